@@ -0,0 +1,105 @@
+/*
+* mt4-stooq-api - stooq.com C++ API
+*
+* Copyright (c) 2018 Elektro Yar. Email: git.electroyar@gmail.com
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+#include <iostream>
+#include <cstdlib>
+#include <cstdio>
+#include "mt4-csv.hpp"
+#include "mt4-csv-loader.hpp"
+#include "mt4-fixed-candles.hpp"
+
+#define PROGRAM_VERSION "1.0"
+#define PROGRAM_DATE "19.10.2026"
+
+/* Проверка записи и чтения csv файлов.
+ * Бары с объемами больше 2^32 записываются в форматах MT4 и MT5,
+ * читаются обратно через read_file_mapped и сравниваются с исходными.
+ * Запуск: csv-check [папка для временных файлов]
+ */
+
+/** \brief Получить тестовые бары
+ */
+mt4_tools::CompactCandles get_candles(const size_t total) {
+    mt4_tools::CompactCandles candles(2);
+    for(size_t k = 0; k < total; ++k) {
+        xquotes_common::Candle candle(10.50, 11.00, 10.00, 10.75, xtime::get_timestamp(13, 9, 2020, 12, 26) + (xtime::timestamp_t)k * xtime::SECONDS_IN_MINUTE);
+        /* объемы вокруг границ int32 и uint32 */
+        const double volumes[] = {0.0, 1.0, 2147483648.0, 4294967295.0, 4294967296.0, 5e9, 123456789012345.0};
+        candle.volume = volumes[k % (sizeof(volumes) / sizeof(volumes[0]))];
+        candles.push_back(candle);
+    }
+    return candles;
+}
+
+/** \brief Записать бары, прочитать их и сравнить
+ * \return Вернет true, если бары совпали
+ */
+bool check_round_trip(const std::string &file_name, const mt4_tools::CsvTypes type_csv, const size_t total, const uint32_t threads) {
+    const mt4_tools::CompactCandles candles = get_candles(total);
+    std::remove(file_name.c_str());
+    int err = mt4_tools::write_file(file_name, std::string(), candles, type_csv, threads);
+    if(err != xquotes_common::OK) {
+        std::cout << "error: write " << file_name << ", code: " << err << std::endl;
+        return false;
+    }
+    mt4_tools::CompactCandles candles_read(candles.get_digits());
+    err = mt4_tools::read_file_mapped(file_name, candles_read, 0, type_csv);
+    std::remove(file_name.c_str());
+    if(err != xquotes_common::OK || candles_read.size() != candles.size()) {
+        std::cout << "error: read " << file_name << ", code: " << err << " bars: " << candles_read.size() << " of " << candles.size() << std::endl;
+        return false;
+    }
+    for(size_t i = 0; i < candles.size(); ++i) {
+        if(!candles.is_equal(i, candles_read, i)) {
+            std::cout << "error: bar " << i << " of " << file_name << " differs, volume " << (unsigned long long)candles_read[i].volume << " instead of " << (unsigned long long)candles[i].volume << std::endl;
+            return false;
+        }
+    }
+    std::cout << file_name << " bars: " << candles.size() << " threads: " << threads << " ok" << std::endl;
+    return true;
+}
+
+int main(int argc, char* argv[]) {
+    std::cout << "csv check" << std::endl;
+    std::cout
+        << "version: " << PROGRAM_VERSION
+        << " date: " << PROGRAM_DATE
+        << std::endl << std::endl;
+
+    const std::string path = argc > 1 ? std::string(argv[1]) + "/" : std::string();
+    bool is_ok = true;
+    /* маленький файл и файл из нескольких блоков форматирования,
+     * в одном потоке и потоками пула, в том числе при меньшем числе потоков после большего
+     */
+    const size_t sizes[] = {7, mt4_tools::CSV_CHUNK_SIZE * 9 + 5};
+    const uint32_t threads[] = {1, 4, 2};
+    for(size_t s = 0; s < 2; ++s) {
+        for(size_t t = 0; t < 3; ++t) {
+            is_ok = check_round_trip(path + "csv-check-mt4.csv", mt4_tools::CsvTypes::MT4, sizes[s], threads[t]) && is_ok;
+            is_ok = check_round_trip(path + "csv-check-mt5.csv", mt4_tools::CsvTypes::MT5, sizes[s], threads[t]) && is_ok;
+        }
+    }
+    if(!is_ok) return EXIT_FAILURE;
+    std::cout << "ok" << std::endl;
+    return EXIT_SUCCESS;
+}
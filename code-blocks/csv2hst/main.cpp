@@ -0,0 +1,147 @@
+/*
+* mt4-stooq-api - stooq.com C++ API
+*
+* Copyright (c) 2018 Elektro Yar. Email: git.electroyar@gmail.com
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+#include <iostream>
+#include <cstdlib>
+#include "mt4-csv.hpp"
+#include "mt4-csv2hst.hpp"
+#include "mt4-common.hpp"
+
+#define PROGRAM_VERSION "1.0"
+#define PROGRAM_DATE "19.10.2020"
+
+/** \brief Загрузить точность символов из json файла настроек
+ *
+ * Используется массив symbols в том же виде, что и в config.json загрузчика
+ * \param file_name Имя json файла
+ * \param symbols Настройки символов
+ * \return Вернет true в случае успешного завершения
+ */
+bool load_symbols(const std::string &file_name, std::vector<mt4_common::SymbolConfig> &symbols) {
+    mt4_common::json j;
+    if(!mt4_common::open_json_file(file_name, j)) return false;
+    try {
+        if(j["symbols"] != nullptr && j["symbols"].is_array()) {
+            const size_t symbols_size = j["symbols"].size();
+            for(size_t i = 0; i < symbols_size; ++i) {
+                mt4_common::SymbolConfig symbol_config;
+                symbol_config.symbol = j["symbols"][i]["symbol"];
+                if(j["symbols"][i]["period"] != nullptr) symbol_config.period = j["symbols"][i]["period"];
+                if(j["symbols"][i]["digits"] != nullptr) symbol_config.digits = j["symbols"][i]["digits"];
+                symbols.push_back(symbol_config);
+            }
+        }
+    }
+    catch(...) {
+        std::cerr << "csv2hst parser error, file: " << file_name << std::endl;
+        return false;
+    }
+    return true;
+}
+
+int main(int argc, char* argv[]) {
+    std::cout << "csv2hst" << std::endl;
+    std::cout
+        << "version: " << PROGRAM_VERSION
+        << " date: " << PROGRAM_DATE
+        << std::endl << std::endl;
+
+    mt4_tools::CsvToHstConverter::Config config;
+    std::string json_settings_file;
+    bool is_error = false;
+    /* аргументы csv и hst можно указать несколько раз */
+    if(!mt4_common::process_arguments(
+            argc,
+            argv,
+            [&](
+                const std::string &key,
+                const std::string &value) {
+        if(key == "csv" || key == "-csv") {
+            config.paths_csv.push_back(value);
+        } else
+        if(key == "hst" || key == "-hst") {
+            config.paths_hst.push_back(value);
+        } else
+        if(key == "type" || key == "-type") {
+            if(value == "mt4" || value == "MT4") config.type_csv = mt4_tools::CsvTypes::MT4;
+            else if(value == "mt5" || value == "MT5") config.type_csv = mt4_tools::CsvTypes::MT5;
+            else if(value == "dukascopy" || value == "DUKASCOPY") config.type_csv = mt4_tools::CsvTypes::DUKASCOPY;
+            else is_error = true;
+        } else
+        if(key == "hst_version" || key == "-hst_version") {
+            if(value == "400") config.hst_version = mt4_tools::HstVersions::V400;
+            else if(value == "401") config.hst_version = mt4_tools::HstVersions::V401;
+            else is_error = true;
+        } else
+        if(key == "period" || key == "-period") {
+            config.period = (uint32_t)std::atoi(value.c_str());
+        } else
+        if(key == "threads" || key == "-threads") {
+            config.threads = (uint32_t)std::atoi(value.c_str());
+        } else
+        if(key == "csv_suffix" || key == "-csv_suffix") {
+            config.symbol_csv_suffix = value;
+        } else
+        if(key == "hst_suffix" || key == "-hst_suffix") {
+            config.symbol_hst_suffix = value;
+        } else
+        if(key == "recursive" || key == "-recursive") {
+            config.is_recursive = true;
+        } else
+        if(key == "json_settings_file" || key == "jsf" || key == "jf" || key == "-jf") {
+            json_settings_file = value;
+        }
+    }) || is_error || config.paths_csv.empty() || config.paths_hst.empty()) {
+        std::cout
+            << "usage: csv2hst --csv <dir> [--csv <dir> ...] --hst <dir> [--hst <dir> ...]" << std::endl
+            << "    [--type mt4|mt5|dukascopy] [--hst_version 400|401] [--period <minutes>] [--threads <n>]" << std::endl
+            << "    [--csv_suffix <suffix>] [--hst_suffix <suffix>] [--recursive] [--jf <config.json>]" << std::endl;
+        return EXIT_FAILURE;
+    }
+    /* точность символов из настроек, остальные символы получают точность по ценам */
+    if(json_settings_file.size() != 0 && !load_symbols(json_settings_file, config.symbols)) {
+        std::cout << "error load symbols from " << json_settings_file << std::endl;
+        return EXIT_FAILURE;
+    }
+    for(size_t i = 0; i < config.paths_hst.size(); ++i) {
+        bf::create_directory(config.paths_hst[i]);
+    }
+
+    mt4_tools::CsvToHstConverter converter;
+    mt4_tools::CsvToHstConverter::Stats stats;
+    const int err = converter.run(config, stats);
+    if(err != xquotes_common::OK) {
+        std::cout << "csv files not found" << std::endl;
+        return EXIT_FAILURE;
+    }
+    const double seconds = stats.seconds > 0 ? stats.seconds : 1e-9;
+    std::cout
+        << "files: " << stats.files
+        << " bars: " << stats.candles
+        << " errors: " << stats.errors
+        << " time: " << stats.seconds << " s" << std::endl;
+    std::cout
+        << "files/s: " << (double)stats.files / seconds
+        << " bars/s: " << (double)stats.candles / seconds << std::endl;
+    return stats.errors == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
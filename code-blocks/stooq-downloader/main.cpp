@@ -25,19 +25,119 @@
 #include <iomanip>
 #include <cctype>
 #include <cstdlib>
+#include <cstdio>
+#include <map>
+#include <set>
+#include <limits>
 #include <nlohmann/json.hpp>
 #include "mt4-stooq.hpp"
 #include "mt4-csv.hpp"
+#include "mt4-csv-loader.hpp"
 #include "mt4-hst.hpp"
 #include "mt4-common.hpp"
 #include "mt4-settings.hpp"
-#include "xquotes_csv.hpp"
+#include "mt4-shard.hpp"
+#include "mt4-fixed-candles.hpp"
+#include "mt4-sync.hpp"
+#include "mt4-synthetic.hpp"
+#include "mt4-shm.hpp"
+#include "mt4-ws-server.hpp"
+#include "mt4-resample.hpp"
+#include "mt4-indicators.hpp"
+#include "mt4-stooq-archive.hpp"
+#include "mt4-trace.hpp"
+#include "mt4-clock.hpp"
+#include "mt4-simulation.hpp"
+#include "mt4-alloc-stats.hpp"
 
 using json = nlohmann::json;
 
 #define PROGRAM_VERSION "1.2"
 #define PROGRAM_DATE "28.08.2020"
 
+/** \brief Состояние обновления символа в одном цикле загрузки
+ */
+class SymbolUpdate {
+public:
+    mt4_tools::CompactCandles candles_csv;      /**< История или ее окно, бар candles_csv[i] - это бар base + i */
+    mt4_tools::CompactCandles candles_fresh;    /**< Загруженные бары */
+    mt4_tools::CsvTail csv_tail;
+    mt4_tools::CandleResampler resampler;
+    xquotes_common::Candle candle_resampled;
+    std::string file_csv;
+    size_t base = 0;
+    xtime::timestamp_t timestamp_beg = 0;
+    xtime::timestamp_t timestamp_end = 0;
+    uint32_t period = 0;
+    uint32_t source_period = 0;                 /**< Период загружаемых баров */
+    StooqApi::PeriodTypes stooq_period = StooqApi::PeriodTypes::DAY;
+    bool is_tail = false;                       /**< В candles_csv только конец истории */
+    bool is_quote = false;                      /**< Текущий бар обновляется котировкой, история не запрашивается */
+    xquotes_common::Candle quote;
+    bool is_synthetic = false;                  /**< Бары рассчитаны по составляющим, история не запрашивается */
+    bool is_unchanged = false;                  /**< Составляющие не изменились, символ пропускается */
+    bool is_deferred = false;                   /**< Окно истории читается после загрузки, если загруженные бары изменились */
+    bool is_range_error = false;               /**< Цена не помещается в candles_fresh при точности символа */
+    bool is_volume_error = false;              /**< Объем не помещается в candles_fresh */
+
+    SymbolUpdate(const uint32_t digits, const uint32_t user_period) :
+        candles_csv(digits), candles_fresh(digits), resampler(user_period),
+        period(user_period), source_period(user_period) {};
+
+    /** \brief Сохранить бар, запомнив причину, если он не помещается в массив
+     */
+    void push_candle(const xquotes_common::Candle &candle) {
+        if(!candles_fresh.check_prices(candle)) is_range_error = true;
+        else if(!candles_fresh.check_volume(candle)) is_volume_error = true;
+        else candles_fresh.push_back(candle);
+    }
+
+    /** \brief Добавить загруженный бар
+     */
+    void add_candle(const xquotes_common::Candle &candle) {
+        if(source_period == period) {
+            push_candle(candle);
+        } else
+        if(resampler.update(candle, candle_resampled)) {
+            push_candle(candle_resampled);
+        }
+    }
+
+    /** \brief Завершить загрузку, добавив последний пересчитанный бар
+     */
+    void flush() {
+        if(source_period != period && resampler.flush(candle_resampled)) {
+            push_candle(candle_resampled);
+        }
+    }
+};
+
+/** \brief Вывести выделения памяти за цикл по этапам
+ * \param start Счетчики этапов в начале цикла
+ * \param symbols Количество символов
+ */
+void print_alloc_stats(const std::vector<mt4_tools::AllocStats::Counters> &start, const size_t symbols) {
+    std::vector<mt4_tools::AllocStats::Counters> counters;
+    mt4_tools::AllocStats::Counters total;
+    mt4_tools::AllocStats::get(counters, total);
+    const mt4_tools::ResourceUsage usage = mt4_tools::ResourceUsage::get();
+    const double divider = symbols > 0 ? (double)symbols : 1.0;
+    std::cout
+        << "memory peak rss: " << (usage.max_rss / (1024 * 1024)) << " MB"
+        << " live: " << (total.live_bytes / 1024) << " KB"
+        << " peak live: " << (total.peak_bytes / 1024) << " KB" << std::endl;
+    for(size_t i = 0; i < counters.size() && i < start.size(); ++i) {
+        const uint64_t allocations = counters[i].allocations - start[i].allocations;
+        const uint64_t bytes = counters[i].bytes - start[i].bytes;
+        if(allocations == 0) continue;
+        std::cout
+            << "memory " << mt4_tools::AllocStats::get_stage_name((mt4_tools::AllocStages)i) << ":"
+            << " allocations: " << allocations << " (" << ((double)allocations / divider) << " per symbol)"
+            << " bytes: " << (bytes / 1024) << " KB (" << ((double)bytes / divider / 1024.0) << " KB per symbol)"
+            << " peak live: " << (counters[i].peak_bytes / 1024) << " KB" << std::endl;
+    }
+}
+
 int main(int argc, char* argv[]) {
     std::cout << "stooq downloader" << std::endl;
     std::cout
@@ -58,119 +158,869 @@ int main(int argc, char* argv[]) {
     }
 
     if(settings.path_csv.size() != 0) settings.path_csv += "\\";
-    if(settings.path_hst.size() != 0) settings.path_hst += "\\";
+    for(size_t i = 0; i < settings.paths_hst.size(); ++i) {
+        if(settings.paths_hst[i].size() != 0) settings.paths_hst[i] += "\\";
+    }
+    if(settings.path_trace.size() != 0) settings.path_trace += "\\";
     if(settings.path_csv.size() != 0) bf::create_directory(settings.path_csv);
-    if(settings.path_hst.size() != 0) bf::create_directory(settings.path_hst);
+    if(settings.path_trace.size() != 0) bf::create_directory(settings.path_trace);
+    for(size_t i = 0; i < settings.paths_hst.size(); ++i) {
+        if(settings.paths_hst[i].size() != 0) bf::create_directory(settings.paths_hst[i]);
+    }
+    /* разовая загрузка архива stooq со всем рынком */
+    if(settings.zip_archive.size() != 0) {
+        std::cout << "ingest archive " << settings.zip_archive << std::endl;
+        mt4_tools::StooqArchiveIngest::Config ingest_config;
+        ingest_config.symbols = settings.symbols_config;
+        ingest_config.path_csv = settings.path_csv;
+        ingest_config.paths_hst = settings.paths_hst;
+        ingest_config.symbol_csv_suffix = settings.symbol_csv_suffix;
+        ingest_config.symbol_hst_suffix = settings.symbol_hst_suffix;
+        ingest_config.hst_version = (mt4_tools::HstVersions)settings.hst_version;
+        ingest_config.threads = settings.zip_threads;
+        ingest_config.is_all = settings.is_zip_all;
+        mt4_tools::StooqArchiveIngest ingest;
+        mt4_tools::StooqArchiveIngest::Stats stats;
+        const int err_zip = ingest.run(settings.zip_archive, ingest_config, stats);
+        if(err_zip != mt4_tools::ZipArchive::OK) {
+            std::cout << "error open archive " << settings.zip_archive << ", code: " << err_zip << std::endl;
+            return EXIT_FAILURE;
+        }
+        std::cout
+            << "files: " << stats.files
+            << " bars: " << stats.candles
+            << " errors: " << stats.errors
+            << " time: " << stats.seconds << " s" << std::endl;
+        return stats.errors == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    /* в режиме деления символов процесс оставляет только свою часть
+     * и захватывает файлы блокировки, чтобы у символа был один писатель */
+    std::vector<std::shared_ptr<mt4_tools::SymbolLock>> symbol_locks;
+    mt4_tools::ShardStatus shard_status;
+    const std::string shard_status_file = settings.path_csv + "shard_" + std::to_string(settings.shard_index) + "_of_" + std::to_string(settings.shard_count) + ".json";
+    if(settings.shard_count > 1) {
+        shard_status.shard_index = settings.shard_index;
+        shard_status.shard_count = settings.shard_count;
+        std::vector<mt4_common::SymbolConfig> shard_symbols;
+        for(size_t si = 0; si < settings.symbols_config.size(); ++si) {
+            const mt4_common::SymbolConfig &symbol_config = settings.symbols_config[si];
+            if(mt4_tools::get_symbol_shard(symbol_config.symbol, settings.shard_count) != settings.shard_index) continue;
+            std::shared_ptr<mt4_tools::SymbolLock> symbol_lock = std::make_shared<mt4_tools::SymbolLock>();
+            if(!symbol_lock->lock(settings.path_csv + symbol_config.symbol + settings.symbol_csv_suffix + std::to_string(symbol_config.period) + ".lock")) {
+                std::cout << symbol_config.symbol << " is locked by another process, skip" << std::endl;
+                ++shard_status.skipped;
+                continue;
+            }
+            symbol_locks.push_back(symbol_lock);
+            shard_symbols.push_back(symbol_config);
+        }
+        settings.symbols_config = shard_symbols;
+        shard_status.symbols = shard_symbols.size();
+        std::cout << "shard " << settings.shard_index << "/" << settings.shard_count << ", symbols: " << shard_status.symbols << ", skipped: " << shard_status.skipped << std::endl;
+        shard_status.write(shard_status_file);
+    }
+
     //std::string path_hst = "C:\\Users\\user\\AppData\\Roaming\\MetaQuotes\\Terminal\\2E8DC23981084565FA3E19C061F586B2\\history\\RoboForex-Demo\\";
 
-    std::vector<std::shared_ptr<mt4_tools::MqlHst>> mql_history;
-    StooqApi stooq;
+    std::vector<std::shared_ptr<mt4_tools::MqlHstGroup>> mql_history;
+    std::vector<mt4_tools::CompactHistorySync> history_sync(settings.symbols_config.size());
+    std::vector<mt4_tools::IndicatorStage> indicator_stages(settings.symbols_config.size());
+    std::vector<size_t> history_sizes(settings.symbols_config.size(), 0);
+    std::vector<xtime::timestamp_t> last_full_resync(settings.symbols_config.size(), 0);
+    /* окна прошлого цикла, чтобы не читать и не писать файлы символов без изменений */
+    std::vector<mt4_tools::CompactWindowCache> window_cache(settings.symbols_config.size());
+    StooqApi stooq(settings.sert_file, settings.api_point);
+    stooq.set_multiplex(settings.http2, settings.max_streams, settings.max_connections, settings.http2_prior_knowledge);
+    stooq.set_hedging(settings.hedging, settings.hedge_percentile);
+    /* в режиме моделирования время виртуальное, а запросы обслуживает локальная замена сервера */
+    mt4_tools::Clock clock;
+    mt4_tools::SimulatedServer::Config sim_config;
+    sim_config.latency_ms = settings.sim_latency_ms;
+    sim_config.slow_ratio = settings.sim_slow_ratio;
+    sim_config.slow_latency_ms = settings.sim_slow_latency_ms;
+    sim_config.history_days = settings.sim_history_days;
+    mt4_tools::SimulatedServer simulation(clock, sim_config);
+    stooq.set_clock(&clock);
+    if(settings.simulation) {
+        clock.set_virtual(xtime::get_timestamp());
+        stooq.set_simulation(&simulation);
+        std::cout << "simulation, symbols: " << settings.symbols_config.size() << ", cycles: " << settings.sim_cycles << ", path: " << settings.path_csv << std::endl;
+    }
+    /* трасса каждого цикла пишется в отдельный файл, пустой path_trace - не пишется */
+    mt4_tools::TraceRecorder tracer;
+    uint64_t trace_cycle = 0;
+    if(settings.path_trace.size() != 0) {
+        tracer.set_enabled(true);
+        stooq.set_tracer(&tracer);
+    }
+    /* символы, не успевшие загрузиться до конца цикла, в следующем цикле идут первыми */
+    std::vector<size_t> symbol_order(settings.symbols_config.size());
+    std::vector<bool> is_deadline_missed(settings.symbols_config.size(), false);
+    for(size_t si = 0; si < symbol_order.size(); ++si) {
+        symbol_order[si] = si;
+    }
+
+    /* синтетические символы считаются после загрузки своих составляющих.
+     * Составляющая другого процесса имеет индекс -1 и читается с диска как есть */
+    const xtime::timestamp_t SYNTHETIC_UNCHANGED = std::numeric_limits<xtime::timestamp_t>::max();
+    std::vector<std::vector<int>> synthetic_legs(settings.symbols_config.size());
+    size_t synthetic_beg = settings.symbols_config.size();
+    for(size_t si = 0; si < settings.symbols_config.size(); ++si) {
+        const std::vector<mt4_common::SyntheticLegConfig> &legs = settings.symbols_config[si].legs;
+        if(legs.size() == 0) continue;
+        --synthetic_beg;
+        for(size_t k = 0; k < legs.size(); ++k) {
+            int leg_index = -1;
+            for(size_t n = 0; n < settings.symbols_config.size(); ++n) {
+                if(settings.symbols_config[n].symbol == legs[k].symbol &&
+                    settings.symbols_config[n].period == settings.symbols_config[si].period &&
+                    settings.symbols_config[n].legs.size() == 0) {
+                    leg_index = (int)n;
+                    break;
+                }
+            }
+            synthetic_legs[si].push_back(leg_index);
+        }
+    }
+    std::vector<xtime::timestamp_t> changed_from(settings.symbols_config.size(), SYNTHETIC_UNCHANGED);
 
     /* инициализируем историю */
     std::cout << "init mql history" << std::endl;
+    /* hst файлы открываются по требованию, чтобы число символов не упиралось в лимит дескрипторов */
+    std::shared_ptr<mt4_tools::HstFilePool> hst_pool;
+    if(settings.hst_max_open_files != 0) hst_pool = std::make_shared<mt4_tools::HstFilePool>(settings.hst_max_open_files);
     mql_history.resize(settings.symbols_config.size());
     for(size_t si = 0; si < settings.symbols_config.size(); ++si) {
-        mql_history[si] = std::make_shared<mt4_tools::MqlHst>(
+        mql_history[si] = std::make_shared<mt4_tools::MqlHstGroup>(
             settings.symbols_config[si].symbol + settings.symbol_hst_suffix,
-            settings.path_hst,
+            settings.paths_hst,
             settings.symbols_config[si].period,
+            settings.symbols_config[si].digits,
+            0,
+            hst_pool,
+            (mt4_tools::HstVersions)settings.hst_version);
+    }
+
+    /* в режиме io_uring записи csv и hst файлов пачки уходят в ядро одним вызовом
+     * и завершаются, пока загружается следующая пачка */
+    mt4_tools::AsyncStorage storage;
+    if(settings.storage == "io_uring") {
+        if(storage.open(settings.storage_buffer_size, settings.storage_fsync)) {
+            for(size_t si = 0; si < mql_history.size(); ++si) {
+                mql_history[si]->set_storage(&storage);
+            }
+            std::cout << "io_uring storage, registered buffer: " << (storage.is_registered_buffer() ? "yes" : "no") << std::endl;
+        } else {
+            std::cout << "io_uring is not available, files are written through streams" << std::endl;
+        }
+    }
+
+    /* индикаторы пишутся рядом с csv файлом символа */
+    for(size_t si = 0; si < settings.symbols_config.size(); ++si) {
+        if(settings.symbols_config[si].indicators.size() == 0) continue;
+        indicator_stages[si] = mt4_tools::IndicatorStage(
+            settings.path_csv + settings.symbols_config[si].symbol + settings.symbol_csv_suffix + std::to_string(settings.symbols_config[si].period) + "_indicators.csv",
+            settings.symbols_config[si].indicators,
             settings.symbols_config[si].digits);
     }
+
+    /* публикуем бары в разделяемую память */
+    mt4_tools::ShmPublisher shm_publisher;
+    std::vector<int> shm_slots(settings.symbols_config.size(), -1);
+    if(settings.shm_name.size() != 0) {
+        if(!shm_publisher.open(settings.shm_name, settings.symbols_config.size(), settings.shm_ring_size)) {
+            std::cout << "error open shared memory " << settings.shm_name << std::endl;
+            return EXIT_FAILURE;
+        }
+        for(size_t si = 0; si < settings.symbols_config.size(); ++si) {
+            shm_slots[si] = shm_publisher.add_slot(
+                settings.symbols_config[si].symbol + settings.symbol_hst_suffix,
+                settings.symbols_config[si].period,
+                settings.symbols_config[si].digits);
+        }
+    }
+
+    /* рассылаем бары удаленным клиентам через WebSocket */
+    mt4_tools::CandleWsServer ws_server;
+    std::vector<int> ws_channels(settings.symbols_config.size(), -1);
+    std::vector<bool> is_ws_history(settings.symbols_config.size(), false);
+    if(settings.ws_port != 0) {
+        for(size_t si = 0; si < settings.symbols_config.size(); ++si) {
+            ws_channels[si] = ws_server.add_channel(
+                settings.symbols_config[si].symbol,
+                settings.symbols_config[si].period,
+                settings.symbols_config[si].digits);
+        }
+        mt4_tools::CandleWsServer::Config ws_config;
+        ws_config.address = settings.ws_address;
+        ws_config.port = (uint16_t)settings.ws_port;
+        ws_config.snapshot_size = settings.ws_snapshot_size;
+        ws_config.max_queue_bytes = settings.ws_max_queue_bytes;
+        if(!ws_server.start(ws_config)) {
+            std::cout << "error start websocket server on port " << settings.ws_port << std::endl;
+            return EXIT_FAILURE;
+        }
+        std::cout << "websocket server port " << settings.ws_port << std::endl;
+    }
+
+    /* чтение всего csv файла, нужно при запуске и полной сверке истории */
+    auto check_csv_error = [&](const int err_csv, const size_t si) -> bool {
+        if(err_csv == xquotes_common::INVALID_PARAMETER) {
+            std::cout << settings.symbols_config[si].symbol << " error: price does not fit with digits " << settings.symbols_config[si].digits << " or volume is too large" << std::endl;
+            return false;
+        }
+        if(err_csv != xquotes_common::OK) {
+            std::cout << settings.symbols_config[si].symbol << " error read csv file, code: " << err_csv << std::endl;
+            return false;
+        }
+        return true;
+    };
+    auto read_csv_file = [&](const std::string &file_csv, const size_t si, mt4_tools::CompactCandles &candles) -> bool {
+        return check_csv_error(mt4_tools::read_file_mapped(file_csv, candles), si);
+    };
+    /* конец истории с начала окна загрузки, бар candles_csv[i] - это бар base + i */
+    auto read_csv_tail = [&](const size_t si, SymbolUpdate &update) -> bool {
+        if(mt4_tools::read_file_tail(update.file_csv, update.timestamp_beg, update.candles_csv, update.csv_tail) != xquotes_common::OK ||
+            update.candles_csv.size() == 0 || update.candles_csv.size() > history_sizes[si]) return false;
+        update.is_tail = true;
+        update.base = history_sizes[si] - update.candles_csv.size();
+        return true;
+    };
+
+    /* бары синтетического символа считаются по csv файлам составляющих */
+    auto compute_synthetic_update = [&](const size_t si, const xtime::timestamp_t timestamp_beg, SymbolUpdate &update) -> bool {
+        const mt4_common::SymbolConfig &symbol_config = settings.symbols_config[si];
+        std::vector<mt4_tools::CompactCandles> legs_candles;
+        std::vector<int32_t> powers;
+        for(size_t k = 0; k < symbol_config.legs.size(); ++k) {
+            const mt4_common::SyntheticLegConfig &leg_config = symbol_config.legs[k];
+            legs_candles.push_back(mt4_tools::CompactCandles(leg_config.digits));
+            powers.push_back(leg_config.power);
+            const std::string file_leg = settings.path_csv + leg_config.symbol + settings.symbol_csv_suffix + std::to_string(symbol_config.period) + ".csv";
+            if(!bf::check_file(file_leg)) continue;
+            int err_csv = xquotes_common::OK;
+            if(timestamp_beg == 0) {
+                err_csv = mt4_tools::read_file_mapped(file_leg, legs_candles.back());
+            } else {
+                mt4_tools::CsvTail leg_tail;
+                err_csv = mt4_tools::read_file_tail(file_leg, timestamp_beg, legs_candles.back(), leg_tail);
+            }
+            if(err_csv != xquotes_common::OK) {
+                std::cout << symbol_config.symbol << " error read leg " << leg_config.symbol << ", code: " << err_csv << std::endl;
+                return false;
+            }
+        }
+        std::vector<const mt4_tools::CompactCandles*> legs;
+        for(size_t k = 0; k < legs_candles.size(); ++k) {
+            legs.push_back(&legs_candles[k]);
+        }
+        std::vector<xquotes_common::Candle> candles;
+        mt4_tools::compute_synthetic(
+            legs,
+            powers,
+            symbol_config.synthetic_mode == "close" ? mt4_tools::SyntheticModes::CLOSE : mt4_tools::SyntheticModes::OHLC,
+            timestamp_beg,
+            candles);
+        for(size_t i = 0; i < candles.size(); ++i) {
+            update.add_candle(candles[i]);
+        }
+        return true;
+    };
+
+    /* при запуске файлы всех символов читаются одновременно */
+    std::vector<mt4_tools::CompactCandles> preload_candles;
+    std::vector<bool> is_preloaded(settings.symbols_config.size(), false);
+    {
+        std::vector<std::string> preload_files;
+        std::vector<size_t> preload_symbols;
+        for(size_t si = 0; si < settings.symbols_config.size(); ++si) {
+            const std::string file_csv = settings.path_csv + settings.symbols_config[si].symbol + settings.symbol_csv_suffix + std::to_string(settings.symbols_config[si].period) + ".csv";
+            if(!bf::check_file(file_csv)) continue;
+            preload_files.push_back(file_csv);
+            preload_symbols.push_back(si);
+        }
+        std::vector<mt4_tools::CompactCandles> candles;
+        for(size_t i = 0; i < preload_symbols.size(); ++i) {
+            candles.push_back(mt4_tools::CompactCandles(settings.symbols_config[preload_symbols[i]].digits));
+        }
+        std::vector<int> errors;
+        const auto time_start = std::chrono::steady_clock::now();
+        mt4_tools::read_files_mapped(preload_files, candles, errors);
+        preload_candles.resize(settings.symbols_config.size());
+        size_t total_candles = 0;
+        for(size_t i = 0; i < preload_symbols.size(); ++i) {
+            const size_t si = preload_symbols[i];
+            if(!check_csv_error(errors[i], si)) return EXIT_FAILURE;
+            total_candles += candles[i].size();
+            std::swap(preload_candles[si], candles[i]);
+            is_preloaded[si] = true;
+        }
+        if(preload_files.size() != 0) {
+            std::cout << "read csv files: " << preload_files.size() << ", candles: " << total_candles
+                << ", seconds: " << std::chrono::duration<double>(std::chrono::steady_clock::now() - time_start).count() << std::endl;
+        }
+    }
+
+    /* показатели моделирования */
+    std::ofstream sim_report;
+    if(settings.simulation && settings.sim_report.size() != 0) {
+        sim_report.open(settings.sim_report, std::ios::trunc);
+        sim_report << "cycle,start,lag_s,duration_s,symbols_missed,symbols_unchanged,requests,cpu_s,max_rss_mb" << std::endl;
+    }
+    uint32_t sim_cycle = 0;
+    xtime::timestamp_t sim_scheduled = 0;
+    xtime::timestamp_t sim_max_lag = 0;
+    size_t sim_missed = 0;
+    size_t sim_unchanged = 0;
+    uint64_t sim_requests = 0;
+    const auto sim_wall_start = std::chrono::steady_clock::now();
+
     while(true) {
         std::cout << "update start" << std::endl;
-        xtime::timestamp_t timestamp = xtime::get_timestamp();
+        xtime::timestamp_t timestamp = clock.get_timestamp();
+        const auto cycle_start = clock.now();
+        const auto cycle_start_steady = std::chrono::steady_clock::now();
+        /* выделения памяти считаются за цикл, если программа собрана с MT4_ALLOC_STATS */
+        std::vector<mt4_tools::AllocStats::Counters> alloc_start;
+        if(mt4_tools::AllocStats::is_enabled()) {
+            mt4_tools::AllocStats::Counters alloc_start_total;
+            mt4_tools::AllocStats::get(alloc_start, alloc_start_total);
+            mt4_tools::AllocStats::reset_peaks();
+        }
+        auto last_status_write = cycle_start_steady;
+        if(settings.shard_count > 1) {
+            ++shard_status.cycle;
+            shard_status.state = "update";
+            shard_status.processed = 0;
+            shard_status.errors = 0;
+            shard_status.cycle_start = timestamp;
+            shard_status.write(shard_status_file);
+        }
         xtime::timestamp_t restart_timestamp = timestamp - (timestamp % (settings.update_period * xtime::SECONDS_IN_MINUTE)) + (settings.update_period * xtime::SECONDS_IN_MINUTE);
-        /* загружаем данные */
-        for(size_t si = 0; si < settings.symbols_config.size(); ++si) {
-            /* читаем данные из csv файла */
-            std::vector<xquotes_common::Candle> candles_csv;
-            std::string file_csv(settings.path_csv + settings.symbols_config[si].symbol + settings.symbol_csv_suffix + std::to_string(settings.symbols_config[si].period) + ".csv");
-            if(bf::check_file(file_csv)) {
-                int err_csv = xquotes_csv::read_file(
-                        file_csv,
-                        false,
-                        xquotes_common::DO_NOT_CHANGE_TIME_ZONE,
-                        [&](xquotes_csv::Candle candle, bool is_end) {
-                    if(!is_end) {
-                        candles_csv.push_back(candle);
-                    }
-                });
-                if(err_csv != xquotes_common::OK) {
-                    std::cout << settings.symbols_config[si].symbol << " error read csv file, code: " << err_csv << std::endl;
+        /* запросы не должны выходить за начало следующего цикла */
+        stooq.set_deadline(cycle_start + std::chrono::seconds(restart_timestamp - timestamp));
+        std::stable_partition(symbol_order.begin(), symbol_order.end(), [&](const size_t si) {
+            return is_deadline_missed[si];
+        });
+        std::stable_partition(symbol_order.begin(), symbol_order.end(), [&](const size_t si) {
+            return settings.symbols_config[si].legs.size() == 0;
+        });
+        std::fill(changed_from.begin(), changed_from.end(), SYNTHETIC_UNCHANGED);
+        size_t deadline_missed = 0;
+        size_t symbols_unchanged = 0;   /**< Символы, у которых не изменились загруженные бары или составляющие */
+        /* текущий бар дневных символов обновляем котировками, один запрос на сотни символов */
+        std::map<std::string, xquotes_common::Candle> quotes;
+        if(settings.quote_snapshots) {
+            mt4_tools::TraceSpan span(&tracer, "quotes", "stage");
+            std::vector<std::string> quote_symbols;
+            std::set<std::string> quote_symbols_set;
+            for(size_t si = 0; si < settings.symbols_config.size(); ++si) {
+                if(settings.symbols_config[si].period != xtime::MINUTES_IN_DAY || history_sizes[si] == 0) continue;
+                if(settings.symbols_config[si].legs.size() != 0) continue;
+                if(quote_symbols_set.insert(settings.symbols_config[si].symbol).second) {
+                    quote_symbols.push_back(settings.symbols_config[si].symbol);
+                }
+            }
+            if(quote_symbols.size() != 0) {
+                mt4_tools::AllocScope alloc_scope(mt4_tools::AllocStages::FETCH);
+                const int err_quotes = stooq.get_quotes(quote_symbols, quotes);
+                if(err_quotes != StooqApi::OK) std::cout << "quotes error, code: " << err_quotes << std::endl;
+                std::cout << "quotes received: " << quotes.size() << " of " << quote_symbols.size() << std::endl;
+            }
+        }
+        /* символы обрабатываются пачками: чтение истории, загрузка, запись.
+         * В режиме http2 символы пачки загружаются одновременно.
+         * Синтетические символы идут отдельными пачками после загружаемых */
+        const size_t batch_size = settings.http2 ? std::max<uint32_t>(settings.max_streams, 1) : 1;
+        for(size_t batch_beg = 0, batch_end = 0; batch_beg < settings.symbols_config.size(); batch_beg = batch_end) {
+            batch_end = std::min(settings.symbols_config.size(), batch_beg + batch_size);
+            if(batch_beg < synthetic_beg) batch_end = std::min(batch_end, synthetic_beg);
+            /* составляющие читаются из csv файлов, поэтому их запись должна завершиться */
+            if(batch_beg == synthetic_beg && storage.is_open()) {
+                mt4_tools::TraceSpan span(&tracer, "storage wait", "io");
+                if(!storage.wait()) {
+                    std::cout << "error write files through io_uring" << std::endl;
                     return EXIT_FAILURE;
                 }
             }
-
-            xtime::timestamp_t timestamp_beg = xtime::get_first_timestamp_day(xtime::get_timestamp(1,1,1970));
-            xtime::timestamp_t timestamp_end = xtime::get_first_timestamp_day();
-            if(candles_csv.size() != 0) timestamp_beg = xtime::get_first_timestamp_day(candles_csv.back().timestamp);
-            std::cout << settings.symbols_config[si].symbol << " download date: " << xtime::get_str_date(timestamp_beg) << " - " << xtime::get_str_date(timestamp_end) <<  std::endl;
-
-            /* качаем историю */
-            std::vector<xquotes_common::Candle> candles;
-            StooqApi::PeriodTypes stooq_period = StooqApi::PeriodTypes::DAY;
-            switch(settings.symbols_config[si].period) {
-            case xtime::MINUTES_IN_DAY:
-                stooq_period = StooqApi::PeriodTypes::DAY;
-                break;
-            case 10080:
-                stooq_period = StooqApi::PeriodTypes::WEEK;
-                break;
-            case 40320:
-                stooq_period = StooqApi::PeriodTypes::MONTH;
-                break;
-            };
-
-            stooq.get_historical_data(candles, settings.symbols_config[si].symbol, stooq_period, timestamp_beg,  timestamp_end);
-            if(candles_csv.size() != 0) {
-                for(size_t i = 0; i < candles.size(); ++i) {
-                    if(i == 0 && xtime::get_first_timestamp_day(candles_csv.back().timestamp) == xtime::get_first_timestamp_day(candles.back().timestamp)) {
-                        candles_csv.back() = candles[0];
+            std::vector<SymbolUpdate> updates;
+            updates.reserve(batch_end - batch_beg);
+            for(size_t n = batch_beg; n < batch_end; ++n) {
+                const size_t si = symbol_order[n];
+                mt4_tools::TraceSpan span(&tracer, "read csv", "io", &settings.symbols_config[si].symbol);
+                mt4_tools::AllocScope alloc_scope(mt4_tools::AllocStages::READ);
+                /* читаем данные из csv файла
+                 * После первого цикла читается только конец файла, который перекачивается,
+                 * а история до него остается на диске. Бар candles_csv[i] - это бар base + i
+                 */
+                updates.push_back(SymbolUpdate(settings.symbols_config[si].digits, settings.symbols_config[si].period));
+                SymbolUpdate &update = updates.back();
+                mt4_tools::CompactCandles &candles_csv = update.candles_csv;
+                bool &is_tail = update.is_tail;
+                std::string &file_csv = update.file_csv;
+                file_csv = settings.path_csv + settings.symbols_config[si].symbol + settings.symbol_csv_suffix + std::to_string(settings.symbols_config[si].period) + ".csv";
+                const xtime::timestamp_t resync_depth = settings.resync_depth * xtime::SECONDS_IN_DAY;
+                const bool is_full_resync = settings.resync_period != 0 && (timestamp - last_full_resync[si]) >= (settings.resync_period * xtime::SECONDS_IN_HOUR);
+                xtime::timestamp_t &timestamp_beg = update.timestamp_beg;
+                xtime::timestamp_t &timestamp_end = update.timestamp_end;
+                timestamp_beg = xtime::get_first_timestamp_day(xtime::get_timestamp(1,1,1970));
+                timestamp_end = xtime::get_first_timestamp_day(clock.get_timestamp());
+                /* синтетический символ пересчитывается с первого измененного бара составляющих */
+                update.is_synthetic = settings.symbols_config[si].legs.size() != 0;
+                xtime::timestamp_t synthetic_from = SYNTHETIC_UNCHANGED;
+                for(size_t k = 0; k < synthetic_legs[si].size(); ++k) {
+                    const int leg_index = synthetic_legs[si][k];
+                    /* составляющую другого процесса считаем измененной в окне перекачки */
+                    const xtime::timestamp_t leg_from = leg_index >= 0 ? changed_from[leg_index] :
+                        (timestamp_end > resync_depth ? timestamp_end - resync_depth : 0);
+                    synthetic_from = std::min(synthetic_from, leg_from);
+                }
+                if(update.is_synthetic && history_sizes[si] != 0 && !is_full_resync && synthetic_from == SYNTHETIC_UNCHANGED) {
+                    update.is_unchanged = true;
+                    ++symbols_unchanged;
+                    continue;
+                }
+                xquotes_common::Candle candle_last;
+                bool is_last_candle = false;
+                if(history_sizes[si] != 0 && !is_full_resync) {
+                    /* последний бар известен с прошлого цикла, файл не читается до загрузки */
+                    if(!update.is_synthetic && window_cache[si].is_valid()) {
+                        candle_last.timestamp = window_cache[si].get_last_timestamp();
+                        is_last_candle = true;
+                        update.is_deferred = true;
                     } else {
-                        candles_csv.push_back(candles[i]);
+                        is_last_candle = bf::check_file(file_csv) &&
+                            mt4_tools::read_last_candle(file_csv, candle_last) == xquotes_common::OK;
                     }
                 }
-            } else {
-                candles_csv = candles;
-            }
+                if(is_last_candle) {
+                    timestamp_beg = xtime::get_first_timestamp_day(candle_last.timestamp);
+                    /* бар дня котировки уже есть в истории, значит пропусков нет
+                     * и достаточно обновить последний бар */
+                    auto quote = quotes.find(settings.symbols_config[si].symbol);
+                    if(update.is_synthetic) {
+                        timestamp_beg = std::min(timestamp_beg, xtime::get_first_timestamp_day(synthetic_from));
+                    } else
+                    if(settings.symbols_config[si].period == xtime::MINUTES_IN_DAY &&
+                        quote != quotes.end() && quote->second.timestamp == timestamp_beg) {
+                        update.is_quote = true;
+                        update.quote = quote->second;
+                    } else {
+                        timestamp_beg = timestamp_beg > resync_depth ? timestamp_beg - resync_depth : 0;
+                    }
+                    if(update.is_deferred) {
+                        /* окно прочитается после загрузки, если загруженные бары изменились */
+                    } else
+                    if(!read_csv_tail(si, update)) {
+                        /* файл изменен в обход загрузчика, читаем его целиком */
+                        history_sync[si].reset();
+                        candles_csv.clear();
+                        update.is_quote = false;
+                    }
+                }
+                if(update.is_deferred) {
+                    /* история будет прочитана после загрузки */
+                } else
+                if(!is_tail && is_preloaded[si]) {
+                    std::swap(candles_csv, preload_candles[si]);
+                    is_preloaded[si] = false;
+                } else
+                if(!is_tail && bf::check_file(file_csv)) {
+                    if(!read_csv_file(file_csv, si, candles_csv)) return EXIT_FAILURE;
+                }
 
-            if(candles_csv.size() > 0) std::cout << settings.symbols_config[si].symbol << " write date: " << xtime::get_str_date(candles_csv.front().timestamp) << " - " << xtime::get_str_date(candles_csv.back().timestamp) <<  std::endl;
-            else std::cout << settings.symbols_config[si].symbol << " write date: null" << std::endl;
+                if(update.is_quote) {
+                    std::cout << settings.symbols_config[si].symbol << " quote date: " << xtime::get_str_date(update.quote.timestamp) << std::endl;
+                    continue;
+                }
+
+                if(update.is_synthetic) {
+                    if(!is_tail) {
+                        timestamp_beg = 0;
+                        last_full_resync[si] = timestamp;
+                    }
+                    mt4_tools::TraceSpan span_synthetic(&tracer, "synthetic", "stage", &settings.symbols_config[si].symbol);
+                    if(!compute_synthetic_update(si, timestamp_beg, update)) return EXIT_FAILURE;
+                    std::cout << settings.symbols_config[si].symbol << " synthetic date: " << xtime::get_str_date(timestamp_beg) << " - " << xtime::get_str_date(timestamp_end) << std::endl;
+                    continue;
+                }
+
+                if(update.is_deferred) {
+                    /* окно уже выбрано по последнему бару */
+                } else
+                if(candles_csv.size() != 0) {
+                    /* перекачиваем окно истории, чтобы заметить ее исправления */
+                    timestamp_beg = xtime::get_first_timestamp_day(candles_csv.back().timestamp);
+                    timestamp_beg = timestamp_beg > resync_depth ? timestamp_beg - resync_depth : 0;
+                    if(!is_tail && timestamp_beg < candles_csv.front().timestamp) timestamp_beg = xtime::get_first_timestamp_day(candles_csv.front().timestamp);
+                    /* периодически сверяем всю историю */
+                    if(is_full_resync) {
+                        timestamp_beg = xtime::get_first_timestamp_day(xtime::get_timestamp(1,1,1970));
+                        last_full_resync[si] = timestamp;
+                    }
+                } else {
+                    last_full_resync[si] = timestamp;
+                }
+                std::cout << settings.symbols_config[si].symbol << " download date: " << xtime::get_str_date(timestamp_beg) << " - " << xtime::get_str_date(timestamp_end) <<  std::endl;
+
+                /* выбираем период запроса */
+                const uint32_t period = settings.symbols_config[si].period;
+                uint32_t &source_period = update.source_period;
+                StooqApi::PeriodTypes &stooq_period = update.stooq_period;
+                switch(period) {
+                case 5:
+                    stooq_period = StooqApi::PeriodTypes::MINUTE_5;
+                    break;
+                case 15:
+                case 30:
+                    /* получаем из баров M5 */
+                    stooq_period = StooqApi::PeriodTypes::MINUTE_5;
+                    source_period = 5;
+                    break;
+                case 60:
+                    stooq_period = StooqApi::PeriodTypes::HOUR_1;
+                    break;
+                case 240:
+                    /* получаем из баров H1 */
+                    stooq_period = StooqApi::PeriodTypes::HOUR_1;
+                    source_period = 60;
+                    break;
+                case xtime::MINUTES_IN_DAY:
+                    stooq_period = StooqApi::PeriodTypes::DAY;
+                    break;
+                case 10080:
+                    stooq_period = StooqApi::PeriodTypes::WEEK;
+                    break;
+                case 40320:
+                case 43200:
+                    stooq_period = StooqApi::PeriodTypes::MONTH;
+                    break;
+                };
 
-            /* записываем csv */
-            std::string header_csv;
-            mt4_tools::CsvTypes type_csv = mt4_tools::CsvTypes::MT4;
-            int err_csv = mt4_tools::write_file(
-                    file_csv,
-                    header_csv,
-                    candles_csv,
-                    type_csv);
-            if(err_csv != xquotes_common::OK) {
-                std::cout << settings.symbols_config[si].symbol << " error write csv file, code: " << err_csv << std::endl;
-                return EXIT_FAILURE;
             }
 
-            /* обновляем hst файл */
-            const xtime::timestamp_t last_timestamp = mql_history[si]->get_last_timestamp();
-            if(last_timestamp == 0) {
-                for(size_t i = 0; i < candles_csv.size(); ++i) {
-                    mql_history[si]->add_new_candle(candles_csv[i]);
+            /* качаем историю, бары разбираются и пересчитываются по мере приема ответа */
+            std::vector<StooqApi::HistoryRequest> requests;
+            std::vector<size_t> request_updates;
+            for(size_t i = 0; i < updates.size(); ++i) {
+                SymbolUpdate &update = updates[i];
+                if(update.is_quote) {
+                    update.add_candle(update.quote);
+                    continue;
                 }
-            } else {
-                for(size_t i = 0; i < candles_csv.size(); ++i) {
-                    if(candles_csv[i].timestamp == last_timestamp) {
-                        mql_history[si]->update_candle(candles_csv[i]);
+                if(update.is_synthetic) continue;
+                StooqApi::HistoryRequest request;
+                request.symbol = settings.symbols_config[symbol_order[batch_beg + i]].symbol;
+                request.period = update.stooq_period;
+                request.start_date = update.timestamp_beg;
+                request.stop_date = update.timestamp_end;
+                request.callback = [&update](const xquotes_common::Candle &candle) {
+                    update.add_candle(candle);
+                };
+                requests.push_back(request);
+                request_updates.push_back(i);
+            }
+            {
+                mt4_tools::TraceSpan span(&tracer, "download", "stage");
+                mt4_tools::AllocScope alloc_scope(mt4_tools::AllocStages::FETCH);
+                stooq.get_historical_data(requests);
+            }
+            std::vector<int> errors(updates.size(), StooqApi::OK);
+            for(size_t r = 0; r < requests.size(); ++r) {
+                errors[request_updates[r]] = requests[r].err;
+            }
+
+            for(size_t n = batch_beg; n < batch_end; ++n) {
+                const size_t si = symbol_order[n];
+                SymbolUpdate &update = updates[n - batch_beg];
+                if(update.is_unchanged) continue;
+                update.flush();
+                is_deadline_missed[si] = errors[n - batch_beg] == StooqApi::DEADLINE_EXCEEDED;
+                if(is_deadline_missed[si]) {
+                    /* запрос не успел до начала следующего цикла, историю не трогаем */
+                    ++deadline_missed;
+                    continue;
+                }
+                if(errors[n - batch_beg] != StooqApi::OK) {
+                    std::cout << settings.symbols_config[si].symbol << " download error, code: " << errors[n - batch_beg] << std::endl;
+                    ++shard_status.errors;
+                }
+                if(update.is_range_error || update.is_volume_error) {
+                    /* история символа не трогается, остальные символы обновляются как обычно */
+                    if(update.is_range_error) std::cout << settings.symbols_config[si].symbol << " error: price does not fit with digits " << settings.symbols_config[si].digits << ", symbol skipped" << std::endl;
+                    else std::cout << settings.symbols_config[si].symbol << " error: volume is too large, symbol skipped" << std::endl;
+                    window_cache[si].reset();
+                    ++shard_status.errors;
+                    continue;
+                }
+                if(update.is_deferred) {
+                    /* окно совпало с прошлым циклом и уже внесено в историю: файлы не читаются и не пишутся */
+                    if(errors[n - batch_beg] == StooqApi::OK && window_cache[si].is_unchanged(update.candles_fresh, update.timestamp_beg)) {
+                        ++symbols_unchanged;
+                        continue;
+                    }
+                    mt4_tools::TraceSpan span(&tracer, "read csv", "io", &settings.symbols_config[si].symbol);
+                    mt4_tools::AllocScope alloc_scope(mt4_tools::AllocStages::READ);
+                    if(!read_csv_tail(si, update)) {
+                        /* файл изменен в обход загрузчика, читаем его целиком */
+                        history_sync[si].reset();
+                        update.candles_csv.clear();
+                        if(bf::check_file(update.file_csv) && !read_csv_file(update.file_csv, si, update.candles_csv)) return EXIT_FAILURE;
+                    }
+                }
+                mt4_tools::CompactCandles &candles_csv = update.candles_csv;
+                mt4_tools::CompactCandles &candles_fresh = update.candles_fresh;
+                const mt4_tools::CsvTail &csv_tail = update.csv_tail;
+                const bool is_tail = update.is_tail;
+                const size_t base = update.base;
+                const std::string &file_csv = update.file_csv;
+
+                /* сверяем загруженные бары с историей, хеши блоков привязаны к абсолютным номерам баров */
+                mt4_tools::SyncResult sync;
+                {
+                    mt4_tools::TraceSpan span(&tracer, "merge", "stage", &settings.symbols_config[si].symbol);
+                    mt4_tools::AllocScope alloc_scope(mt4_tools::AllocStages::MERGE);
+                    sync = history_sync[si].synchronize(candles_csv, candles_fresh, base);
+                }
+                history_sizes[si] = base + candles_csv.size();
+                if(sync.is_changed && sync.first_changed < candles_csv.size()) changed_from[si] = candles_csv[sync.first_changed].timestamp;
+                if(sync.changed.size() != 0 || sync.is_rewritten) {
+                    std::cout << settings.symbols_config[si].symbol << " history revised, changed bars: " << sync.changed.size();
+                    if(sync.is_rewritten) std::cout << ", rewritten from: " << xtime::get_str_date(candles_csv[sync.first_rewritten].timestamp);
+                    std::cout << std::endl;
+                }
+
+                if(candles_csv.size() > 0) std::cout << settings.symbols_config[si].symbol << " write date: " << xtime::get_str_date(candles_csv.front().timestamp) << " - " << xtime::get_str_date(candles_csv.back().timestamp) <<  std::endl;
+                else std::cout << settings.symbols_config[si].symbol << " write date: null" << std::endl;
+
+                /* записываем csv, начиная с первого измененного бара */
+                if(sync.is_changed) {
+                    mt4_tools::TraceSpan span(&tracer, "csv write", "io", &settings.symbols_config[si].symbol);
+                    mt4_tools::AllocScope alloc_scope(mt4_tools::AllocStages::CSV_WRITE);
+                    std::string header_csv;
+                    mt4_tools::CsvTypes type_csv = mt4_tools::CsvTypes::MT4;
+                    int err_csv = storage.is_open() ? (is_tail ?
+                        mt4_tools::rewrite_file_tail(
+                            storage,
+                            file_csv,
+                            csv_tail,
+                            candles_csv,
+                            sync.first_changed,
+                            (int)candles_csv.get_digits(),
+                            type_csv) :
+                        mt4_tools::rewrite_file_tail(
+                            storage,
+                            file_csv,
+                            header_csv,
+                            candles_csv,
+                            sync.first_changed,
+                            (int)candles_csv.get_digits(),
+                            type_csv)) :
+                        is_tail ?
+                        mt4_tools::rewrite_file_tail(
+                            file_csv,
+                            csv_tail,
+                            candles_csv,
+                            sync.first_changed,
+                            (int)candles_csv.get_digits(),
+                            type_csv) :
+                        mt4_tools::rewrite_file_tail(
+                            file_csv,
+                            header_csv,
+                            candles_csv,
+                            sync.first_changed,
+                            (int)candles_csv.get_digits(),
+                            type_csv);
+                    if(err_csv != xquotes_common::OK) {
+                        std::cout << settings.symbols_config[si].symbol << " error write csv file, code: " << err_csv << std::endl;
+                        return EXIT_FAILURE;
+                    }
+                }
+
+                /* обновляем hst файл */
+                {
+                    mt4_tools::TraceSpan span(&tracer, "hst write", "io", &settings.symbols_config[si].symbol);
+                    mt4_tools::AllocScope alloc_scope(mt4_tools::AllocStages::HST_WRITE);
+                    const xtime::timestamp_t last_timestamp = mql_history[si]->get_last_timestamp();
+                    if(last_timestamp == 0 && !is_tail) {
+                        mql_history[si]->write_candles(candles_csv, 0, candles_csv.size());
                     } else
-                    if(candles_csv[i].timestamp > last_timestamp) {
-                        mql_history[si]->add_new_candle(candles_csv[i]);
+                    if(sync.is_changed) {
+                        /* перезаписываем только измененные бары */
+                        mql_history[si]->write_candles(candles_csv, sync.changed, base);
+                        size_t first_new = candles_csv.size() - sync.added;
+                        if(sync.is_rewritten) {
+                            first_new = sync.first_rewritten;
+                            const xtime::timestamp_t timestamp_prev = first_new > 0 ? candles_csv[first_new - 1].timestamp : csv_tail.prev_timestamp;
+                            mql_history[si]->resize(base + first_new, timestamp_prev);
+                        }
+                        mql_history[si]->write_candles(candles_csv, first_new, candles_csv.size(), base);
                     }
                 }
+
+                /* запоминаем окно, чтобы в следующем цикле пропустить символ без изменений */
+                if(!update.is_synthetic && errors[n - batch_beg] == StooqApi::OK && candles_csv.size() != 0) {
+                    window_cache[si].set(candles_fresh, update.timestamp_beg, candles_csv.back().timestamp);
+                } else {
+                    window_cache[si].reset();
+                }
+
+                /* обновляем индикаторы, при исправлении старых баров нужна вся история */
+                mt4_tools::TraceSpan span_indicators(&tracer, "indicators", "stage", &settings.symbols_config[si].symbol);
+                bool is_indicators_ok = true;
+                if(is_tail && indicator_stages[si].is_full_history_required(base, sync)) {
+                    /* csv файл читается заново, поэтому его запись должна завершиться */
+                    if(storage.is_open() && !storage.wait()) {
+                        std::cout << "error write files through io_uring" << std::endl;
+                        return EXIT_FAILURE;
+                    }
+                    mt4_tools::CompactCandles candles_full(settings.symbols_config[si].digits);
+                    if(!read_csv_file(file_csv, si, candles_full)) return EXIT_FAILURE;
+                    mt4_tools::SyncResult sync_full;
+                    sync_full.is_changed = true;
+                    is_indicators_ok = indicator_stages[si].update(candles_full, sync_full);
+                } else {
+                    is_indicators_ok = indicator_stages[si].update(candles_csv, sync, base);
+                }
+                if(!is_indicators_ok) {
+                    std::cout << settings.symbols_config[si].symbol << " error write indicators file" << std::endl;
+                    return EXIT_FAILURE;
+                }
+
+                /* публикуем измененные бары */
+                if(shm_publisher.is_open() && sync.is_changed) {
+                    const size_t last_index = candles_csv.size() - 1;
+                    for(size_t i = 0; i < sync.changed.size(); ++i) {
+                        shm_publisher.publish(
+                            shm_slots[si],
+                            candles_csv[sync.changed[i]],
+                            mt4_tools::SHM_EVENT_UPDATE,
+                            sync.changed[i] == last_index);
+                    }
+                    const size_t first_new = sync.is_rewritten ? sync.first_rewritten : candles_csv.size() - sync.added;
+                    for(size_t i = first_new; i < candles_csv.size(); ++i) {
+                        shm_publisher.publish(
+                            shm_slots[si],
+                            candles_csv[i],
+                            mt4_tools::SHM_EVENT_NEW_BAR,
+                            i == last_index);
+                    }
+                }
+
+                /* первый раз отправляем снимок истории, затем только изменения */
+                if(ws_server.is_running() && !is_ws_history[si]) {
+                    ws_server.set_history(ws_channels[si], candles_csv);
+                    is_ws_history[si] = true;
+                } else
+                if(ws_server.is_running() && sync.is_changed) {
+                    for(size_t i = 0; i < sync.changed.size(); ++i) {
+                        ws_server.update(ws_channels[si], candles_csv[sync.changed[i]]);
+                    }
+                    const size_t first_new = sync.is_rewritten ? sync.first_rewritten : candles_csv.size() - sync.added;
+                    for(size_t i = first_new; i < candles_csv.size(); ++i) {
+                        ws_server.update(ws_channels[si], candles_csv[i]);
+                    }
+                }
+            }
+            /* записи пачки выполняются, пока загружается следующая */
+            if(storage.is_open() && !storage.submit()) {
+                std::cout << "error submit files through io_uring" << std::endl;
+                return EXIT_FAILURE;
+            }
+            /* изменения символов пачки уходят клиентам одним сообщением */
+            if(ws_server.is_running()) ws_server.flush();
+            /* прогресс пишем не чаще раза в секунду */
+            shard_status.processed = batch_end;
+            if(settings.shard_count > 1 && (std::chrono::steady_clock::now() - last_status_write) >= std::chrono::seconds(1)) {
+                shard_status.write(shard_status_file);
+                last_status_write = std::chrono::steady_clock::now();
+            }
+        }
+        if(settings.shard_count > 1) {
+            shard_status.state = "wait";
+            shard_status.last_update = clock.get_timestamp();
+            shard_status.cycle_seconds = std::chrono::duration<double>(clock.now() - cycle_start).count();
+            shard_status.write(shard_status_file);
+        }
+        if(storage.is_open()) {
+            mt4_tools::TraceSpan span(&tracer, "storage wait", "io");
+            if(!storage.wait()) {
+                std::cout << "error write files through io_uring" << std::endl;
+                return EXIT_FAILURE;
             }
         }
-        std::cout << "update completed " << xtime::get_str_date_time(xtime::get_timestamp()) << std::endl;
+        if(deadline_missed > 0) {
+            std::cout << "symbols missed the deadline: " << deadline_missed << ", they go first in the next update" << std::endl;
+        }
+        std::cout << "symbols unchanged, skipped: " << symbols_unchanged << " of " << settings.symbols_config.size() << std::endl;
+        if(hst_pool) {
+            std::cout << "hst files open: " << hst_pool->size() << ", hits: " << hst_pool->get_hits() << ", misses: " << hst_pool->get_misses() << ", evictions: " << hst_pool->get_evictions() << std::endl;
+        }
+        if(settings.hedging) {
+            std::cout << "hedged requests: " << stooq.get_hedges_started() << ", won: " << stooq.get_hedges_won() << std::endl;
+        }
+        if(mt4_tools::AllocStats::is_enabled()) print_alloc_stats(alloc_start, settings.symbols_config.size());
+        std::cout << "update completed " << xtime::get_str_date_time(clock.get_timestamp()) << std::endl;
         std::cout << "next update " << xtime::get_str_date_time(restart_timestamp) << std::endl;
-        while(xtime::get_timestamp() < restart_timestamp) {
-            std::this_thread::sleep_for(std::chrono::milliseconds(1000));
+        /* трасса цикла пишется перед ожиданием, ожидание попадает в трассу следующего цикла */
+        if(tracer.is_enabled()) {
+            tracer.add("cycle", "cycle", cycle_start_steady, std::chrono::steady_clock::now());
+            const std::string file_trace = settings.path_trace + "trace_" + std::to_string(trace_cycle) + ".json";
+            if(!tracer.write(file_trace)) std::cout << "error write trace file " << file_trace << std::endl;
+            if(settings.trace_keep != 0 && trace_cycle >= settings.trace_keep) {
+                std::remove((settings.path_trace + "trace_" + std::to_string(trace_cycle - settings.trace_keep) + ".json").c_str());
+            }
+            tracer.clear();
+            ++trace_cycle;
+        }
+        /* отставание цикла от расписания, если предыдущий цикл не успел до начала этого */
+        if(settings.simulation) {
+            const xtime::timestamp_t lag = sim_scheduled != 0 && timestamp > sim_scheduled ? timestamp - sim_scheduled : 0;
+            const double duration = std::chrono::duration<double>(clock.now() - cycle_start).count();
+            const uint64_t requests = simulation.get_requests() - sim_requests;
+            const mt4_tools::ResourceUsage usage = mt4_tools::ResourceUsage::get();
+            sim_max_lag = std::max(sim_max_lag, lag);
+            sim_missed += deadline_missed;
+            sim_unchanged += symbols_unchanged;
+            sim_requests = simulation.get_requests();
+            std::cout
+                << "simulation cycle " << sim_cycle
+                << " lag: " << lag << " s"
+                << " duration: " << duration << " s"
+                << " missed: " << deadline_missed
+                << " unchanged: " << symbols_unchanged
+                << " requests: " << requests
+                << " cpu: " << usage.cpu_seconds << " s"
+                << " rss: " << (usage.max_rss / (1024 * 1024)) << " MB" << std::endl;
+            if(sim_report.is_open()) {
+                sim_report
+                    << sim_cycle << ","
+                    << xtime::get_str_date_time(timestamp) << ","
+                    << lag << ","
+                    << duration << ","
+                    << deadline_missed << ","
+                    << symbols_unchanged << ","
+                    << requests << ","
+                    << usage.cpu_seconds << ","
+                    << (usage.max_rss / (1024 * 1024)) << std::endl;
+            }
+            sim_scheduled = restart_timestamp;
+            if(++sim_cycle >= settings.sim_cycles) {
+                std::cout
+                    << "simulation completed, cycles: " << sim_cycle
+                    << " max lag: " << sim_max_lag << " s"
+                    << " symbols missed: " << sim_missed
+                    << " symbols unchanged: " << sim_unchanged
+                    << " requests: " << sim_requests
+                    << " bars: " << simulation.get_candles()
+                    << " wall time: " << std::chrono::duration<double>(std::chrono::steady_clock::now() - sim_wall_start).count() << " s" << std::endl;
+                return EXIT_SUCCESS;
+            }
+        }
+        {
+            mt4_tools::TraceSpan span(&tracer, "sleep", "cycle");
+            clock.sleep_until(restart_timestamp);
         }
     }
     return EXIT_FAILURE;
@@ -0,0 +1,127 @@
+/*
+* mt4-stooq-api - stooq.com C++ API
+*
+* Copyright (c) 2018 Elektro Yar. Email: git.electroyar@gmail.com
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+#include <iostream>
+#include <cstdlib>
+#include <cmath>
+#include "mt4-stooq.hpp"
+#include "mt4-resample.hpp"
+
+#define PROGRAM_VERSION "1.0"
+#define PROGRAM_DATE "19.10.2026"
+
+/* Проверка потокового разбора ответа сервера истории.
+ * Программа запрашивает бары M5 у tools/stooq-fixture.py, который отдает
+ * ответ кусками с разрывами строк, сверяет каждый бар с формулой сервера
+ * и пересчитывает бары в M15. Запуск: stream-check [http://127.0.0.1:18080]
+ */
+
+static const size_t M5_BARS = 576;
+static const size_t M15_BARS = 192;
+
+/** \brief Получить бар M5 с номером k так, как его формирует сервер
+ */
+xquotes_common::Candle get_fixture_candle(const size_t k) {
+    const xtime::timestamp_t timestamp = xtime::get_timestamp(28, 8, 2020) + (xtime::timestamp_t)k * 5 * xtime::SECONDS_IN_MINUTE;
+    xquotes_common::Candle candle(
+        1.0 + (double)k / 100000.0,
+        1.0 + (double)(k + 5) / 100000.0,
+        (double)(99000 + k % 900) / 100000.0,
+        1.0 + (double)(k + 1) / 100000.0,
+        timestamp);
+    candle.volume = (double)k;
+    return candle;
+}
+
+bool is_equal(const xquotes_common::Candle &a, const xquotes_common::Candle &b) {
+    const double eps = 1e-9;
+    return  a.timestamp == b.timestamp &&
+            std::abs(a.open - b.open) < eps &&
+            std::abs(a.high - b.high) < eps &&
+            std::abs(a.low - b.low) < eps &&
+            std::abs(a.close - b.close) < eps &&
+            std::abs(a.volume - b.volume) < eps;
+}
+
+int main(int argc, char* argv[]) {
+    std::cout << "stream check" << std::endl;
+    std::cout
+        << "version: " << PROGRAM_VERSION
+        << " date: " << PROGRAM_DATE
+        << std::endl << std::endl;
+
+    const std::string point = argc > 1 ? argv[1] : "http://127.0.0.1:18080";
+    StooqApi stooq("", point);
+
+    std::vector<xquotes_common::Candle> candles_m5;
+    std::vector<xquotes_common::Candle> candles_m15;
+    mt4_tools::CandleResampler resampler(15);
+    xquotes_common::Candle candle_m15;
+    const int err = stooq.get_historical_data(
+            "EURUSD",
+            StooqApi::PeriodTypes::MINUTE_5,
+            xtime::get_timestamp(28, 8, 2020),
+            xtime::get_timestamp(29, 8, 2020),
+            [&](const xquotes_common::Candle &candle) {
+        candles_m5.push_back(candle);
+        if(resampler.update(candle, candle_m15)) candles_m15.push_back(candle_m15);
+    });
+    if(resampler.flush(candle_m15)) candles_m15.push_back(candle_m15);
+
+    if(err != StooqApi::OK) {
+        std::cout << "error: request failed, code: " << err << std::endl;
+        return EXIT_FAILURE;
+    }
+    std::cout << "M5 bars: " << candles_m5.size() << " M15 bars: " << candles_m15.size() << std::endl;
+    if(candles_m5.size() != M5_BARS || candles_m15.size() != M15_BARS) {
+        std::cout << "error: expected " << M5_BARS << " M5 bars and " << M15_BARS << " M15 bars" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    /* каждый бар M5 должен совпасть с формулой сервера, где бы ни прошла граница куска */
+    for(size_t k = 0; k < candles_m5.size(); ++k) {
+        if(!is_equal(candles_m5[k], get_fixture_candle(k))) {
+            std::cout << "error: M5 bar " << k << " differs from the fixture" << std::endl;
+            return EXIT_FAILURE;
+        }
+    }
+
+    /* бар M15 с номером n собирается из баров M5 3n, 3n+1 и 3n+2 */
+    for(size_t n = 0; n < candles_m15.size(); ++n) {
+        const xquotes_common::Candle first = get_fixture_candle(3 * n);
+        xquotes_common::Candle expected = first;
+        for(size_t k = 3 * n + 1; k < 3 * n + 3; ++k) {
+            const xquotes_common::Candle candle = get_fixture_candle(k);
+            expected.high = std::max(expected.high, candle.high);
+            expected.low = std::min(expected.low, candle.low);
+            expected.close = candle.close;
+            expected.volume += candle.volume;
+        }
+        if(!is_equal(candles_m15[n], expected)) {
+            std::cout << "error: M15 bar " << n << " differs from the folded M5 bars" << std::endl;
+            return EXIT_FAILURE;
+        }
+    }
+    std::cout << "ok" << std::endl;
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,264 @@
+#ifndef MT4_ALLOC_STATS_HPP_INCLUDED
+#define MT4_ALLOC_STATS_HPP_INCLUDED
+
+#include <atomic>
+#include <new>
+#include <vector>
+#include <cstdlib>
+#include <cstdint>
+
+namespace mt4_tools {
+
+    /** \brief Этапы цикла загрузки, по которым считаются выделения памяти
+     */
+    enum class AllocStages {
+        OTHER,      /**< Вне отмеченных этапов */
+        READ,       /**< Чтение csv файлов */
+        FETCH,      /**< Запросы к серверу */
+        PARSE,      /**< Разбор ответов сервера */
+        MERGE,      /**< Сверка загруженных баров с историей */
+        CSV_WRITE,  /**< Запись csv файлов */
+        HST_WRITE,  /**< Запись hst файлов */
+    };
+
+    static const size_t ALLOC_STAGES_SIZE = 7;
+
+    /** \brief Счетчики выделений памяти по этапам
+     *
+     * Счетчики работают, только если программа собрана с MT4_ALLOC_STATS:
+     * тогда этот заголовок заменяет глобальные operator new и operator delete,
+     * поэтому в программе он должен включаться в одну единицу трансляции.
+     * Перед каждым блоком хранится его размер и этап, на котором он выделен,
+     * так что освобождение уменьшает занятую память того этапа, который ее занял.
+     * Этап задается для каждого потока отдельно через AllocScope.
+     * Выделения с выравниванием больше стандартного (operator new и delete
+     * с std::align_val_t из C++17) не заменяются и не учитываются, их парами
+     * обслуживает стандартная библиотека. В программе, собранной как C++11, их нет.
+     * Без MT4_ALLOC_STATS счетчики всегда нулевые, а AllocScope ничего не делает.
+     */
+    class AllocStats {
+    public:
+
+        /** \brief Счетчики этапа
+         */
+        class Counters {
+        public:
+            uint64_t allocations = 0;   /**< Количество выделений */
+            uint64_t bytes = 0;         /**< Выделено байт */
+            uint64_t live_bytes = 0;    /**< Занято байт сейчас */
+            uint64_t peak_bytes = 0;    /**< Наибольшее количество занятых байт с последнего reset_peaks */
+
+            Counters() {};
+        };
+
+    private:
+
+        class State {
+        public:
+            std::atomic<uint64_t> allocations[ALLOC_STAGES_SIZE];
+            std::atomic<uint64_t> bytes[ALLOC_STAGES_SIZE];
+            std::atomic<uint64_t> live_bytes[ALLOC_STAGES_SIZE];
+            std::atomic<uint64_t> peak_bytes[ALLOC_STAGES_SIZE];
+            std::atomic<uint64_t> total_live_bytes;
+            std::atomic<uint64_t> total_peak_bytes;
+        };
+
+        /** \brief Счетчики живут в статической памяти и обнулены до первого выделения
+         */
+        static State &get_state() {
+            static State state;
+            return state;
+        }
+
+        static inline void update_peak(std::atomic<uint64_t> &peak, const uint64_t value) {
+            uint64_t current = peak.load(std::memory_order_relaxed);
+            while(value > current && !peak.compare_exchange_weak(current, value, std::memory_order_relaxed)) {};
+        }
+
+        static inline uint8_t &get_thread_stage() {
+            static thread_local uint8_t stage = 0;
+            return stage;
+        }
+
+    public:
+
+        /** \brief Проверить, собрана ли программа со счетчиками
+         */
+        static constexpr bool is_enabled() {
+#ifdef MT4_ALLOC_STATS
+            return true;
+#else
+            return false;
+#endif
+        }
+
+        static const char *get_stage_name(const AllocStages stage) {
+            static const char *names[ALLOC_STAGES_SIZE] = {
+                "other", "read", "fetch", "parse", "merge", "csv write", "hst write"};
+            return names[(size_t)stage];
+        }
+
+        static inline AllocStages get_stage() {
+            return (AllocStages)get_thread_stage();
+        }
+
+        static inline void set_stage(const AllocStages stage) {
+            get_thread_stage() = (uint8_t)stage;
+        }
+
+        /** \brief Учесть выделение блока
+         * \return Этап, который нужно сохранить вместе с блоком
+         */
+        static inline uint8_t on_allocate(const size_t size) {
+            State &state = get_state();
+            const uint8_t stage = get_thread_stage();
+            state.allocations[stage].fetch_add(1, std::memory_order_relaxed);
+            state.bytes[stage].fetch_add(size, std::memory_order_relaxed);
+            update_peak(state.peak_bytes[stage], state.live_bytes[stage].fetch_add(size, std::memory_order_relaxed) + size);
+            update_peak(state.total_peak_bytes, state.total_live_bytes.fetch_add(size, std::memory_order_relaxed) + size);
+            return stage;
+        }
+
+        /** \brief Учесть освобождение блока
+         */
+        static inline void on_free(const size_t size, const uint8_t stage) {
+            State &state = get_state();
+            state.live_bytes[stage].fetch_sub(size, std::memory_order_relaxed);
+            state.total_live_bytes.fetch_sub(size, std::memory_order_relaxed);
+        }
+
+        /** \brief Получить счетчики всех этапов
+         * \param counters Счетчики, индекс - номер этапа AllocStages
+         * \param total Суммарные счетчики
+         */
+        static void get(std::vector<Counters> &counters, Counters &total) {
+            State &state = get_state();
+            counters.assign(ALLOC_STAGES_SIZE, Counters());
+            total = Counters();
+            for(size_t i = 0; i < ALLOC_STAGES_SIZE; ++i) {
+                counters[i].allocations = state.allocations[i].load(std::memory_order_relaxed);
+                counters[i].bytes = state.bytes[i].load(std::memory_order_relaxed);
+                counters[i].live_bytes = state.live_bytes[i].load(std::memory_order_relaxed);
+                counters[i].peak_bytes = state.peak_bytes[i].load(std::memory_order_relaxed);
+                total.allocations += counters[i].allocations;
+                total.bytes += counters[i].bytes;
+            }
+            total.live_bytes = state.total_live_bytes.load(std::memory_order_relaxed);
+            total.peak_bytes = state.total_peak_bytes.load(std::memory_order_relaxed);
+        }
+
+        /** \brief Начать отсчет наибольшей занятой памяти с текущего значения
+         */
+        static void reset_peaks() {
+            State &state = get_state();
+            for(size_t i = 0; i < ALLOC_STAGES_SIZE; ++i) {
+                state.peak_bytes[i].store(state.live_bytes[i].load(std::memory_order_relaxed), std::memory_order_relaxed);
+            }
+            state.total_peak_bytes.store(state.total_live_bytes.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        }
+    };
+
+    /** \brief Этап текущего потока от создания до удаления объекта
+     *
+     * Вложенный этап после завершения возвращает предыдущий
+     */
+    class AllocScope {
+#ifdef MT4_ALLOC_STATS
+    private:
+        AllocStages previous;
+
+    public:
+
+        AllocScope(const AllocStages stage) : previous(AllocStats::get_stage()) {
+            AllocStats::set_stage(stage);
+        }
+
+        ~AllocScope() {
+            AllocStats::set_stage(previous);
+        }
+#else
+    public:
+
+        AllocScope(const AllocStages) {};
+#endif
+
+        AllocScope(const AllocScope&) = delete;
+        AllocScope &operator=(const AllocScope&) = delete;
+    };
+}
+
+#ifdef MT4_ALLOC_STATS
+namespace mt4_tools {
+
+    static const size_t ALLOC_HEADER_SIZE = 16; /**< Заголовок блока: размер и этап, сохраняет выравнивание */
+
+    void *alloc_stats_allocate(const size_t size) noexcept {
+        char *ptr = (char*)std::malloc(size + ALLOC_HEADER_SIZE);
+        if(ptr == nullptr) return nullptr;
+        const uint64_t size_value = size;
+        *reinterpret_cast<uint64_t*>(ptr) = size_value;
+        ptr[8] = (char)AllocStats::on_allocate(size);
+        return ptr + ALLOC_HEADER_SIZE;
+    }
+
+    void *alloc_stats_allocate_or_throw(const size_t size) {
+        while(true) {
+            void *ptr = alloc_stats_allocate(size);
+            if(ptr != nullptr) return ptr;
+            std::new_handler handler = std::get_new_handler();
+            if(handler == nullptr) throw std::bad_alloc();
+            handler();
+        }
+    }
+
+    void alloc_stats_free(void *user_ptr) noexcept {
+        if(user_ptr == nullptr) return;
+        char *ptr = (char*)user_ptr - ALLOC_HEADER_SIZE;
+        AllocStats::on_free((size_t)*reinterpret_cast<uint64_t*>(ptr), (uint8_t)ptr[8]);
+        std::free(ptr);
+    }
+}
+
+void *operator new(std::size_t size) {
+    return mt4_tools::alloc_stats_allocate_or_throw(size);
+}
+
+void *operator new[](std::size_t size) {
+    return mt4_tools::alloc_stats_allocate_or_throw(size);
+}
+
+void *operator new(std::size_t size, const std::nothrow_t&) noexcept {
+    return mt4_tools::alloc_stats_allocate(size);
+}
+
+void *operator new[](std::size_t size, const std::nothrow_t&) noexcept {
+    return mt4_tools::alloc_stats_allocate(size);
+}
+
+void operator delete(void *ptr) noexcept {
+    mt4_tools::alloc_stats_free(ptr);
+}
+
+void operator delete[](void *ptr) noexcept {
+    mt4_tools::alloc_stats_free(ptr);
+}
+
+void operator delete(void *ptr, const std::nothrow_t&) noexcept {
+    mt4_tools::alloc_stats_free(ptr);
+}
+
+void operator delete[](void *ptr, const std::nothrow_t&) noexcept {
+    mt4_tools::alloc_stats_free(ptr);
+}
+
+/* размер блока хранится в заголовке, поэтому размер из sized delete не нужен */
+void operator delete(void *ptr, std::size_t) noexcept {
+    mt4_tools::alloc_stats_free(ptr);
+}
+
+void operator delete[](void *ptr, std::size_t) noexcept {
+    mt4_tools::alloc_stats_free(ptr);
+}
+#endif
+
+#endif // MT4_ALLOC_STATS_HPP_INCLUDED
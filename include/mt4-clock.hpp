@@ -0,0 +1,87 @@
+#ifndef MT4_CLOCK_HPP_INCLUDED
+#define MT4_CLOCK_HPP_INCLUDED
+
+#include <xtime.hpp>
+#include <chrono>
+#include <thread>
+
+namespace mt4_tools {
+
+    /** \brief Часы загрузчика
+     *
+     * В обычном режиме возвращают системное время и ждут в реальном времени.
+     * В виртуальном режиме время идет от заданной метки со скоростью реальных
+     * часов, пока программа работает, а ожидание и смоделированные задержки
+     * сети переводят часы вперед мгновенно. Так циклы за сутки проходят
+     * за время, которое занимает только сама обработка
+     */
+    class Clock {
+    private:
+        bool is_virtual_flag = false;
+        xtime::timestamp_t virtual_start = 0;               /**< Метка времени начала виртуального времени */
+        std::chrono::steady_clock::time_point steady_start; /**< Момент начала виртуального времени */
+        std::chrono::steady_clock::duration skipped = std::chrono::steady_clock::duration::zero(); /**< Пропущенное время */
+
+    public:
+
+        Clock() {};
+
+        /** \brief Перейти на виртуальное время
+         * \param timestamp Метка времени, с которой начинается виртуальное время
+         */
+        void set_virtual(const xtime::timestamp_t timestamp) {
+            is_virtual_flag = true;
+            virtual_start = timestamp;
+            steady_start = std::chrono::steady_clock::now();
+            skipped = std::chrono::steady_clock::duration::zero();
+        }
+
+        inline bool is_virtual() const {
+            return is_virtual_flag;
+        }
+
+        /** \brief Получить момент монотонного времени
+         */
+        inline std::chrono::steady_clock::time_point now() const {
+            return std::chrono::steady_clock::now() + skipped;
+        }
+
+        /** \brief Получить метку времени
+         */
+        xtime::timestamp_t get_timestamp() const {
+            if(!is_virtual_flag) return xtime::get_timestamp();
+            return virtual_start + (xtime::timestamp_t)std::chrono::duration_cast<std::chrono::seconds>(now() - steady_start).count();
+        }
+
+        /** \brief Перевести виртуальное время вперед
+         *
+         * В обычном режиме ждет заданное время
+         * \param duration Время
+         */
+        void advance(const std::chrono::steady_clock::duration &duration) {
+            if(duration <= std::chrono::steady_clock::duration::zero()) return;
+            if(!is_virtual_flag) {
+                std::this_thread::sleep_for(duration);
+                return;
+            }
+            skipped += duration;
+        }
+
+        /** \brief Ждать до метки времени
+         * \param timestamp Метка времени
+         */
+        void sleep_until(const xtime::timestamp_t timestamp) {
+            if(!is_virtual_flag) {
+                while(xtime::get_timestamp() < timestamp) {
+                    std::this_thread::sleep_for(std::chrono::milliseconds(1000));
+                }
+                return;
+            }
+            if(timestamp <= get_timestamp()) return;
+            const auto target = steady_start + std::chrono::seconds(timestamp - virtual_start);
+            advance(target - now());
+        }
+    };
+}
+
+#endif // MT4_CLOCK_HPP_INCLUDED
@@ -1,9 +1,44 @@
 #ifndef MT4_COMMON_HPP_INCLUDED
 #define MT4_COMMON_HPP_INCLUDED
 
+#include <nlohmann/json.hpp>
+#include <functional>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+#ifdef _WIN32
+#include <io.h>
+#include <fcntl.h>
+#else
+#include <unistd.h>
+#include <sys/types.h>
+#endif
+
 namespace mt4_common {
     using json = nlohmann::json;
 
+    /** \brief Параметры индикатора
+     */
+    class IndicatorConfig {
+    public:
+        std::string type;       /**< Тип индикатора: sma, ema или atr */
+        uint32_t period = 14;
+
+        IndicatorConfig() {};
+    };
+
+    /** \brief Составляющая синтетического символа
+     */
+    class SyntheticLegConfig {
+    public:
+        std::string symbol;     /**< Загружаемый символ с тем же периодом */
+        int32_t power = 1;      /**< Степень, 1 - множитель, -1 - делитель */
+        uint32_t digits = 5;    /**< Точность цен составляющей, берется из ее настроек */
+
+        SyntheticLegConfig() {};
+    };
+
     /** \brief Параметры символа
      */
     class SymbolConfig {
@@ -11,6 +46,9 @@ namespace mt4_common {
         std::string symbol;
         uint32_t digits = 5;
         uint32_t period = 1440;
+        std::vector<IndicatorConfig> indicators;    /**< Индикаторы, которые считаются для символа */
+        std::vector<SyntheticLegConfig> legs;       /**< Составляющие синтетического символа, пустой - символ загружается */
+        std::string synthetic_mode = "ohlc";        /**< Расчет синтетического символа: ohlc - все цены, close - только цена закрытия */
 
         SymbolConfig() {};
     };
@@ -46,6 +84,25 @@ namespace mt4_common {
         return !is_error;
     }
 
+    /** \brief Обрезать файл
+     *
+     * Файл не должен быть открыт потоком, который еще будет в него писать
+     * \param file_name Имя файла
+     * \param size Новый размер файла в байтах
+     * \return Вернет true в случае успешного завершения
+     */
+    bool truncate_file(const std::string &file_name, const uint64_t size) {
+#ifdef _WIN32
+        const int fd = _open(file_name.c_str(), _O_RDWR | _O_BINARY);
+        if(fd < 0) return false;
+        const int err = _chsize_s(fd, (__int64)size);
+        _close(fd);
+        return err == 0;
+#else
+        return ::truncate(file_name.c_str(), (off_t)size) == 0;
+#endif
+    }
+
     /** \brief Открыть файл JSON
      *
      * Данная функция прочитает файл с JSON и запишет данные в JSON структуру
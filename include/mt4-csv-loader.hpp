@@ -0,0 +1,295 @@
+#ifndef MT4_CSV_LOADER_HPP_INCLUDED
+#define MT4_CSV_LOADER_HPP_INCLUDED
+
+#include "mt4-csv.hpp"
+#include "mt4-fixed-candles.hpp"
+#include <vector>
+#include <string>
+#include <thread>
+#include <atomic>
+#include <functional>
+#include <algorithm>
+#include <cstring>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+namespace mt4_tools {
+
+    static const size_t CSV_LOADER_MIN_REGION = 1024 * 1024;   /**< Минимальный размер части файла, которую разбирает один поток */
+
+    /** \brief Файл, отображенный в память только для чтения
+     */
+    class MappedFile {
+    private:
+        const char *data = nullptr;
+        size_t size = 0;
+        bool is_open = false;
+#ifdef _WIN32
+        HANDLE file = INVALID_HANDLE_VALUE;
+        HANDLE mapping = NULL;
+#endif
+
+    public:
+
+        MappedFile() {};
+
+        MappedFile(const MappedFile&) = delete;
+        MappedFile &operator=(const MappedFile&) = delete;
+
+        ~MappedFile() {
+            close();
+        }
+
+        /** \brief Отобразить файл в память
+         * \param file_name Имя файла
+         * \return Вернет true в случае успешного завершения. Пустой файл открывается без отображения
+         */
+        bool open(const std::string &file_name) {
+            close();
+#ifdef _WIN32
+            file = CreateFileA(
+                file_name.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL,
+                OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+            if(file == INVALID_HANDLE_VALUE) return false;
+            LARGE_INTEGER file_size;
+            if(!GetFileSizeEx(file, &file_size)) {
+                close();
+                return false;
+            }
+            size = (size_t)file_size.QuadPart;
+            is_open = true;
+            if(size == 0) return true;
+            mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+            if(mapping == NULL) {
+                close();
+                return false;
+            }
+            void *ptr = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+            if(ptr == NULL) {
+                close();
+                return false;
+            }
+            data = (const char*)ptr;
+#else
+            const int fd = ::open(file_name.c_str(), O_RDONLY);
+            if(fd < 0) return false;
+            struct stat st;
+            if(fstat(fd, &st) != 0) {
+                ::close(fd);
+                return false;
+            }
+            size = (size_t)st.st_size;
+            is_open = true;
+            if(size == 0) {
+                ::close(fd);
+                return true;
+            }
+            void *ptr = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+            ::close(fd);
+            if(ptr == MAP_FAILED) {
+                size = 0;
+                is_open = false;
+                return false;
+            }
+            madvise(ptr, size, MADV_SEQUENTIAL);
+            data = (const char*)ptr;
+#endif
+            return true;
+        }
+
+        void close() {
+#ifdef _WIN32
+            if(data != nullptr) UnmapViewOfFile(data);
+            if(mapping != NULL) CloseHandle(mapping);
+            if(file != INVALID_HANDLE_VALUE) CloseHandle(file);
+            mapping = NULL;
+            file = INVALID_HANDLE_VALUE;
+#else
+            if(data != nullptr) munmap((void*)data, size);
+#endif
+            data = nullptr;
+            size = 0;
+            is_open = false;
+        }
+
+        inline const char *get() const {
+            return data;
+        }
+
+        inline size_t get_size() const {
+            return size;
+        }
+    };
+
+    /** \brief Запустить функцию для индексов 0..count-1 в отдельных потоках
+     *
+     * Индекс 0 выполняется в вызывающем потоке
+     * \param count Количество потоков
+     * \param f Функция, принимающая индекс
+     */
+    void run_parallel(const size_t count, const std::function<void(const size_t)> &f) {
+        std::vector<std::thread> pool;
+        for(size_t i = 1; i < count; ++i) {
+            pool.push_back(std::thread(f, i));
+        }
+        if(count > 0) f(0);
+        for(size_t i = 0; i < pool.size(); ++i) {
+            pool[i].join();
+        }
+    }
+
+    inline bool set_candle(std::vector<xquotes_common::Candle> &candles, const size_t index, const xquotes_common::Candle &candle) {
+        candles[index] = candle;
+        return true;
+    }
+
+    template<class PRICE_TYPE, class VOLUME_TYPE>
+    inline bool set_candle(FixedCandles<PRICE_TYPE, VOLUME_TYPE> &candles, const size_t index, const xquotes_common::Candle &candle) {
+        return candles.set(index, candle);
+    }
+
+    /** \brief Прочитать csv файл через отображение в память
+     *
+     * Файл делится на части по границам строк. Сначала в каждой части
+     * параллельно считаются строки, затем массив баров получает итоговый
+     * размер, и части разбираются параллельно, каждая в свой диапазон массива.
+     * Строки, которые не являются барами (например, заголовок), пропускаются.
+     * \param file_name Имя csv файла
+     * \param candles Бары файла. Массив очищается перед чтением
+     * \param threads Количество потоков, 0 - по числу ядер
+     * \param type_csv Тип csv файла (MT4, MT5, DUKASCOPY)
+     * \return вернет 0 в случае успеха, INVALID_PARAMETER если цена не помещается в массив, иначе см. код ошибок в xquotes_common.hpp
+     */
+    template<class CANDLES_TYPE>
+    int read_file_mapped(
+            const std::string &file_name,
+            CANDLES_TYPE &candles,
+            const uint32_t threads = 0,
+            const CsvTypes type_csv = CsvTypes::MT4) {
+        candles.clear();
+        MappedFile file;
+        if(!file.open(file_name)) return xquotes_common::FILE_CANNOT_OPENED;
+        const char *data = file.get();
+        const size_t size = file.get_size();
+        if(size == 0) return xquotes_common::OK;
+
+        size_t max_threads = threads != 0 ? threads : std::thread::hardware_concurrency();
+        if(max_threads == 0) max_threads = 1;
+        const size_t regions = std::max<size_t>(1, std::min(max_threads, size / CSV_LOADER_MIN_REGION));
+
+        /* границы частей сдвигаем на начало следующей строки */
+        std::vector<size_t> bounds(regions + 1, size);
+        bounds[0] = 0;
+        for(size_t r = 1; r < regions; ++r) {
+            const size_t start = std::max(bounds[r - 1], size / regions * r);
+            const char *line_end = (const char*)std::memchr(data + start, '\n', size - start);
+            bounds[r] = line_end == nullptr ? size : (size_t)(line_end - data) + 1;
+        }
+
+        /* считаем строки в частях */
+        std::vector<size_t> lines(regions, 0);
+        run_parallel(regions, [&](const size_t r) {
+            const char *ptr = data + bounds[r];
+            const char *end = data + bounds[r + 1];
+            size_t count = 0;
+            while(ptr < end) {
+                const char *line_end = (const char*)std::memchr(ptr, '\n', end - ptr);
+                ++count;
+                if(line_end == nullptr) break;
+                ptr = line_end + 1;
+            }
+            lines[r] = count;
+        });
+        std::vector<size_t> offsets(regions, 0);
+        for(size_t r = 1; r < regions; ++r) {
+            offsets[r] = offsets[r - 1] + lines[r - 1];
+        }
+        candles.resize(offsets.back() + lines.back());
+
+        /* разбираем части, бары каждой части пишутся подряд с ее смещения */
+        std::vector<size_t> counts(regions, 0);
+        std::atomic<bool> is_range_error(false);
+        run_parallel(regions, [&](const size_t r) {
+            const char *ptr = data + bounds[r];
+            const char *end = data + bounds[r + 1];
+            size_t index = offsets[r];
+            while(ptr < end) {
+                const char *line_end = (const char*)std::memchr(ptr, '\n', end - ptr);
+                if(line_end == nullptr) line_end = end;
+                const char *text_end = line_end > ptr && line_end[-1] == '\r' ? line_end - 1 : line_end;
+                xquotes_common::Candle candle;
+                if(parse_csv_line(ptr, text_end, candle, type_csv)) {
+                    if(!set_candle(candles, index, candle)) {
+                        is_range_error = true;
+                        break;
+                    }
+                    ++index;
+                }
+                ptr = line_end + 1;
+            }
+            counts[r] = index - offsets[r];
+        });
+        if(is_range_error) {
+            candles.clear();
+            return xquotes_common::INVALID_PARAMETER;
+        }
+
+        /* убираем места пропущенных строк */
+        size_t total = counts[0];
+        for(size_t r = 1; r < regions; ++r) {
+            if(offsets[r] != total) {
+                for(size_t i = 0; i < counts[r]; ++i) {
+                    set_candle(candles, total + i, candles[offsets[r] + i]);
+                }
+            }
+            total += counts[r];
+        }
+        candles.resize(total);
+        return xquotes_common::OK;
+    }
+
+    /** \brief Прочитать несколько csv файлов одновременно
+     *
+     * Файлы распределяются по потокам, а если файлов меньше, чем потоков,
+     * каждый файл дополнительно разбирается по частям
+     * \param file_names Имена csv файлов
+     * \param candles Массивы баров, по одному на файл. Должны быть созданы заранее
+     * \param errors Коды ошибок чтения файлов
+     * \param threads Количество потоков, 0 - по числу ядер
+     * \param type_csv Тип csv файлов (MT4, MT5, DUKASCOPY)
+     */
+    template<class CANDLES_TYPE>
+    void read_files_mapped(
+            const std::vector<std::string> &file_names,
+            std::vector<CANDLES_TYPE> &candles,
+            std::vector<int> &errors,
+            const uint32_t threads = 0,
+            const CsvTypes type_csv = CsvTypes::MT4) {
+        errors.assign(file_names.size(), xquotes_common::OK);
+        if(file_names.empty()) return;
+        size_t max_threads = threads != 0 ? threads : std::thread::hardware_concurrency();
+        if(max_threads == 0) max_threads = 1;
+        const size_t workers = std::min(max_threads, file_names.size());
+        const uint32_t file_threads = (uint32_t)std::max<size_t>(1, max_threads / workers);
+        std::atomic<size_t> next_file(0);
+        run_parallel(workers, [&](const size_t) {
+            while(true) {
+                const size_t i = next_file++;
+                if(i >= file_names.size()) break;
+                errors[i] = read_file_mapped(file_names[i], candles[i], file_threads, type_csv);
+            }
+        });
+    }
+}
+
+#endif // MT4_CSV_LOADER_HPP_INCLUDED
@@ -4,8 +4,19 @@
 #include "xquotes_common.hpp"
 #include "banana_filesystem.hpp"
 #include "xtime.hpp"
+#include "mt4-fixed-candles.hpp"
+#include "mt4-common.hpp"
+#include "mt4-storage.hpp"
 #include <functional>
 #include <iostream>
+#include <vector>
+#include <cstring>
+#include <cmath>
+#include <cstdlib>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <algorithm>
 
 namespace mt4_tools {
 
@@ -15,7 +26,313 @@ namespace mt4_tools {
         DUKASCOPY
     };
 
+    static const int CSV_LINE_BUFFER_SIZE = 1024; /**< Размер буфера для одной строки csv файла */
+    static const size_t CSV_CHUNK_SIZE = 16384;     /**< Количество баров в блоке, который форматируется одним потоком */
+    static const size_t CSV_PARALLEL_MIN_BARS = 2 * CSV_CHUNK_SIZE; /**< Меньше баров форматируется в текущем потоке */
+
+    /** \brief Получить строку формата sprintf для строки csv файла
+     * \param decimal_places количество знаков после запятой
+     * \param type_csv Тип csv файла (MT4, MT5, DUKASCOPY)
+     * \return Строка формата
+     */
+    std::string get_sprintf_param(const int decimal_places, const CsvTypes type_csv) {
+        const std::string str_price = "%." + std::to_string(decimal_places) + "f";
+        return
+            // пример MT4: 1971.01.04,00:00,0.53690,0.53690,0.53690,0.53690,1
+            type_csv == CsvTypes::MT4 ? "%.4d.%.2d.%.2d,%.2d:%.2d," + str_price + "," + str_price + "," + str_price + "," + str_price + ",%llu" :
+            /* пример MT5: 2007.02.12	11:36:00	0.90510	0.90510	0.90500	0.90500	4	0	100
+             * спред и реальный объем придется заполнить 0
+             */
+            type_csv == CsvTypes::MT5 ? "%.4d.%.2d.%.2d\t%.2d:%.2d:%.2d\t" + str_price + "\t" + str_price + "\t" + str_price + "\t" + str_price + "\t" + "%llu\t0\t0" :
+            // пример DUKASCOPY: 01.01.2017 00:00:00.000,1150.312,1150.312,1150.312,1150.312,0
+            type_csv == CsvTypes::DUKASCOPY ? "%.2d.%.2d.%.4d %.2d:%.2d:%.2d.000," + str_price + "," + str_price + "," + str_price + "," + str_price + "," + "%f" :
+            "%.4d.%.2d.%.2d,%.2d:%.2d," + str_price + "," + str_price + "," + str_price + "," + str_price + ",%llu";
+    }
+
+    /** \brief Получить объем для строки csv файла MT4 и MT5
+     *
+     * Объем пишется целым без знака на 64 бита, как он хранится в CompactCandles,
+     * иначе объемы больше 2^31 при чтении становятся отрицательными
+     */
+    inline unsigned long long get_csv_volume(const double volume) {
+        return volume > 0 ? (unsigned long long)std::round(volume) : 0ULL;
+    }
+
+    /** \brief Записать бар в буфер как строку csv файла
+     * \param buffer Буфер размером не меньше CSV_LINE_BUFFER_SIZE
+     * \param sprintf_param Строка формата, см. get_sprintf_param
+     * \param candle Бар
+     * \param type_csv Тип csv файла (MT4, MT5, DUKASCOPY)
+     * \return Длина строки без завершающего нуля
+     */
+    int format_candle(
+            char *buffer,
+            const std::string &sprintf_param,
+            const xquotes_common::Candle &candle,
+            const CsvTypes type_csv) {
+        int result = 0;
+        xtime::DateTime date_time(candle.timestamp);
+        switch(type_csv) {
+        case CsvTypes::MT4:
+        default:
+            result = sprintf(
+                buffer,
+                sprintf_param.c_str(),
+                date_time.year,
+                date_time.month,
+                date_time.day,
+                date_time.hour,
+                date_time.minute,
+                candle.open,
+                candle.high,
+                candle.low,
+                candle.close,
+                get_csv_volume(candle.volume));
+            break;
+        case CsvTypes::MT5:
+            result = sprintf(
+                buffer,
+                sprintf_param.c_str(),
+                date_time.year,
+                date_time.month,
+                date_time.day,
+                date_time.hour,
+                date_time.minute,
+                date_time.second,
+                candle.open,
+                candle.high,
+                candle.low,
+                candle.close,
+                get_csv_volume(candle.volume));
+            break;
+        case CsvTypes::DUKASCOPY:
+            result = sprintf(
+                buffer,
+                sprintf_param.c_str(),
+                date_time.day,
+                date_time.month,
+                date_time.year,
+                date_time.hour,
+                date_time.minute,
+                date_time.second,
+                candle.open,
+                candle.high,
+                candle.low,
+                candle.close,
+                candle.volume);
+            break;
+        }
+        return result;
+    }
+
+    /** \brief Записать блок баров в строку
+     * \param output Строка, память которой переиспользуется
+     * \param candles Массив баров
+     * \param begin Индекс первого бара
+     * \param end Индекс за последним баром
+     * \param sprintf_param Строка формата, см. get_sprintf_param
+     * \param type_csv Тип csv файла (MT4, MT5, DUKASCOPY)
+     */
+    template<class CANDLES_TYPE>
+    void format_chunk(
+            std::string &output,
+            const CANDLES_TYPE &candles,
+            const size_t begin,
+            const size_t end,
+            const std::string &sprintf_param,
+            const CsvTypes type_csv) {
+        char buffer[CSV_LINE_BUFFER_SIZE];
+        output.clear();
+        for(size_t i = begin; i < end; ++i) {
+            const int len = format_candle(buffer, sprintf_param, candles[i], type_csv);
+            output.append(buffer, len);
+            output.push_back('\n');
+        }
+    }
+
+    /** \brief Пул потоков форматирования csv
+     *
+     * Потоки создаются при первой параллельной записи и живут до конца программы,
+     * поэтому запись файла не создает и не завершает потоки. Буферы блоков
+     * тоже принадлежат пулу и переиспользуются. Пул выполняет одну запись
+     * за раз, остальные записи ждут на get_job_mutex()
+     */
+    class CsvFormatPool {
+    private:
+        std::vector<std::thread> workers;
+        std::vector<std::string> chunks;        /**< Буферы блоков, память переиспользуется */
+        std::mutex job_mutex;
+        std::mutex mutex;
+        std::condition_variable cv_start;
+        std::condition_variable cv_done;
+        void (*task)(void *data, const size_t index) = nullptr;
+        void *task_data = nullptr;
+        size_t tasks = 0;                       /**< Количество задач текущего вызова run() */
+        size_t next_task = 0;                   /**< Индекс следующей свободной задачи */
+        size_t done_tasks = 0;
+        size_t active_workers = 0;              /**< Сколько потоков пула участвует в текущем вызове run() */
+        bool is_stop = false;
+
+        /** \brief Выполнять задачи, пока они есть
+         *
+         * Вызывается с захваченным mutex, задача выполняется без него
+         */
+        void run_tasks(std::unique_lock<std::mutex> &lock) {
+            while(next_task < tasks) {
+                const size_t index = next_task++;
+                lock.unlock();
+                task(task_data, index);
+                lock.lock();
+                if(++done_tasks == tasks) cv_done.notify_all();
+            }
+        }
+
+        void work(const size_t id) {
+            std::unique_lock<std::mutex> lock(mutex);
+            while(true) {
+                cv_start.wait(lock, [this, id] {
+                    return is_stop || (id < active_workers && next_task < tasks);
+                });
+                if(is_stop) return;
+                run_tasks(lock);
+            }
+        }
+
+    public:
+
+        CsvFormatPool() {};
+
+        CsvFormatPool(const CsvFormatPool&) = delete;
+        CsvFormatPool &operator=(const CsvFormatPool&) = delete;
+
+        ~CsvFormatPool() {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                is_stop = true;
+            }
+            cv_start.notify_all();
+            for(size_t i = 0; i < workers.size(); ++i) {
+                workers[i].join();
+            }
+        }
+
+        /** \brief Мьютекс записи, его нужно держать на время работы с пулом
+         */
+        inline std::mutex &get_job_mutex() {
+            return job_mutex;
+        }
+
+        /** \brief Получить буферы блоков
+         * \param total Количество буферов
+         */
+        std::vector<std::string> &get_chunks(const size_t total) {
+            if(chunks.size() < total) chunks.resize(total);
+            return chunks;
+        }
+
+        /** \brief Выполнить f(0) ... f(total - 1) в threads потоках
+         *
+         * Текущий поток выполняет задачи вместе с потоками пула
+         * и возвращается, когда выполнены все задачи
+         * \param total Количество задач
+         * \param threads Количество потоков вместе с текущим
+         * \param f Функция, принимающая индекс задачи
+         */
+        template<class F>
+        void run(const size_t total, const size_t threads, F &f) {
+            if(total == 0) return;
+            std::unique_lock<std::mutex> lock(mutex);
+            while(workers.size() + 1 < threads) {
+                workers.push_back(std::thread(&CsvFormatPool::work, this, workers.size()));
+            }
+            active_workers = threads - 1;
+            task = [](void *data, const size_t index) {
+                (*(F*)data)(index);
+            };
+            task_data = &f;
+            next_task = 0;
+            done_tasks = 0;
+            tasks = total;
+            cv_start.notify_all();
+            run_tasks(lock);
+            cv_done.wait(lock, [this] {
+                return done_tasks == tasks;
+            });
+            tasks = 0;
+            next_task = 0;
+            task = nullptr;
+            task_data = nullptr;
+        }
+    };
+
+    /** \brief Получить пул потоков, общий для всех записей csv файлов
+     */
+    CsvFormatPool &get_csv_format_pool() {
+        static CsvFormatPool pool;
+        return pool;
+    }
+
+    /** \brief Записать бары в строки блоками по CSV_CHUNK_SIZE
+     *
+     * Блоки форматируются параллельно потоками get_csv_format_pool() и передаются
+     * в функцию по порядку, поэтому результат не зависит от числа потоков.
+     * Меньше CSV_PARALLEL_MIN_BARS баров форматируется в текущем потоке
+     * \param candles Массив баров
+     * \param begin Индекс первого бара
+     * \param end Индекс за последним баром
+     * \param sprintf_param Строка формата, см. get_sprintf_param
+     * \param type_csv Тип csv файла (MT4, MT5, DUKASCOPY)
+     * \param threads Количество потоков форматирования, 0 - по числу ядер
+     * \param f Функция, принимающая очередной блок
+     */
+    template<class CANDLES_TYPE>
+    void format_candles(
+            const CANDLES_TYPE &candles,
+            const size_t begin,
+            const size_t end,
+            const std::string &sprintf_param,
+            const CsvTypes type_csv,
+            const uint32_t threads,
+            const std::function<void(const std::string &chunk)> &f) {
+        if(begin >= end) return;
+        const size_t chunks_total = (end - begin + CSV_CHUNK_SIZE - 1) / CSV_CHUNK_SIZE;
+        size_t max_threads = threads != 0 ? threads : std::thread::hardware_concurrency();
+        max_threads = std::max<size_t>(std::min(max_threads, chunks_total), 1);
+
+        if(max_threads == 1 || (end - begin) < CSV_PARALLEL_MIN_BARS) {
+            /* маленькие файлы форматируем в текущем потоке */
+            std::string chunk;
+            for(size_t chunk_beg = begin; chunk_beg < end; chunk_beg += CSV_CHUNK_SIZE) {
+                format_chunk(chunk, candles, chunk_beg, std::min(end, chunk_beg + CSV_CHUNK_SIZE), sprintf_param, type_csv);
+                f(chunk);
+            }
+            return;
+        }
+
+        CsvFormatPool &pool = get_csv_format_pool();
+        std::lock_guard<std::mutex> job_lock(pool.get_job_mutex());
+        std::vector<std::string> &chunks = pool.get_chunks(max_threads);
+        const size_t round_size = max_threads * CSV_CHUNK_SIZE;
+        for(size_t round_beg = begin; round_beg < end; round_beg += round_size) {
+            const size_t round_chunks = std::min(max_threads, (end - round_beg + CSV_CHUNK_SIZE - 1) / CSV_CHUNK_SIZE);
+            auto format = [&](const size_t c) {
+                const size_t chunk_beg = round_beg + c * CSV_CHUNK_SIZE;
+                format_chunk(chunks[c], candles, chunk_beg, std::min(end, chunk_beg + CSV_CHUNK_SIZE), sprintf_param, type_csv);
+            };
+            pool.run(round_chunks, max_threads, format);
+            for(size_t c = 0; c < round_chunks; ++c) {
+                f(chunks[c]);
+            }
+        }
+    }
+
     /** \brief Записать файл
+     *
+     * Массив баров может быть любым контейнером с методом size() и оператором [],
+     * который возвращает xquotes_common::Candle и может читаться из нескольких потоков.
+     * Бары делятся на блоки по CSV_CHUNK_SIZE, блоки форматируются параллельно
+     * и пишутся в файл по порядку, поэтому файл не зависит от числа потоков.
+     * Прежнее содержимое файла после записанных баров обрезается.
      * \param file_name Имя csv файла, куда запишем данные
      * \param header Заголовок csv файла
      * \param is_write_header Флаг записи заголовка csv файла. Если true, заголовок будет записан
@@ -27,13 +344,17 @@ namespace mt4_tools {
      * \param decimal_places количество знаков после запятой
      * \param f лямбда-функция для получения бара или свечи по метке времени, должна вернуть false в случае завершения
      * Лямбда функция может пропускать запись по своему усмотрению. Для этого достаточно вернуть false.
+     * \param threads Количество потоков форматирования, 0 - по числу ядер
      * \return вернет 0 в случае успеха, иначе см. код ошибок в xquotes_common.hpp
      */
+    template<class CANDLES_TYPE>
     int write_file(
             const std::string &file_name,
             const std::string &header,
-            const std::vector<xquotes_common::Candle> &candles,
-            const CsvTypes type_csv) {
+            const CANDLES_TYPE &candles,
+            const int decimal_places,
+            const CsvTypes type_csv,
+            const uint32_t threads = 0) {
         //std::ofstream file(file_name);
         if(!bf::check_file(file_name)) {
             std::fstream file(file_name, std::ios::out | std::ios::app);
@@ -46,83 +367,570 @@ namespace mt4_tools {
         file.clear();
         file.seekg(0, std::ios::beg);
         file.clear();
-        const int decimal_places = xquotes_common::get_decimal_places(candles);
-        std::string str_price = "%." + std::to_string(decimal_places) + "f";
-        std::string sprintf_param =
-            // пример MT4: 1971.01.04,00:00,0.53690,0.53690,0.53690,0.53690,1
-            type_csv == CsvTypes::MT4 ? "%.4d.%.2d.%.2d,%.2d:%.2d," + str_price + "," + str_price + "," + str_price + "," + str_price + ",%d" :
-            /* пример MT5: 2007.02.12	11:36:00	0.90510	0.90510	0.90500	0.90500	4	0	100
-             * спред и реальный объем придется заполнить 0
-             */
-            type_csv == CsvTypes::MT5 ? "%.4d.%.2d.%.2d\t%.2d:%.2d:%.2d\t" + str_price + "\t" + str_price + "\t" + str_price + "\t" + str_price + "\t" + "%d\t0\t0" :
-            // пример DUKASCOPY: 01.01.2017 00:00:00.000,1150.312,1150.312,1150.312,1150.312,0
-            type_csv == CsvTypes::DUKASCOPY ? "%.2d.%.2d.%.4d %.2d:%.2d:%.2d.000," + str_price + "," + str_price + "," + str_price + "," + str_price + "," + "%f" :
-            "%.4d.%.2d.%.2d,%.2d:%.2d," + str_price + "," + str_price + "," + str_price + "," + str_price + ",%d";
+        const std::string sprintf_param = get_sprintf_param(decimal_places, type_csv);
 
         if(header.size() != 0) file << header << std::endl;
 
-        const int BUFFER_SIZE = 1024;
-        char buffer[BUFFER_SIZE];
-
-        for(size_t i = 0; i < candles.size(); ++i) {
-            xquotes_common::Candle candle = candles[i];
-            xtime::DateTime date_time(candle.timestamp);
-            std::fill(buffer, buffer + BUFFER_SIZE, '\0');
-            switch(type_csv) {
-            case CsvTypes::MT4:
-            default:
-                sprintf(
-                    buffer,
-                    sprintf_param.c_str(),
-                    date_time.year,
-                    date_time.month,
-                    date_time.day,
-                    date_time.hour,
-                    date_time.minute,
-                    candle.open,
-                    candle.high,
-                    candle.low,
-                    candle.close,
-                    (int)candle.volume);
-                break;
-            case CsvTypes::MT5:
-                sprintf(
-                    buffer,
-                    sprintf_param.c_str(),
-                    date_time.year,
-                    date_time.month,
-                    date_time.day,
-                    date_time.hour,
-                    date_time.minute,
-                    date_time.second,
-                    candle.open,
-                    candle.high,
-                    candle.low,
-                    candle.close,
-                    (int)candle.volume);
-                break;
-            case CsvTypes::DUKASCOPY:
-                sprintf(
-                    buffer,
-                    sprintf_param.c_str(),
-                    date_time.day,
-                    date_time.month,
-                    date_time.year,
-                    date_time.hour,
-                    date_time.minute,
-                    date_time.second,
-                    candle.open,
-                    candle.high,
-                    candle.low,
-                    candle.close,
-                    candle.volume);
-                break;
+        /* блоки пишутся по порядку через тот же поток файла, что и раньше построчно */
+        format_candles(candles, 0, candles.size(), sprintf_param, type_csv, threads, [&](const std::string &chunk) {
+            file.write(chunk.data(), chunk.size());
+        });
+        /* файл открыт без обрезки, старый хвост длиннее новых данных нужно удалить */
+        const std::streampos stop_pos = file.tellp();
+        file.close();
+        if(stop_pos < 0 || !mt4_common::truncate_file(file_name, (uint64_t)stop_pos)) {
+            return xquotes_common::FILE_CANNOT_OPENED;
+        }
+        return xquotes_common::OK;
+    }
+
+    /** \brief Перезаписать конец файла
+     *
+     * Строки файла до бара с индексом first_index остаются на месте,
+     * начиная с него бары записываются заново, а лишний хвост файла обрезается.
+     * Если в файле меньше строк, чем first_index, файл будет записан целиком.
+     * \param file_name Имя csv файла
+     * \param header Заголовок csv файла. Если он не пустой, первая строка файла считается заголовком
+     * \param candles Массив баров, соответствующий всему файлу
+     * \param first_index Индекс первого бара, который нужно перезаписать
+     * \param decimal_places количество знаков после запятой
+     * \param type_csv Тип csv файла (MT4, MT5, DUKASCOPY)
+     * \return вернет 0 в случае успеха, иначе см. код ошибок в xquotes_common.hpp
+     */
+    template<class CANDLES_TYPE>
+    int rewrite_file_tail(
+            const std::string &file_name,
+            const std::string &header,
+            const CANDLES_TYPE &candles,
+            const size_t first_index,
+            const int decimal_places,
+            const CsvTypes type_csv) {
+        if(first_index == 0 || !bf::check_file(file_name)) {
+            return write_file(file_name, header, candles, decimal_places, type_csv);
+        }
+        std::fstream file(file_name, std::ios::in | std::ios::out);
+        if(!file.is_open()) {
+            return xquotes_common::FILE_CANNOT_OPENED;
+        }
+
+        /* ищем начало строки с баром first_index */
+        const size_t skip_lines = first_index + (header.size() != 0 ? 1 : 0);
+        size_t lines = 0;
+        std::string line;
+        while(lines < skip_lines && std::getline(file, line)) {
+            ++lines;
+        }
+        if(lines < skip_lines || file.eof()) {
+            file.close();
+            return write_file(file_name, header, candles, decimal_places, type_csv);
+        }
+        const std::streampos start_pos = file.tellg();
+        file.clear();
+        file.seekp(start_pos);
+
+        const std::string sprintf_param = get_sprintf_param(decimal_places, type_csv);
+        char buffer[CSV_LINE_BUFFER_SIZE];
+        for(size_t i = first_index; i < candles.size(); ++i) {
+            format_candle(buffer, sprintf_param, candles[i], type_csv);
+            file << buffer << '\n';
+        }
+        const std::streampos stop_pos = file.tellp();
+        file.close();
+        if(stop_pos < 0 || !mt4_common::truncate_file(file_name, (uint64_t)stop_pos)) {
+            return xquotes_common::FILE_CANNOT_OPENED;
+        }
+        return xquotes_common::OK;
+    }
+
+    /** \brief Окно в конце csv файла
+     */
+    class CsvTail {
+    public:
+        std::vector<uint64_t> offsets;          /**< Смещения строк баров окна в файле, последний элемент - конец файла */
+        xtime::timestamp_t prev_timestamp = 0;  /**< Метка времени бара перед окном, 0 - окно начинается с первого бара */
+        bool is_crlf = false;                   /**< Строки файла завершаются \r\n */
+
+        CsvTail() {};
+    };
+
+    /** \brief Разобрать число из строки csv файла
+     *
+     * Числа до 15 значащих цифр собираются в целое и делятся на степень 10,
+     * что дает тот же результат, что и strtod, но без учета локали и
+     * без чтения за концом строки. Остальные числа разбираются через strtod.
+     * \param ptr Начало числа, после разбора указывает на символ за числом
+     * \param end Конец строки
+     * \param value Число
+     * \return Вернет true, если число разобрано
+     */
+    bool parse_price(const char *&ptr, const char *end, double &value) {
+        static const double pow10[16] = {
+            1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7,
+            1e8, 1e9, 1e10, 1e11, 1e12, 1e13, 1e14, 1e15};
+        const char *start = ptr;
+        const bool is_negative = ptr < end && *ptr == '-';
+        if(ptr < end && (*ptr == '-' || *ptr == '+')) ++ptr;
+        uint64_t mantissa = 0;
+        size_t digits = 0;
+        size_t fraction = 0;
+        bool is_dot = false;
+        while(ptr < end) {
+            const char c = *ptr;
+            if(c >= '0' && c <= '9') {
+                mantissa = mantissa * 10 + (uint64_t)(c - '0');
+                ++digits;
+                if(is_dot) ++fraction;
+            } else
+            if(c == '.' && !is_dot) {
+                is_dot = true;
+            } else break;
+            ++ptr;
+        }
+        if(digits == 0) {
+            ptr = start;
+            return false;
+        }
+        if(digits <= 15 && (ptr >= end || (*ptr != 'e' && *ptr != 'E'))) {
+            value = (double)mantissa / pow10[fraction];
+            if(is_negative) value = -value;
+            return true;
+        }
+        /* длинные числа и экспоненциальная запись, копируем в буфер с нулем в конце */
+        char buffer[64];
+        const char *token_end = start;
+        while(token_end < end && (token_end - start) < 63 && *token_end != ',' && *token_end != '\r' && *token_end != '\n') ++token_end;
+        const size_t length = (size_t)(token_end - start);
+        std::memcpy(buffer, start, length);
+        buffer[length] = '\0';
+        char *next = nullptr;
+        value = std::strtod(buffer, &next);
+        if(next == buffer) {
+            ptr = start;
+            return false;
+        }
+        ptr = start + (next - buffer);
+        return true;
+    }
+
+    /** \brief Разобрать строку csv файла MT4
+     * \param begin Начало строки
+     * \param end Конец строки без символов перевода строки
+     * \param candle Бар
+     * \return Вернет true, если строка содержит бар
+     */
+    bool parse_mt4_line(const char *begin, const char *end, xquotes_common::Candle &candle) {
+        /* 2020.01.02,00:00,1.12100,1.12200,1.12000,1.12150,1234 */
+        if((end - begin) < 17 || begin[4] != '.' || begin[7] != '.' || begin[10] != ',' || begin[13] != ':' || begin[16] != ',') return false;
+        const int pos[12] = {0,1,2,3,5,6,8,9,11,12,14,15};
+        int values[12];
+        for(size_t i = 0; i < 12; ++i) {
+            values[i] = begin[pos[i]] - '0';
+            if(values[i] < 0 || values[i] > 9) return false;
+        }
+        candle.timestamp = xtime::get_timestamp(
+            values[6] * 10 + values[7],
+            values[4] * 10 + values[5],
+            values[0] * 1000 + values[1] * 100 + values[2] * 10 + values[3],
+            values[8] * 10 + values[9],
+            values[10] * 10 + values[11],
+            0);
+        const char *ptr = begin + 17;
+        double *prices[5] = {&candle.open, &candle.high, &candle.low, &candle.close, &candle.volume};
+        for(size_t i = 0; i < 5; ++i) {
+            if(!parse_price(ptr, end, *prices[i])) return false;
+            if(ptr < end && *ptr == ',') ++ptr;
+        }
+        return true;
+    }
+
+    /** \brief Разобрать цены бара, разделенные символом delimiter
+     * \param ptr Начало первой цены
+     * \param end Конец строки
+     * \param delimiter Разделитель
+     * \param candle Бар
+     * \return Вернет true, если разобраны все цены и объем
+     */
+    bool parse_prices(const char *ptr, const char *end, const char delimiter, xquotes_common::Candle &candle) {
+        double *prices[5] = {&candle.open, &candle.high, &candle.low, &candle.close, &candle.volume};
+        for(size_t i = 0; i < 5; ++i) {
+            if(!parse_price(ptr, end, *prices[i])) return false;
+            if(ptr < end && *ptr == delimiter) ++ptr;
+        }
+        return true;
+    }
+
+    /** \brief Разобрать строку csv файла MT5
+     *
+     * Разделителем может быть табуляция или запятая. Время может отсутствовать
+     * (дневные бары) или быть без секунд. Из трех последних столбцов
+     * (тиковый объем, реальный объем, спред) берется тиковый объем.
+     * \param begin Начало строки
+     * \param end Конец строки без символов перевода строки
+     * \param candle Бар
+     * \return Вернет true, если строка содержит бар
+     */
+    bool parse_mt5_line(const char *begin, const char *end, xquotes_common::Candle &candle) {
+        /* 2007.02.12	11:36:00	0.90510	0.90510	0.90500	0.90500	4	0	100 */
+        if((end - begin) < 11 || begin[4] != '.' || begin[7] != '.' || (begin[10] != '\t' && begin[10] != ',')) return false;
+        const char delimiter = begin[10];
+        const int pos[8] = {0,1,2,3,5,6,8,9};
+        int values[14] = {0};
+        for(size_t i = 0; i < 8; ++i) {
+            values[i] = begin[pos[i]] - '0';
+            if(values[i] < 0 || values[i] > 9) return false;
+        }
+        const char *ptr = begin + 11;
+        if((end - ptr) >= 6 && ptr[2] == ':') {
+            const bool is_seconds = (end - ptr) >= 9 && ptr[5] == ':';
+            const size_t length = is_seconds ? 8 : 5;
+            const int time_pos[6] = {0,1,3,4,6,7};
+            for(size_t i = 0; i < (is_seconds ? 6 : 4); ++i) {
+                values[8 + i] = ptr[time_pos[i]] - '0';
+                if(values[8 + i] < 0 || values[8 + i] > 9) return false;
+            }
+            if(ptr[length] != delimiter) return false;
+            ptr += length + 1;
+        }
+        candle.timestamp = xtime::get_timestamp(
+            values[6] * 10 + values[7],
+            values[4] * 10 + values[5],
+            values[0] * 1000 + values[1] * 100 + values[2] * 10 + values[3],
+            values[8] * 10 + values[9],
+            values[10] * 10 + values[11],
+            values[12] * 10 + values[13]);
+        return parse_prices(ptr, end, delimiter, candle);
+    }
+
+    /** \brief Разобрать строку csv файла DUKASCOPY
+     * \param begin Начало строки
+     * \param end Конец строки без символов перевода строки
+     * \param candle Бар
+     * \return Вернет true, если строка содержит бар
+     */
+    bool parse_dukascopy_line(const char *begin, const char *end, xquotes_common::Candle &candle) {
+        /* 01.01.2017 00:00:00.000,1150.312,1150.312,1150.312,1150.312,0 */
+        if((end - begin) < 20 || begin[2] != '.' || begin[5] != '.' || begin[10] != ' ' || begin[13] != ':' || begin[16] != ':') return false;
+        const int pos[14] = {0,1,3,4,6,7,8,9,11,12,14,15,17,18};
+        int values[14];
+        for(size_t i = 0; i < 14; ++i) {
+            values[i] = begin[pos[i]] - '0';
+            if(values[i] < 0 || values[i] > 9) return false;
+        }
+        candle.timestamp = xtime::get_timestamp(
+            values[0] * 10 + values[1],
+            values[2] * 10 + values[3],
+            values[4] * 1000 + values[5] * 100 + values[6] * 10 + values[7],
+            values[8] * 10 + values[9],
+            values[10] * 10 + values[11],
+            values[12] * 10 + values[13]);
+        /* миллисекунды не используются */
+        const char *ptr = (const char*)std::memchr(begin + 19, ',', end - begin - 19);
+        if(ptr == nullptr) return false;
+        return parse_prices(ptr + 1, end, ',', candle);
+    }
+
+    /** \brief Разобрать строку csv файла заданного типа
+     * \param begin Начало строки
+     * \param end Конец строки без символов перевода строки
+     * \param candle Бар
+     * \param type_csv Тип csv файла (MT4, MT5, DUKASCOPY)
+     * \return Вернет true, если строка содержит бар
+     */
+    inline bool parse_csv_line(const char *begin, const char *end, xquotes_common::Candle &candle, const CsvTypes type_csv) {
+        switch(type_csv) {
+        case CsvTypes::MT5:
+            return parse_mt5_line(begin, end, candle);
+        case CsvTypes::DUKASCOPY:
+            return parse_dukascopy_line(begin, end, candle);
+        case CsvTypes::MT4:
+        default:
+            return parse_mt4_line(begin, end, candle);
+        }
+    }
+
+    /** \brief Прочитать последний бар csv файла MT4
+     * \param file_name Имя csv файла
+     * \param candle Последний бар
+     * \return вернет 0 в случае успеха, иначе см. код ошибок в xquotes_common.hpp
+     */
+    int read_last_candle(const std::string &file_name, xquotes_common::Candle &candle) {
+        std::ifstream file(file_name, std::ios::in | std::ios::binary);
+        if(!file.is_open()) return xquotes_common::FILE_CANNOT_OPENED;
+        file.seekg(0, std::ios::end);
+        const uint64_t file_size = (uint64_t)file.tellg();
+        const uint64_t start = file_size > (uint64_t)CSV_LINE_BUFFER_SIZE ? file_size - CSV_LINE_BUFFER_SIZE : 0;
+        std::vector<char> buffer((size_t)(file_size - start));
+        file.seekg((std::streamoff)start, std::ios::beg);
+        file.read(buffer.data(), buffer.size());
+        const char *begin = buffer.data();
+        const char *end = begin + (size_t)file.gcount();
+        while(end > begin) {
+            /* идем по строкам с конца */
+            while(end > begin && (end[-1] == '\n' || end[-1] == '\r')) --end;
+            const char *line = end;
+            while(line > begin && line[-1] != '\n') --line;
+            if(line == begin && start != 0) break;
+            if(parse_mt4_line(line, end, candle)) return xquotes_common::OK;
+            end = line;
+        }
+        return xquotes_common::DATA_NOT_AVAILABLE;
+    }
+
+    /** \brief Прочитать конец csv файла MT4, начиная с заданной метки времени
+     *
+     * Файл читается блоками с конца, пока не встретится бар старше timestamp_beg,
+     * поэтому память и время чтения зависят от размера окна, а не всего файла.
+     * \param file_name Имя csv файла
+     * \param timestamp_beg Метка времени первого бара окна
+     * \param candles Бары окна
+     * \param tail Смещения строк окна для последующей перезаписи
+     * \return вернет 0 в случае успеха, иначе см. код ошибок в xquotes_common.hpp
+     */
+    template<class CANDLES_TYPE>
+    int read_file_tail(
+            const std::string &file_name,
+            const xtime::timestamp_t timestamp_beg,
+            CANDLES_TYPE &candles,
+            CsvTail &tail) {
+        static const uint64_t BLOCK_SIZE = 65536;
+        std::ifstream file(file_name, std::ios::in | std::ios::binary);
+        if(!file.is_open()) return xquotes_common::FILE_CANNOT_OPENED;
+        file.seekg(0, std::ios::end);
+        const uint64_t file_size = (uint64_t)file.tellg();
+        tail = CsvTail();
+
+        /* читаем блоки с конца, пока первая целая строка не окажется старше окна */
+        std::vector<char> buffer;
+        uint64_t start = file_size;
+        while(start > 0) {
+            const uint64_t block_start = start > BLOCK_SIZE ? start - BLOCK_SIZE : 0;
+            buffer.insert(buffer.begin(), (size_t)(start - block_start), 0);
+            file.seekg((std::streamoff)block_start, std::ios::beg);
+            file.read(buffer.data(), (std::streamsize)(start - block_start));
+            if((uint64_t)file.gcount() != start - block_start) return xquotes_common::FILE_CANNOT_OPENED;
+            start = block_start;
+            if(start == 0) break;
+            const char *begin = buffer.data();
+            const char *end = begin + buffer.size();
+            const char *line = (const char*)std::memchr(begin, '\n', end - begin);
+            if(line == nullptr) continue;
+            ++line;
+            const char *line_end = (const char*)std::memchr(line, '\n', end - line);
+            if(line_end == nullptr) continue;
+            xquotes_common::Candle candle;
+            if(parse_mt4_line(line, line_end > line && line_end[-1] == '\r' ? line_end - 1 : line_end, candle) &&
+                candle.timestamp < timestamp_beg) break;
+        }
+
+        /* разбираем строки окна */
+        const char *begin = buffer.data();
+        const char *end = begin + buffer.size();
+        const char *line = begin;
+        if(start != 0) {
+            line = (const char*)std::memchr(begin, '\n', end - begin);
+            line = line == nullptr ? end : line + 1;
+        }
+        while(line < end) {
+            const char *line_end = (const char*)std::memchr(line, '\n', end - line);
+            if(line_end == nullptr) line_end = end;
+            const char *text_end = line_end;
+            if(text_end > line && text_end[-1] == '\r') {
+                --text_end;
+                tail.is_crlf = true;
             }
-            std::string line(buffer);
-            file << line << std::endl;
+            xquotes_common::Candle candle;
+            if(parse_mt4_line(line, text_end, candle)) {
+                if(candle.timestamp < timestamp_beg) {
+                    tail.prev_timestamp = candle.timestamp;
+                } else {
+                    if(!candles.push_back(candle)) return xquotes_common::INVALID_PARAMETER;
+                    tail.offsets.push_back(start + (uint64_t)(line - begin));
+                }
+            }
+            line = line_end + 1;
+        }
+        tail.offsets.push_back(file_size);
+        return xquotes_common::OK;
+    }
+
+    /** \brief Перезаписать конец файла, прочитанного через read_file_tail
+     *
+     * В отличие от rewrite_file_tail, файл не читается с начала:
+     * запись начинается со смещения строки бара first_index из окна.
+     * \param file_name Имя csv файла
+     * \param tail Смещения строк окна
+     * \param candles Бары окна после изменения
+     * \param first_index Индекс первого бара окна, который нужно перезаписать
+     * \param decimal_places количество знаков после запятой
+     * \param type_csv Тип csv файла (MT4, MT5, DUKASCOPY)
+     * \return вернет 0 в случае успеха, иначе см. код ошибок в xquotes_common.hpp
+     */
+    template<class CANDLES_TYPE>
+    int rewrite_file_tail(
+            const std::string &file_name,
+            const CsvTail &tail,
+            const CANDLES_TYPE &candles,
+            const size_t first_index,
+            const int decimal_places,
+            const CsvTypes type_csv) {
+        if(first_index >= tail.offsets.size()) return xquotes_common::INVALID_PARAMETER;
+        std::fstream file(file_name, std::ios::in | std::ios::out | std::ios::binary);
+        if(!file.is_open()) {
+            return xquotes_common::FILE_CANNOT_OPENED;
         }
+        file.seekp((std::streamoff)tail.offsets[first_index], std::ios::beg);
+        const std::string sprintf_param = get_sprintf_param(decimal_places, type_csv);
+        char buffer[CSV_LINE_BUFFER_SIZE];
+        for(size_t i = first_index; i < candles.size(); ++i) {
+            int len = format_candle(buffer, sprintf_param, candles[i], type_csv);
+            if(tail.is_crlf) buffer[len++] = '\r';
+            buffer[len++] = '\n';
+            file.write(buffer, len);
+        }
+        const std::streampos stop_pos = file.tellp();
         file.close();
+        if(stop_pos < 0 || !mt4_common::truncate_file(file_name, (uint64_t)stop_pos)) {
+            return xquotes_common::FILE_CANNOT_OPENED;
+        }
+        return xquotes_common::OK;
+    }
+
+    /** \brief Перезаписать конец файла через асинхронное хранилище
+     *
+     * То же, что rewrite_file_tail для окна CsvTail, но строки форматируются
+     * в память и ставятся в очередь хранилища вместе с обрезкой файла.
+     * Запись завершится после AsyncStorage::submit() и AsyncStorage::wait()
+     * \param storage Хранилище
+     * \param file_name Имя csv файла
+     * \param tail Смещения строк окна
+     * \param candles Бары окна после изменения
+     * \param first_index Индекс первого бара окна, который нужно перезаписать
+     * \param decimal_places количество знаков после запятой
+     * \param type_csv Тип csv файла (MT4, MT5, DUKASCOPY)
+     * \return вернет 0 в случае успеха, иначе см. код ошибок в xquotes_common.hpp
+     */
+    template<class CANDLES_TYPE>
+    int rewrite_file_tail(
+            AsyncStorage &storage,
+            const std::string &file_name,
+            const CsvTail &tail,
+            const CANDLES_TYPE &candles,
+            const size_t first_index,
+            const int decimal_places,
+            const CsvTypes type_csv) {
+        if(first_index >= tail.offsets.size()) return xquotes_common::INVALID_PARAMETER;
+        const uint64_t offset = tail.offsets[first_index];
+        const std::string sprintf_param = get_sprintf_param(decimal_places, type_csv);
+        std::string data;
+        char buffer[CSV_LINE_BUFFER_SIZE];
+        for(size_t i = first_index; i < candles.size(); ++i) {
+            int len = format_candle(buffer, sprintf_param, candles[i], type_csv);
+            if(tail.is_crlf) buffer[len++] = '\r';
+            buffer[len++] = '\n';
+            data.append(buffer, len);
+        }
+        if(!storage.write(file_name, offset, data) ||
+            !storage.truncate(file_name, offset + data.size())) {
+            return xquotes_common::FILE_CANNOT_OPENED;
+        }
+        return xquotes_common::OK;
+    }
+
+    /** \brief Перезаписать конец файла через асинхронное хранилище
+     *
+     * То же, что rewrite_file_tail с заголовком: начало строки first_index
+     * ищется чтением файла, а новые строки ставятся в очередь хранилища.
+     * Если в файле меньше строк, чем first_index, файл будет записан целиком.
+     * \param storage Хранилище
+     * \param file_name Имя csv файла
+     * \param header Заголовок csv файла. Если он не пустой, первая строка файла считается заголовком
+     * \param candles Массив баров, соответствующий всему файлу
+     * \param first_index Индекс первого бара, который нужно перезаписать
+     * \param decimal_places количество знаков после запятой
+     * \param type_csv Тип csv файла (MT4, MT5, DUKASCOPY)
+     * \param threads Количество потоков форматирования, 0 - по числу ядер
+     * \return вернет 0 в случае успеха, иначе см. код ошибок в xquotes_common.hpp
+     */
+    template<class CANDLES_TYPE>
+    int rewrite_file_tail(
+            AsyncStorage &storage,
+            const std::string &file_name,
+            const std::string &header,
+            const CANDLES_TYPE &candles,
+            const size_t first_index,
+            const int decimal_places,
+            const CsvTypes type_csv,
+            const uint32_t threads = 0) {
+        uint64_t offset = 0;
+        size_t begin = 0;
+        std::string data;
+        if(first_index != 0 && bf::check_file(file_name)) {
+            std::ifstream file(file_name, std::ios::in | std::ios::binary);
+            if(!file.is_open()) {
+                return xquotes_common::FILE_CANNOT_OPENED;
+            }
+            /* ищем начало строки с баром first_index */
+            const size_t skip_lines = first_index + (header.size() != 0 ? 1 : 0);
+            size_t lines = 0;
+            std::string line;
+            while(lines < skip_lines && std::getline(file, line)) {
+                ++lines;
+            }
+            if(lines == skip_lines && !file.eof()) {
+                offset = (uint64_t)file.tellg();
+                begin = first_index;
+            }
+        }
+        if(begin == 0 && header.size() != 0) data = header + "\n";
+        const std::string sprintf_param = get_sprintf_param(decimal_places, type_csv);
+        format_candles(candles, begin, candles.size(), sprintf_param, type_csv, threads, [&](const std::string &chunk) {
+            data += chunk;
+        });
+        if(!storage.write(file_name, offset, data) ||
+            !storage.truncate(file_name, offset + data.size())) {
+            return xquotes_common::FILE_CANNOT_OPENED;
+        }
         return xquotes_common::OK;
     }
+
+    /** \brief Записать файл
+     *
+     * Количество знаков после запятой определяется по ценам баров
+     * \param file_name Имя csv файла, куда запишем данные
+     * \param header Заголовок csv файла
+     * \param candles Массив баров
+     * \param type_csv Тип csv файла (MT4, MT5, DUKASCOPY)
+     * \param threads Количество потоков форматирования, 0 - по числу ядер
+     * \return вернет 0 в случае успеха, иначе см. код ошибок в xquotes_common.hpp
+     */
+    int write_file(
+            const std::string &file_name,
+            const std::string &header,
+            const std::vector<xquotes_common::Candle> &candles,
+            const CsvTypes type_csv,
+            const uint32_t threads = 0) {
+        const int decimal_places = xquotes_common::get_decimal_places(candles);
+        return write_file(file_name, header, candles, decimal_places, type_csv, threads);
+    }
+
+    /** \brief Записать файл
+     *
+     * Цены записываются с точностью, с которой они хранятся в массиве
+     * \param file_name Имя csv файла, куда запишем данные
+     * \param header Заголовок csv файла
+     * \param candles Компактный массив баров
+     * \param type_csv Тип csv файла (MT4, MT5, DUKASCOPY)
+     * \param threads Количество потоков форматирования, 0 - по числу ядер
+     * \return вернет 0 в случае успеха, иначе см. код ошибок в xquotes_common.hpp
+     */
+    template<class PRICE_TYPE, class VOLUME_TYPE>
+    int write_file(
+            const std::string &file_name,
+            const std::string &header,
+            const FixedCandles<PRICE_TYPE, VOLUME_TYPE> &candles,
+            const CsvTypes type_csv,
+            const uint32_t threads = 0) {
+        return write_file(file_name, header, candles, (int)candles.get_digits(), type_csv, threads);
+    }
 };
 #endif // MT4-CSV_HPP_INCLUDED
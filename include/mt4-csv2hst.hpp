@@ -0,0 +1,202 @@
+#ifndef MT4_CSV2HST_HPP_INCLUDED
+#define MT4_CSV2HST_HPP_INCLUDED
+
+#include "mt4-csv.hpp"
+#include "mt4-csv-loader.hpp"
+#include "mt4-hst.hpp"
+#include "mt4-common.hpp"
+#include "banana_filesystem.hpp"
+#include <iostream>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <chrono>
+#include <cctype>
+
+namespace mt4_tools {
+
+    /** \brief Класс для перевода папок csv файлов в hst файлы
+     *
+     * Файлы распределяются по потокам, каждый файл читается через отображение
+     * в память и записывается в hst файлы всех терминалов одним блоком.
+     * Если файлов меньше, чем потоков, файл дополнительно разбирается по частям.
+     */
+    class CsvToHstConverter {
+    public:
+
+        /** \brief Параметры перевода
+         */
+        class Config {
+        public:
+            std::vector<std::string> paths_csv;             /**< Папки или отдельные csv файлы */
+            std::vector<std::string> paths_hst;
+            std::vector<mt4_common::SymbolConfig> symbols;  /**< Точность символов, остальные символы получают точность по ценам */
+            std::string symbol_csv_suffix;
+            std::string symbol_hst_suffix;
+            CsvTypes type_csv = CsvTypes::MT4;
+            HstVersions hst_version = HstVersions::V400;
+            uint32_t period = 0;            /**< Период в минутах, 0 - по шагу баров файла */
+            uint32_t threads = 0;           /**< Количество потоков, 0 - по числу ядер */
+            bool is_recursive = false;      /**< Искать файлы во вложенных папках */
+
+            Config() {};
+        };
+
+        /** \brief Статистика перевода
+         */
+        class Stats {
+        public:
+            size_t files = 0;
+            size_t candles = 0;
+            size_t errors = 0;
+            double seconds = 0;
+
+            Stats() {};
+        };
+
+        /** \brief Получить имя символа по имени csv файла
+         *
+         * Из имени убираются папка, расширение, период и суффикс, например
+         * data/EURUSD1440.csv с периодом 1440 - EURUSD, а data/SYM01.csv
+         * с периодом 1 остается SYM01
+         * \param file_name Имя csv файла
+         * \param period Период в минутах
+         * \param symbol_csv_suffix Суффикс имени символа в csv файле
+         * \return Имя символа
+         */
+        static std::string get_symbol(const std::string &file_name, const uint32_t period, const std::string &symbol_csv_suffix) {
+            const size_t slash = file_name.find_last_of("/\\");
+            std::string symbol = slash == std::string::npos ? file_name : file_name.substr(slash + 1);
+            const size_t dot = symbol.find_last_of('.');
+            if(dot != std::string::npos && dot != 0) symbol.resize(dot);
+            /* период убирается, только если все цифры в конце имени равны ему */
+            size_t digits_pos = symbol.size();
+            while(digits_pos > 0 && std::isdigit((unsigned char)symbol[digits_pos - 1])) --digits_pos;
+            if(period != 0 && digits_pos != 0 && symbol.substr(digits_pos) == std::to_string(period)) {
+                symbol.resize(digits_pos);
+            }
+            if(symbol_csv_suffix.size() != 0 && symbol.size() > symbol_csv_suffix.size() &&
+                symbol.compare(symbol.size() - symbol_csv_suffix.size(), symbol_csv_suffix.size(), symbol_csv_suffix) == 0) {
+                symbol.resize(symbol.size() - symbol_csv_suffix.size());
+            }
+            return symbol;
+        }
+
+        /** \brief Получить период баров по наименьшему шагу между ними
+         * \param candles Бары
+         * \return Период в минутах или 0, если в файле меньше двух баров
+         */
+        static uint32_t get_period(const std::vector<xquotes_common::Candle> &candles) {
+            xtime::timestamp_t step = 0;
+            for(size_t i = 1; i < candles.size(); ++i) {
+                if(candles[i].timestamp <= candles[i - 1].timestamp) continue;
+                const xtime::timestamp_t diff = candles[i].timestamp - candles[i - 1].timestamp;
+                if(step == 0 || diff < step) step = diff;
+            }
+            return (uint32_t)(step / xtime::SECONDS_IN_MINUTE);
+        }
+
+        /** \brief Получить список csv файлов
+         * \param config Параметры перевода
+         * \param file_names Имена csv файлов
+         */
+        static void get_files(const Config &config, std::vector<std::string> &file_names) {
+            auto is_csv = [](const std::string &name) -> bool {
+                if(name.size() < 4) return false;
+                std::string extension = name.substr(name.size() - 4);
+                for(size_t c = 0; c < extension.size(); ++c) {
+                    extension[c] = (char)std::tolower((unsigned char)extension[c]);
+                }
+                return extension == ".csv";
+            };
+            file_names.clear();
+            for(size_t i = 0; i < config.paths_csv.size(); ++i) {
+                const std::string &path = config.paths_csv[i];
+                if(is_csv(path)) {
+                    file_names.push_back(path);
+                    continue;
+                }
+                std::vector<std::string> list;
+                bf::get_list_files(path, std::vector<std::string>(), list, config.is_recursive);
+                for(size_t n = 0; n < list.size(); ++n) {
+                    if(is_csv(list[n])) file_names.push_back(list[n]);
+                }
+            }
+            std::sort(file_names.begin(), file_names.end());
+            file_names.erase(std::unique(file_names.begin(), file_names.end()), file_names.end());
+        }
+
+        /** \brief Перевести csv файлы
+         * \param config Параметры перевода
+         * \param stats Статистика перевода
+         * \return вернет 0 в случае успеха, DATA_NOT_AVAILABLE если csv файлы не найдены
+         */
+        int run(const Config &config, Stats &stats) {
+            const auto time_start = std::chrono::steady_clock::now();
+            stats = Stats();
+            std::vector<std::string> file_names;
+            get_files(config, file_names);
+            if(file_names.empty()) return xquotes_common::DATA_NOT_AVAILABLE;
+
+            uint32_t threads = config.threads != 0 ? config.threads : std::thread::hardware_concurrency();
+            if(threads == 0) threads = 1;
+            const size_t workers = std::min<size_t>(threads, file_names.size());
+            const uint32_t file_threads = (uint32_t)std::max<size_t>(1, threads / workers);
+
+            std::atomic<size_t> next_file(0);
+            std::atomic<size_t> total_files(0);
+            std::atomic<size_t> total_candles(0);
+            std::atomic<size_t> total_errors(0);
+            std::mutex log_mutex;
+
+            run_parallel(workers, [&](const size_t) {
+                std::vector<xquotes_common::Candle> candles;
+                while(true) {
+                    const size_t i = next_file++;
+                    if(i >= file_names.size()) break;
+                    const std::string &file_name = file_names[i];
+                    const int err_csv = read_file_mapped(file_name, candles, file_threads, config.type_csv);
+                    if(err_csv != xquotes_common::OK || candles.empty()) {
+                        std::lock_guard<std::mutex> lock(log_mutex);
+                        std::cout << "error read csv file " << file_name << ", code: " << err_csv << std::endl;
+                        ++total_errors;
+                        continue;
+                    }
+                    const uint32_t period = config.period != 0 ? config.period : get_period(candles);
+                    if(period == 0) {
+                        std::lock_guard<std::mutex> lock(log_mutex);
+                        std::cout << "error get period of csv file " << file_name << std::endl;
+                        ++total_errors;
+                        continue;
+                    }
+                    const std::string symbol = get_symbol(file_name, period, config.symbol_csv_suffix);
+                    int digits = -1;
+                    for(size_t s = 0; s < config.symbols.size(); ++s) {
+                        if(config.symbols[s].symbol == symbol) {
+                            digits = (int)config.symbols[s].digits;
+                            break;
+                        }
+                    }
+                    if(digits < 0) digits = xquotes_common::get_decimal_places(candles);
+                    MqlHstGroup hst(symbol + config.symbol_hst_suffix, config.paths_hst, period, digits, 0, nullptr, config.hst_version);
+                    if(!hst.write_candles(candles, 0, candles.size())) {
+                        std::lock_guard<std::mutex> lock(log_mutex);
+                        std::cout << "error write hst file " << symbol << config.symbol_hst_suffix << period << ".hst" << std::endl;
+                        ++total_errors;
+                        continue;
+                    }
+                    ++total_files;
+                    total_candles += candles.size();
+                }
+            });
+
+            stats.files = total_files;
+            stats.candles = total_candles;
+            stats.errors = total_errors;
+            stats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - time_start).count();
+            return xquotes_common::OK;
+        }
+    };
+}
+
+#endif // MT4_CSV2HST_HPP_INCLUDED
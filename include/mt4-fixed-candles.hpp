@@ -0,0 +1,334 @@
+#ifndef MT4_FIXED_CANDLES_HPP_INCLUDED
+#define MT4_FIXED_CANDLES_HPP_INCLUDED
+
+#include "xquotes_common.hpp"
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <iterator>
+#include <cstddef>
+
+namespace mt4_tools {
+
+    /** \brief Компактный массив баров с ценами в фиксированной точке
+     *
+     * Цены хранятся как целые числа, умноженные на 10^digits, а каждое поле
+     * бара лежит в отдельном массиве (structure-of-arrays). Бар с ценами int32
+     * и объемом uint64 занимает 32 байта вместо 48 байт у xquotes_common::Candle,
+     * а проход по одному полю истории идет по непрерывной памяти.
+     * Для цены, записанной не более чем с digits знаками после запятой,
+     * преобразование туда и обратно дает то же самое число double.
+     * Цены с большим числом знаков округляются до digits, а объем - до целого,
+     * поэтому в hst файл попадают уже округленные значения.
+     * С ценами int32 при digits = 5 помещаются цены до 21474.83647,
+     * для дорогих инструментов нужно уменьшить digits
+     */
+    template<class PRICE_TYPE = int32_t, class VOLUME_TYPE = uint64_t>
+    class FixedCandles {
+    private:
+        std::vector<xtime::timestamp_t> timestamps;
+        std::vector<PRICE_TYPE> opens;
+        std::vector<PRICE_TYPE> highs;
+        std::vector<PRICE_TYPE> lows;
+        std::vector<PRICE_TYPE> closes;
+        std::vector<VOLUME_TYPE> volumes;
+        uint32_t digits = 5;
+        double scale = 100000.0;
+
+        /* max() + 1 - степень двойки и точно представима в double, в отличие от max() для 64-битных типов */
+        inline bool to_fixed(const double value, PRICE_TYPE &out) const {
+            const double temp = std::round(value * scale);
+            if(!(temp < (double)std::numeric_limits<PRICE_TYPE>::max() + 1.0 &&
+                 temp >= (double)std::numeric_limits<PRICE_TYPE>::lowest())) return false;
+            out = (PRICE_TYPE)temp;
+            return true;
+        }
+
+        inline bool to_fixed_volume(const double value, VOLUME_TYPE &out) const {
+            const double temp = std::round(value);
+            if(!(temp < (double)std::numeric_limits<VOLUME_TYPE>::max() + 1.0 &&
+                 temp >= (double)std::numeric_limits<VOLUME_TYPE>::lowest())) return false;
+            out = (VOLUME_TYPE)temp;
+            return true;
+        }
+
+        inline double to_double(const PRICE_TYPE value) const {
+            /* деление, а не умножение на 1/scale, дает ближайшее к десятичной записи число */
+            return (double)value / scale;
+        }
+
+    public:
+
+        /** \brief Итератор, возвращающий бары по значению
+         */
+        class const_iterator {
+        public:
+            typedef std::input_iterator_tag iterator_category;
+            typedef xquotes_common::Candle value_type;
+            typedef std::ptrdiff_t difference_type;
+            typedef const xquotes_common::Candle *pointer;
+            typedef xquotes_common::Candle reference;
+
+        private:
+            const FixedCandles *candles = nullptr;
+            size_t index = 0;
+        public:
+            const_iterator() {};
+            const_iterator(const FixedCandles *user_candles, const size_t user_index) :
+                candles(user_candles), index(user_index) {};
+
+            inline xquotes_common::Candle operator*() const {
+                return (*candles)[index];
+            }
+
+            inline const_iterator &operator++() {
+                ++index;
+                return *this;
+            }
+
+            inline const_iterator operator++(int) {
+                const_iterator temp(*this);
+                ++index;
+                return temp;
+            }
+
+            inline bool operator==(const const_iterator &other) const {
+                return index == other.index && candles == other.candles;
+            }
+
+            inline bool operator!=(const const_iterator &other) const {
+                return !(*this == other);
+            }
+        };
+
+        FixedCandles(const uint32_t user_digits = 5) {
+            set_digits(user_digits);
+        };
+
+        /** \brief Установить количество знаков после запятой
+         *
+         * Менять точность можно только у пустого массива
+         * \param user_digits Количество знаков после запятой
+         * \return Вернет false, если массив не пуст
+         */
+        bool set_digits(const uint32_t user_digits) {
+            if(!timestamps.empty()) return false;
+            digits = user_digits;
+            scale = std::pow(10.0, (double)digits);
+            return true;
+        }
+
+        inline uint32_t get_digits() const {
+            return digits;
+        }
+
+        /** \brief Проверить, что цены бара помещаются в PRICE_TYPE при данной точности
+         * \param candle Бар
+         * \return Вернет true, если цены можно сохранить без переполнения
+         */
+        inline bool check_prices(const xquotes_common::Candle &candle) const {
+            PRICE_TYPE temp = 0;
+            return  to_fixed(candle.open, temp) &&
+                    to_fixed(candle.high, temp) &&
+                    to_fixed(candle.low, temp) &&
+                    to_fixed(candle.close, temp);
+        }
+
+        /** \brief Проверить, что объем бара помещается в VOLUME_TYPE
+         * \param candle Бар
+         * \return Вернет true, если объем можно сохранить без переполнения
+         */
+        inline bool check_volume(const xquotes_common::Candle &candle) const {
+            VOLUME_TYPE temp = 0;
+            return to_fixed_volume(candle.volume, temp);
+        }
+
+        /** \brief Проверить, что бар можно сохранить без переполнения
+         * \param candle Бар
+         * \return Вернет true, если цены и объем помещаются в PRICE_TYPE и VOLUME_TYPE
+         */
+        inline bool check_candle(const xquotes_common::Candle &candle) const {
+            return check_prices(candle) && check_volume(candle);
+        }
+
+        /** \brief Добавить бар в конец массива
+         * \param candle Бар
+         * \return Вернет false, если цена не помещается в PRICE_TYPE при данной точности или объем в VOLUME_TYPE
+         */
+        bool push_back(const xquotes_common::Candle &candle) {
+            if(!check_candle(candle)) return false;
+            timestamps.push_back(candle.timestamp);
+            opens.push_back(PRICE_TYPE());
+            highs.push_back(PRICE_TYPE());
+            lows.push_back(PRICE_TYPE());
+            closes.push_back(PRICE_TYPE());
+            volumes.push_back(VOLUME_TYPE());
+            set(timestamps.size() - 1, candle);
+            return true;
+        }
+
+        /** \brief Заменить бар
+         * \param index Индекс бара
+         * \param candle Бар
+         * \return Вернет false, если цена не помещается в PRICE_TYPE при данной точности или объем в VOLUME_TYPE
+         */
+        bool set(const size_t index, const xquotes_common::Candle &candle) {
+            if(!check_candle(candle)) return false;
+            timestamps[index] = candle.timestamp;
+            to_fixed(candle.open, opens[index]);
+            to_fixed(candle.high, highs[index]);
+            to_fixed(candle.low, lows[index]);
+            to_fixed(candle.close, closes[index]);
+            to_fixed_volume(candle.volume, volumes[index]);
+            return true;
+        }
+
+        inline xquotes_common::Candle operator[](const size_t index) const {
+            xquotes_common::Candle candle(
+                to_double(opens[index]),
+                to_double(highs[index]),
+                to_double(lows[index]),
+                to_double(closes[index]),
+                timestamps[index]);
+            candle.volume = (double)volumes[index];
+            return candle;
+        }
+
+        inline xquotes_common::Candle front() const {
+            return (*this)[0];
+        }
+
+        inline xquotes_common::Candle back() const {
+            return (*this)[timestamps.size() - 1];
+        }
+
+        inline const_iterator begin() const {
+            return const_iterator(this, 0);
+        }
+
+        inline const_iterator end() const {
+            return const_iterator(this, timestamps.size());
+        }
+
+        inline size_t size() const {
+            return timestamps.size();
+        }
+
+        inline bool empty() const {
+            return timestamps.empty();
+        }
+
+        void reserve(const size_t capacity) {
+            timestamps.reserve(capacity);
+            opens.reserve(capacity);
+            highs.reserve(capacity);
+            lows.reserve(capacity);
+            closes.reserve(capacity);
+            volumes.reserve(capacity);
+        }
+
+        /** \brief Добавить в конец диапазон баров другого массива
+         *
+         * При одинаковой точности массивы копируются целиком, без побарного преобразования
+         * \param other Другой массив
+         * \param begin Индекс первого бара
+         * \param end Индекс за последним баром
+         * \return Вернет false, если цена не помещается в PRICE_TYPE при данной точности
+         */
+        bool append(const FixedCandles &other, const size_t begin, const size_t end) {
+            if(begin >= end) return true;
+            if(other.digits != digits) {
+                reserve(timestamps.size() + end - begin);
+                for(size_t i = begin; i < end; ++i) {
+                    if(!push_back(other[i])) return false;
+                }
+                return true;
+            }
+            timestamps.insert(timestamps.end(), other.timestamps.begin() + begin, other.timestamps.begin() + end);
+            opens.insert(opens.end(), other.opens.begin() + begin, other.opens.begin() + end);
+            highs.insert(highs.end(), other.highs.begin() + begin, other.highs.begin() + end);
+            lows.insert(lows.end(), other.lows.begin() + begin, other.lows.begin() + end);
+            closes.insert(closes.end(), other.closes.begin() + begin, other.closes.begin() + end);
+            volumes.insert(volumes.end(), other.volumes.begin() + begin, other.volumes.begin() + end);
+            return true;
+        }
+
+        /** \brief Изменить размер массива
+         *
+         * Новые бары нулевые, их нужно заполнить через set
+         * \param new_size Новый размер
+         */
+        void resize(const size_t new_size) {
+            timestamps.resize(new_size);
+            opens.resize(new_size);
+            highs.resize(new_size);
+            lows.resize(new_size);
+            closes.resize(new_size);
+            volumes.resize(new_size);
+        }
+
+        /** \brief Обрезать массив до заданного размера
+         * \param new_size Новый размер, не больше текущего
+         */
+        void truncate(const size_t new_size) {
+            if(new_size >= timestamps.size()) return;
+            timestamps.resize(new_size);
+            opens.resize(new_size);
+            highs.resize(new_size);
+            lows.resize(new_size);
+            closes.resize(new_size);
+            volumes.resize(new_size);
+        }
+
+        void clear() {
+            truncate(0);
+        }
+
+        /** \brief Сравнить бар с баром другого массива
+         *
+         * Сравнение идет по целым значениям, поэтому оба массива должны иметь одинаковую точность
+         * \param index Индекс бара в этом массиве
+         * \param other Другой массив
+         * \param other_index Индекс бара в другом массиве
+         * \return Вернет true, если бары совпадают
+         */
+        inline bool is_equal(const size_t index, const FixedCandles &other, const size_t other_index) const {
+            return  timestamps[index] == other.timestamps[other_index] &&
+                    opens[index] == other.opens[other_index] &&
+                    highs[index] == other.highs[other_index] &&
+                    lows[index] == other.lows[other_index] &&
+                    closes[index] == other.closes[other_index] &&
+                    volumes[index] == other.volumes[other_index];
+        }
+
+        /** \brief Найти первый бар, метка времени которого не меньше заданной
+         * \param timestamp Метка времени
+         * \return Индекс бара или size(), если такого бара нет
+         */
+        inline size_t lower_bound(const xtime::timestamp_t timestamp) const {
+            return std::lower_bound(timestamps.begin(), timestamps.end(), timestamp) - timestamps.begin();
+        }
+
+        /** \brief Получить объем памяти, занимаемый барами
+         * \return Размер в байтах
+         */
+        inline size_t get_memory_size() const {
+            return  timestamps.capacity() * sizeof(xtime::timestamp_t) +
+                    (opens.capacity() + highs.capacity() + lows.capacity() + closes.capacity()) * sizeof(PRICE_TYPE) +
+                    volumes.capacity() * sizeof(VOLUME_TYPE);
+        }
+
+        /* прямой доступ к массивам для потоковой обработки */
+        inline const xtime::timestamp_t *timestamp_data() const {return timestamps.data();}
+        inline const PRICE_TYPE *open_data() const {return opens.data();}
+        inline const PRICE_TYPE *high_data() const {return highs.data();}
+        inline const PRICE_TYPE *low_data() const {return lows.data();}
+        inline const PRICE_TYPE *close_data() const {return closes.data();}
+        inline const VOLUME_TYPE *volume_data() const {return volumes.data();}
+    };
+
+    typedef FixedCandles<int32_t, uint64_t> CompactCandles;
+}
+
+#endif // MT4_FIXED_CANDLES_HPP_INCLUDED
@@ -1,36 +1,184 @@
 #ifndef MT4_HST_HPP_INCLUDED
 #define MT4_HST_HPP_INCLUDED
 
+#include "xquotes_common.hpp"
+#include "mt4-common.hpp"
+#include "mt4-storage.hpp"
+#include <fstream>
+#include <memory>
+#include <vector>
+#include <list>
+#include <unordered_map>
+#include <algorithm>
+#include <cstring>
+
 namespace mt4_tools {
+    /** \brief Ограниченный набор открытых hst файлов
+     *
+     * Файлы открываются по требованию, а при превышении лимита закрывается
+     * файл, к которому дольше всего не обращались. Пока файл символа открыт,
+     * все его записи идут через один и тот же поток без повторного открытия,
+     * поэтому количество символов не ограничено лимитом дескрипторов процесса
+     */
+    class HstFilePool {
+    private:
+
+        /** \brief Открытый файл
+         */
+        class Entry {
+        public:
+            std::string file_name;
+            std::unique_ptr<std::fstream> file;
+        };
+
+        std::list<Entry> entries;   /**< Открытые файлы, в начале - последний использованный */
+        std::unordered_map<std::string, std::list<Entry>::iterator> index;
+        size_t capacity = 256;
+        uint64_t hits = 0;
+        uint64_t misses = 0;
+        uint64_t evictions = 0;
+
+    public:
+
+        /** \brief Создать набор файлов
+         * \param user_capacity Максимум одновременно открытых файлов
+         */
+        HstFilePool(const size_t user_capacity = 256) :
+            capacity(std::max<size_t>(user_capacity, 1)) {};
+
+        HstFilePool(const HstFilePool&) = delete;
+        HstFilePool &operator=(const HstFilePool&) = delete;
+
+        /** \brief Получить открытый файл
+         *
+         * Если файл закрыт, он открывается для чтения и записи без изменения содержимого,
+         * а если открыто уже capacity файлов, закрывается давно не использованный
+         * \param file_name Имя файла
+         * \param is_trunc Создать файл заново. Ранее открытый поток файла при этом закрывается
+         * \return Поток файла или nullptr, если файл не удалось открыть.
+         * Указатель действителен до следующего вызова get или close
+         */
+        std::fstream *get(const std::string &file_name, const bool is_trunc = false) {
+            auto it = index.find(file_name);
+            if(it != index.end()) {
+                if(!is_trunc) {
+                    ++hits;
+                    entries.splice(entries.begin(), entries, it->second);
+                    return entries.front().file.get();
+                }
+                close(file_name);
+            }
+            ++misses;
+            while(entries.size() >= capacity) {
+                entries.back().file->flush();
+                index.erase(entries.back().file_name);
+                entries.pop_back();
+                ++evictions;
+            }
+            std::unique_ptr<std::fstream> file(is_trunc ?
+                new std::fstream(file_name, std::ios_base::binary | std::ios::out | std::ios::trunc) :
+                new std::fstream(file_name, std::ios_base::binary | std::ios::in | std::ios::out));
+            if(!file->is_open()) return nullptr;
+            Entry entry;
+            entry.file_name = file_name;
+            entry.file = std::move(file);
+            entries.push_front(std::move(entry));
+            index[file_name] = entries.begin();
+            return entries.front().file.get();
+        }
+
+        /** \brief Закрыть файл, если он открыт
+         * \param file_name Имя файла
+         */
+        void close(const std::string &file_name) {
+            auto it = index.find(file_name);
+            if(it == index.end()) return;
+            it->second->file->flush();
+            entries.erase(it->second);
+            index.erase(it);
+        }
+
+        inline size_t size() const {
+            return entries.size();
+        }
+
+        inline size_t get_capacity() const {
+            return capacity;
+        }
+
+        /** \brief Получить количество обращений к уже открытому файлу
+         */
+        inline uint64_t get_hits() const {
+            return hits;
+        }
+
+        /** \brief Получить количество открытий файлов
+         */
+        inline uint64_t get_misses() const {
+            return misses;
+        }
+
+        /** \brief Получить количество файлов, закрытых из-за лимита
+         */
+        inline uint64_t get_evictions() const {
+            return evictions;
+        }
+    };
+
+    /** \brief Версия формата hst файла
+     */
+    enum class HstVersions {
+        V400 = 400, /**< Старый формат: время uint32, цены и объем double, 44 байта на бар */
+        V401 = 401, /**< Формат MT4 build 509 и новее: время int64, тиковый объем, спред и реальный объем, 60 байт на бар */
+    };
+
     /** \brief Класс для записи потока котировок
+     *
+     * Терминал переводит файлы версии 400 в формат 401 при загрузке,
+     * файлы версии 401 загружаются без перевода
      */
     class MqlHst {
+    public:
+        static const size_t HEADER_SIZE = 148;      /**< Размер заголовка файла */
+        static const size_t RECORD_SIZE_400 = 44;   /**< Размер одного бара версии 400 */
+        static const size_t RECORD_SIZE_401 = 60;   /**< Размер одного бара версии 401 */
+        static const size_t RECORD_SIZE_MAX = 60;   /**< Наибольший размер одного бара */
+
     private:
         std::string symbol; /**< Символ */
         std::string path;   /**< Путь к файлам */
-        std::fstream file;  /**< Файл данных */
+        std::string file_name;
+        std::fstream own_file;                  /**< Файл данных, если набор файлов не задан */
+        std::shared_ptr<HstFilePool> pool;      /**< Набор открытых файлов, nullptr - файл открыт все время */
         uint32_t period = 0;
         uint32_t digits = 0;
         int64_t timezone = 0;
         size_t offset = 0;
+        size_t record_size = RECORD_SIZE_400;
+        HstVersions version = HstVersions::V400;
         xtime::timestamp_t last_timestamp = 0;
         bool is_open = false;
+        AsyncStorage *storage = nullptr;    /**< Хранилище для write_records и resize, nullptr - писать через поток файла */
 
-        inline void seek(const unsigned long offset, const std::ios::seekdir &origin = std::ios::beg) {
+        /** \brief Получить поток файла, открыв его при необходимости
+         * \return Поток файла или nullptr, если файл не удалось открыть
+         */
+        inline std::fstream *get_file() {
+            if(!pool) return &own_file;
+            return pool->get(file_name);
+        }
+
+        inline void seek(std::fstream &file, const unsigned long offset, const std::ios::seekdir &origin = std::ios::beg) {
             file.clear();
             file.seekp(offset, origin);
             file.clear();
         }
 
-        inline void write_u32(const uint32_t value) {
-            file.write(reinterpret_cast<const char *>(&value), sizeof(value));
-        }
-
-        inline void write_double(const double value) {
+        inline void write_u32(std::fstream &file, const uint32_t value) {
             file.write(reinterpret_cast<const char *>(&value), sizeof(value));
         }
 
-        inline void write_string(const std::string &value, const size_t length) {
+        inline void write_string(std::fstream &file, const std::string &value, const size_t length) {
             std::unique_ptr<char[]> buffer;
             buffer = std::unique_ptr<char[]>(new char[length]);
             char *temp = buffer.get();
@@ -41,30 +189,45 @@ namespace mt4_tools {
         }
 
         template<class T>
-        inline void write_array(const T *value, const size_t length) {
+        inline void write_array(std::fstream &file, const T *value, const size_t length) {
             file.write(reinterpret_cast<const char *>(value), length * sizeof(T));
         }
 
+        inline void write_record(std::fstream &file, const xquotes_common::Candle &candle) {
+            char buffer[RECORD_SIZE_MAX];
+            serialize_candle(candle, timezone, buffer, version);
+            file.write(buffer, record_size);
+        }
+
         bool create() {
-            std::string file_name(path);
+            file_name = path;
             file_name += "//" + symbol + std::to_string(period) + ".hst";
             //std::cout << "file_name " << file_name << std::endl;
-            file = std::fstream(file_name, std::ios_base::binary | std::ios::out | std::ios::trunc);
+            std::fstream *file_ptr = &own_file;
+            if(pool) {
+                file_ptr = pool->get(file_name, true);
+                if(file_ptr == nullptr) return false;
+            } else {
+                own_file = std::fstream(file_name, std::ios_base::binary | std::ios::out | std::ios::trunc);
+            }
+            std::fstream &file = *file_ptr;
             if(!file.is_open()) return false;
             file.clear();
             file.seekg(0, std::ios::beg);
             file.clear();
-            write_u32(400);
-            write_string("Copyright © 2020, ELEKTRO YAR", 64);
-            write_string(symbol, 12);
-            write_u32(period);
-            write_u32(digits);
-            write_u32(0); // timesign
-            write_u32(0); // last_sync
-            uint32_t temp[13];
-            write_array(temp, 13);
+            write_u32(file, (uint32_t)version);
+            write_string(file, "Copyright © 2020, ELEKTRO YAR", 64);
+            write_string(file, symbol, 12);
+            write_u32(file, period);
+            write_u32(file, digits);
+            write_u32(file, 0); // timesign
+            write_u32(file, 0); // last_sync
+            uint32_t temp[13] = {0};
+            write_array(file, temp, 13);
             file.flush();
             offset = file.tellp();
+            /* созданный файл открыт только для записи, дальше он открывается для чтения и записи */
+            if(pool) pool->close(file_name);
             return true;
         }
 
@@ -77,49 +240,361 @@ namespace mt4_tools {
             const std::string &user_path,
             const uint32_t user_period,
             const uint32_t user_digits,
-            const int64_t user_timezone = 0) :
+            const int64_t user_timezone = 0,
+            const std::shared_ptr<HstFilePool> &user_pool = nullptr,
+            const HstVersions user_version = HstVersions::V400) :
             symbol(user_symbol),
             path(user_path),
+            pool(user_pool),
             period(user_period),
             digits(user_digits),
-            timezone(user_timezone) {
+            timezone(user_timezone),
+            record_size(get_record_size(user_version)),
+            version(user_version) {
             is_open = create();
             //std::cout << "is_open " << is_open << std::endl;
         }
 
         ~MqlHst() {
-            if(is_open) {
-                file.flush();
-                file.close();
+            if(!is_open) return;
+            if(pool) {
+                pool->close(file_name);
+            } else {
+                own_file.flush();
+                own_file.close();
             }
         };
 
         void update_candle(const xquotes_common::Candle &candle) {
             if(!is_open) return;
-            seek(offset);
-            write_u32((uint32_t)((int64_t)candle.timestamp + timezone));
-            write_double(candle.open);
-            write_double(candle.low);
-            write_double(candle.high);
-            write_double(candle.close);
-            write_double(candle.volume);
-            file.flush();
+            std::fstream *file = get_file();
+            if(file == nullptr) return;
+            seek(*file, offset);
+            write_record(*file, candle);
+            file->flush();
             last_timestamp = candle.timestamp;
         }
 
+        /** \brief Перезаписать бар по индексу
+         *
+         * Бар должен уже быть записан в файл. Текущий (последний) бар
+         * при этом также можно перезаписать.
+         * \param index Индекс бара в файле
+         * \param candle Бар
+         */
+        void write_candle(const size_t index, const xquotes_common::Candle &candle) {
+            if(!is_open) return;
+            const size_t record_offset = HEADER_SIZE + index * record_size;
+            if(record_offset >= offset) {
+                /* бар с таким индексом является текущим или еще не записан */
+                if(record_offset == offset) update_candle(candle);
+                return;
+            }
+            std::fstream *file = get_file();
+            if(file == nullptr) return;
+            seek(*file, record_offset);
+            write_record(*file, candle);
+            file->flush();
+        }
+
+        /** \brief Обрезать файл до заданного количества баров
+         *
+         * После вызова текущим баром считается бар с индексом size,
+         * его можно записать через update_candle или add_new_candle
+         * \param size Количество баров, которые останутся в файле
+         * \param timestamp Метка времени последнего оставшегося бара
+         * \return Вернет true в случае успешного завершения
+         */
+        bool resize(const size_t size, const xtime::timestamp_t timestamp) {
+            if(!is_open) return false;
+            const size_t new_offset = HEADER_SIZE + size * record_size;
+            if(new_offset > offset) return false;
+            if(storage != nullptr) {
+                if(!storage->truncate(file_name, new_offset)) return false;
+                offset = new_offset;
+                last_timestamp = timestamp;
+                return true;
+            }
+            if(pool) {
+                /* файл откроется заново при следующей записи */
+                pool->close(file_name);
+                if(!mt4_common::truncate_file(file_name, new_offset)) return false;
+                offset = new_offset;
+                last_timestamp = timestamp;
+                return true;
+            }
+            own_file.flush();
+            own_file.close();
+            const bool is_truncated = mt4_common::truncate_file(file_name, new_offset);
+            own_file = std::fstream(file_name, std::ios_base::binary | std::ios::in | std::ios::out);
+            is_open = own_file.is_open();
+            if(!is_open || !is_truncated) return false;
+            offset = new_offset;
+            last_timestamp = timestamp;
+            return true;
+        }
+
+        /** \brief Получить количество баров в файле
+         * \return Количество записанных баров, не считая текущего
+         */
+        inline size_t get_size() const {
+            return (offset - HEADER_SIZE) / record_size;
+        }
+
         void add_new_candle(const xquotes_common::Candle &candle) {
             if(!is_open) return;
-            update_candle(candle);
-            offset = file.tellp();
+            std::fstream *file = get_file();
+            if(file == nullptr) return;
+            seek(*file, offset);
+            write_record(*file, candle);
+            file->flush();
+            last_timestamp = candle.timestamp;
+            offset = file->tellp();
+        }
+
+        /** \brief Получить размер одного бара
+         * \param user_version Версия формата
+         * \return Размер записи бара в байтах
+         */
+        static inline size_t get_record_size(const HstVersions user_version) {
+            return user_version == HstVersions::V401 ? RECORD_SIZE_401 : RECORD_SIZE_400;
+        }
+
+        /** \brief Записать бар в буфер в формате записи hst файла
+         *
+         * Версия 401 хранит объем как тиковый объем, спред и реальный объем равны 0
+         * \param candle Бар
+         * \param user_timezone Смещение меток времени в секундах
+         * \param buffer Буфер размером не меньше get_record_size(user_version)
+         * \param user_version Версия формата
+         */
+        static inline void serialize_candle(
+                const xquotes_common::Candle &candle,
+                const int64_t user_timezone,
+                char *buffer,
+                const HstVersions user_version = HstVersions::V400) {
+            if(user_version == HstVersions::V401) {
+                /* time, open, high, low, close, tick_volume, spread, real_volume */
+                const int64_t timestamp = (int64_t)candle.timestamp + user_timezone;
+                const int64_t tick_volume = (int64_t)candle.volume;
+                const int32_t spread = 0;
+                const int64_t real_volume = 0;
+                std::memcpy(buffer, &timestamp, sizeof(timestamp));
+                std::memcpy(buffer + 8, &candle.open, sizeof(double));
+                std::memcpy(buffer + 16, &candle.high, sizeof(double));
+                std::memcpy(buffer + 24, &candle.low, sizeof(double));
+                std::memcpy(buffer + 32, &candle.close, sizeof(double));
+                std::memcpy(buffer + 40, &tick_volume, sizeof(tick_volume));
+                std::memcpy(buffer + 48, &spread, sizeof(spread));
+                std::memcpy(buffer + 52, &real_volume, sizeof(real_volume));
+                return;
+            }
+            const uint32_t timestamp = (uint32_t)((int64_t)candle.timestamp + user_timezone);
+            std::memcpy(buffer, &timestamp, sizeof(timestamp));
+            std::memcpy(buffer + 4, &candle.open, sizeof(double));
+            std::memcpy(buffer + 12, &candle.low, sizeof(double));
+            std::memcpy(buffer + 20, &candle.high, sizeof(double));
+            std::memcpy(buffer + 28, &candle.close, sizeof(double));
+            std::memcpy(buffer + 36, &candle.volume, sizeof(double));
+        }
+
+        /** \brief Записать подготовленные записи баров одним блоком
+         *
+         * Записи могут перезаписывать уже сохраненные бары и продолжать файл,
+         * но не могут начинаться за его концом.
+         * \param index Индекс первой записи в файле
+         * \param data Записи, подготовленные через serialize_candle
+         * \param count Количество записей
+         * \param timestamp Метка времени последней записи
+         * \return Вернет true в случае успешного завершения
+         */
+        bool write_records(
+                const size_t index,
+                const char *data,
+                const size_t count,
+                const xtime::timestamp_t timestamp) {
+            if(!is_open) return false;
+            const size_t record_offset = HEADER_SIZE + index * record_size;
+            if(record_offset > offset) return false;
+            if(count == 0) return true;
+            bool is_ok = true;
+            if(storage != nullptr) {
+                is_ok = storage->write(file_name, record_offset, data, count * record_size);
+            } else {
+                std::fstream *file = get_file();
+                if(file == nullptr) return false;
+                seek(*file, record_offset);
+                file->write(data, count * record_size);
+                file->flush();
+                is_ok = !file->fail();
+            }
+            const size_t end_offset = record_offset + count * record_size;
+            if(end_offset >= offset) {
+                offset = end_offset;
+                last_timestamp = timestamp;
+            }
+            return is_ok;
+        }
+
+        /** \brief Писать бары через асинхронное хранилище
+         *
+         * После установки хранилища write_records и resize только ставят
+         * операции в его очередь, а update_candle, write_candle и add_new_candle
+         * по-прежнему пишут через поток файла, поэтому смешивать их нельзя
+         * \param user_storage Хранилище или nullptr, чтобы писать через поток файла
+         */
+        inline void set_storage(AsyncStorage *user_storage) {
+            storage = user_storage;
         }
 
         inline xtime::timestamp_t get_last_timestamp() {
             return last_timestamp;
         }
 
+        inline HstVersions get_version() const {
+            return version;
+        }
+
         inline void set_timezone(const int64_t user_timezone) {
             timezone = user_timezone;
         }
+
+        inline int64_t get_timezone() const {
+            return timezone;
+        }
+
+        inline const std::string &get_file_name() const {
+            return file_name;
+        }
+    };
+
+    /** \brief Класс для записи одного потока котировок в несколько терминалов
+     *
+     * Бары переводятся в записи hst файла один раз в общий буфер,
+     * затем буфер целиком записывается в файл каждого терминала.
+     */
+    class MqlHstGroup {
+    private:
+        std::vector<std::shared_ptr<MqlHst>> targets;
+        std::vector<char> buffer;
+        int64_t timezone = 0;
+        HstVersions version = HstVersions::V400;
+
+        template<class CANDLES_TYPE>
+        void serialize(const CANDLES_TYPE &candles, const size_t begin, const size_t end) {
+            const size_t record_size = MqlHst::get_record_size(version);
+            buffer.resize((end - begin) * record_size);
+            char *ptr = buffer.data();
+            for(size_t i = begin; i < end; ++i) {
+                MqlHst::serialize_candle(candles[i], timezone, ptr, version);
+                ptr += record_size;
+            }
+        }
+
+    public:
+
+        MqlHstGroup() {};
+
+        /** \brief Создать hst файлы символа во всех терминалах
+         * \param user_symbol Символ
+         * \param user_paths Пути к папкам history терминалов
+         * \param user_period Период в минутах
+         * \param user_digits Количество знаков после запятой
+         * \param user_timezone Смещение меток времени в секундах
+         * \param user_pool Общий набор открытых файлов, nullptr - файлы открыты все время
+         * \param user_version Версия формата hst файлов
+         */
+        MqlHstGroup(
+                const std::string &user_symbol,
+                const std::vector<std::string> &user_paths,
+                const uint32_t user_period,
+                const uint32_t user_digits,
+                const int64_t user_timezone = 0,
+                const std::shared_ptr<HstFilePool> &user_pool = nullptr,
+                const HstVersions user_version = HstVersions::V400) :
+                timezone(user_timezone), version(user_version) {
+            for(size_t i = 0; i < user_paths.size(); ++i) {
+                targets.push_back(std::make_shared<MqlHst>(
+                    user_symbol,
+                    user_paths[i],
+                    user_period,
+                    user_digits,
+                    user_timezone,
+                    user_pool,
+                    user_version));
+            }
+        }
+
+        /** \brief Записать бары с индексами от begin до end во все терминалы
+         *
+         * Бар с индексом i записывается в запись файла с индексом base + i
+         * \param candles Массив баров
+         * \param begin Индекс первого бара
+         * \param end Индекс за последним баром
+         * \param base Индекс записи файла, соответствующий первому бару массива
+         * \return Вернет true, если бары записаны во все терминалы
+         */
+        template<class CANDLES_TYPE>
+        bool write_candles(const CANDLES_TYPE &candles, const size_t begin, const size_t end, const size_t base = 0) {
+            if(begin >= end) return true;
+            serialize(candles, begin, end);
+            const xtime::timestamp_t timestamp = candles[end - 1].timestamp;
+            bool is_ok = true;
+            for(size_t t = 0; t < targets.size(); ++t) {
+                if(!targets[t]->write_records(base + begin, buffer.data(), end - begin, timestamp)) is_ok = false;
+            }
+            return is_ok;
+        }
+
+        /** \brief Перезаписать бары по списку индексов
+         *
+         * Подряд идущие индексы записываются одним блоком
+         * \param candles Массив баров
+         * \param indexes Отсортированный список индексов
+         * \param base Индекс записи файла, соответствующий первому бару массива
+         * \return Вернет true, если бары записаны во все терминалы
+         */
+        template<class CANDLES_TYPE>
+        bool write_candles(const CANDLES_TYPE &candles, const std::vector<size_t> &indexes, const size_t base = 0) {
+            bool is_ok = true;
+            size_t i = 0;
+            while(i < indexes.size()) {
+                size_t j = i + 1;
+                while(j < indexes.size() && indexes[j] == indexes[j - 1] + 1) ++j;
+                if(!write_candles(candles, indexes[i], indexes[j - 1] + 1, base)) is_ok = false;
+                i = j;
+            }
+            return is_ok;
+        }
+
+        /** \brief Писать бары всех терминалов через асинхронное хранилище
+         * \param user_storage Хранилище или nullptr, чтобы писать через потоки файлов
+         */
+        void set_storage(AsyncStorage *user_storage) {
+            for(size_t t = 0; t < targets.size(); ++t) {
+                targets[t]->set_storage(user_storage);
+            }
+        }
+
+        bool resize(const size_t size, const xtime::timestamp_t timestamp) {
+            bool is_ok = true;
+            for(size_t t = 0; t < targets.size(); ++t) {
+                if(!targets[t]->resize(size, timestamp)) is_ok = false;
+            }
+            return is_ok;
+        }
+
+        inline xtime::timestamp_t get_last_timestamp() {
+            return targets.empty() ? 0 : targets[0]->get_last_timestamp();
+        }
+
+        inline size_t get_size() const {
+            return targets.empty() ? 0 : targets[0]->get_size();
+        }
+
+        inline size_t get_targets() const {
+            return targets.size();
+        }
     };
 }
 
@@ -0,0 +1,374 @@
+#ifndef MT4_INDICATORS_HPP_INCLUDED
+#define MT4_INDICATORS_HPP_INCLUDED
+
+#include "mt4-fixed-candles.hpp"
+#include "mt4-sync.hpp"
+#include "mt4-csv.hpp"
+#include "mt4-common.hpp"
+#include <vector>
+#include <string>
+#include <memory>
+#include <fstream>
+#include <cmath>
+#include <cstdio>
+#include <algorithm>
+
+namespace mt4_tools {
+
+    /** \brief Простая скользящая средняя
+     *
+     * Метод update добавляет новое значение, метод test считает значение
+     * индикатора для еще не завершенного бара, не меняя состояние.
+     */
+    template<class T = double>
+    class IndicatorSMA {
+    private:
+        std::vector<T> buffer;
+        size_t period = 0;
+        size_t pos = 0;
+        size_t count = 0;
+        T sum = 0;
+
+    public:
+
+        IndicatorSMA() {};
+
+        IndicatorSMA(const size_t user_period) :
+            buffer(std::max<size_t>(user_period, 1)), period(std::max<size_t>(user_period, 1)) {};
+
+        /** \brief Добавить значение
+         * \param in Входное значение
+         * \param out Значение индикатора
+         * \return Вернет true, если значение индикатора сформировано
+         */
+        bool update(const T in, T &out) {
+            if(count == period) sum -= buffer[pos];
+            else ++count;
+            buffer[pos] = in;
+            sum += in;
+            pos = (pos + 1) % period;
+            if(count < period) return false;
+            out = sum / (T)period;
+            return true;
+        }
+
+        /** \brief Посчитать значение без изменения состояния
+         * \param in Входное значение
+         * \param out Значение индикатора
+         * \return Вернет true, если значение индикатора сформировано
+         */
+        bool test(const T in, T &out) const {
+            if((count + 1) < period) return false;
+            const T test_sum = count == period ? sum - buffer[pos] + in : sum + in;
+            out = test_sum / (T)period;
+            return true;
+        }
+
+        void clear() {
+            std::fill(buffer.begin(), buffer.end(), T(0));
+            pos = 0;
+            count = 0;
+            sum = 0;
+        }
+    };
+
+    /** \brief Экспоненциальная скользящая средняя
+     *
+     * Первое значение равно простой средней за период
+     */
+    template<class T = double>
+    class IndicatorEMA {
+    private:
+        IndicatorSMA<T> sma;
+        T alpha = 1;
+        T prev = 0;
+        bool is_init = false;
+
+    public:
+
+        IndicatorEMA() {};
+
+        IndicatorEMA(const size_t period) :
+            sma(period), alpha((T)2 / (T)(std::max<size_t>(period, 1) + 1)) {};
+
+        bool update(const T in, T &out) {
+            if(!is_init) {
+                if(!sma.update(in, prev)) return false;
+                is_init = true;
+                out = prev;
+                return true;
+            }
+            prev = alpha * in + (1 - alpha) * prev;
+            out = prev;
+            return true;
+        }
+
+        bool test(const T in, T &out) const {
+            if(!is_init) return sma.test(in, out);
+            out = alpha * in + (1 - alpha) * prev;
+            return true;
+        }
+
+        void clear() {
+            sma.clear();
+            prev = 0;
+            is_init = false;
+        }
+    };
+
+    /** \brief Средний истинный диапазон со сглаживанием Уайлдера
+     */
+    template<class T = double>
+    class IndicatorATR {
+    private:
+        IndicatorSMA<T> sma;
+        T period = 1;
+        T prev_close = 0;
+        T prev = 0;
+        bool is_close = false;
+        bool is_init = false;
+
+        inline T get_true_range(const xquotes_common::Candle &candle) const {
+            const T range = (T)(candle.high - candle.low);
+            if(!is_close) return range;
+            return std::max(range, std::max(
+                (T)std::abs(candle.high - prev_close),
+                (T)std::abs(candle.low - prev_close)));
+        }
+
+    public:
+
+        IndicatorATR() {};
+
+        IndicatorATR(const size_t user_period) :
+            sma(user_period), period((T)std::max<size_t>(user_period, 1)) {};
+
+        bool update(const xquotes_common::Candle &candle, T &out) {
+            const T tr = get_true_range(candle);
+            prev_close = (T)candle.close;
+            is_close = true;
+            if(!is_init) {
+                if(!sma.update(tr, prev)) return false;
+                is_init = true;
+                out = prev;
+                return true;
+            }
+            prev = (prev * (period - 1) + tr) / period;
+            out = prev;
+            return true;
+        }
+
+        bool test(const xquotes_common::Candle &candle, T &out) const {
+            const T tr = get_true_range(candle);
+            if(!is_init) return sma.test(tr, out);
+            out = (prev * (period - 1) + tr) / period;
+            return true;
+        }
+
+        void clear() {
+            sma.clear();
+            prev_close = 0;
+            prev = 0;
+            is_close = false;
+            is_init = false;
+        }
+    };
+
+    /** \brief Индикатор из настроек символа
+     */
+    class Indicator {
+    public:
+
+        /// Типы индикаторов
+        enum IndicatorTypes {
+            SMA,
+            EMA,
+            ATR,
+        };
+
+    private:
+        IndicatorTypes type = SMA;
+        IndicatorSMA<double> sma;
+        IndicatorEMA<double> ema;
+        IndicatorATR<double> atr;
+
+    public:
+
+        Indicator() {};
+
+        Indicator(const IndicatorTypes user_type, const size_t period) :
+            type(user_type),
+            sma(user_type == SMA ? period : 1),
+            ema(user_type == EMA ? period : 1),
+            atr(user_type == ATR ? period : 1) {};
+
+        /** \brief Создать индикатор по имени типа
+         * \param name Имя типа: sma, ema или atr
+         * \param period Период индикатора
+         * \param indicator Индикатор
+         * \return Вернет true, если тип известен
+         */
+        static bool create(const std::string &name, const size_t period, Indicator &indicator) {
+            if(name == "sma" || name == "SMA") indicator = Indicator(SMA, period);
+            else if(name == "ema" || name == "EMA") indicator = Indicator(EMA, period);
+            else if(name == "atr" || name == "ATR") indicator = Indicator(ATR, period);
+            else return false;
+            return true;
+        }
+
+        inline bool update(const xquotes_common::Candle &candle, double &out) {
+            switch(type) {
+            case SMA: return sma.update(candle.close, out);
+            case EMA: return ema.update(candle.close, out);
+            case ATR: return atr.update(candle, out);
+            };
+            return false;
+        }
+
+        inline bool test(const xquotes_common::Candle &candle, double &out) const {
+            switch(type) {
+            case SMA: return sma.test(candle.close, out);
+            case EMA: return ema.test(candle.close, out);
+            case ATR: return atr.test(candle, out);
+            };
+            return false;
+        }
+
+        void clear() {
+            sma.clear();
+            ema.clear();
+            atr.clear();
+        }
+    };
+
+    /** \brief Класс для пошагового расчета индикаторов символа
+     *
+     * Все бары истории, кроме последнего, проводятся через update и больше не
+     * пересчитываются. Последний бар может меняться, поэтому его значение
+     * считается через test. Если сверка изменила более ранние бары, индикаторы
+     * пересчитываются с начала истории.
+     *
+     * Значения пишутся в csv файл: дата, время и по столбцу на индикатор.
+     * Строки завершенных баров не перезаписываются, файл дописывается с
+     * позиции после последнего завершенного бара.
+     */
+    class IndicatorStage {
+    private:
+        std::vector<Indicator> indicators;
+        std::vector<double> values;
+        std::string file_name;
+        std::string sprintf_param;
+        size_t committed = 0;           /**< Количество баров, проведенных через update */
+        uint64_t committed_offset = 0;  /**< Размер файла со строками завершенных баров */
+        bool is_init = false;
+
+        int write_line(char *buffer, const xtime::timestamp_t timestamp, const std::vector<bool> &is_ready) {
+            xtime::DateTime date_time(timestamp);
+            int len = std::sprintf(buffer, "%.4d.%.2d.%.2d,%.2d:%.2d",
+                date_time.year, date_time.month, date_time.day,
+                date_time.hour, date_time.minute);
+            for(size_t n = 0; n < values.size(); ++n) {
+                buffer[len++] = ',';
+                if(is_ready[n]) len += std::sprintf(buffer + len, sprintf_param.c_str(), values[n]);
+            }
+            buffer[len++] = '\n';
+            return len;
+        }
+
+    public:
+
+        IndicatorStage() {};
+
+        /** \brief Инициализировать расчет индикаторов
+         * \param user_file_name Имя файла для значений индикаторов
+         * \param configs Настройки индикаторов
+         * \param digits Количество знаков после запятой
+         */
+        IndicatorStage(
+                const std::string &user_file_name,
+                const std::vector<mt4_common::IndicatorConfig> &configs,
+                const uint32_t digits) :
+                file_name(user_file_name),
+                sprintf_param("%." + std::to_string(digits) + "f") {
+            for(size_t i = 0; i < configs.size(); ++i) {
+                Indicator indicator;
+                if(!Indicator::create(configs[i].type, configs[i].period, indicator)) continue;
+                indicators.push_back(indicator);
+            }
+            values.resize(indicators.size());
+        }
+
+        inline bool empty() const {
+            return indicators.empty();
+        }
+
+        /** \brief Проверить, нужна ли для обновления вся история
+         * \param base Индекс первого бара окна истории
+         * \param sync Результат сверки окна истории
+         * \return Вернет true, если индикаторы придется пересчитать с бара до base
+         */
+        inline bool is_full_history_required(const size_t base, const SyncResult &sync) const {
+            if(indicators.empty()) return false;
+            if(is_init && !sync.is_changed) return false;
+            return !is_init || committed < base || (base + sync.first_changed) < committed;
+        }
+
+        /** \brief Обновить индикаторы после сверки истории
+         * \param candles История или ее окно
+         * \param sync Результат сверки истории
+         * \param base Индекс первого бара окна в полной истории
+         * \return Вернет true в случае успешного завершения
+         */
+        template<class PRICE_TYPE, class VOLUME_TYPE>
+        bool update(const FixedCandles<PRICE_TYPE, VOLUME_TYPE> &candles, const SyncResult &sync, const size_t base = 0) {
+            if(indicators.empty()) return true;
+            if(is_init && !sync.is_changed) return true;
+            if(is_full_history_required(base, sync) || (base + candles.size()) < committed) {
+                /* изменились завершенные бары, пересчитываем с начала */
+                if(base != 0) return false;
+                for(size_t n = 0; n < indicators.size(); ++n) {
+                    indicators[n].clear();
+                }
+                committed = 0;
+                committed_offset = 0;
+                is_init = true;
+            }
+
+            std::fstream file(file_name, std::ios::binary | std::ios::in | std::ios::out);
+            if(!file.is_open()) file.open(file_name, std::ios::binary | std::ios::out | std::ios::trunc);
+            if(!file.is_open()) return false;
+            file.seekp((std::streamoff)committed_offset, std::ios::beg);
+
+            char buffer[CSV_LINE_BUFFER_SIZE];
+            std::vector<bool> is_ready(indicators.size());
+            uint64_t offset = committed_offset;
+            const size_t size = base + candles.size();
+            const size_t last = size > 0 ? size - 1 : 0;
+            for(size_t i = committed; i < last; ++i) {
+                const xquotes_common::Candle candle = candles[i - base];
+                for(size_t n = 0; n < indicators.size(); ++n) {
+                    is_ready[n] = indicators[n].update(candle, values[n]);
+                }
+                const int len = write_line(buffer, candle.timestamp, is_ready);
+                file.write(buffer, len);
+                offset += len;
+            }
+            committed = std::max(committed, last);
+            committed_offset = offset;
+
+            if(candles.size() > 0) {
+                const xquotes_common::Candle candle = candles[last - base];
+                for(size_t n = 0; n < indicators.size(); ++n) {
+                    is_ready[n] = indicators[n].test(candle, values[n]);
+                }
+                const int len = write_line(buffer, candle.timestamp, is_ready);
+                file.write(buffer, len);
+                offset += len;
+            }
+            file.close();
+            return mt4_common::truncate_file(file_name, offset);
+        }
+    };
+}
+
+#endif // MT4_INDICATORS_HPP_INCLUDED
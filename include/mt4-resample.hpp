@@ -0,0 +1,80 @@
+#ifndef MT4_RESAMPLE_HPP_INCLUDED
+#define MT4_RESAMPLE_HPP_INCLUDED
+
+#include "xquotes_common.hpp"
+#include <algorithm>
+
+namespace mt4_tools {
+
+    /** \brief Класс для потокового пересчета баров в более старший период
+     *
+     * Используется для получения баров M15, M30 и H4 из внутридневных данных
+     * M5 и H1. Бары старшего периода начинаются на границе периода, отсчитанной
+     * от начала суток, как в MT4.
+     */
+    class CandleResampler {
+    private:
+        xquotes_common::Candle current;
+        xtime::timestamp_t period_seconds = 0;
+        bool is_current = false;
+
+    public:
+
+        CandleResampler() {};
+
+        /** \brief Инициализировать пересчет
+         * \param period Период в минутах, не больше суток
+         */
+        CandleResampler(const uint32_t period) :
+            period_seconds((xtime::timestamp_t)period * xtime::SECONDS_IN_MINUTE) {};
+
+        /** \brief Получить начало бара старшего периода
+         * \param timestamp Метка времени
+         * \return Метка времени начала бара
+         */
+        inline xtime::timestamp_t get_bar_start(const xtime::timestamp_t timestamp) const {
+            return timestamp - (timestamp % period_seconds);
+        }
+
+        /** \brief Добавить бар младшего периода
+         *
+         * Бары должны поступать в порядке возрастания времени
+         * \param candle Бар младшего периода
+         * \param output Завершенный бар старшего периода
+         * \return Вернет true, если бар старшего периода завершен и записан в output
+         */
+        bool update(const xquotes_common::Candle &candle, xquotes_common::Candle &output) {
+            const xtime::timestamp_t bar_start = get_bar_start(candle.timestamp);
+            bool is_output = false;
+            if(is_current && current.timestamp != bar_start) {
+                output = current;
+                is_output = true;
+                is_current = false;
+            }
+            if(!is_current) {
+                current = candle;
+                current.timestamp = bar_start;
+                is_current = true;
+            } else {
+                current.high = std::max(current.high, candle.high);
+                current.low = std::min(current.low, candle.low);
+                current.close = candle.close;
+                current.volume += candle.volume;
+            }
+            return is_output;
+        }
+
+        /** \brief Получить последний, возможно незавершенный, бар
+         * \param output Бар старшего периода
+         * \return Вернет true, если бар был
+         */
+        bool flush(xquotes_common::Candle &output) {
+            if(!is_current) return false;
+            output = current;
+            is_current = false;
+            return true;
+        }
+    };
+}
+
+#endif // MT4_RESAMPLE_HPP_INCLUDED
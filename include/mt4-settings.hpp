@@ -2,7 +2,9 @@
 #define MT4_SETTINGS_HPP_INCLUDED
 
 #include "mt4-common.hpp"
+#include "mt4-shard.hpp"
 #include <nlohmann/json.hpp>
+#include <cstdlib>
 
 namespace mt4_tools {
     using json = nlohmann::json;
@@ -13,12 +15,49 @@ namespace mt4_tools {
     public:
         std::vector<mt4_common::SymbolConfig> symbols_config;
         std::string path_csv;
-        std::string path_hst;// = "C:\\Users\\user\\AppData\\Roaming\\MetaQuotes\\Terminal\\2E8DC23981084565FA3E19C061F586B2\\history\\RoboForex-Demo\\";
+        std::vector<std::string> paths_hst;   /**< Папки history терминалов, в которые пишутся hst файлы */
         std::string symbol_hst_suffix;
         std::string symbol_csv_suffix;
         std::string sert_file = "curl-ca-bundle.crt";       /**< Файл сертификата */
+        std::string api_point = "https://stooq.com";        /**< Адрес сервера данных */
         std::string json_settings_file;
         uint32_t update_period = 5;
+        uint32_t resync_depth = 0;      /**< Глубина истории в днях, которая перекачивается каждый цикл для поиска исправлений */
+        uint32_t resync_period = 0;     /**< Период полной сверки истории в часах, 0 - не сверять */
+        std::string shm_name;           /**< Имя разделяемой памяти для публикации баров, пустое - не публиковать */
+        uint32_t shm_ring_size = 4096;  /**< Размер кольцевого буфера событий в разделяемой памяти */
+        uint32_t ws_port = 0;           /**< Порт WebSocket сервера для рассылки баров, 0 - не запускать */
+        std::string ws_address;         /**< Адрес WebSocket сервера, пустой - все интерфейсы */
+        uint32_t ws_snapshot_size = 100;        /**< Количество баров в снимке при подписке */
+        uint32_t ws_max_queue_bytes = 1048576;  /**< Лимит очереди отправки одного клиента */
+        bool http2 = false;             /**< Загружать символы параллельно, мультиплексируя запросы через HTTP/2 */
+        uint32_t max_streams = 16;      /**< Максимум одновременных запросов в режиме http2 */
+        uint32_t max_connections = 2;   /**< Максимум соединений с сервером в режиме http2 */
+        bool http2_prior_knowledge = false; /**< Сервер без TLS принимает HTTP/2 без Upgrade, например локальный h2c сервер */
+        bool hedging = false;           /**< Повторять запрос, если сервер не ответил дольше обычного */
+        double hedge_percentile = 0.95; /**< Процентиль времени до первого байта, после которого запрос повторяется */
+        bool quote_snapshots = false;   /**< Обновлять текущий бар дневных символов котировками, запрашивая много символов сразу */
+        std::string zip_archive;        /**< Архив stooq со всем рынком для загрузки, пустое - обычный режим */
+        bool is_zip_all = false;        /**< Загрузить из архива все символы, а не только symbols */
+        uint32_t zip_threads = 0;       /**< Количество потоков загрузки архива, 0 - по числу ядер */
+        std::string storage = "stream"; /**< Запись csv и hst файлов: stream - через потоки файлов, io_uring - асинхронно через io_uring в Linux */
+        uint32_t storage_buffer_size = 4194304; /**< Буфер записей io_uring, регистрируется в ядре */
+        bool storage_fsync = true;      /**< Выполнять fdatasync файлов после записи в режиме io_uring */
+        uint32_t hst_max_open_files = 256;  /**< Максимум одновременно открытых hst файлов, 0 - держать открытыми все */
+        uint32_t hst_version = 400;     /**< Версия формата hst файлов: 400 или 401, который терминал загружает без перевода */
+        std::string path_trace;         /**< Папка для трассы каждого цикла в формате Chrome trace event, пустое - не писать */
+        uint32_t trace_keep = 10;       /**< Количество последних файлов трассы, 0 - хранить все */
+        bool simulation = false;        /**< Моделировать циклы в виртуальном времени на локальной замене сервера */
+        std::string sim_path = "simulation";    /**< Папка для csv и hst файлов моделирования, рабочие файлы не трогаются */
+        uint32_t sim_cycles = 1440;     /**< Количество циклов моделирования */
+        uint32_t sim_symbols = 0;       /**< Количество дополнительных символов SIM00000... для оценки нагрузки */
+        uint32_t sim_latency_ms = 200;  /**< Обычная задержка ответа замены сервера */
+        double sim_slow_ratio = 0.01;   /**< Доля медленных ответов */
+        uint32_t sim_slow_latency_ms = 40000;   /**< Задержка медленного ответа */
+        uint32_t sim_history_days = 365;        /**< Глубина истории замены сервера в днях */
+        std::string sim_report;         /**< csv файл с показателями каждого цикла, пустое - не писать */
+        uint32_t shard_index = 0;       /**< Номер части символов этого процесса */
+        uint32_t shard_count = 1;       /**< Количество частей, на которые делятся символы, 1 - без деления */
 
         bool is_error = false;
 
@@ -28,6 +67,12 @@ namespace mt4_tools {
             /* обрабатываем аргументы командой строки */
             json j;
             bool is_default = false;
+            bool is_shard_arg = false;
+            bool is_shard_error = false;
+            bool is_synthetic_error = false;
+            bool is_sim_cycles_arg = false;
+            bool is_sim_symbols_arg = false;
+            std::string storage_arg;
             if(!mt4_common::process_arguments(
                     argc,
                     argv,
@@ -37,6 +82,37 @@ namespace mt4_tools {
                 /* аргумент json_file указываает на файл с настройками json */
                 if(key == "json_settings_file" || key == "jsf" || key == "jf") {
                     json_settings_file = value;
+                } else
+                /* аргумент zip указывает на архив stooq для разовой загрузки */
+                if(key == "zip" || key == "-zip") {
+                    zip_archive = value;
+                } else
+                if(key == "zip_all" || key == "-zip_all") {
+                    is_zip_all = true;
+                } else
+                if(key == "zip_threads" || key == "-zip_threads") {
+                    zip_threads = (uint32_t)std::atoi(value.c_str());
+                } else
+                /* аргумент shard задает часть символов в виде i/N */
+                if(key == "shard" || key == "-shard") {
+                    if(!parse_shard(value, shard_index, shard_count)) is_shard_error = true;
+                    is_shard_arg = true;
+                } else
+                /* аргумент storage выбирает способ записи файлов */
+                if(key == "storage" || key == "-storage") {
+                    storage_arg = value;
+                } else
+                /* аргумент simulation включает моделирование в виртуальном времени */
+                if(key == "simulation" || key == "-simulation") {
+                    simulation = true;
+                } else
+                if(key == "sim_cycles" || key == "-sim_cycles") {
+                    sim_cycles = (uint32_t)std::atoi(value.c_str());
+                    is_sim_cycles_arg = true;
+                } else
+                if(key == "sim_symbols" || key == "-sim_symbols") {
+                    sim_symbols = (uint32_t)std::atoi(value.c_str());
+                    is_sim_symbols_arg = true;
                 }
             })) {
                 /* параметры не были указаны */
@@ -47,6 +123,7 @@ namespace mt4_tools {
                 is_default = true;
             }
 
+            if(!is_default && json_settings_file.size() == 0) json_settings_file = "config.json";
             if(!is_default && !mt4_common::open_json_file(json_settings_file, j)) {
                 is_error = true;
                 return;
@@ -55,11 +132,56 @@ namespace mt4_tools {
             /* разбираем json сообщение */
             try {
                 if(j["sert_file"] != nullptr) sert_file = j["sert_file"];
+                if(j["api_point"] != nullptr) api_point = j["api_point"];
                 if(j["update_period"] != nullptr) update_period = j["update_period"];
+                if(j["resync_depth"] != nullptr) resync_depth = j["resync_depth"];
+                if(j["resync_period"] != nullptr) resync_period = j["resync_period"];
+                if(j["http2"] != nullptr) http2 = j["http2"];
+                if(j["max_streams"] != nullptr) max_streams = j["max_streams"];
+                if(j["max_connections"] != nullptr) max_connections = j["max_connections"];
+                if(j["http2_prior_knowledge"] != nullptr) http2_prior_knowledge = j["http2_prior_knowledge"];
+                if(j["hedging"] != nullptr) hedging = j["hedging"];
+                if(j["hedge_percentile"] != nullptr) hedge_percentile = j["hedge_percentile"];
+                if(j["quote_snapshots"] != nullptr) quote_snapshots = j["quote_snapshots"];
+                if(j["shm_name"] != nullptr) shm_name = j["shm_name"];
+                if(j["shm_ring_size"] != nullptr) shm_ring_size = j["shm_ring_size"];
+                if(j["ws_port"] != nullptr) ws_port = j["ws_port"];
+                if(j["ws_address"] != nullptr) ws_address = j["ws_address"];
+                if(j["ws_snapshot_size"] != nullptr) ws_snapshot_size = j["ws_snapshot_size"];
+                if(j["ws_max_queue_bytes"] != nullptr) ws_max_queue_bytes = j["ws_max_queue_bytes"];
                 if(j["symbol_hst_suffix"] != nullptr) symbol_hst_suffix = j["symbol_hst_suffix"];
                 if(j["symbol_csv_suffix"] != nullptr) symbol_csv_suffix = j["symbol_csv_suffix"];
                 if(j["path_csv"] != nullptr) path_csv = j["path_csv"];
-                if(j["path_hst"] != nullptr) path_hst = j["path_hst"];
+                if(j["hst_max_open_files"] != nullptr) hst_max_open_files = j["hst_max_open_files"];
+                if(j["hst_version"] != nullptr) hst_version = j["hst_version"];
+                if(j["storage"] != nullptr) storage = j["storage"];
+                if(j["storage_buffer_size"] != nullptr) storage_buffer_size = j["storage_buffer_size"];
+                if(j["storage_fsync"] != nullptr) storage_fsync = j["storage_fsync"];
+                if(j["path_trace"] != nullptr) path_trace = j["path_trace"];
+                if(j["trace_keep"] != nullptr) trace_keep = j["trace_keep"];
+                if(j["simulation"] != nullptr && !simulation) simulation = j["simulation"];
+                if(j["sim_path"] != nullptr) sim_path = j["sim_path"];
+                if(j["sim_cycles"] != nullptr && !is_sim_cycles_arg) sim_cycles = j["sim_cycles"];
+                if(j["sim_symbols"] != nullptr && !is_sim_symbols_arg) sim_symbols = j["sim_symbols"];
+                if(j["sim_latency_ms"] != nullptr) sim_latency_ms = j["sim_latency_ms"];
+                if(j["sim_slow_ratio"] != nullptr) sim_slow_ratio = j["sim_slow_ratio"];
+                if(j["sim_slow_latency_ms"] != nullptr) sim_slow_latency_ms = j["sim_slow_latency_ms"];
+                if(j["sim_history_days"] != nullptr) sim_history_days = j["sim_history_days"];
+                if(j["sim_report"] != nullptr) sim_report = j["sim_report"];
+                if(j["zip_threads"] != nullptr && zip_threads == 0) zip_threads = j["zip_threads"];
+                if(j["shard"] != nullptr && !is_shard_arg) {
+                    if(!parse_shard(j["shard"].get<std::string>(), shard_index, shard_count)) is_shard_error = true;
+                }
+                if(j["path_hst"] != nullptr) {
+                    /* путь может быть строкой или списком путей для нескольких терминалов */
+                    if(j["path_hst"].is_array()) {
+                        for(size_t i = 0; i < j["path_hst"].size(); ++i) {
+                            paths_hst.push_back(j["path_hst"][i].get<std::string>());
+                        }
+                    } else {
+                        paths_hst.push_back(j["path_hst"].get<std::string>());
+                    }
+                }
                 if(j["symbols"] != nullptr && j["symbols"].is_array()) {
                     const size_t symbols_size = j["symbols"].size();
                     for(size_t i = 0; i < symbols_size; ++i) {
@@ -67,8 +189,50 @@ namespace mt4_tools {
                         symbol_config.symbol = j["symbols"][i]["symbol"];
                         symbol_config.period = j["symbols"][i]["period"];
                         symbol_config.digits = j["symbols"][i]["digits"];
+                        json &j_indicators = j["symbols"][i]["indicators"];
+                        if(j_indicators != nullptr && j_indicators.is_array()) {
+                            for(size_t n = 0; n < j_indicators.size(); ++n) {
+                                mt4_common::IndicatorConfig indicator_config;
+                                indicator_config.type = j_indicators[n]["type"];
+                                if(j_indicators[n]["period"] != nullptr) indicator_config.period = j_indicators[n]["period"];
+                                symbol_config.indicators.push_back(indicator_config);
+                            }
+                        }
+                        json &j_synthetic = j["symbols"][i]["synthetic"];
+                        if(j_synthetic != nullptr) {
+                            if(j_synthetic["mode"] != nullptr) symbol_config.synthetic_mode = j_synthetic["mode"];
+                            json &j_legs = j_synthetic["legs"];
+                            if(j_legs != nullptr && j_legs.is_array()) {
+                                for(size_t n = 0; n < j_legs.size(); ++n) {
+                                    mt4_common::SyntheticLegConfig leg_config;
+                                    leg_config.symbol = j_legs[n]["symbol"];
+                                    if(j_legs[n]["power"] != nullptr) leg_config.power = j_legs[n]["power"];
+                                    symbol_config.legs.push_back(leg_config);
+                                }
+                            }
+                            if(symbol_config.legs.size() == 0) is_synthetic_error = true;
+                        }
                         symbols_config.push_back(symbol_config);
                     }
+                    /* составляющие синтетических символов должны загружаться с тем же периодом */
+                    for(size_t i = 0; i < symbols_config.size(); ++i) {
+                        mt4_common::SymbolConfig &symbol_config = symbols_config[i];
+                        if(symbol_config.synthetic_mode != "ohlc" && symbol_config.synthetic_mode != "close") is_synthetic_error = true;
+                        for(size_t n = 0; n < symbol_config.legs.size(); ++n) {
+                            mt4_common::SyntheticLegConfig &leg_config = symbol_config.legs[n];
+                            bool is_found = false;
+                            for(size_t k = 0; k < symbols_config.size(); ++k) {
+                                if(symbols_config[k].symbol == leg_config.symbol &&
+                                    symbols_config[k].period == symbol_config.period &&
+                                    symbols_config[k].legs.size() == 0) {
+                                    leg_config.digits = symbols_config[k].digits;
+                                    is_found = true;
+                                    break;
+                                }
+                            }
+                            if(!is_found || leg_config.power == 0) is_synthetic_error = true;
+                        }
+                    }
                 }
             }
             catch(const json::parse_error& e) {
@@ -87,7 +251,41 @@ namespace mt4_tools {
                 std::cerr << "mt4_tools::Settings parser error" << std::endl;
                 is_error = true;
             }
-            if(symbols_config.size() == 0) is_error = true;
+            if(storage_arg.size() != 0) storage = storage_arg;
+            if(storage != "stream" && storage != "io_uring") {
+                std::cerr << "mt4_tools::Settings error: storage must be stream or io_uring" << std::endl;
+                is_error = true;
+            }
+            if(hst_version != 400 && hst_version != 401) {
+                std::cerr << "mt4_tools::Settings error: hst_version must be 400 or 401" << std::endl;
+                is_error = true;
+            }
+            if(is_synthetic_error) {
+                std::cerr << "mt4_tools::Settings error: synthetic symbol needs legs downloaded with the same period, non-zero powers and mode ohlc or close" << std::endl;
+                is_error = true;
+            }
+            if(is_shard_error) {
+                std::cerr << "mt4_tools::Settings error: shard must be i/N, where i < N" << std::endl;
+                is_error = true;
+            }
+            /* моделирование пишет файлы в свою папку и не публикует бары потребителям */
+            if(simulation) {
+                for(uint32_t i = 0; i < sim_symbols; ++i) {
+                    mt4_common::SymbolConfig symbol_config;
+                    const std::string number = std::to_string(i);
+                    symbol_config.symbol = "SIM" + std::string(number.size() < 5 ? 5 - number.size() : 0, '0') + number;
+                    symbol_config.digits = 4;
+                    symbols_config.push_back(symbol_config);
+                }
+                path_csv = sim_path;
+                paths_hst.clear();
+                paths_hst.push_back(sim_path);
+                shm_name.clear();
+                ws_port = 0;
+                zip_archive.clear();
+            }
+            if(paths_hst.size() == 0) paths_hst.push_back(std::string());
+            if(symbols_config.size() == 0 && !(zip_archive.size() != 0 && is_zip_all)) is_error = true;
         }
     };
 }
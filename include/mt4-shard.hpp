@@ -0,0 +1,235 @@
+#ifndef MT4_SHARD_HPP_INCLUDED
+#define MT4_SHARD_HPP_INCLUDED
+
+#include <nlohmann/json.hpp>
+#include <string>
+#include <fstream>
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <cstdint>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#include <process.h>
+#else
+#include <sys/types.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+namespace mt4_tools {
+
+    /** \brief Разобрать номер части в виде i/N
+     *
+     * Части нумеруются с нуля, например 0/4, 1/4, 2/4 и 3/4
+     * \param value Строка вида i/N
+     * \param index Номер части
+     * \param count Количество частей
+     * \return Вернет true, если строка корректна
+     */
+    bool parse_shard(const std::string &value, uint32_t &index, uint32_t &count) {
+        const size_t slash = value.find('/');
+        if(slash == std::string::npos || slash == 0 || slash + 1 >= value.size()) return false;
+        for(size_t i = 0; i < value.size(); ++i) {
+            if(i != slash && (value[i] < '0' || value[i] > '9')) return false;
+        }
+        const uint32_t user_index = (uint32_t)std::atoi(value.substr(0, slash).c_str());
+        const uint32_t user_count = (uint32_t)std::atoi(value.substr(slash + 1).c_str());
+        if(user_count == 0 || user_index >= user_count) return false;
+        index = user_index;
+        count = user_count;
+        return true;
+    }
+
+    /** \brief Получить номер части для символа
+     *
+     * Используется хеш FNV-1a от имени символа, поэтому распределение
+     * не зависит от порядка символов в настройках, платформы и процесса
+     * \param symbol Имя символа
+     * \param count Количество частей
+     * \return Номер части
+     */
+    uint32_t get_symbol_shard(const std::string &symbol, const uint32_t count) {
+        if(count <= 1) return 0;
+        uint64_t hash = 14695981039346656037ULL;
+        for(size_t i = 0; i < symbol.size(); ++i) {
+            hash ^= (uint8_t)symbol[i];
+            hash *= 1099511628211ULL;
+        }
+        /* младшие биты FNV-1a зависят только от младших битов символов,
+         * поэтому перед делением на количество частей хеш перемешивается */
+        hash ^= hash >> 33;
+        hash *= 0xff51afd7ed558ccdULL;
+        hash ^= hash >> 33;
+        hash *= 0xc4ceb9fe1a85ec53ULL;
+        hash ^= hash >> 33;
+        return (uint32_t)(hash % count);
+    }
+
+    /** \brief Получить идентификатор процесса
+     */
+    inline int get_process_id() {
+#ifdef _WIN32
+        return (int)_getpid();
+#else
+        return (int)getpid();
+#endif
+    }
+
+    /** \brief Рекомендательная блокировка файла символа
+     *
+     * Пока объект существует, другой процесс не сможет захватить тот же файл.
+     * Блокировку держит система, поэтому после падения процесса она
+     * снимается сама и не требует ручной очистки
+     */
+    class SymbolLock {
+    private:
+        std::string file_name;
+#ifdef _WIN32
+        HANDLE handle = INVALID_HANDLE_VALUE;
+#else
+        int fd = -1;
+#endif
+
+    public:
+
+        SymbolLock() {};
+
+        SymbolLock(const SymbolLock&) = delete;
+        SymbolLock &operator=(const SymbolLock&) = delete;
+
+        ~SymbolLock() {
+            unlock();
+        }
+
+        /** \brief Захватить файл блокировки
+         * \param user_file_name Имя файла блокировки
+         * \return Вернет true, если файл захвачен этим процессом
+         */
+        bool lock(const std::string &user_file_name) {
+            unlock();
+            file_name = user_file_name;
+            const std::string pid = std::to_string(get_process_id()) + "\n";
+#ifdef _WIN32
+            handle = CreateFileA(
+                file_name.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE,
+                NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+            if(handle == INVALID_HANDLE_VALUE) return false;
+            OVERLAPPED overlapped;
+            std::memset(&overlapped, 0, sizeof(overlapped));
+            if(!LockFileEx(handle, LOCKFILE_EXCLUSIVE_LOCK | LOCKFILE_FAIL_IMMEDIATELY, 0, 1, 0, &overlapped)) {
+                CloseHandle(handle);
+                handle = INVALID_HANDLE_VALUE;
+                return false;
+            }
+            /* номер процесса пишем после заблокированного байта, чтобы файл можно было прочитать */
+            SetFilePointer(handle, 1, NULL, FILE_BEGIN);
+            SetEndOfFile(handle);
+            DWORD written = 0;
+            WriteFile(handle, pid.c_str(), (DWORD)pid.size(), &written, NULL);
+#else
+            fd = ::open(file_name.c_str(), O_RDWR | O_CREAT, 0644);
+            if(fd < 0) return false;
+            /* блокировки fcntl, в отличие от flock, работают и на сетевых папках NFS */
+            struct flock fl;
+            std::memset(&fl, 0, sizeof(fl));
+            fl.l_type = F_WRLCK;
+            fl.l_whence = SEEK_SET;
+            fl.l_start = 0;
+            fl.l_len = 0;
+            if(fcntl(fd, F_SETLK, &fl) != 0) {
+                ::close(fd);
+                fd = -1;
+                return false;
+            }
+            /* номер процесса нужен только для диагностики, ошибки записи не важны */
+            if(ftruncate(fd, 0) == 0) {
+                const ssize_t written = pwrite(fd, pid.c_str(), pid.size(), 0);
+                (void)written;
+            }
+#endif
+            return true;
+        }
+
+        void unlock() {
+#ifdef _WIN32
+            if(handle == INVALID_HANDLE_VALUE) return;
+            OVERLAPPED overlapped;
+            std::memset(&overlapped, 0, sizeof(overlapped));
+            UnlockFileEx(handle, 0, 1, 0, &overlapped);
+            CloseHandle(handle);
+            handle = INVALID_HANDLE_VALUE;
+#else
+            if(fd < 0) return;
+            ::close(fd);
+            fd = -1;
+#endif
+        }
+
+        inline bool is_locked() const {
+#ifdef _WIN32
+            return handle != INVALID_HANDLE_VALUE;
+#else
+            return fd >= 0;
+#endif
+        }
+    };
+
+    /** \brief Файл состояния части символов
+     *
+     * Файл в формате JSON перезаписывается через временный файл, поэтому
+     * внешний мониторинг всегда читает целую запись
+     */
+    class ShardStatus {
+    public:
+        uint32_t shard_index = 0;
+        uint32_t shard_count = 1;
+        size_t symbols = 0;             /**< Символы, захваченные процессом */
+        size_t skipped = 0;             /**< Символы части, захваченные другим процессом */
+        uint64_t cycle = 0;             /**< Номер цикла обновления */
+        size_t processed = 0;           /**< Символы, обработанные в текущем цикле */
+        size_t errors = 0;              /**< Ошибки загрузки в текущем цикле */
+        std::string state = "start";    /**< start, update или wait */
+        uint64_t cycle_start = 0;       /**< Время начала цикла */
+        uint64_t last_update = 0;       /**< Время завершения последнего цикла */
+        double cycle_seconds = 0;       /**< Длительность последнего цикла */
+
+        ShardStatus() {};
+
+        /** \brief Записать файл состояния
+         * \param file_name Имя файла
+         * \return Вернет true в случае успешного завершения
+         */
+        bool write(const std::string &file_name) const {
+            nlohmann::json j;
+            j["shard"] = std::to_string(shard_index) + "/" + std::to_string(shard_count);
+            j["pid"] = get_process_id();
+            j["state"] = state;
+            j["symbols"] = symbols;
+            j["skipped"] = skipped;
+            j["cycle"] = cycle;
+            j["processed"] = processed;
+            j["errors"] = errors;
+            j["cycle_start"] = cycle_start;
+            j["last_update"] = last_update;
+            j["cycle_seconds"] = cycle_seconds;
+            const std::string temp_file_name = file_name + ".tmp";
+            {
+                std::ofstream file(temp_file_name, std::ios::out | std::ios::trunc);
+                if(!file.is_open()) return false;
+                file << j.dump(4) << std::endl;
+            }
+#ifdef _WIN32
+            return MoveFileExA(temp_file_name.c_str(), file_name.c_str(), MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+            return std::rename(temp_file_name.c_str(), file_name.c_str()) == 0;
+#endif
+        }
+    };
+}
+
+#endif // MT4_SHARD_HPP_INCLUDED
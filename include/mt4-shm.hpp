@@ -0,0 +1,442 @@
+#ifndef MT4_SHM_HPP_INCLUDED
+#define MT4_SHM_HPP_INCLUDED
+
+/* Данный файл не зависит от других библиотек проекта и может
+ * подключаться потребителями данных (стратегиями, DLL для советников MT4) отдельно.
+ * На Linux может понадобиться линковка с -lrt
+ */
+
+#include <atomic>
+#include <string>
+#include <cstring>
+#include <cstdint>
+#include <functional>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#if ATOMIC_INT_LOCK_FREE != 2 || ATOMIC_LLONG_LOCK_FREE != 2
+#error "mt4-shm.hpp requires lock-free 32 and 64 bit atomics"
+#endif
+
+namespace mt4_tools {
+
+    static const uint32_t SHM_MAGIC = 0x51545453;   /**< "STTQ" */
+    static const uint32_t SHM_VERSION = 1;
+    static const size_t SHM_MAX_READ_ATTEMPTS = 1000000;
+
+    /// Типы событий в кольцевом буфере
+    enum ShmEventTypes {
+        SHM_EVENT_UPDATE = 0,   ///< Бар изменился (текущий бар или исправление истории)
+        SHM_EVENT_NEW_BAR = 1,  ///< Появился новый бар
+    };
+
+    /* Все структуры состоят из полей по 8 байт или пар полей по 4 байта,
+     * поэтому их расположение одинаково в 32 и 64 битных программах
+     */
+
+    /** \brief Бар в разделяемой памяти
+     */
+    struct ShmCandle {
+        int64_t timestamp;
+        double open;
+        double high;
+        double low;
+        double close;
+        double volume;
+    };
+
+    /** \brief Последний бар символа, защищенный seqlock
+     */
+    struct ShmSlot {
+        char symbol[32];
+        uint32_t period;
+        uint32_t digits;
+        std::atomic<uint32_t> sequence;     /**< Нечетное значение - идет запись */
+        uint32_t reserved;
+        uint64_t updates;                   /**< Количество обновлений */
+        ShmCandle candle;
+        char padding[24];
+    };
+
+    /** \brief Событие в кольцевом буфере
+     */
+    struct ShmEvent {
+        std::atomic<uint64_t> sequence;     /**< 2 * номер события + 2 после записи, нечетное - идет запись */
+        uint32_t slot;
+        uint32_t type;
+        ShmCandle candle;
+    };
+
+    /** \brief Заголовок разделяемой памяти
+     */
+    struct ShmHeader {
+        uint32_t magic;
+        uint32_t version;
+        uint32_t max_slots;
+        uint32_t ring_size;
+        std::atomic<uint32_t> slots_used;
+        uint32_t reserved;
+        std::atomic<uint64_t> ring_head;    /**< Количество опубликованных событий */
+        uint64_t padding[4];
+    };
+
+    static_assert(sizeof(ShmCandle) == 48, "ShmCandle layout");
+    static_assert(sizeof(ShmSlot) == 128, "ShmSlot layout");
+    static_assert(sizeof(ShmEvent) == 64, "ShmEvent layout");
+    static_assert(sizeof(ShmHeader) == 64, "ShmHeader layout");
+
+    /** \brief Отображение именованной разделяемой памяти
+     */
+    class ShmSegment {
+    private:
+        std::string name;
+        char *data = nullptr;
+        size_t size = 0;
+        bool is_owner = false;
+#ifdef _WIN32
+        HANDLE handle = NULL;
+#endif
+
+    public:
+
+        ShmSegment() {};
+
+        ShmSegment(const ShmSegment&) = delete;
+        ShmSegment &operator=(const ShmSegment&) = delete;
+
+        ~ShmSegment() {
+            close();
+        }
+
+        /** \brief Создать или открыть разделяемую память
+         * \param user_name Имя без префиксов, например "mt4-stooq"
+         * \param user_size Размер в байтах. Для открытия существующей памяти можно передать 0
+         * \param is_create Создать память (для писателя) или открыть существующую (для читателя)
+         * \return Вернет true в случае успешного завершения
+         */
+        bool open(const std::string &user_name, const size_t user_size, const bool is_create) {
+            close();
+            name = user_name;
+            is_owner = is_create;
+#ifdef _WIN32
+            const std::string win_name = "Local\\" + name;
+            if(is_create) {
+                const uint64_t full_size = user_size;
+                handle = CreateFileMappingA(
+                    INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE,
+                    (DWORD)(full_size >> 32), (DWORD)(full_size & 0xFFFFFFFF),
+                    win_name.c_str());
+            } else {
+                handle = OpenFileMappingA(FILE_MAP_READ, FALSE, win_name.c_str());
+            }
+            if(handle == NULL) return false;
+            void *ptr = MapViewOfFile(handle, is_create ? FILE_MAP_ALL_ACCESS : FILE_MAP_READ, 0, 0, 0);
+            if(ptr == NULL) {
+                CloseHandle(handle);
+                handle = NULL;
+                return false;
+            }
+            MEMORY_BASIC_INFORMATION info;
+            VirtualQuery(ptr, &info, sizeof(info));
+            size = is_create ? user_size : (size_t)info.RegionSize;
+            data = (char*)ptr;
+#else
+            const std::string posix_name = "/" + name;
+            const int fd = is_create ?
+                shm_open(posix_name.c_str(), O_CREAT | O_RDWR, 0644) :
+                shm_open(posix_name.c_str(), O_RDONLY, 0);
+            if(fd < 0) return false;
+            if(is_create) {
+                if(ftruncate(fd, (off_t)user_size) != 0) {
+                    ::close(fd);
+                    return false;
+                }
+                size = user_size;
+            } else {
+                struct stat st;
+                if(fstat(fd, &st) != 0) {
+                    ::close(fd);
+                    return false;
+                }
+                size = (size_t)st.st_size;
+            }
+            void *ptr = mmap(NULL, size, is_create ? (PROT_READ | PROT_WRITE) : PROT_READ, MAP_SHARED, fd, 0);
+            ::close(fd);
+            if(ptr == MAP_FAILED) return false;
+            data = (char*)ptr;
+#endif
+            return true;
+        }
+
+        void close() {
+            if(data == nullptr) return;
+#ifdef _WIN32
+            UnmapViewOfFile(data);
+            CloseHandle(handle);
+            handle = NULL;
+#else
+            munmap(data, size);
+            if(is_owner) shm_unlink(("/" + name).c_str());
+#endif
+            data = nullptr;
+            size = 0;
+        }
+
+        inline char *get() const {
+            return data;
+        }
+
+        inline size_t get_size() const {
+            return size;
+        }
+    };
+
+    /** \brief Класс для публикации баров в разделяемую память
+     *
+     * Писатель должен быть один. В памяти хранится таблица последних баров
+     * символов (каждый под своим seqlock) и кольцевой буфер событий.
+     * Кольцевой буфер не блокирует писателя: медленный читатель теряет
+     * перезаписанные события и узнает об этом при чтении.
+     */
+    class ShmPublisher {
+    private:
+        ShmSegment segment;
+        ShmHeader *header = nullptr;
+        ShmSlot *slots = nullptr;
+        ShmEvent *events = nullptr;
+
+        template<class CANDLE_TYPE>
+        static inline void copy_candle(ShmCandle &out, const CANDLE_TYPE &candle) {
+            out.timestamp = (int64_t)candle.timestamp;
+            out.open = candle.open;
+            out.high = candle.high;
+            out.low = candle.low;
+            out.close = candle.close;
+            out.volume = candle.volume;
+        }
+
+    public:
+
+        ShmPublisher() {};
+
+        /** \brief Создать разделяемую память
+         * \param name Имя разделяемой памяти
+         * \param max_slots Максимальное количество символов
+         * \param ring_size Размер кольцевого буфера событий
+         * \return Вернет true в случае успешного завершения
+         */
+        bool open(const std::string &name, const uint32_t max_slots, const uint32_t ring_size) {
+            if(max_slots == 0 || ring_size == 0) return false;
+            const size_t size = sizeof(ShmHeader) + max_slots * sizeof(ShmSlot) + ring_size * sizeof(ShmEvent);
+            if(!segment.open(name, size, true)) return false;
+            char *data = segment.get();
+            std::memset(data, 0, size);
+            header = reinterpret_cast<ShmHeader*>(data);
+            slots = reinterpret_cast<ShmSlot*>(data + sizeof(ShmHeader));
+            events = reinterpret_cast<ShmEvent*>(data + sizeof(ShmHeader) + max_slots * sizeof(ShmSlot));
+            header->max_slots = max_slots;
+            header->ring_size = ring_size;
+            header->slots_used.store(0, std::memory_order_relaxed);
+            header->ring_head.store(0, std::memory_order_relaxed);
+            header->version = SHM_VERSION;
+            /* magic записываем последним, после него заголовок считается готовым */
+            std::atomic_thread_fence(std::memory_order_release);
+            header->magic = SHM_MAGIC;
+            return true;
+        }
+
+        inline bool is_open() const {
+            return header != nullptr;
+        }
+
+        /** \brief Зарегистрировать символ
+         * \param symbol Имя символа
+         * \param period Период в минутах
+         * \param digits Количество знаков после запятой
+         * \return Индекс слота или -1, если места нет
+         */
+        int add_slot(const std::string &symbol, const uint32_t period, const uint32_t digits) {
+            if(header == nullptr) return -1;
+            const uint32_t index = header->slots_used.load(std::memory_order_relaxed);
+            if(index >= header->max_slots) return -1;
+            ShmSlot &slot = slots[index];
+            std::strncpy(slot.symbol, symbol.c_str(), sizeof(slot.symbol) - 1);
+            slot.period = period;
+            slot.digits = digits;
+            header->slots_used.store(index + 1, std::memory_order_release);
+            return (int)index;
+        }
+
+        /** \brief Опубликовать бар
+         * \param slot_index Индекс слота, см. add_slot
+         * \param candle Бар (любая структура с полями timestamp, open, high, low, close, volume)
+         * \param type Тип события, см. ShmEventTypes
+         * \param is_latest Обновить таблицу последних баров
+         */
+        template<class CANDLE_TYPE>
+        void publish(const int slot_index, const CANDLE_TYPE &candle, const uint32_t type, const bool is_latest = true) {
+            if(header == nullptr || slot_index < 0 || (uint32_t)slot_index >= header->max_slots) return;
+            if(is_latest) {
+                ShmSlot &slot = slots[slot_index];
+                const uint32_t seq = slot.sequence.load(std::memory_order_relaxed);
+                slot.sequence.store(seq + 1, std::memory_order_relaxed);
+                std::atomic_thread_fence(std::memory_order_release);
+                copy_candle(slot.candle, candle);
+                ++slot.updates;
+                slot.sequence.store(seq + 2, std::memory_order_release);
+            }
+            const uint64_t head = header->ring_head.load(std::memory_order_relaxed);
+            ShmEvent &event = events[head % header->ring_size];
+            event.sequence.store(2 * head + 1, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_release);
+            event.slot = (uint32_t)slot_index;
+            event.type = type;
+            copy_candle(event.candle, candle);
+            event.sequence.store(2 * head + 2, std::memory_order_release);
+            header->ring_head.store(head + 1, std::memory_order_release);
+        }
+    };
+
+    /** \brief Класс для чтения баров из разделяемой памяти
+     *
+     * Читателей может быть сколько угодно, каждый ведет свою позицию в кольцевом буфере
+     */
+    class ShmReader {
+    private:
+        ShmSegment segment;
+        const ShmHeader *header = nullptr;
+        const ShmSlot *slots = nullptr;
+        const ShmEvent *events = nullptr;
+        uint64_t cursor = 0;    /**< Номер следующего события */
+        uint64_t lost = 0;      /**< Количество потерянных событий */
+
+    public:
+
+        ShmReader() {};
+
+        /** \brief Открыть разделяемую память
+         * \param name Имя разделяемой памяти
+         * \return Вернет true в случае успешного завершения
+         */
+        bool open(const std::string &name) {
+            header = nullptr;
+            if(!segment.open(name, 0, false)) return false;
+            if(segment.get_size() < sizeof(ShmHeader)) return false;
+            const ShmHeader *temp = reinterpret_cast<const ShmHeader*>(segment.get());
+            if(temp->magic != SHM_MAGIC || temp->version != SHM_VERSION) return false;
+            std::atomic_thread_fence(std::memory_order_acquire);
+            const size_t size = sizeof(ShmHeader) + temp->max_slots * sizeof(ShmSlot) + temp->ring_size * sizeof(ShmEvent);
+            if(segment.get_size() < size) return false;
+            header = temp;
+            slots = reinterpret_cast<const ShmSlot*>(segment.get() + sizeof(ShmHeader));
+            events = reinterpret_cast<const ShmEvent*>(segment.get() + sizeof(ShmHeader) + header->max_slots * sizeof(ShmSlot));
+            cursor = header->ring_head.load(std::memory_order_acquire);
+            return true;
+        }
+
+        inline bool is_open() const {
+            return header != nullptr;
+        }
+
+        /** \brief Найти слот символа
+         * \param symbol Имя символа
+         * \param period Период в минутах
+         * \return Индекс слота или -1, если символ не найден
+         */
+        int find_slot(const std::string &symbol, const uint32_t period) const {
+            if(header == nullptr) return -1;
+            const uint32_t used = header->slots_used.load(std::memory_order_acquire);
+            for(uint32_t i = 0; i < used; ++i) {
+                if(slots[i].period == period && std::strncmp(slots[i].symbol, symbol.c_str(), sizeof(slots[i].symbol)) == 0) {
+                    return (int)i;
+                }
+            }
+            return -1;
+        }
+
+        /** \brief Получить имя символа слота
+         * \param slot_index Индекс слота
+         * \return Имя символа
+         */
+        std::string get_symbol(const int slot_index) const {
+            if(header == nullptr || slot_index < 0 || (uint32_t)slot_index >= header->slots_used.load(std::memory_order_acquire)) return std::string();
+            return std::string(slots[slot_index].symbol, strnlen(slots[slot_index].symbol, sizeof(slots[slot_index].symbol)));
+        }
+
+        /** \brief Прочитать последний бар символа
+         * \param slot_index Индекс слота
+         * \param candle Бар
+         * \return Вернет false, если бар еще не публиковался
+         */
+        bool get_latest(const int slot_index, ShmCandle &candle) const {
+            if(header == nullptr || slot_index < 0 || (uint32_t)slot_index >= header->max_slots) return false;
+            const ShmSlot &slot = slots[slot_index];
+            /* ограничиваем число попыток на случай, если писатель завершился посреди записи */
+            for(size_t attempt = 0; attempt < SHM_MAX_READ_ATTEMPTS; ++attempt) {
+                const uint32_t seq_beg = slot.sequence.load(std::memory_order_acquire);
+                if(seq_beg & 1) continue;
+                std::memcpy(&candle, &slot.candle, sizeof(ShmCandle));
+                std::atomic_thread_fence(std::memory_order_acquire);
+                const uint32_t seq_end = slot.sequence.load(std::memory_order_relaxed);
+                if(seq_beg == seq_end) return seq_beg != 0;
+            }
+            return false;
+        }
+
+        /** \brief Прочитать новые события
+         * \param f Лямбда-функция, получающая индекс слота, тип события и бар
+         * \param max_events Максимальное количество событий за вызов
+         * \return Количество прочитанных событий
+         */
+        size_t poll(
+                std::function<void(const int slot_index, const uint32_t type, const ShmCandle &candle)> f,
+                const size_t max_events = 1024) {
+            if(header == nullptr) return 0;
+            size_t count = 0;
+            while(count < max_events) {
+                const uint64_t head = header->ring_head.load(std::memory_order_acquire);
+                if(cursor >= head) break;
+                if((head - cursor) > header->ring_size) {
+                    /* писатель обогнал читателя на весь буфер */
+                    lost += (head - header->ring_size) - cursor;
+                    cursor = head - header->ring_size;
+                }
+                const ShmEvent &event = events[cursor % header->ring_size];
+                const uint64_t seq_beg = event.sequence.load(std::memory_order_acquire);
+                if(seq_beg != 2 * cursor + 2) {
+                    if(seq_beg < 2 * cursor + 2) break; // событие еще пишется
+                    ++lost;
+                    ++cursor;
+                    continue;
+                }
+                ShmCandle candle;
+                std::memcpy(&candle, &event.candle, sizeof(ShmCandle));
+                const int slot_index = (int)event.slot;
+                const uint32_t type = event.type;
+                std::atomic_thread_fence(std::memory_order_acquire);
+                const uint64_t seq_end = event.sequence.load(std::memory_order_relaxed);
+                ++cursor;
+                if(seq_end != seq_beg) {
+                    ++lost;
+                    continue;
+                }
+                if(f != nullptr) f(slot_index, type, candle);
+                ++count;
+            }
+            return count;
+        }
+
+        inline uint64_t get_lost_events() const {
+            return lost;
+        }
+    };
+}
+
+#endif // MT4_SHM_HPP_INCLUDED
@@ -0,0 +1,209 @@
+#ifndef MT4_SIMULATION_HPP_INCLUDED
+#define MT4_SIMULATION_HPP_INCLUDED
+
+#include "xquotes_common.hpp"
+#include "mt4-clock.hpp"
+#include <string>
+#include <functional>
+#include <random>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <sys/time.h>
+#include <sys/resource.h>
+#endif
+
+namespace mt4_tools {
+
+    /** \brief Локальная замена сервера данных для моделирования работы загрузчика
+     *
+     * Бары генерируются по имени символа и метке времени без хранения состояния,
+     * поэтому повторный запрос того же бара дает те же цены, а текущий бар
+     * меняется вместе с часами, как у настоящего сервера. Задержка ответа
+     * выбирается случайно: обычно около latency_ms, с долей slow_ratio -
+     * slow_latency_ms. Ответ приходит мгновенно, а задержку вызывающий код
+     * переводит в часы через advance(), чтобы одновременные запросы
+     * занимали время самого медленного из них
+     */
+    class SimulatedServer {
+    public:
+
+        /** \brief Параметры модели
+         */
+        class Config {
+        public:
+            uint32_t latency_ms = 200;          /**< Обычная задержка ответа */
+            double slow_ratio = 0.01;           /**< Доля медленных ответов */
+            uint32_t slow_latency_ms = 40000;   /**< Задержка медленного ответа */
+            uint32_t history_days = 365;        /**< Глубина истории сервера в днях */
+            uint32_t seed = 1;
+
+            Config() {};
+        };
+
+    private:
+        Config config;
+        Clock *clock = nullptr;
+        std::mt19937 rng;
+        uint64_t requests = 0;
+        uint64_t candles = 0;
+
+        static uint64_t get_hash(const std::string &symbol, const uint64_t value) {
+            uint64_t hash = 14695981039346656037ULL;
+            for(size_t i = 0; i < symbol.size(); ++i) {
+                hash ^= (uint8_t)symbol[i];
+                hash *= 1099511628211ULL;
+            }
+            hash ^= value;
+            hash ^= hash >> 33;
+            hash *= 0xff51afd7ed558ccdULL;
+            hash ^= hash >> 33;
+            hash *= 0xc4ceb9fe1a85ec53ULL;
+            hash ^= hash >> 33;
+            return hash;
+        }
+
+        static inline double to_unit(const uint64_t hash) {
+            return (double)(hash >> 11) / 9007199254740992.0;
+        }
+
+        /** \brief Получить цену символа в момент времени
+         *
+         * Цена колеблется в пределах 2% около базовой цены символа.
+         * Округление до 4 знаков позволяет записать цену с любым digits от 4
+         */
+        static double get_price(const std::string &symbol, const xtime::timestamp_t timestamp) {
+            const double base = 1.0 + std::floor(to_unit(get_hash(symbol, 0)) * 200.0);
+            const double price = base * (1.0 + 0.02 * (to_unit(get_hash(symbol, (uint64_t)timestamp)) - 0.5));
+            return std::round(price * 10000.0) / 10000.0;
+        }
+
+        static xquotes_common::Candle get_candle(
+                const std::string &symbol,
+                const xtime::timestamp_t timestamp,
+                const xtime::timestamp_t timestamp_close) {
+            xquotes_common::Candle candle;
+            candle.timestamp = timestamp;
+            candle.open = get_price(symbol, timestamp);
+            candle.close = get_price(symbol, timestamp_close);
+            candle.high = std::max(candle.open, candle.close) + std::round(to_unit(get_hash(symbol, timestamp ^ 0x1)) * candle.open * 10.0) / 10000.0;
+            candle.low = std::min(candle.open, candle.close) - std::round(to_unit(get_hash(symbol, timestamp ^ 0x2)) * candle.open * 10.0) / 10000.0;
+            candle.volume = (double)(get_hash(symbol, timestamp ^ 0x3) % 100000);
+            return candle;
+        }
+
+    public:
+
+        SimulatedServer(Clock &user_clock, const Config &user_config = Config()) :
+            config(user_config), clock(&user_clock), rng(user_config.seed) {};
+
+        /** \brief Получить задержку следующего ответа
+         */
+        std::chrono::milliseconds get_latency() {
+            ++requests;
+            std::uniform_real_distribution<double> uniform(0.0, 1.0);
+            if(uniform(rng) < config.slow_ratio) return std::chrono::milliseconds(config.slow_latency_ms);
+            /* разброс обычной задержки от половины до полуторной */
+            return std::chrono::milliseconds((int64_t)((double)config.latency_ms * (0.5 + uniform(rng))));
+        }
+
+        /** \brief Перевести часы на время ожидания ответа
+         */
+        void advance(const std::chrono::milliseconds &latency) {
+            clock->advance(latency);
+        }
+
+        /** \brief Получить историю
+         * \param symbol Имя символа
+         * \param period Период в минутах
+         * \param start_date Дата начала
+         * \param stop_date Дата конца (включительно)
+         * \param f Лямбда-функция для приема баров
+         */
+        void get_history(
+                const std::string &symbol,
+                const uint32_t period,
+                const xtime::timestamp_t start_date,
+                const xtime::timestamp_t stop_date,
+                const std::function<void(const xquotes_common::Candle &candle)> &f) {
+            if(period == 0) return;
+            const xtime::timestamp_t now = clock->get_timestamp();
+            const xtime::timestamp_t step = (xtime::timestamp_t)period * xtime::SECONDS_IN_MINUTE;
+            const xtime::timestamp_t history_beg = now > (xtime::timestamp_t)config.history_days * xtime::SECONDS_IN_DAY ?
+                now - (xtime::timestamp_t)config.history_days * xtime::SECONDS_IN_DAY : 0;
+            const xtime::timestamp_t stop = std::min(now, stop_date + xtime::SECONDS_IN_DAY - 1);
+            xtime::timestamp_t timestamp = std::max(start_date, history_beg);
+            timestamp = timestamp - (timestamp % step) + (timestamp % step != 0 ? step : 0);
+            for(; timestamp <= stop; timestamp += step) {
+                /* текущий бар закрывается ценой на момент запроса */
+                const xtime::timestamp_t timestamp_close = std::min(timestamp + step, now);
+                if(f != nullptr) f(get_candle(symbol, timestamp, timestamp_close));
+                ++candles;
+            }
+        }
+
+        /** \brief Получить текущий дневной бар
+         * \param symbol Имя символа
+         * \param candle Бар
+         */
+        void get_quote(const std::string &symbol, xquotes_common::Candle &candle) {
+            const xtime::timestamp_t now = clock->get_timestamp();
+            candle = get_candle(symbol, xtime::get_first_timestamp_day(now), now);
+        }
+
+        inline uint64_t get_requests() const {
+            return requests;
+        }
+
+        inline uint64_t get_candles() const {
+            return candles;
+        }
+    };
+
+    /** \brief Потребление ресурсов процессом
+     */
+    class ResourceUsage {
+    public:
+        double cpu_seconds = 0;     /**< Время процессора в режиме пользователя и ядра */
+        uint64_t max_rss = 0;       /**< Пиковый объем резидентной памяти в байтах, 0 - неизвестно */
+
+        ResourceUsage() {};
+
+        /** \brief Получить потребление ресурсов текущим процессом
+         */
+        static ResourceUsage get() {
+            ResourceUsage usage;
+#ifdef _WIN32
+            FILETIME creation_time, exit_time, kernel_time, user_time;
+            if(GetProcessTimes(GetCurrentProcess(), &creation_time, &exit_time, &kernel_time, &user_time)) {
+                const uint64_t kernel = ((uint64_t)kernel_time.dwHighDateTime << 32) | kernel_time.dwLowDateTime;
+                const uint64_t user = ((uint64_t)user_time.dwHighDateTime << 32) | user_time.dwLowDateTime;
+                usage.cpu_seconds = (double)(kernel + user) / 10000000.0;
+            }
+#else
+            struct rusage ru;
+            if(getrusage(RUSAGE_SELF, &ru) == 0) {
+                usage.cpu_seconds =
+                    (double)ru.ru_utime.tv_sec + (double)ru.ru_utime.tv_usec / 1000000.0 +
+                    (double)ru.ru_stime.tv_sec + (double)ru.ru_stime.tv_usec / 1000000.0;
+#ifdef __APPLE__
+                usage.max_rss = (uint64_t)ru.ru_maxrss;
+#else
+                usage.max_rss = (uint64_t)ru.ru_maxrss * 1024;
+#endif
+            }
+#endif
+            return usage;
+        }
+    };
+}
+
+#endif // MT4_SIMULATION_HPP_INCLUDED
@@ -0,0 +1,233 @@
+#ifndef MT4_STOOQ_ARCHIVE_HPP_INCLUDED
+#define MT4_STOOQ_ARCHIVE_HPP_INCLUDED
+
+#include "mt4-zip.hpp"
+#include "mt4-csv.hpp"
+#include "mt4-hst.hpp"
+#include "mt4-common.hpp"
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <chrono>
+#include <cstdlib>
+
+namespace mt4_tools {
+
+    /** \brief Класс для загрузки архивов stooq со всем рынком
+     *
+     * Архив содержит по одному текстовому файлу на инструмент, строки вида
+     * <TICKER>,<PER>,<DATE>,<TIME>,<OPEN>,<HIGH>,<LOW>,<CLOSE>,<VOL>,<OPENINT>.
+     * Файлы распаковываются и разбираются параллельно, каждый файл записывается
+     * в csv и hst файлы так же, как их записывает загрузчик.
+     */
+    class StooqArchiveIngest {
+    public:
+
+        /** \brief Параметры загрузки архива
+         */
+        class Config {
+        public:
+            std::vector<mt4_common::SymbolConfig> symbols; /**< Символы для загрузки и их точность */
+            std::string path_csv;
+            std::vector<std::string> paths_hst;
+            std::string symbol_csv_suffix;
+            std::string symbol_hst_suffix;
+            HstVersions hst_version = HstVersions::V400;
+            uint32_t threads = 0;           /**< Количество потоков, 0 - по числу ядер */
+            bool is_all = false;            /**< Загрузить все файлы архива, а не только symbols */
+
+            Config() {};
+        };
+
+        /** \brief Статистика загрузки
+         */
+        class Stats {
+        public:
+            size_t files = 0;
+            size_t candles = 0;
+            size_t errors = 0;
+            double seconds = 0;
+
+            Stats() {};
+        };
+
+        /** \brief Разобрать строку файла из архива
+         * \param begin Начало строки
+         * \param end Конец строки
+         * \param period Период в минутах
+         * \param candle Бар
+         * \return Вернет true, если строка содержит бар
+         */
+        static bool parse_line(const char *begin, const char *end, uint32_t &period, xquotes_common::Candle &candle) {
+            const char *ptr = (const char*)std::memchr(begin, ',', end - begin);
+            if(ptr == nullptr || begin[0] == '<') return false;
+            ++ptr;
+            /* период: D, W, M или количество минут */
+            const char *per_end = (const char*)std::memchr(ptr, ',', end - ptr);
+            if(per_end == nullptr || per_end == ptr) return false;
+            if(*ptr == 'D') period = xtime::MINUTES_IN_DAY;
+            else if(*ptr == 'W') period = 10080;
+            else if(*ptr == 'M') period = 40320;
+            else period = (uint32_t)std::atoi(ptr);
+            ptr = per_end + 1;
+            /* дата YYYYMMDD и время HHMMSS */
+            if((end - ptr) < 16 || ptr[8] != ',' || ptr[15] != ',') return false;
+            int values[14];
+            for(size_t i = 0; i < 8; ++i) values[i] = ptr[i] - '0';
+            for(size_t i = 0; i < 6; ++i) values[8 + i] = ptr[9 + i] - '0';
+            for(size_t i = 0; i < 14; ++i) {
+                if(values[i] < 0 || values[i] > 9) return false;
+            }
+            candle.timestamp = xtime::get_timestamp(
+                values[6] * 10 + values[7],
+                values[4] * 10 + values[5],
+                values[0] * 1000 + values[1] * 100 + values[2] * 10 + values[3],
+                values[8] * 10 + values[9],
+                values[10] * 10 + values[11],
+                values[12] * 10 + values[13]);
+            ptr += 16;
+            double *prices[4] = {&candle.open, &candle.high, &candle.low, &candle.close};
+            for(size_t i = 0; i < 4; ++i) {
+                if(ptr >= end) return false;
+                char *next = nullptr;
+                *prices[i] = std::strtod(ptr, &next);
+                if(next == ptr) return false;
+                ptr = next;
+                if(ptr < end && *ptr == ',') ++ptr;
+            }
+            candle.volume = ptr < end ? std::strtod(ptr, nullptr) : 0;
+            return true;
+        }
+
+        /** \brief Получить имя символа по имени файла архива
+         *
+         * Например, data/daily/us/nasdaq stocks/1/aapl.us.txt - AAPL.US
+         * \param name Имя файла в архиве
+         * \return Имя символа
+         */
+        static std::string get_symbol(const std::string &name) {
+            const size_t slash = name.find_last_of("/\\");
+            std::string symbol = slash == std::string::npos ? name : name.substr(slash + 1);
+            if(symbol.size() > 4 && symbol.substr(symbol.size() - 4) == ".txt") symbol.resize(symbol.size() - 4);
+            for(size_t i = 0; i < symbol.size(); ++i) {
+                symbol[i] = (char)std::toupper((unsigned char)symbol[i]);
+            }
+            return symbol;
+        }
+
+        /** \brief Загрузить архив
+         * \param archive_name Имя файла архива
+         * \param config Параметры загрузки
+         * \param stats Статистика загрузки
+         * \return Код ошибки ZipArchive::ErrorType
+         */
+        int run(const std::string &archive_name, const Config &config, Stats &stats) {
+            const auto time_start = std::chrono::steady_clock::now();
+            ZipArchive archive;
+            const int err = archive.open(archive_name);
+            if(err != ZipArchive::OK) return err;
+
+            /* отбираем файлы и точность символов */
+            class Job {
+            public:
+                size_t entry = 0;
+                std::string symbol;
+                int digits = -1;
+            };
+            std::vector<Job> jobs;
+            const std::vector<ZipArchive::Entry> &entries = archive.get_entries();
+            for(size_t i = 0; i < entries.size(); ++i) {
+                Job job;
+                job.entry = i;
+                job.symbol = get_symbol(entries[i].name);
+                for(size_t s = 0; s < config.symbols.size(); ++s) {
+                    if(config.symbols[s].symbol == job.symbol) {
+                        job.digits = (int)config.symbols[s].digits;
+                        break;
+                    }
+                }
+                if(job.digits < 0 && !config.is_all) continue;
+                jobs.push_back(job);
+            }
+
+            std::atomic<size_t> next_job(0);
+            std::atomic<size_t> total_files(0);
+            std::atomic<size_t> total_candles(0);
+            std::atomic<size_t> total_errors(0);
+            std::mutex log_mutex;
+
+            auto worker = [&]() {
+                ZipArchive worker_archive;
+                if(worker_archive.open(archive_name) != ZipArchive::OK) {
+                    ++total_errors;
+                    return;
+                }
+                std::string content;
+                std::vector<xquotes_common::Candle> candles;
+                while(true) {
+                    const size_t j = next_job++;
+                    if(j >= jobs.size()) break;
+                    const Job &job = jobs[j];
+                    if(worker_archive.read(entries[job.entry], content) != ZipArchive::OK) {
+                        std::lock_guard<std::mutex> lock(log_mutex);
+                        std::cout << job.symbol << " error unpack " << entries[job.entry].name << std::endl;
+                        ++total_errors;
+                        continue;
+                    }
+                    /* разбираем строки файла */
+                    candles.clear();
+                    uint32_t period = 0;
+                    const char *ptr = content.c_str();
+                    const char *end = ptr + content.size();
+                    while(ptr < end) {
+                        const char *line_end = (const char*)std::memchr(ptr, '\n', end - ptr);
+                        if(line_end == nullptr) line_end = end;
+                        xquotes_common::Candle candle;
+                        if(parse_line(ptr, line_end, period, candle)) candles.push_back(candle);
+                        ptr = line_end + 1;
+                    }
+                    if(candles.empty() || period == 0) continue;
+
+                    /* записываем csv и hst, файлы уже пишутся параллельно, поэтому форматируем в одном потоке */
+                    const int digits = job.digits >= 0 ? job.digits : xquotes_common::get_decimal_places(candles);
+                    const std::string file_csv(config.path_csv + job.symbol + config.symbol_csv_suffix + std::to_string(period) + ".csv");
+                    const int err_csv = write_file(file_csv, std::string(), candles, digits, CsvTypes::MT4, 1);
+                    if(err_csv != xquotes_common::OK) {
+                        std::lock_guard<std::mutex> lock(log_mutex);
+                        std::cout << job.symbol << " error write csv file, code: " << err_csv << std::endl;
+                        ++total_errors;
+                        continue;
+                    }
+                    MqlHstGroup hst(job.symbol + config.symbol_hst_suffix, config.paths_hst, period, digits, 0, nullptr, config.hst_version);
+                    if(!hst.write_candles(candles, 0, candles.size())) {
+                        std::lock_guard<std::mutex> lock(log_mutex);
+                        std::cout << job.symbol << " error write hst file" << std::endl;
+                        ++total_errors;
+                        continue;
+                    }
+                    ++total_files;
+                    total_candles += candles.size();
+                }
+            };
+
+            uint32_t threads = config.threads != 0 ? config.threads : std::thread::hardware_concurrency();
+            if(threads == 0) threads = 1;
+            std::vector<std::thread> pool;
+            for(uint32_t t = 1; t < threads; ++t) {
+                pool.push_back(std::thread(worker));
+            }
+            worker();
+            for(size_t t = 0; t < pool.size(); ++t) {
+                pool[t].join();
+            }
+
+            stats.files = total_files;
+            stats.candles = total_candles;
+            stats.errors = total_errors;
+            stats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - time_start).count();
+            return ZipArchive::OK;
+        }
+    };
+}
+
+#endif // MT4_STOOQ_ARCHIVE_HPP_INCLUDED
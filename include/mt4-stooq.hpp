@@ -30,9 +30,24 @@
 #include <thread>
 #include <string>
 #include <vector>
+#include <map>
+#include <functional>
+#include <cstring>
+#include <cstdlib>
+#include <cstdio>
+#include <locale>
+#include <memory>
+#include <limits>
+#include <algorithm>
+#include <chrono>
 #include "xquotes_common.hpp"
+#include "mt4-trace.hpp"
+#include "mt4-alloc-stats.hpp"
+#include "mt4-clock.hpp"
+#include "mt4-simulation.hpp"
 #include "nlohmann/json.hpp"
 #include "gzip/decompress.hpp"
+#include "zlib.h"
 
 /** \brief Класс для работы с https://stooq.com
  */
@@ -55,6 +70,7 @@ public:
         NO_RESPONSE_WAITING_PERIOD = -11,
         INVALID_PARAMETER = -12,
         NO_PRICE_STREAM_SUBSCRIPTION = -13,
+        DEADLINE_EXCEEDED = -14,            ///< Запрос не начат или прерван, так как наступил срок окончания цикла
         INVALID_TIMESTAMP = -1021,                  /**< Временная метка для этого запроса находится за пределами recvWindow или Временная метка для этого запроса была на 1000 мс раньше времени сервера. */
         NO_SUCH_ORDER = -2013,                      /**< Заказ не существует */
         ORDER_WOULD_IMMEDIATELY_TRIGGER = -2021,    /**< Заказ сразу сработает. */
@@ -64,13 +80,69 @@ public:
         POSITION_SIDE_CHANGE_EXISTS_QUANTITY = -4068,/**< Сторона позиции не может быть изменена, если существует позиция */
     };
 
+    /** \brief Статистика задержек точки доступа
+     *
+     * Хранит последние замеры времени до первого байта ответа
+     * в кольцевом буфере фиксированного размера
+     */
+    class LatencyTracker {
+    public:
+        static const size_t MAX_SAMPLES = 256;
+
+    private:
+        double samples[MAX_SAMPLES];
+        size_t count = 0;
+        size_t pos = 0;
+
+    public:
+
+        LatencyTracker() {};
+
+        /** \brief Добавить замер
+         * \param seconds Время в секундах
+         */
+        void add(const double seconds) {
+            samples[pos] = seconds;
+            pos = (pos + 1) % MAX_SAMPLES;
+            if(count < MAX_SAMPLES) ++count;
+        }
+
+        /** \brief Получить процентиль
+         * \param p Доля от 0 до 1, например 0.95
+         * \return Значение процентиля в секундах или 0, если замеров нет
+         */
+        double get_percentile(const double p) const {
+            if(count == 0) return 0;
+            double temp[MAX_SAMPLES];
+            std::copy(samples, samples + count, temp);
+            const size_t n = std::min(count - 1, (size_t)(p * (double)count));
+            std::nth_element(temp, temp + n, temp + count);
+            return temp[n];
+        }
+
+        inline size_t size() const {
+            return count;
+        }
+    };
+
+    /// Точки доступа, для которых ведется статистика задержек
+    enum class Endpoints {
+        HISTORY = 0,                        ///< История, /q/d/l/
+        QUOTES = 1,                         ///< Котировки, /q/l/
+    };
+
+    static const size_t ENDPOINTS_TOTAL = 2;
+
 private:
     std::string point = "https://stooq.com";
     std::string sert_file = "curl-ca-bundle.crt";       /**< Файл сертификата */
     std::string cookie_file = "binance-sapi.cookie";    /**< Файл cookie */
 
-    char error_buffer[CURL_ERROR_SIZE];
     static const int TIME_OUT = 60;     /**< Время ожидания ответа сервера для разных запросов */
+    static const size_t LATENCY_MIN_SAMPLES = 20;       /**< Минимум замеров, после которого таймауты и дублирование запросов считаются по статистике */
+    static const int64_t MIN_FIRST_BYTE_TIME_OUT_MS = 2000;
+    static const int64_t FIRST_BYTE_TIME_OUT_FACTOR = 4;    /**< Время ожидания первого байта в p99 */
+    static const size_t QUOTE_URL_MAX_LENGTH = 2000;    /**< Максимальная длина URL запроса котировок, больше символов делятся на несколько запросов */
 
     /** \brief Класс для хранения Http заголовков
      */
@@ -96,6 +168,9 @@ private:
             http_headers = curl_slist_append(http_headers, header.c_str());
         }
 
+        HttpHeaders(const HttpHeaders&) = delete;
+        HttpHeaders &operator=(const HttpHeaders&) = delete;
+
         ~HttpHeaders() {
             if(http_headers != nullptr) {
                 curl_slist_free_all(http_headers);
@@ -121,26 +196,378 @@ private:
         return result;
     }
 
-    /** \brief Парсер строки, состоящей из пары параметров
+    /** \brief Заголовки ответа, которые нужны клиенту
      *
-     * \param value Строка
-     * \param one Первое значение
-     * \param two Второе значение
+     * Строки заголовков разбираются без выделения памяти: значения нужных
+     * заголовков копируются в буферы фиксированного размера, остальные пропускаются.
      */
-    static void parse_pair(std::string value, std::string &one, std::string &two) {
-        if(value.back() != ' ' || value.back() != '\n' || value.back() != ' ') value += " ";
-        std::size_t start_pos = 0;
-        while(true) {
-            std::size_t found_beg = value.find_first_of(" \t\n", start_pos);
-            if(found_beg != std::string::npos) {
-                std::size_t len = found_beg - start_pos;
-                if(len > 0) {
-                    if(start_pos == 0) one = value.substr(start_pos, len);
-                    else two = value.substr(start_pos, len);
+    class ResponseHeaders {
+    public:
+        static const size_t VALUE_SIZE = 128;   /**< Размер буфера значения, длинные значения обрезаются */
+        char content_encoding[VALUE_SIZE];
+        char retry_after[VALUE_SIZE];
+        char etag[VALUE_SIZE];
+        uint64_t content_length = 0;
+        bool is_content_length = false;
+
+        ResponseHeaders() {
+            clear();
+        };
+
+        void clear() {
+            content_encoding[0] = '\0';
+            retry_after[0] = '\0';
+            etag[0] = '\0';
+            content_length = 0;
+            is_content_length = false;
+        }
+
+        inline bool is_content_encoding() const {
+            return content_encoding[0] != '\0';
+        }
+
+        inline bool is_gzip() const {
+            return std::strstr(content_encoding, "gzip") != nullptr;
+        }
+
+        inline bool is_identity() const {
+            return std::strstr(content_encoding, "identity") != nullptr;
+        }
+
+        /** \brief Сравнить имя заголовка без учета регистра
+         * \param begin Начало имени
+         * \param end Конец имени (двоеточие)
+         * \param key Имя заголовка в нижнем регистре
+         */
+        static bool is_key(const char *begin, const char *end, const char *key) {
+            for(; begin < end; ++begin, ++key) {
+                if(*key == '\0') return false;
+                char ch = *begin;
+                if(ch >= 'A' && ch <= 'Z') ch = ch - 'A' + 'a';
+                if(ch != *key) return false;
+            }
+            return *key == '\0';
+        }
+
+        static void copy_value(char *dst, const char *begin, const char *end) {
+            const size_t size = std::min<size_t>(end - begin, VALUE_SIZE - 1);
+            std::memcpy(dst, begin, size);
+            dst[size] = '\0';
+        }
+
+        /** \brief Разобрать строку заголовка
+         * \param line Строка заголовка
+         * \param size Длина строки
+         */
+        void parse_line(const char *line, const size_t size) {
+            const char *end = line + size;
+            const char *colon = (const char*)std::memchr(line, ':', size);
+            if(colon == nullptr) {
+                /* строка статуса нового ответа, например после перенаправления */
+                if(size >= 5 && std::memcmp(line, "HTTP/", 5) == 0) clear();
+                return;
+            }
+            const char *value = colon + 1;
+            while(value < end && (*value == ' ' || *value == '\t')) ++value;
+            const char *value_end = end;
+            while(value_end > value && (value_end[-1] == '\r' || value_end[-1] == '\n' || value_end[-1] == ' ')) --value_end;
+            if(is_key(line, colon, "content-encoding")) copy_value(content_encoding, value, value_end);
+            else if(is_key(line, colon, "retry-after")) copy_value(retry_after, value, value_end);
+            else if(is_key(line, colon, "etag")) copy_value(etag, value, value_end);
+            else if(is_key(line, colon, "content-length")) {
+                uint64_t length = 0;
+                const char *ptr = value;
+                for(; ptr < value_end && *ptr >= '0' && *ptr <= '9'; ++ptr) {
+                    length = length * 10 + (uint64_t)(*ptr - '0');
                 }
-                start_pos = found_beg + 1;
-            } else break;
+                if(ptr != value) {
+                    content_length = length;
+                    is_content_length = true;
+                }
+            }
         }
+    };
+
+    class ResponseContext;
+
+    /** \brief Состояние потокового разбора истории
+     *
+     * Бары разбираются по мере поступления данных от сервера,
+     * в памяти держится только незаконченная строка ответа
+     */
+    class HistoryStream {
+    public:
+        std::function<void(const xquotes_common::Candle &candle)> callback;
+        ResponseContext *context = nullptr;
+        CURL *curl = nullptr;
+        std::string pending;            /**< Незаконченная строка или весь ответ, если он сжат */
+        size_t candles = 0;             /**< Количество разобранных баров */
+        int64_t parse_us = 0;           /**< Время разбора ответа, считается при is_timed */
+        bool is_timed = false;          /**< Замерять время разбора для трассировки */
+        bool is_checked = false;        /**< Флаг проверки кода ответа и кодирования */
+        bool is_buffered = false;       /**< Ответ сжат и будет разобран целиком */
+        bool is_skipped = false;        /**< Ответ не содержит истории (код ответа не 200) */
+
+        HistoryStream() {};
+
+        /** \brief Подготовить к новому запросу, сохранив память буфера
+         */
+        void reset() {
+            callback = nullptr;
+            curl = nullptr;
+            pending.clear();
+            candles = 0;
+            parse_us = 0;
+            is_timed = false;
+            is_checked = false;
+            is_buffered = false;
+            is_skipped = false;
+        }
+    };
+
+    /** \brief Состояние соединения, которое переиспользуется между запросами
+     *
+     * Хранит открытый CURL, заголовки запроса, буферы ответа и распаковщик gzip.
+     * Память буферов не освобождается после запроса, поэтому при установившемся
+     * размере ответов запросы не выделяют память на стороне клиента.
+     */
+    class ResponseContext {
+    public:
+        CURL *curl = nullptr;
+        char error_buffer[CURL_ERROR_SIZE];
+        ResponseHeaders headers;
+        HistoryStream stream;
+        std::string buffer;             /**< Тело ответа как оно пришло от сервера */
+        std::string response;           /**< Распакованный ответ */
+        std::string url;                /**< URL запроса, память переиспользуется */
+        z_stream inflate_stream;
+        bool is_inflate_init = false;
+        bool is_body_buffer = false;    /**< Тело ответа собирается в buffer, его размер резервируется по Content-Length */
+        bool is_first_byte = false;     /**< Сервер начал отвечать */
+
+        ResponseContext() {
+            std::memset(&inflate_stream, 0, sizeof(inflate_stream));
+            error_buffer[0] = '\0';
+        };
+
+        ResponseContext(const ResponseContext&) = delete;
+        ResponseContext &operator=(const ResponseContext&) = delete;
+
+        ~ResponseContext() {
+            if(curl != nullptr) curl_easy_cleanup(curl);
+            if(is_inflate_init) inflateEnd(&inflate_stream);
+        };
+
+        /** \brief Распаковать gzip в буфер, память которого переиспользуется
+         * \param data Сжатые данные
+         * \param size Размер сжатых данных
+         * \param output Распакованные данные
+         * \return Вернет true в случае успешного завершения
+         */
+        bool decompress(const char *data, const size_t size, std::string &output) {
+            if(!is_inflate_init) {
+                /* 15 + 32 - автоматическое определение заголовка gzip или zlib */
+                if(inflateInit2(&inflate_stream, 15 + 32) != Z_OK) return false;
+                is_inflate_init = true;
+            } else {
+                inflateReset(&inflate_stream);
+            }
+            size_t out_size = 0;
+            output.resize(std::max(output.capacity(), std::max<size_t>(size * 4, 4096)));
+            inflate_stream.next_in = (Bytef*)data;
+            inflate_stream.avail_in = (uInt)size;
+            while(true) {
+                if(out_size == output.size()) output.resize(output.size() * 2);
+                inflate_stream.next_out = (Bytef*)&output[out_size];
+                inflate_stream.avail_out = (uInt)(output.size() - out_size);
+                const int err = inflate(&inflate_stream, Z_NO_FLUSH);
+                out_size = output.size() - inflate_stream.avail_out;
+                if(err == Z_STREAM_END) break;
+                if(err != Z_OK && err != Z_BUF_ERROR) {
+                    output.clear();
+                    return false;
+                }
+                if(err == Z_BUF_ERROR && inflate_stream.avail_out != 0) {
+                    /* сжатые данные закончились раньше конца потока */
+                    output.clear();
+                    return false;
+                }
+            }
+            output.resize(out_size);
+            return true;
+        }
+    };
+
+    ResponseContext context;            /**< Соединение для запросов к серверу */
+    HttpHeaders request_headers;        /**< Заголовки запросов, собираются один раз */
+
+    CURLM *multi = nullptr;             /**< Общие соединения для параллельных запросов */
+    std::vector<std::shared_ptr<ResponseContext>> multi_contexts;   /**< Состояние каждого параллельного запроса */
+    bool is_multiplex = false;          /**< Использовать параллельные запросы через HTTP/2 */
+    uint32_t max_streams = 16;          /**< Максимум одновременных запросов */
+    uint32_t max_connections = 2;       /**< Максимум соединений с сервером */
+    bool is_prior_knowledge = false;    /**< Сервер без TLS точно поддерживает HTTP/2, Upgrade не нужен */
+
+    LatencyTracker latency[ENDPOINTS_TOTAL];            /**< Время до первого байта по точкам доступа */
+    std::vector<std::string> quote_symbols;             /**< Символы последнего запроса котировок */
+    std::vector<std::pair<std::string, size_t>> quote_names;    /**< Имена символов в верхнем регистре и их индексы, отсортированы */
+    std::string quote_symbol;                           /**< Имя символа из строки ответа с котировкой */
+    bool is_hedging = false;            /**< Дублировать запросы, которые отвечают дольше hedge_percentile */
+    double hedge_percentile = 0.95;
+    bool is_deadline = false;
+    std::chrono::steady_clock::time_point deadline;     /**< Срок окончания цикла загрузки */
+    uint64_t hedges_started = 0;
+    uint64_t hedges_won = 0;
+    mt4_tools::TraceRecorder *tracer = nullptr;         /**< Запись интервалов запросов, nullptr - не пишется */
+    mt4_tools::Clock *clock = nullptr;                  /**< Часы для срока окончания цикла, nullptr - системные */
+    mt4_tools::SimulatedServer *simulation = nullptr;   /**< Локальная замена сервера, nullptr - запросы идут на сервер */
+
+    /** \brief Разобрать строку истории
+     *
+     * Поддерживаются строки вида 2020-08-28,1.1829,1.1913,1.1822,1.1904,0
+     * и строки внутридневных данных 2020-08-28,15:05:00,1.1829,1.1913,1.1822,1.1904,0.
+     * Строка должна заканчиваться символом, который не может быть частью числа.
+     * \param begin Начало строки
+     * \param end Конец строки
+     * \param candle Бар
+     * \return Вернет true, если строка содержит бар
+     */
+    static bool parse_history_line(const char *begin, const char *end, xquotes_common::Candle &candle) {
+        /* дата YYYY-MM-DD */
+        if((end - begin) < 11) return false;
+        for(size_t i = 0; i < 10; ++i) {
+            if(i == 4 || i == 7) {
+                if(begin[i] != '-') return false;
+            } else
+            if(begin[i] < '0' || begin[i] > '9') return false;
+        }
+        const int year = (begin[0] - '0') * 1000 + (begin[1] - '0') * 100 + (begin[2] - '0') * 10 + (begin[3] - '0');
+        const int month = (begin[5] - '0') * 10 + (begin[6] - '0');
+        const int day = (begin[8] - '0') * 10 + (begin[9] - '0');
+        const char *ptr = begin + 10;
+        if(*ptr != ',') return false;
+        ++ptr;
+        /* время HH:MM:SS, есть только у внутридневных данных */
+        int hour = 0, minute = 0, second = 0;
+        if((end - ptr) >= 9 && ptr[2] == ':' && ptr[5] == ':' && ptr[8] == ',') {
+            hour = (ptr[0] - '0') * 10 + (ptr[1] - '0');
+            minute = (ptr[3] - '0') * 10 + (ptr[4] - '0');
+            second = (ptr[6] - '0') * 10 + (ptr[7] - '0');
+            ptr += 9;
+        }
+        candle.timestamp = xtime::get_timestamp(day, month, year, hour, minute, second);
+        // Open High Low Close
+        double *values[4] = {&candle.open, &candle.high, &candle.low, &candle.close};
+        for(size_t i = 0; i < 4; ++i) {
+            if(ptr >= end) return false;
+            char *next = nullptr;
+            *values[i] = std::strtod(ptr, &next);
+            if(next == ptr) return false;
+            ptr = next;
+            if(ptr < end && *ptr == ',') ++ptr;
+        }
+        candle.volume = 0;
+        if(ptr < end && *ptr != '\r' && *ptr != '\n') {
+            candle.volume = std::strtod(ptr, nullptr);
+        }
+        return true;
+    }
+
+    /** \brief Разобрать законченную строку потока истории
+     */
+    static void parse_stream_line(HistoryStream &stream, const char *begin, const char *end) {
+        xquotes_common::Candle candle;
+        if(!parse_history_line(begin, end, candle)) return;
+        ++stream.candles;
+        if(stream.callback != nullptr) stream.callback(candle);
+    }
+
+    /** \brief Разобрать очередной фрагмент потока истории
+     */
+    static void parse_stream_data(HistoryStream &stream, const char *data, const size_t size) {
+        mt4_tools::AllocScope alloc_scope(mt4_tools::AllocStages::PARSE);
+        const char *ptr = data;
+        const char *end = data + size;
+        if(!stream.pending.empty()) {
+            const char *line_end = (const char*)std::memchr(ptr, '\n', end - ptr);
+            if(line_end == nullptr) {
+                stream.pending.append(ptr, end - ptr);
+                return;
+            }
+            stream.pending.append(ptr, line_end - ptr + 1);
+            parse_stream_line(stream, stream.pending.data(), stream.pending.data() + stream.pending.size());
+            stream.pending.clear();
+            ptr = line_end + 1;
+        }
+        while(ptr < end) {
+            const char *line_end = (const char*)std::memchr(ptr, '\n', end - ptr);
+            if(line_end == nullptr) break;
+            parse_stream_line(stream, ptr, line_end + 1);
+            ptr = line_end + 1;
+        }
+        stream.pending.assign(ptr, end - ptr);
+    }
+
+    /** \brief Завершить разбор потока истории
+     */
+    static void finish_stream(HistoryStream &stream) {
+        if(stream.is_buffered) {
+            /* сжатый ответ разбираем целиком */
+            stream.is_buffered = false;
+            if(stream.pending.empty()) return;
+            if(stream.context != nullptr) {
+                std::string &response = stream.context->response;
+                if(!stream.context->decompress(stream.pending.data(), stream.pending.size(), response)) {
+                    stream.pending.clear();
+                    return;
+                }
+                stream.pending.clear();
+                parse_stream_data(stream, response.data(), response.size());
+            } else {
+                std::string compressed;
+                compressed.swap(stream.pending);
+                const std::string response = gzip::decompress(compressed.data(), compressed.size());
+                parse_stream_data(stream, response.data(), response.size());
+            }
+        }
+        if(!stream.pending.empty()) {
+            /* последняя строка без перевода строки, std::string оканчивается нулем */
+            parse_stream_line(stream, stream.pending.data(), stream.pending.data() + stream.pending.size());
+            stream.pending.clear();
+        }
+    }
+
+    /** \brief Callback-функция для потокового разбора истории
+     * Данная функция нужна для внутреннего использования
+     */
+    static int stooq_stream_writer(char *data, size_t size, size_t nmemb, void *userdata) {
+        HistoryStream *stream = (HistoryStream*)userdata;
+        const size_t length = size * nmemb;
+        if(stream == NULL) return 0;
+        if(!stream->is_checked) {
+            stream->is_checked = true;
+            long response_code = 0;
+            curl_easy_getinfo(stream->curl, CURLINFO_RESPONSE_CODE, &response_code);
+            if(response_code != 200) stream->is_skipped = true;
+            if(stream->context != nullptr && stream->context->headers.is_gzip()) {
+                stream->is_buffered = true;
+                if(stream->context->headers.is_content_length) {
+                    stream->pending.reserve((size_t)stream->context->headers.content_length);
+                }
+            }
+        }
+        if(stream->is_skipped) return length;
+        if(stream->is_buffered) {
+            stream->pending.append(data, length);
+        } else
+        if(stream->is_timed) {
+            const auto start = std::chrono::steady_clock::now();
+            parse_stream_data(*stream, data, length);
+            stream->parse_us += std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+        } else {
+            parse_stream_data(*stream, data, length);
+        }
+        return length;
     }
 
     /** \brief Callback-функция для обработки HTTP Header ответа
@@ -149,11 +576,12 @@ private:
      */
     static int stooq_header_callback(char *buffer, size_t size, size_t nitems, void *userdata) {
         size_t buffer_size = nitems * size;
-        std::map<std::string,std::string> *headers = (std::map<std::string,std::string>*)userdata;
-        std::string str_buffer(buffer, buffer_size);
-        std::string key, val;
-        parse_pair(str_buffer, key, val);
-        headers->insert({key, val});
+        ResponseContext *context = (ResponseContext*)userdata;
+        context->is_first_byte = true;
+        context->headers.parse_line(buffer, buffer_size);
+        if(context->is_body_buffer && context->headers.is_content_length) {
+            context->buffer.reserve((size_t)context->headers.content_length);
+        }
         return buffer_size;
     }
 
@@ -168,6 +596,7 @@ private:
      *
      * Данная метод является общей инициализацией для разного рода запросов
      * Данный метод нужен для внутреннего использования
+     * \param ctx Состояние соединения, CURL которого будет настроен
      * \param url URL запроса
      * \param body Тело запроса
      * \param response Ответ сервера
@@ -181,6 +610,7 @@ private:
      * \return вернет указатель на CURL или NULL, если инициализация не удалась
      */
     CURL *init_curl(
+            ResponseContext &ctx,
             const std::string &url,
             const std::string &body,
             std::string &response,
@@ -192,10 +622,15 @@ private:
             const bool is_use_cookie = true,
             const bool is_clear_cookie = false,
             const TypesRequest type_req = TypesRequest::REQ_POST) {
-        CURL *curl = curl_easy_init();
+        /* соединение и кеш DNS сохраняются между запросами */
+        if(ctx.curl == nullptr) ctx.curl = curl_easy_init();
+        else curl_easy_reset(ctx.curl);
+        CURL *curl = ctx.curl;
         if(!curl) return NULL;
+        ctx.headers.clear();
+        ctx.is_first_byte = false;
         curl_easy_setopt(curl, CURLOPT_CAINFO, sert_file.c_str());
-        curl_easy_setopt(curl, CURLOPT_ERRORBUFFER, error_buffer);
+        curl_easy_setopt(curl, CURLOPT_ERRORBUFFER, ctx.error_buffer);
         curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
         //curl_easy_setopt(curl, CURLOPT_FAILONERROR, 1L);
         if(type_req == TypesRequest::REQ_POST) curl_easy_setopt(curl, CURLOPT_POST, 1L);
@@ -221,48 +656,171 @@ private:
         return curl;
     }
 
+    /** \brief Получить время до срока окончания цикла
+     * \return Время в миллисекундах, без срока - TIME_OUT
+     */
+    int64_t get_remaining_ms() const {
+        if(!is_deadline) return (int64_t)TIME_OUT * 1000;
+        const auto now = clock != nullptr ? clock->now() : std::chrono::steady_clock::now();
+        return std::chrono::duration_cast<std::chrono::milliseconds>(deadline - now).count();
+    }
+
+    /** \brief Получить время ожидания первого байта
+     *
+     * Пока замеров мало, используется TIME_OUT
+     * \param endpoint Точка доступа
+     * \return Время в миллисекундах
+     */
+    int64_t get_first_byte_timeout_ms(const Endpoints endpoint) const {
+        const LatencyTracker &tracker = latency[(size_t)endpoint];
+        if(tracker.size() < LATENCY_MIN_SAMPLES) return (int64_t)TIME_OUT * 1000;
+        const int64_t timeout = (int64_t)(tracker.get_percentile(0.99) * 1000.0) * FIRST_BYTE_TIME_OUT_FACTOR;
+        return std::min<int64_t>(std::max(timeout, MIN_FIRST_BYTE_TIME_OUT_MS), (int64_t)TIME_OUT * 1000);
+    }
+
+    /** \brief Получить задержку, после которой запрос дублируется
+     * \param endpoint Точка доступа
+     * \return Задержка в секундах или отрицательное число, если замеров мало
+     */
+    double get_hedge_delay(const Endpoints endpoint) const {
+        const LatencyTracker &tracker = latency[(size_t)endpoint];
+        if(tracker.size() < LATENCY_MIN_SAMPLES) return -1;
+        return tracker.get_percentile(hedge_percentile);
+    }
+
+    /** \brief Настроить таймауты запроса
+     *
+     * Ожидание первого байта и остановку передачи ограничивает LOW_SPEED_TIME,
+     * поэтому долгая загрузка всей истории не прерывается, пока данные идут.
+     * Общее время ограничено TIME_OUT и сроком окончания цикла
+     * \param curl Указатель на структуру CURL
+     * \param endpoint Точка доступа
+     * \param remaining_ms Время до срока окончания цикла
+     */
+    void set_adaptive_timeouts(CURL *curl, const Endpoints endpoint, const int64_t remaining_ms) {
+        const int64_t total_ms = std::min<int64_t>((int64_t)TIME_OUT * 1000, remaining_ms);
+        const int64_t first_byte_ms = std::min(get_first_byte_timeout_ms(endpoint), total_ms);
+        curl_easy_setopt(curl, CURLOPT_TIMEOUT_MS, (long)total_ms);
+        curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT_MS, (long)first_byte_ms);
+        curl_easy_setopt(curl, CURLOPT_LOW_SPEED_LIMIT, 1L);
+        curl_easy_setopt(curl, CURLOPT_LOW_SPEED_TIME, (long)std::max<int64_t>(1, (first_byte_ms + 999) / 1000));
+    }
+
+    /** \brief Добавить замер времени до первого байта
+     * \param curl Указатель на структуру CURL завершенного запроса
+     * \param endpoint Точка доступа
+     * \param result Код завершения CURL
+     */
+    void add_latency(CURL *curl, const Endpoints endpoint, const CURLcode result) {
+        double seconds = 0;
+        if(result == CURLE_OK) {
+            curl_easy_getinfo(curl, CURLINFO_STARTTRANSFER_TIME, &seconds);
+        } else
+        if(result == CURLE_OPERATION_TIMEDOUT) {
+            /* сервер не ответил, время ответа не меньше прошедшего */
+            curl_easy_getinfo(curl, CURLINFO_STARTTRANSFER_TIME, &seconds);
+            if(seconds <= 0) curl_easy_getinfo(curl, CURLINFO_TOTAL_TIME, &seconds);
+        } else {
+            return;
+        }
+        if(seconds > 0) latency[(size_t)endpoint].add(seconds);
+    }
+
+    /** \brief Добавить замер отмененного запроса
+     *
+     * Копия запроса, проигравшая дублированию, обычно медленная, и без ее замера
+     * процентиль занижается. Если ответ еще не начался, время до первого байта
+     * не меньше прошедшего, как и при CURLE_OPERATION_TIMEDOUT
+     * \param curl Указатель на структуру CURL отменяемого запроса
+     * \param endpoint Точка доступа
+     * \param start Время начала запроса
+     */
+    void add_latency_cancelled(CURL *curl, const Endpoints endpoint, const std::chrono::steady_clock::time_point &start) {
+        double seconds = 0;
+        curl_easy_getinfo(curl, CURLINFO_STARTTRANSFER_TIME, &seconds);
+        if(seconds <= 0) seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        if(seconds > 0) latency[(size_t)endpoint].add(seconds);
+    }
+
+    inline bool is_tracing() const {
+        return tracer != nullptr && tracer->is_enabled();
+    }
+
+    /** \brief Завершить разбор ответа, замеряя время для трассировки
+     */
+    static void finish_stream_timed(HistoryStream &stream) {
+        if(!stream.is_timed) {
+            finish_stream(stream);
+            return;
+        }
+        const auto start = std::chrono::steady_clock::now();
+        finish_stream(stream);
+        stream.parse_us += std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    /** \brief Записать этапы завершенного запроса
+     *
+     * Этапы восстанавливаются по замерам CURL: разрешение имени, соединение,
+     * TLS, ожидание первого байта и прием ответа. Для переиспользованного
+     * соединения первых этапов нет
+     * \param curl Указатель на структуру CURL завершенного запроса
+     * \param start Момент запуска запроса
+     * \param name Имя интервала всего запроса
+     * \param symbol Символ или nullptr
+     * \param value_name Имя числового параметра или nullptr
+     * \param value Значение числового параметра
+     */
+    void trace_transfer(
+            CURL *curl,
+            const std::chrono::steady_clock::time_point &start,
+            const char *name,
+            const char *symbol,
+            const char *value_name = nullptr,
+            const int64_t value = 0) {
+        double dns = 0, connect = 0, tls = 0, pretransfer = 0, first_byte = 0, total = 0;
+        curl_easy_getinfo(curl, CURLINFO_NAMELOOKUP_TIME, &dns);
+        curl_easy_getinfo(curl, CURLINFO_CONNECT_TIME, &connect);
+        curl_easy_getinfo(curl, CURLINFO_APPCONNECT_TIME, &tls);
+        curl_easy_getinfo(curl, CURLINFO_PRETRANSFER_TIME, &pretransfer);
+        curl_easy_getinfo(curl, CURLINFO_STARTTRANSFER_TIME, &first_byte);
+        curl_easy_getinfo(curl, CURLINFO_TOTAL_TIME, &total);
+        auto at = [&start](const double seconds) {
+            return start + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(seconds));
+        };
+        tracer->add(name, "http", start, at(total), symbol, value_name, value);
+        if(dns > 0) tracer->add("dns", "http", start, at(dns), symbol);
+        if(connect > dns) tracer->add("connect", "http", at(dns), at(connect), symbol);
+        if(tls > connect) tracer->add("tls", "http", at(connect), at(tls), symbol);
+        if(first_byte > pretransfer) tracer->add("wait", "http", at(pretransfer), at(first_byte), symbol);
+        if(first_byte > 0 && total > first_byte) tracer->add("transfer", "http", at(first_byte), at(total), symbol);
+    }
+
     /** \brief Обработать ответ сервера
      * \param curl Указатель на структуру CURL
-     * \param headers Заголовки, которые были приняты
+     * \param headers Нужные клиенту заголовки, которые были приняты
      * \param buffer Буфер с ответом сервера
      * \param response Итоговый ответ, который будет возвращен
      * \return Код ошибки
      */
-    int process_server_response(CURL *curl, std::map<std::string,std::string> &headers, std::string &buffer, std::string &response) {
+    int process_server_response(CURL *curl, ResponseHeaders &headers, std::string &buffer, std::string &response) {
         CURLcode result = curl_easy_perform(curl);
         long response_code = 0;
         curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &response_code);
 
         if(result == CURLE_OK) {
-            if(headers.find("Content-Encoding:") != headers.end()) {
-                std::string content_encoding = headers["Content-Encoding:"];
-                if(content_encoding.find("gzip") != std::string::npos) {
-                    if(buffer.size() == 0) return NO_ANSWER;
-                    const char *compressed_pointer = buffer.data();
-                    response = gzip::decompress(compressed_pointer, buffer.size());
-                } else
-                if(content_encoding.find("identity") != std::string::npos) {
-                    response = buffer;
-                } else {
-                    if(response_code != 200) return CURL_REQUEST_FAILED;
-                    return CONTENT_ENCODING_NOT_SUPPORT;
-                }
-            } else
-            if(headers.find("content-encoding:") != headers.end()) {
-                std::string content_encoding = headers["content-encoding:"];
-                if(content_encoding.find("gzip") != std::string::npos) {
+            if(headers.is_content_encoding()) {
+                if(headers.is_gzip()) {
                     if(buffer.size() == 0) return NO_ANSWER;
-                    const char *compressed_pointer = buffer.data();
-                    response = gzip::decompress(compressed_pointer, buffer.size());
+                    if(!context.decompress(buffer.data(), buffer.size(), response)) return PARSER_ERROR;
                 } else
-                if(content_encoding.find("identity") != std::string::npos) {
-                    response = buffer;
+                if(headers.is_identity()) {
+                    response.assign(buffer);
                 } else {
                     if(response_code != 200) return CURL_REQUEST_FAILED;
                     return CONTENT_ENCODING_NOT_SUPPORT;
                 }
             } else {
-                response = buffer;
+                response.assign(buffer);
                 if(response_code != 200) return CURL_REQUEST_FAILED;
             }
             if(response_code != 200) return CURL_REQUEST_FAILED;
@@ -289,10 +847,11 @@ private:
             const bool is_use_cookie = true,
             const bool is_clear_cookie = false,
             const int timeout = TIME_OUT) {
-        //int content_encoding = 0;   // Тип кодирования сообщения
-        std::map<std::string,std::string> headers;
-        std::string buffer;
+        std::string &buffer = context.buffer;
+        buffer.clear();
+        context.is_body_buffer = true;
         CURL *curl = init_curl(
+            context,
             url,
             body,
             buffer,
@@ -300,165 +859,804 @@ private:
             timeout,
             stooq_writer,
             stooq_header_callback,
-            &headers,
+            &context,
             is_use_cookie,
             is_clear_cookie,
             TypesRequest::REQ_GET);
 
         if(curl == NULL) return CURL_CANNOT_BE_INIT;
-        int err = process_server_response(curl, headers, buffer, response);
-        curl_easy_cleanup(curl);
-        return err;
+        return process_server_response(curl, context.headers, buffer, response);
     }
 
-    std::string to_lower_case(const std::string &s){
-        std::string temp = s;
-        std::transform(temp.begin(), temp.end(), temp.begin(), [](char ch) {
-            return std::use_facet<std::ctype<char>>(std::locale()).tolower(ch);
-        });
-        return temp;
+    /** \brief Дописать строку в нижнем регистре
+     */
+    static void append_lower_case(std::string &out, const std::string &s) {
+        const std::ctype<char> &facet = std::use_facet<std::ctype<char>>(std::locale());
+        for(size_t i = 0; i < s.size(); ++i) {
+            out.push_back(facet.tolower(s[i]));
+        }
     }
 
-    std::string to_upper_case(const std::string &s){
-        std::string temp = s;
-        std::transform(temp.begin(), temp.end(), temp.begin(), [](char ch) {
-            return std::use_facet<std::ctype<char>>(std::locale()).toupper(ch);
-        });
-        return temp;
+    /** \brief Перевести строку в верхний регистр на месте
+     */
+    static void set_upper_case(std::string &s) {
+        const std::ctype<char> &facet = std::use_facet<std::ctype<char>>(std::locale());
+        facet.toupper(&s[0], &s[0] + s.size());
+    }
+
+    /** \brief Дописать дату в виде YYYYMMDD
+     */
+    static void append_date(std::string &out, const xtime::timestamp_t timestamp) {
+        const xtime::DateTime date_time(timestamp);
+        char buffer[16];
+        const int length = std::snprintf(buffer, sizeof(buffer), "%.4d%.2d%.2d", date_time.year, date_time.month, date_time.day);
+        if(length > 0) out.append(buffer, std::min<size_t>((size_t)length, sizeof(buffer) - 1));
     }
 
     int get_request_none_security(std::string &response, const std::string &url, const uint64_t weight = 1) {
         const std::string body;
         //check_request_limit(weight);
-        HttpHeaders http_headers({
-            //"Accept-Encoding: gzip",
-            "Content-Type: application/json"});
-        int err = get_request(url, body, http_headers.get(), response, false, false);
+        int err = get_request(url, body, request_headers.get(), response, false, false);
         if(err != OK) {
 
         }
         return err;
     }
 
-    void parse_line(std::string line, std::vector<std::string> &output_list) {
-        if(line.back() != '\n') line += "\n";
-        std::size_t start_pos = 0;
-        while(true) {
-            std::size_t found_beg = line.find_first_of("\n", start_pos);
-            if(found_beg != std::string::npos) {
-                std::size_t len = found_beg - start_pos;
-                if(len > 0) {
-                    output_list.push_back(line.substr(start_pos, len));
-                }
-                start_pos = found_beg + 1;
-            } else break;
-        }
-    }
-
-    void parse_word(std::string line, std::vector<std::string> &output_list) {
-        if(line.back() != ',' && line.back() != '-') line += ",";
-        std::size_t start_pos = 0;
-        while(true) {
-            std::size_t found_beg = line.find_first_of(",-\n", start_pos);
-            if(found_beg != std::string::npos) {
-                std::size_t len = found_beg - start_pos;
-                if(len > 0) {
-                    //if(output_list.size() == 0 && line.size() > 3 && line.substr(0, 2) == "~/") {
-                    //    output_list.push_back(line.substr(0, 2));
-                    //} else
-                    //if(output_list.size() == 0 && line.size() > 2 && line.substr(0, 1) == "/") {
-                    //    output_list.push_back(line.substr(0, 1));
-                    //}
-                    output_list.push_back(line.substr(start_pos, len));
-                }
-                start_pos = found_beg + 1;
-            } else break;
-        }
-    }
-
     void parse_history(
             std::vector<xquotes_common::Candle> &candles,
             std::string &response) {
-        try {
-            std::vector<std::string> item_list;
-            parse_line(response, item_list);
-            const size_t size_data = item_list.size();
-            for(size_t l = 1; l < size_data; ++l) {
-                std::vector<std::string> item_word;
-                parse_word(item_list[l], item_word);
-                xquotes_common::Candle candle;
-                if(item_word.size() >= 7) {
-                    const int year = std::atoi(item_word[0].c_str());
-                    const int month = std::atoi(item_word[1].c_str());
-                    const int day = std::atoi(item_word[2].c_str());
-                    candle.timestamp = xtime::get_timestamp(day, month, year);
-                    // Open High Low Close
-                    candle.open = std::atof(item_word[3].c_str());
-                    candle.high = std::atof(item_word[4].c_str());
-                    candle.low = std::atof(item_word[5].c_str());
-                    candle.close = std::atof(item_word[6].c_str());
-                    if(item_word.size() >= 8) {
-                        candle.volume = std::atof(item_word[7].c_str());
-                    }
-                    candles.push_back(candle);
-                }
-            }
-        } catch(...) {}
+        HistoryStream stream;
+        stream.callback = [&](const xquotes_common::Candle &candle) {
+            candles.push_back(candle);
+        };
+        parse_stream_data(stream, response.data(), response.size());
+        finish_stream(stream);
+    }
+
+    /** \brief GET запрос с потоковым разбором истории
+     *
+     * Данный метод нужен для внутреннего использования
+     * \param url URL сообщения
+     * \param symbol Символ для трассировки
+     * \param stream Состояние потокового разбора
+     * \param timeout Время ожидания ответа
+     * \return код ошибки
+     */
+    int get_request_stream(
+            const std::string &url,
+            const std::string &symbol,
+            HistoryStream &stream,
+            const int timeout = TIME_OUT) {
+        static const std::string body;
+        const int64_t remaining_ms = get_remaining_ms();
+        if(remaining_ms <= 0) return DEADLINE_EXCEEDED;
+        CURL *curl = init_curl(
+            context,
+            url,
+            body,
+            context.buffer,
+            request_headers.get(),
+            timeout,
+            stooq_stream_writer,
+            stooq_header_callback,
+            &context,
+            false,
+            false,
+            TypesRequest::REQ_GET);
+        if(curl == NULL) return CURL_CANNOT_BE_INIT;
+        context.is_body_buffer = false;
+        stream.curl = curl;
+        stream.context = &context;
+        curl_easy_setopt(curl, CURLOPT_WRITEDATA, &stream);
+        const Endpoints endpoint = Endpoints::HISTORY;
+        set_adaptive_timeouts(curl, endpoint, remaining_ms);
+        stream.is_timed = is_tracing();
+        const auto start = std::chrono::steady_clock::now();
+        CURLcode result = curl_easy_perform(curl);
+        long response_code = 0;
+        curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &response_code);
+        stream.curl = nullptr;
+        add_latency(curl, endpoint, result);
+        if(result == CURLE_OK && response_code == 200) finish_stream_timed(stream);
+        if(stream.is_timed) trace_transfer(curl, start, "request", symbol.c_str(), "parse_us", stream.parse_us);
+        if(result == CURLE_OPERATION_TIMEDOUT && get_remaining_ms() <= 0) return DEADLINE_EXCEEDED;
+        if(result != CURLE_OK) return result;
+        if(response_code != 200) return CURL_REQUEST_FAILED;
+        return OK;
     }
 
 public:
 
-    StooqApi(const std::string &user_sert_file = "curl-ca-bundle.crt") {
+    StooqApi(
+            const std::string &user_sert_file = "curl-ca-bundle.crt",
+            const std::string &user_point = "https://stooq.com") {
         sert_file = user_sert_file;
+        point = user_point;
         curl_global_init(CURL_GLOBAL_ALL);
+        request_headers.add_header("Content-Type: application/json");
+    };
+
+    ~StooqApi() {
+        /* CURL параллельных запросов нужно отключить до закрытия CURLM */
+        if(multi != nullptr) {
+            multi_contexts.clear();
+            curl_multi_cleanup(multi);
+            multi = nullptr;
+        }
     };
 
-    ~StooqApi() {};
+    StooqApi(const StooqApi&) = delete;
+    StooqApi &operator=(const StooqApi&) = delete;
+
+    /** \brief Проверить поддержку HTTP/2 в libcurl
+     * \return Вернет true, если libcurl собран с HTTP/2
+     */
+    static bool is_http2_supported() {
+        const curl_version_info_data *info = curl_version_info(CURLVERSION_NOW);
+        return info != nullptr && (info->features & CURL_VERSION_HTTP2) != 0;
+    }
+
+    /** \brief Включить параллельную загрузку истории
+     *
+     * Запросы из get_historical_data(std::vector<HistoryRequest>&) мультиплексируются
+     * в несколько соединений HTTP/2. Если сервер или libcurl не поддерживают HTTP/2,
+     * запросы идут по HTTP/1.1, по одному на соединение, не больше user_max_connections соединений.
+     * \param is_enable Включить параллельную загрузку
+     * \param user_max_streams Максимум одновременных запросов
+     * \param user_max_connections Максимум соединений с сервером
+     * \param user_prior_knowledge Сервер без TLS (http://) принимает HTTP/2 сразу, без Upgrade
+     */
+    void set_multiplex(
+            const bool is_enable,
+            const uint32_t user_max_streams = 16,
+            const uint32_t user_max_connections = 2,
+            const bool user_prior_knowledge = false) {
+        is_multiplex = is_enable;
+        is_prior_knowledge = user_prior_knowledge;
+        max_streams = std::max<uint32_t>(user_max_streams, 1);
+        max_connections = std::max<uint32_t>(user_max_connections, 1);
+        if(multi != nullptr) {
+            curl_multi_setopt(multi, CURLMOPT_MAX_HOST_CONNECTIONS, (long)max_connections);
+        }
+    }
 
     enum class PeriodTypes {
         DAY,
         WEEK,
         MONTH,
         QUARTER,
-        YEAR
+        YEAR,
+        MINUTE_5,
+        HOUR_1
     };
 
-    /** \brief Получить исторические данные
+    /** \brief Получить URL запроса исторических данных
      *
-     * \param candles Массив баров
      * \param symbol Имя символа
      * \param period Период
-     * \param limit Ограничение количества баров
-     * \return Код ошибки
+     * \param start_date Дата начала
+     * \param stop_date Дата конца (включительно)
+     * \return URL запроса
      */
-    int get_historical_data(
-            std::vector<xquotes_common::Candle> &candles,
+    std::string get_history_url(
             const std::string &symbol,
             const PeriodTypes period,
             const xtime::timestamp_t start_date,
             const xtime::timestamp_t stop_date) {
-        std::string url(point);
-        std::string response;
+        std::string url;
+        get_history_url(symbol, period, start_date, stop_date, url);
+        return url;
+    }
+
+    /** \brief Записать URL запроса исторических данных в буфер
+     *
+     * Память буфера переиспользуется между запросами
+     * \param symbol Имя символа
+     * \param period Период
+     * \param start_date Дата начала
+     * \param stop_date Дата конца (включительно)
+     * \param url URL запроса
+     */
+    void get_history_url(
+            const std::string &symbol,
+            const PeriodTypes period,
+            const xtime::timestamp_t start_date,
+            const xtime::timestamp_t stop_date,
+            std::string &url) {
+        url.assign(point);
         url += "/q/d/l/?";
         url += "s=";
-        url += to_lower_case(symbol);
+        append_lower_case(url, symbol);
         // 20200818
         url += "&d1=";
-        url += xtime::to_string("%YYYY%MM%DD",start_date);
+        append_date(url, start_date);
         url += "&d2=";
-        url += xtime::to_string("%YYYY%MM%DD",stop_date);
+        append_date(url, stop_date);
         url += "&i=";
         if(period == PeriodTypes::DAY) url += "d";
         else if(period == PeriodTypes::WEEK) url += "w";
         else if(period == PeriodTypes::MONTH) url += "m";
+        else if(period == PeriodTypes::QUARTER) url += "q";
         else if(period == PeriodTypes::YEAR) url += "y";
-        //std::cout << url << std::endl;
-        int err = get_request_none_security(response, url);
-        //std::cout << response << std::endl;
-        if(err != OK) return err;
-        parse_history(candles, response);
+        else if(period == PeriodTypes::MINUTE_5) url += "5";
+        else if(period == PeriodTypes::HOUR_1) url += "60";
+    }
+
+    /** \brief Получить URL запроса котировок нескольких символов
+     *
+     * Сервер вернет csv с заголовком Symbol,Date,Time,Open,High,Low,Close,Volume
+     * и строкой текущего дневного бара для каждого символа
+     * \param symbols Имена символов
+     * \param begin Индекс первого символа
+     * \param end Индекс за последним символом
+     * \return URL запроса
+     */
+    std::string get_quote_url(
+            const std::vector<std::string> &symbols,
+            const size_t begin,
+            const size_t end) {
+        std::string url;
+        get_quote_url(symbols, begin, end, url);
+        return url;
+    }
+
+    /** \brief Записать URL запроса котировок нескольких символов в буфер
+     * \param symbols Имена символов
+     * \param begin Индекс первого символа
+     * \param end Индекс за последним символом
+     * \param url URL запроса
+     */
+    void get_quote_url(
+            const std::vector<std::string> &symbols,
+            const size_t begin,
+            const size_t end,
+            std::string &url) {
+        url.assign(point);
+        url += "/q/l/?s=";
+        for(size_t i = begin; i < end; ++i) {
+            if(i != begin) url += "+";
+            append_lower_case(url, symbols[i]);
+        }
+        url += "&f=sd2t2ohlcv&h&e=csv";
+    }
+
+    /** \brief Разобрать строку ответа с котировкой
+     *
+     * Строка имеет вид EURUSD,2020-08-28,22:59:59,1.1829,1.1913,1.1822,1.1904,0
+     * Метка времени бара - начало дня котировки. Если данных по символу нет,
+     * сервер возвращает N/D вместо даты и цен, такая строка пропускается
+     * \param begin Начало строки
+     * \param end Конец строки
+     * \param symbol Имя символа в верхнем регистре
+     * \param candle Текущий дневной бар
+     * \return Вернет true, если строка содержит котировку
+     */
+    static bool parse_quote_line(const char *begin, const char *end, std::string &symbol, xquotes_common::Candle &candle) {
+        const char *comma = (const char*)std::memchr(begin, ',', end - begin);
+        if(comma == nullptr || comma == begin) return false;
+        symbol.assign(begin, comma);
+        /* после имени символа строка совпадает со строкой внутридневной истории */
+        if(!parse_history_line(comma + 1, end, candle)) return false;
+        candle.timestamp = xtime::get_first_timestamp_day(candle.timestamp);
+        return true;
+    }
+
+    /** \brief Получить текущие дневные бары нескольких символов
+     *
+     * Символы объединяются в запросы к /q/l/ так, чтобы URL не превышал
+     * QUOTE_URL_MAX_LENGTH, поэтому сотни символов обновляются несколькими
+     * запросами вместо запроса истории на каждый символ
+     * \param symbols Имена символов
+     * \param quotes Бары, ключ - имя символа в том виде, в котором оно передано в symbols.
+     * Символы без данных в массив не попадают
+     * \return Код ошибки последнего неудачного запроса, бары удачных запросов сохраняются
+     */
+    int get_quotes(
+            const std::vector<std::string> &symbols,
+            std::map<std::string, xquotes_common::Candle> &quotes) {
+        /* имена в верхнем регистре считаются заново, только если список символов изменился */
+        if(symbols != quote_symbols) {
+            quote_symbols = symbols;
+            quote_names.resize(symbols.size());
+            for(size_t i = 0; i < symbols.size(); ++i) {
+                quote_names[i].first = symbols[i];
+                set_upper_case(quote_names[i].first);
+                quote_names[i].second = i;
+            }
+            std::sort(quote_names.begin(), quote_names.end());
+        }
+        int err = OK;
+        get_quote_url(symbols, 0, 0, context.url);
+        const size_t base_length = context.url.size();
+        size_t begin = 0;
+        while(begin < symbols.size()) {
+            /* набираем символы, пока URL помещается в лимит */
+            size_t end = begin + 1;
+            size_t length = base_length + symbols[begin].size();
+            while(end < symbols.size() && length + 1 + symbols[end].size() <= QUOTE_URL_MAX_LENGTH) {
+                length += 1 + symbols[end].size();
+                ++end;
+            }
+            if(get_remaining_ms() <= 0) return DEADLINE_EXCEEDED;
+            if(simulation != nullptr) {
+                for(size_t i = begin; i < end; ++i) {
+                    simulation->get_quote(symbols[i], quotes[symbols[i]]);
+                }
+                simulation->advance(simulation->get_latency());
+                begin = end;
+                continue;
+            }
+            std::string &response = context.response;
+            get_quote_url(symbols, begin, end, context.url);
+            const auto start = std::chrono::steady_clock::now();
+            const int err_request = get_request_none_security(response, context.url);
+            if(context.curl != nullptr && (err_request == OK || err_request == CURLE_OPERATION_TIMEDOUT)) {
+                add_latency(context.curl, Endpoints::QUOTES, (CURLcode)err_request);
+            }
+            if(is_tracing() && context.curl != nullptr) trace_transfer(context.curl, start, "quotes", nullptr, "symbols", (int64_t)(end - begin));
+            begin = end;
+            if(err_request != OK) {
+                err = err_request;
+                continue;
+            }
+            mt4_tools::TraceSpan span(tracer, "parse quotes", "parse");
+            mt4_tools::AllocScope alloc_scope(mt4_tools::AllocStages::PARSE);
+            const char *ptr = response.data();
+            const char *data_end = ptr + response.size();
+            while(ptr < data_end) {
+                const char *line_end = (const char*)std::memchr(ptr, '\n', data_end - ptr);
+                if(line_end == nullptr) line_end = data_end;
+                xquotes_common::Candle candle;
+                if(parse_quote_line(ptr, line_end, quote_symbol, candle)) {
+                    set_upper_case(quote_symbol);
+                    auto it = std::lower_bound(quote_names.begin(), quote_names.end(), quote_symbol,
+                        [](const std::pair<std::string, size_t> &name, const std::string &value) {
+                        return name.first < value;
+                    });
+                    if(it != quote_names.end() && it->first == quote_symbol) quotes[symbols[it->second]] = candle;
+                }
+                ptr = line_end + 1;
+            }
+        }
+        return err;
+    }
+
+    /** \brief Получить исторические данные
+     *
+     * \param candles Массив баров
+     * \param symbol Имя символа
+     * \param period Период
+     * \param limit Ограничение количества баров
+     * \return Код ошибки
+     */
+    int get_historical_data(
+            std::vector<xquotes_common::Candle> &candles,
+            const std::string &symbol,
+            const PeriodTypes period,
+            const xtime::timestamp_t start_date,
+            const xtime::timestamp_t stop_date) {
+        return get_historical_data(
+            symbol,
+            period,
+            start_date,
+            stop_date,
+            [&](const xquotes_common::Candle &candle) {
+            candles.push_back(candle);
+        });
+    }
+
+    /** \brief Получить исторические данные потоком
+     *
+     * Бары передаются в лямбда-функцию по мере приема ответа сервера,
+     * без сохранения всего ответа в памяти
+     * \param symbol Имя символа
+     * \param period Период
+     * \param start_date Дата начала
+     * \param stop_date Дата конца (включительно)
+     * \param f Лямбда-функция для приема баров
+     * \return Код ошибки
+     */
+    int get_historical_data(
+            const std::string &symbol,
+            const PeriodTypes period,
+            const xtime::timestamp_t start_date,
+            const xtime::timestamp_t stop_date,
+            std::function<void(const xquotes_common::Candle &candle)> f) {
+        if(simulation != nullptr) {
+            HistoryRequest request;
+            request.symbol = symbol;
+            request.period = period;
+            request.start_date = start_date;
+            request.stop_date = stop_date;
+            request.callback = f;
+            simulation->advance(get_simulated_history(request));
+            return request.err;
+        }
+        get_history_url(symbol, period, start_date, stop_date, context.url);
+        HistoryStream &stream = context.stream;
+        stream.reset();
+        stream.callback = f;
+        const int err = get_request_stream(context.url, symbol, stream);
+        stream.callback = nullptr;
+        return err;
+    }
+
+    /** \brief Запрос исторических данных для параллельной загрузки
+     */
+    class HistoryRequest {
+    public:
+        std::string symbol;
+        PeriodTypes period = PeriodTypes::DAY;
+        xtime::timestamp_t start_date = 0;
+        xtime::timestamp_t stop_date = 0;
+        std::function<void(const xquotes_common::Candle &candle)> callback;
+        int err = OK;   /**< Код ошибки запроса */
+
+        HistoryRequest() {};
+    };
+
+private:
+
+    /** \brief Получить период в минутах
+     */
+    static uint32_t get_period_minutes(const PeriodTypes period) {
+        switch(period) {
+        case PeriodTypes::DAY: return xtime::MINUTES_IN_DAY;
+        case PeriodTypes::WEEK: return 10080;
+        case PeriodTypes::MONTH: return 43200;
+        case PeriodTypes::QUARTER: return 129600;
+        case PeriodTypes::YEAR: return 525600;
+        case PeriodTypes::MINUTE_5: return 5;
+        case PeriodTypes::HOUR_1: return 60;
+        };
+        return xtime::MINUTES_IN_DAY;
+    }
+
+    /** \brief Выполнить запрос истории на локальной замене сервера
+     *
+     * Если задержка ответа не укладывается в срок окончания цикла,
+     * запрос прерывается по сроку, как настоящий
+     * \param request Запрос
+     * \return Задержка, которую нужно перевести в часы
+     */
+    std::chrono::milliseconds get_simulated_history(HistoryRequest &request) {
+        const int64_t remaining_ms = get_remaining_ms();
+        if(remaining_ms <= 0) {
+            request.err = DEADLINE_EXCEEDED;
+            return std::chrono::milliseconds(0);
+        }
+        const std::chrono::milliseconds latency = simulation->get_latency();
+        if(latency.count() > remaining_ms) {
+            request.err = DEADLINE_EXCEEDED;
+            return std::chrono::milliseconds(remaining_ms);
+        }
+        simulation->get_history(
+            request.symbol,
+            get_period_minutes(request.period),
+            request.start_date,
+            request.stop_date,
+            request.callback);
+        request.err = OK;
+        return latency;
+    }
+
+public:
+
+    /** \brief Получить исторические данные нескольких запросов
+     *
+     * Если параллельная загрузка или дублирование запросов включены, запросы
+     * выполняются одновременно, не больше max_streams сразу (1 без set_multiplex),
+     * иначе по очереди.
+     * Бары каждого запроса передаются в его callback по мере приема ответа,
+     * а при дублировании - после завершения запроса, чтобы бары второй
+     * копии не смешивались с первой.
+     * Запросы, которые не успевают до срока окончания цикла, не запускаются
+     * и получают код DEADLINE_EXCEEDED.
+     * \param requests Запросы, код ошибки каждого запроса записывается в поле err
+     * \return Код ошибки, если не удалось инициализировать CURL
+     */
+    int get_historical_data(std::vector<HistoryRequest> &requests) {
+        if(simulation != nullptr) {
+            /* одновременные запросы занимают время самого медленного из них */
+            const size_t slots = is_multiplex ? max_streams : 1;
+            for(size_t beg = 0; beg < requests.size(); beg += slots) {
+                const size_t end = std::min(requests.size(), beg + slots);
+                std::chrono::milliseconds latency(0);
+                for(size_t i = beg; i < end; ++i) {
+                    latency = std::max(latency, get_simulated_history(requests[i]));
+                }
+                simulation->advance(latency);
+            }
+            return OK;
+        }
+        if(!is_multiplex && !is_hedging) {
+            for(size_t i = 0; i < requests.size(); ++i) {
+                requests[i].err = get_historical_data(
+                    requests[i].symbol,
+                    requests[i].period,
+                    requests[i].start_date,
+                    requests[i].stop_date,
+                    requests[i].callback);
+            }
+            return OK;
+        }
+        /* часть слотов оставляем для копий медленных запросов */
+        const size_t primary_slots = is_multiplex ? max_streams : 1;
+        const size_t total_slots = primary_slots + (is_hedging ? std::max<size_t>(1, primary_slots / 4) : 0);
+        if(multi == nullptr) {
+            multi = curl_multi_init();
+            if(multi == nullptr) return CURL_CANNOT_BE_INIT;
+        }
+        curl_multi_setopt(multi, CURLMOPT_PIPELINING, is_multiplex ? CURLPIPE_MULTIPLEX : CURLPIPE_NOTHING);
+        curl_multi_setopt(multi, CURLMOPT_MAX_HOST_CONNECTIONS, (long)(is_multiplex ? max_connections : total_slots));
+#if LIBCURL_VERSION_NUM >= 0x074300
+        curl_multi_setopt(multi, CURLMOPT_MAX_CONCURRENT_STREAMS, (long)max_streams);
+#endif
+        while(multi_contexts.size() < total_slots) {
+            multi_contexts.push_back(std::make_shared<ResponseContext>());
+        }
+
+        /** \brief Попытка выполнить запрос в слоте
+         */
+        class Attempt {
+        public:
+            size_t request = 0;
+            bool is_active = false;
+            bool is_hedge = false;
+            std::chrono::steady_clock::time_point start;
+            Endpoints endpoint = Endpoints::HISTORY;
+            std::vector<xquotes_common::Candle> candles;    /**< Бары попытки, пока неизвестно, какая копия ответит первой */
+        };
+
+        static const std::string body;
+        std::vector<Attempt> attempts(total_slots);
+        std::vector<uint8_t> is_done(requests.size(), 0);
+        std::vector<uint8_t> is_hedged(requests.size(), 0);
+        size_t next_request = 0;
+        size_t active = 0;
+        size_t active_primary = 0;
+
+        /* запускаем попытку в свободном слоте */
+        auto start_attempt = [&](const size_t slot, const size_t index, const bool is_hedge, const int64_t remaining_ms) -> bool {
+            HistoryRequest &request = requests[index];
+            ResponseContext &ctx = *multi_contexts[slot];
+            Attempt &attempt = attempts[slot];
+            get_history_url(request.symbol, request.period, request.start_date, request.stop_date, ctx.url);
+            CURL *curl = init_curl(
+                ctx,
+                ctx.url,
+                body,
+                ctx.buffer,
+                request_headers.get(),
+                TIME_OUT,
+                stooq_stream_writer,
+                stooq_header_callback,
+                &ctx,
+                false,
+                false,
+                TypesRequest::REQ_GET);
+            if(curl == NULL) return false;
+            attempt.request = index;
+            attempt.is_active = true;
+            attempt.is_hedge = is_hedge;
+            attempt.start = std::chrono::steady_clock::now();
+            attempt.endpoint = Endpoints::HISTORY;
+            attempt.candles.clear();
+            ctx.is_body_buffer = false;
+            ctx.stream.reset();
+            ctx.stream.is_timed = is_tracing();
+            if(is_hedging) {
+                Attempt *attempt_ptr = &attempt;
+                ctx.stream.callback = [attempt_ptr](const xquotes_common::Candle &candle) {
+                    attempt_ptr->candles.push_back(candle);
+                };
+            } else {
+                ctx.stream.callback = request.callback;
+            }
+            ctx.stream.curl = curl;
+            ctx.stream.context = &ctx;
+            curl_easy_setopt(curl, CURLOPT_WRITEDATA, &ctx.stream);
+            set_adaptive_timeouts(curl, attempt.endpoint, remaining_ms);
+            if(is_multiplex) {
+                /* HTTP/2 через ALPN или Upgrade, при отказе сервера остается HTTP/1.1 */
+                curl_easy_setopt(curl, CURLOPT_HTTP_VERSION, is_prior_knowledge ?
+                    (long)CURL_HTTP_VERSION_2_PRIOR_KNOWLEDGE : (long)CURL_HTTP_VERSION_2_0);
+                /* ждем мультиплексирования вместо открытия нового соединения */
+                curl_easy_setopt(curl, CURLOPT_PIPEWAIT, is_hedge ? 0L : 1L);
+            }
+            curl_multi_add_handle(multi, curl);
+            ++active;
+            if(!is_hedge) ++active_primary;
+            return true;
+        };
+
+        /* освобождаем слот */
+        auto stop_attempt = [&](const size_t slot) {
+            ResponseContext &ctx = *multi_contexts[slot];
+            Attempt &attempt = attempts[slot];
+            curl_multi_remove_handle(multi, ctx.curl);
+            ctx.stream.callback = nullptr;
+            ctx.stream.curl = nullptr;
+            attempt.is_active = false;
+            --active;
+            if(!attempt.is_hedge) --active_primary;
+        };
+
+        while(true) {
+            const int64_t remaining_ms = get_remaining_ms();
+            const auto now = std::chrono::steady_clock::now();
+
+            /* дублируем запросы, сервер которых не ответил за hedge_percentile */
+            for(size_t slot = 0; is_hedging && slot < attempts.size() && remaining_ms > 0; ++slot) {
+                const Attempt &attempt = attempts[slot];
+                if(!attempt.is_active || attempt.is_hedge || is_hedged[attempt.request] || multi_contexts[slot]->is_first_byte) continue;
+                const double delay = get_hedge_delay(attempt.endpoint);
+                if(delay < 0 || std::chrono::duration<double>(now - attempt.start).count() < delay) continue;
+                size_t free_slot = 0;
+                while(free_slot < attempts.size() && attempts[free_slot].is_active) ++free_slot;
+                if(free_slot >= attempts.size()) break;
+                is_hedged[attempt.request] = 1;
+                if(start_attempt(free_slot, attempt.request, true, remaining_ms)) ++hedges_started;
+            }
+
+            /* новые запросы не начинаем после срока окончания цикла */
+            for(size_t slot = 0; slot < attempts.size() && next_request < requests.size() && active_primary < primary_slots; ++slot) {
+                if(attempts[slot].is_active) continue;
+                if(remaining_ms <= 0) {
+                    for(; next_request < requests.size(); ++next_request) {
+                        requests[next_request].err = DEADLINE_EXCEEDED;
+                        is_done[next_request] = 1;
+                    }
+                    break;
+                }
+                if(!start_attempt(slot, next_request, false, remaining_ms)) {
+                    requests[next_request].err = CURL_CANNOT_BE_INIT;
+                    is_done[next_request] = 1;
+                }
+                ++next_request;
+            }
+            if(active == 0) break;
+
+            int still_running = 0;
+            curl_multi_perform(multi, &still_running);
+            CURLMsg *msg = nullptr;
+            int msgs_left = 0;
+            while((msg = curl_multi_info_read(multi, &msgs_left)) != nullptr) {
+                if(msg->msg != CURLMSG_DONE) continue;
+                size_t slot = 0;
+                while(slot < multi_contexts.size() && multi_contexts[slot]->curl != msg->easy_handle) ++slot;
+                if(slot >= multi_contexts.size() || !attempts[slot].is_active) continue;
+                ResponseContext &ctx = *multi_contexts[slot];
+                Attempt &attempt = attempts[slot];
+                const size_t index = attempt.request;
+                HistoryRequest &request = requests[index];
+                long response_code = 0;
+                curl_easy_getinfo(ctx.curl, CURLINFO_RESPONSE_CODE, &response_code);
+                const CURLcode result = msg->data.result;
+                add_latency(ctx.curl, attempt.endpoint, result);
+                int err = OK;
+                if(result == CURLE_OPERATION_TIMEDOUT && get_remaining_ms() <= 0) err = DEADLINE_EXCEEDED;
+                else if(result != CURLE_OK) err = result;
+                else if(response_code != 200) err = CURL_REQUEST_FAILED;
+                else finish_stream_timed(ctx.stream);
+                if(ctx.stream.is_timed) {
+                    trace_transfer(ctx.curl, attempt.start, attempt.is_hedge ? "hedge" : "request", request.symbol.c_str(), "parse_us", ctx.stream.parse_us);
+                }
+
+                /* вторая копия того же запроса */
+                size_t other = 0;
+                while(other < attempts.size() && !(other != slot && attempts[other].is_active && attempts[other].request == index)) ++other;
+                const bool is_other = other < attempts.size();
+
+                if(!is_done[index] && (err == OK || !is_other)) {
+                    is_done[index] = 1;
+                    request.err = err;
+                    if(err == OK && is_hedging && request.callback != nullptr) {
+                        for(size_t i = 0; i < attempt.candles.size(); ++i) {
+                            request.callback(attempt.candles[i]);
+                        }
+                    }
+                    if(err == OK && attempt.is_hedge) ++hedges_won;
+                    /* ответ получен, вторая копия больше не нужна */
+                    if(err == OK && is_other) {
+                        /* опоздавший основной запрос - тот самый медленный ответ, ради которого дублировали;
+                         * проигравшая копия запущена позже, и ее время ничего не говорит о сервере */
+                        if(attempt.is_hedge) add_latency_cancelled(multi_contexts[other]->curl, attempts[other].endpoint, attempts[other].start);
+                        stop_attempt(other);
+                    }
+                }
+                stop_attempt(slot);
+            }
+            if(still_running > 0) curl_multi_wait(multi, nullptr, 0, is_hedging ? 50 : 1000, nullptr);
+        }
         return OK;
     }
+
+    /** \brief Включить дублирование медленных запросов
+     *
+     * Если сервер не начал отвечать за время, большее процентиля hedge_percentile
+     * времени до первого байта, запрос отправляется повторно, и используется
+     * ответ, пришедший первым. Работает в get_historical_data(std::vector<HistoryRequest>&)
+     * \param is_enable Включить дублирование
+     * \param user_percentile Процентиль от 0 до 1
+     */
+    void set_hedging(const bool is_enable, const double user_percentile = 0.95) {
+        is_hedging = is_enable;
+        hedge_percentile = std::min(std::max(user_percentile, 0.5), 0.999);
+    }
+
+    /** \brief Установить срок окончания цикла загрузки
+     *
+     * Таймауты запросов сокращаются до срока, а запросы после срока не начинаются
+     * \param user_deadline Срок окончания
+     */
+    void set_deadline(const std::chrono::steady_clock::time_point &user_deadline) {
+        deadline = user_deadline;
+        is_deadline = true;
+    }
+
+    void clear_deadline() {
+        is_deadline = false;
+    }
+
+    /** \brief Получить статистику задержек точки доступа
+     * \param endpoint Точка доступа
+     * \return Указатель на статистику или nullptr, если замеров нет
+     */
+    const LatencyTracker *get_latency(const Endpoints endpoint) const {
+        const LatencyTracker &tracker = latency[(size_t)endpoint];
+        return tracker.size() == 0 ? nullptr : &tracker;
+    }
+
+    /** \brief Получить статистику задержек точки доступа
+     * \param endpoint URL точки доступа без параметров, например https://stooq.com/q/d/l/
+     * \return Указатель на статистику или nullptr, если замеров нет
+     */
+    const LatencyTracker *get_latency(const std::string &endpoint) const {
+        if(endpoint == get_history_endpoint()) return get_latency(Endpoints::HISTORY);
+        if(endpoint == point + "/q/l/") return get_latency(Endpoints::QUOTES);
+        return nullptr;
+    }
+
+    /** \brief Получить точку доступа исторических данных
+     */
+    std::string get_history_endpoint() const {
+        return point + "/q/d/l/";
+    }
+
+    /** \brief Включить запись этапов запросов
+     * \param user_tracer Запись интервалов или nullptr, чтобы не писать
+     */
+    void set_tracer(mt4_tools::TraceRecorder *user_tracer) {
+        tracer = user_tracer;
+    }
+
+    /** \brief Использовать часы загрузчика для срока окончания цикла
+     * \param user_clock Часы или nullptr для системных часов
+     */
+    void set_clock(mt4_tools::Clock *user_clock) {
+        clock = user_clock;
+    }
+
+    /** \brief Отвечать на запросы истории и котировок локальной заменой сервера
+     *
+     * Задержки ответов переводятся в часы замены сервера, поэтому
+     * с виртуальными часами загрузка не ждет в реальном времени.
+     * Для срока окончания цикла те же часы передаются в set_clock()
+     * \param user_simulation Замена сервера или nullptr, чтобы запросы шли на сервер
+     */
+    void set_simulation(mt4_tools::SimulatedServer *user_simulation) {
+        simulation = user_simulation;
+    }
+
+    inline uint64_t get_hedges_started() const {
+        return hedges_started;
+    }
+
+    inline uint64_t get_hedges_won() const {
+        return hedges_won;
+    }
 };
 
 #endif // FOREXPROSTOOLSAPI_HPP_INCLUDED
@@ -0,0 +1,619 @@
+#ifndef MT4_STORAGE_HPP_INCLUDED
+#define MT4_STORAGE_HPP_INCLUDED
+
+#include <vector>
+#include <map>
+#include <string>
+#include <memory>
+#include <algorithm>
+#include <cstring>
+#include <cstdint>
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#if defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter) && defined(__NR_io_uring_register)
+#define MT4_STORAGE_IO_URING
+#endif
+#endif
+
+#ifdef MT4_STORAGE_IO_URING
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#endif
+
+namespace mt4_tools {
+
+#ifdef MT4_STORAGE_IO_URING
+    /** \brief Часть интерфейса io_uring ядра, нужная AsyncStorage
+     *
+     * Структуры и константы повторяют linux/io_uring.h. Сам заголовок
+     * не подключается, так как он тянет linux/fs.h с макросами BLOCK_SIZE
+     * и другими общими именами. Раскладка структур - часть ABI ядра и не меняется
+     */
+    namespace uring {
+
+        class SqringOffsets {
+        public:
+            uint32_t head;
+            uint32_t tail;
+            uint32_t ring_mask;
+            uint32_t ring_entries;
+            uint32_t flags;
+            uint32_t dropped;
+            uint32_t array;
+            uint32_t resv1;
+            uint64_t resv2;
+        };
+
+        class CqringOffsets {
+        public:
+            uint32_t head;
+            uint32_t tail;
+            uint32_t ring_mask;
+            uint32_t ring_entries;
+            uint32_t overflow;
+            uint32_t cqes;
+            uint32_t flags;
+            uint32_t resv1;
+            uint64_t resv2;
+        };
+
+        class Params {
+        public:
+            uint32_t sq_entries;
+            uint32_t cq_entries;
+            uint32_t flags;
+            uint32_t sq_thread_cpu;
+            uint32_t sq_thread_idle;
+            uint32_t features;
+            uint32_t wq_fd;
+            uint32_t resv[3];
+            SqringOffsets sq_off;
+            CqringOffsets cq_off;
+        };
+
+        class Sqe {
+        public:
+            uint8_t opcode;
+            uint8_t flags;
+            uint16_t ioprio;
+            int32_t fd;
+            uint64_t off;
+            uint64_t addr;
+            uint32_t len;
+            uint32_t fsync_flags;   /**< Флаги операции, для записи - rw_flags */
+            uint64_t user_data;
+            uint16_t buf_index;
+            uint16_t personality;
+            int32_t splice_fd_in;
+            uint64_t pad[2];
+        };
+
+        class Cqe {
+        public:
+            uint64_t user_data;
+            int32_t res;
+            uint32_t flags;
+        };
+
+        static_assert(sizeof(Params) == 120, "io_uring_params size");
+        static_assert(sizeof(Sqe) == 64, "io_uring_sqe size");
+        static_assert(sizeof(Cqe) == 16, "io_uring_cqe size");
+
+        static const uint8_t OP_FSYNC = 3;
+        static const uint8_t OP_WRITE_FIXED = 5;
+        static const uint8_t OP_WRITE = 23;
+        static const uint8_t SQE_IO_LINK = 1U << 2;
+        static const uint32_t FSYNC_DATASYNC = 1U << 0;
+        static const uint32_t ENTER_GETEVENTS = 1U << 0;
+        static const uint32_t FEAT_SINGLE_MMAP = 1U << 0;
+        static const uint32_t REGISTER_BUFFERS = 0;
+        static const off_t OFF_SQ_RING = 0;
+        static const off_t OFF_CQ_RING = 0x8000000;
+        static const off_t OFF_SQES = 0x10000000;
+    }
+#endif
+
+    /** \brief Асинхронная запись файлов через io_uring
+     *
+     * Операции записи копируются в общий буфер и накапливаются в очереди,
+     * submit() отправляет их в ядро одним системным вызовом и сразу возвращает
+     * управление, а wait() дожидается завершения. Операции одного файла
+     * связываются в цепочку и выполняются по порядку, в конце цепочки
+     * выполняется fdatasync. Буфер регистрируется в ядре, если это позволяет
+     * система, иначе используются обычные операции записи.
+     * На других платформах и без поддержки io_uring open() вернет false,
+     * и файлы нужно писать через потоки, как раньше.
+     */
+    class AsyncStorage {
+    public:
+        static const size_t DEFAULT_BUFFER_SIZE = 4 * 1024 * 1024;  /**< Размер буфера записей по умолчанию */
+        static const uint32_t DEFAULT_ENTRIES = 256;                /**< Размер очереди отправки по умолчанию */
+
+    private:
+
+        /** \brief Открытый файл
+         */
+        class FileEntry {
+        public:
+            std::string name;
+            int fd = -1;
+            size_t pending = 0;     /**< Операции файла, отправленные в ядро и еще не завершенные */
+        };
+
+        enum class OperationTypes {
+            WRITE,
+            FSYNC,
+        };
+
+        /** \brief Операция в очереди
+         */
+        class Operation {
+        public:
+            OperationTypes type = OperationTypes::WRITE;
+            size_t file = 0;
+            uint64_t offset = 0;
+            size_t size = 0;
+            size_t buffer_offset = 0;           /**< Смещение данных в общем буфере */
+            std::shared_ptr<std::vector<char>> heap;  /**< Данные, которые не поместились в общий буфер */
+        };
+
+        std::map<std::string, size_t> file_indexes;
+        std::vector<FileEntry> files;
+        std::vector<Operation> queue;           /**< Операции, еще не отправленные в ядро */
+        std::vector<Operation> inflight_ops;    /**< Операции в ядре, индекс - user_data */
+        std::vector<size_t> free_slots;
+        size_t inflight = 0;
+        char *buffer = nullptr;
+        size_t buffer_size = 0;
+        size_t buffer_used = 0;
+        bool is_open_storage = false;
+        bool is_fsync = true;
+        bool is_registered = false;
+        bool is_error = false;
+        uint64_t submits = 0;
+        uint64_t operations = 0;
+        uint64_t bytes = 0;
+
+#ifdef MT4_STORAGE_IO_URING
+        int ring_fd = -1;
+        void *sq_ptr = nullptr;
+        void *cq_ptr = nullptr;
+        size_t sq_ptr_size = 0;
+        size_t cq_ptr_size = 0;
+        uring::Sqe *sqes = nullptr;
+        size_t sqes_size = 0;
+        unsigned *sq_head = nullptr;
+        unsigned *sq_tail = nullptr;
+        unsigned *sq_mask = nullptr;
+        unsigned *sq_array = nullptr;
+        unsigned *cq_head = nullptr;
+        unsigned *cq_tail = nullptr;
+        unsigned *cq_mask = nullptr;
+        uring::Cqe *cqes = nullptr;
+        unsigned sq_entries = 0;
+        unsigned cq_entries = 0;
+        unsigned to_submit = 0;
+
+        static int io_uring_setup(const unsigned entries, uring::Params *params) {
+            return (int)syscall(__NR_io_uring_setup, entries, params);
+        }
+
+        static int io_uring_enter(const int fd, const unsigned submit, const unsigned min_complete, const unsigned flags) {
+            return (int)syscall(__NR_io_uring_enter, fd, submit, min_complete, flags, nullptr, 0);
+        }
+
+        static int io_uring_register(const int fd, const unsigned opcode, void *arg, const unsigned args) {
+            return (int)syscall(__NR_io_uring_register, fd, opcode, arg, args);
+        }
+
+        inline unsigned get_sq_space() const {
+            return sq_entries - (*sq_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE));
+        }
+
+        /** \brief Отправить в ядро заполненные записи очереди
+         * \param min_complete Дождаться завершения указанного количества операций
+         */
+        bool enter(const unsigned min_complete) {
+            while(true) {
+                const int res = io_uring_enter(ring_fd, to_submit, min_complete, min_complete > 0 ? uring::ENTER_GETEVENTS : 0);
+                if(res >= 0) {
+                    to_submit -= std::min<unsigned>(to_submit, (unsigned)res);
+                    if(res > 0) ++submits;
+                    return true;
+                }
+                if(errno == EINTR) continue;
+                if(errno == EAGAIN || errno == EBUSY) {
+                    /* ядру не хватает места для результатов, забираем их и повторяем */
+                    if(reap() == 0) return false;
+                    continue;
+                }
+                return false;
+            }
+        }
+
+        /** \brief Забрать результаты завершенных операций
+         * \return Количество обработанных результатов
+         */
+        size_t reap() {
+            unsigned head = *cq_head;
+            const unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+            size_t count = 0;
+            while(head != tail) {
+                const uring::Cqe &cqe = cqes[head & *cq_mask];
+                const size_t slot = (size_t)cqe.user_data;
+                Operation &op = inflight_ops[slot];
+                if(cqe.res < 0 || (op.type == OperationTypes::WRITE && (size_t)cqe.res != op.size)) is_error = true;
+                --files[op.file].pending;
+                op.heap.reset();
+                free_slots.push_back(slot);
+                --inflight;
+                ++head;
+                ++count;
+            }
+            __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+            return count;
+        }
+
+        /** \brief Дождаться, пока в ядре не останется больше max_inflight операций
+         */
+        bool wait_inflight(const size_t max_inflight) {
+            while(inflight > max_inflight) {
+                if(reap() > 0) continue;
+                if(!enter(1)) return false;
+            }
+            return true;
+        }
+
+        void push_sqe(const Operation &op, const bool is_link) {
+            const size_t slot = free_slots.back();
+            free_slots.pop_back();
+            inflight_ops[slot] = op;
+            const unsigned tail = *sq_tail;
+            const unsigned index = tail & *sq_mask;
+            uring::Sqe &sqe = sqes[index];
+            std::memset(&sqe, 0, sizeof(sqe));
+            sqe.fd = files[op.file].fd;
+            sqe.user_data = (uint64_t)slot;
+            if(is_link) sqe.flags = uring::SQE_IO_LINK;
+            if(op.type == OperationTypes::FSYNC) {
+                sqe.opcode = uring::OP_FSYNC;
+                sqe.fsync_flags = uring::FSYNC_DATASYNC;
+            } else {
+                const char *data = op.heap ? op.heap->data() : buffer + op.buffer_offset;
+                sqe.opcode = is_registered && !op.heap ? uring::OP_WRITE_FIXED : uring::OP_WRITE;
+                sqe.addr = (uint64_t)(uintptr_t)data;
+                sqe.len = (uint32_t)op.size;
+                sqe.off = op.offset;
+                sqe.buf_index = 0;
+                bytes += op.size;
+            }
+            sq_array[index] = index;
+            __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+            ++files[op.file].pending;
+            ++inflight;
+            ++to_submit;
+            ++operations;
+        }
+#endif
+
+        /** \brief Получить открытый файл, открыв его при необходимости
+         * \return Индекс файла или -1, если файл не удалось открыть
+         */
+        int get_file(const std::string &file_name) {
+            auto it = file_indexes.find(file_name);
+            if(it != file_indexes.end()) return (int)it->second;
+#ifdef MT4_STORAGE_IO_URING
+            const int fd = ::open(file_name.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+            if(fd < 0) return -1;
+            FileEntry entry;
+            entry.name = file_name;
+            entry.fd = fd;
+            files.push_back(entry);
+            file_indexes[file_name] = files.size() - 1;
+            return (int)(files.size() - 1);
+#else
+            return -1;
+#endif
+        }
+
+        /** \brief Закрыть файлы, у которых нет незавершенных операций
+         */
+        void close_files() {
+#ifdef MT4_STORAGE_IO_URING
+            if(!queue.empty() || inflight != 0) return;
+            for(size_t i = 0; i < files.size(); ++i) {
+                if(files[i].fd >= 0) ::close(files[i].fd);
+            }
+#endif
+            files.clear();
+            file_indexes.clear();
+        }
+
+    public:
+
+        AsyncStorage() {};
+
+        AsyncStorage(const AsyncStorage&) = delete;
+        AsyncStorage &operator=(const AsyncStorage&) = delete;
+
+        ~AsyncStorage() {
+            close();
+        }
+
+        /** \brief Создать кольцо io_uring
+         * \param user_buffer_size Размер буфера записей. Записи больше буфера копируются в отдельную память
+         * \param user_is_fsync Выполнять fdatasync для каждого файла после его записей
+         * \param entries Размер очереди отправки
+         * \return Вернет false, если io_uring недоступен
+         */
+        bool open(
+                const size_t user_buffer_size = DEFAULT_BUFFER_SIZE,
+                const bool user_is_fsync = true,
+                const uint32_t entries = DEFAULT_ENTRIES) {
+            close();
+#ifdef MT4_STORAGE_IO_URING
+            uring::Params params;
+            std::memset(&params, 0, sizeof(params));
+            ring_fd = io_uring_setup(entries, &params);
+            if(ring_fd < 0) return false;
+            sq_entries = params.sq_entries;
+            cq_entries = params.cq_entries;
+
+            sq_ptr_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+            cq_ptr_size = params.cq_off.cqes + params.cq_entries * sizeof(uring::Cqe);
+            const bool is_single_mmap = (params.features & uring::FEAT_SINGLE_MMAP) != 0;
+            if(is_single_mmap) sq_ptr_size = cq_ptr_size = std::max(sq_ptr_size, cq_ptr_size);
+            sq_ptr = mmap(nullptr, sq_ptr_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, uring::OFF_SQ_RING);
+            if(sq_ptr == MAP_FAILED) {
+                sq_ptr = nullptr;
+                close();
+                return false;
+            }
+            if(is_single_mmap) {
+                cq_ptr = sq_ptr;
+            } else {
+                cq_ptr = mmap(nullptr, cq_ptr_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, uring::OFF_CQ_RING);
+                if(cq_ptr == MAP_FAILED) {
+                    cq_ptr = nullptr;
+                    close();
+                    return false;
+                }
+            }
+            sqes_size = params.sq_entries * sizeof(uring::Sqe);
+            void *sqes_ptr = mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, uring::OFF_SQES);
+            if(sqes_ptr == MAP_FAILED) {
+                close();
+                return false;
+            }
+            sqes = (uring::Sqe*)sqes_ptr;
+            char *sq = (char*)sq_ptr;
+            char *cq = (char*)cq_ptr;
+            sq_head = (unsigned*)(sq + params.sq_off.head);
+            sq_tail = (unsigned*)(sq + params.sq_off.tail);
+            sq_mask = (unsigned*)(sq + params.sq_off.ring_mask);
+            sq_array = (unsigned*)(sq + params.sq_off.array);
+            cq_head = (unsigned*)(cq + params.cq_off.head);
+            cq_tail = (unsigned*)(cq + params.cq_off.tail);
+            cq_mask = (unsigned*)(cq + params.cq_off.ring_mask);
+            cqes = (uring::Cqe*)(cq + params.cq_off.cqes);
+
+            /* буфер выделяем страницами, чтобы ядро могло его закрепить */
+            buffer_size = std::max<size_t>(user_buffer_size, 4096);
+            void *buffer_ptr = mmap(nullptr, buffer_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if(buffer_ptr == MAP_FAILED) {
+                buffer_size = 0;
+                close();
+                return false;
+            }
+            buffer = (char*)buffer_ptr;
+            /* регистрация может не пройти из-за лимита RLIMIT_MEMLOCK, тогда пишем без нее */
+            iovec iov;
+            iov.iov_base = buffer;
+            iov.iov_len = buffer_size;
+            is_registered = io_uring_register(ring_fd, uring::REGISTER_BUFFERS, &iov, 1) == 0;
+
+            inflight_ops.resize(cq_entries);
+            free_slots.clear();
+            for(size_t i = cq_entries; i > 0; --i) {
+                free_slots.push_back(i - 1);
+            }
+            is_fsync = user_is_fsync;
+            is_error = false;
+            is_open_storage = true;
+            return true;
+#else
+            (void)user_buffer_size;
+            (void)user_is_fsync;
+            (void)entries;
+            return false;
+#endif
+        }
+
+        /** \brief Дождаться завершения записи и освободить кольцо
+         */
+        void close() {
+            if(is_open_storage) wait();
+#ifdef MT4_STORAGE_IO_URING
+            close_files();
+            if(buffer != nullptr) munmap(buffer, buffer_size);
+            if(sqes != nullptr) munmap(sqes, sqes_size);
+            if(cq_ptr != nullptr && cq_ptr != sq_ptr) munmap(cq_ptr, cq_ptr_size);
+            if(sq_ptr != nullptr) munmap(sq_ptr, sq_ptr_size);
+            if(ring_fd >= 0) ::close(ring_fd);
+            ring_fd = -1;
+            sqes = nullptr;
+            sq_ptr = cq_ptr = nullptr;
+            to_submit = 0;
+#endif
+            buffer = nullptr;
+            buffer_size = 0;
+            buffer_used = 0;
+            queue.clear();
+            inflight = 0;
+            is_registered = false;
+            is_open_storage = false;
+        }
+
+        inline bool is_open() const {
+            return is_open_storage;
+        }
+
+        /** \brief Поставить в очередь запись данных в файл
+         *
+         * Данные копируются, после вызова буфер можно использовать повторно
+         * \param file_name Имя файла, файл создается при необходимости
+         * \param offset Смещение в файле
+         * \param data Данные
+         * \param size Размер данных
+         * \return Вернет false, если файл не удалось открыть
+         */
+        bool write(const std::string &file_name, const uint64_t offset, const char *data, const size_t size) {
+            if(!is_open_storage) return false;
+            const int file = get_file(file_name);
+            if(file < 0) return false;
+            if(size == 0) return true;
+            Operation op;
+            op.type = OperationTypes::WRITE;
+            op.file = (size_t)file;
+            op.offset = offset;
+            op.size = size;
+            if(size > buffer_size) {
+                op.heap = std::make_shared<std::vector<char>>(data, data + size);
+            } else {
+                if(buffer_used + size > buffer_size) {
+                    /* буфер занят операциями в ядре, ждем их завершения */
+                    if(!wait()) is_error = true;
+                    const int reopened = get_file(file_name);
+                    if(reopened < 0) return false;
+                    op.file = (size_t)reopened;
+                }
+                op.buffer_offset = buffer_used;
+                std::memcpy(buffer + buffer_used, data, size);
+                buffer_used += size;
+            }
+            queue.push_back(op);
+            return true;
+        }
+
+        bool write(const std::string &file_name, const uint64_t offset, const std::string &data) {
+            return write(file_name, offset, data.data(), data.size());
+        }
+
+        /** \brief Обрезать файл
+         *
+         * Результат такой же, как если бы файл обрезался после уже поставленных
+         * в очередь записей. Обрезка выполняется сразу после завершения записей
+         * файла, отправленных в ядро, а данные записей из очереди, которые
+         * лежат за новым концом файла, отбрасываются.
+         * \param file_name Имя файла
+         * \param size Новый размер файла
+         * \return Вернет true в случае успешного завершения
+         */
+        bool truncate(const std::string &file_name, const uint64_t size) {
+            if(!is_open_storage) return false;
+            const int file = get_file(file_name);
+            if(file < 0) return false;
+#ifdef MT4_STORAGE_IO_URING
+            while(files[file].pending > 0) {
+                if(reap() > 0) continue;
+                if(!enter(1)) return false;
+            }
+            size_t n = 0;
+            for(size_t i = 0; i < queue.size(); ++i) {
+                Operation &op = queue[i];
+                if(op.file == (size_t)file && op.type == OperationTypes::WRITE) {
+                    if(op.offset >= size) continue;
+                    if(op.offset + op.size > size) op.size = (size_t)(size - op.offset);
+                }
+                queue[n++] = queue[i];
+            }
+            queue.resize(n);
+            return ::ftruncate(files[file].fd, (off_t)size) == 0;
+#else
+            (void)size;
+            return false;
+#endif
+        }
+
+        /** \brief Отправить накопленные операции в ядро
+         *
+         * Функция не ждет завершения записи
+         * \return Вернет false, если ядро не приняло операции
+         */
+        bool submit() {
+            if(!is_open_storage) return false;
+#ifdef MT4_STORAGE_IO_URING
+            if(queue.empty()) return true;
+            /* собираем операции по файлам, сохраняя их порядок внутри файла */
+            std::stable_sort(queue.begin(), queue.end(), [](const Operation &a, const Operation &b) {
+                return a.file < b.file;
+            });
+            Operation fsync_op;
+            fsync_op.type = OperationTypes::FSYNC;
+            size_t beg = 0;
+            while(beg < queue.size()) {
+                size_t end = beg + 1;
+                while(end < queue.size() && queue[end].file == queue[beg].file) ++end;
+                fsync_op.file = queue[beg].file;
+                const size_t length = end - beg + (is_fsync ? 1 : 0);
+                /* цепочка файла должна попасть в ядро одним вызовом, иначе связь операций прервется */
+                const size_t chain = std::min<size_t>(length, sq_entries);
+                if(get_sq_space() < chain && !enter(0)) return false;
+                if(!wait_inflight(cq_entries - chain)) return false;
+                for(size_t i = 0; i < length; ++i) {
+                    if(get_sq_space() == 0 && !enter(0)) return false;
+                    if(inflight >= cq_entries && !wait_inflight(cq_entries - 1)) return false;
+                    push_sqe(beg + i < end ? queue[beg + i] : fsync_op, i + 1 < length);
+                }
+                beg = end;
+            }
+            queue.clear();
+            return enter(0);
+#else
+            return false;
+#endif
+        }
+
+        /** \brief Отправить накопленные операции и дождаться завершения всех операций
+         * \return Вернет false, если хотя бы одна операция после прошлого вызова wait() завершилась ошибкой
+         */
+        bool wait() {
+            if(!is_open_storage) return false;
+#ifdef MT4_STORAGE_IO_URING
+            if(!submit()) is_error = true;
+            if(!wait_inflight(0)) is_error = true;
+#endif
+            buffer_used = 0;
+            close_files();
+            const bool is_ok = !is_error;
+            is_error = false;
+            return is_ok;
+        }
+
+        /** \brief Проверить, что буфер записей зарегистрирован в ядре
+         */
+        inline bool is_registered_buffer() const {
+            return is_registered;
+        }
+
+        /** \brief Получить количество вызовов io_uring_enter, отправивших операции
+         */
+        inline uint64_t get_submits() const {
+            return submits;
+        }
+
+        inline uint64_t get_operations() const {
+            return operations;
+        }
+
+        inline uint64_t get_bytes() const {
+            return bytes;
+        }
+    };
+}
+
+#endif // MT4_STORAGE_HPP_INCLUDED
@@ -0,0 +1,262 @@
+#ifndef MT4_SYNC_HPP_INCLUDED
+#define MT4_SYNC_HPP_INCLUDED
+
+#include "mt4-fixed-candles.hpp"
+#include <vector>
+#include <algorithm>
+
+namespace mt4_tools {
+
+    /** \brief Результат сверки истории
+     */
+    class SyncResult {
+    public:
+        std::vector<size_t> changed;    /**< Индексы баров, которые изменились на месте */
+        size_t first_changed = 0;       /**< Индекс первого измененного, вставленного или добавленного бара */
+        size_t first_rewritten = 0;     /**< Начиная с этого индекса история заменена целиком (бары были вставлены или удалены) */
+        size_t added = 0;               /**< Количество баров, добавленных в конец истории */
+        bool is_rewritten = false;      /**< Флаг замены конца истории */
+        bool is_changed = false;        /**< Флаг любого изменения истории */
+
+        SyncResult() {};
+    };
+
+    /** \brief Класс для сверки истории с заново загруженными барами
+     *
+     * История делится на блоки по BLOCK_SIZE баров, для каждого полного блока
+     * хранится хеш. Свежие бары хешируются теми же блоками, и побарно
+     * сравниваются только блоки с разными хешами. Блоки выровнены по абсолютному
+     * номеру бара в истории, поэтому хеши переживают циклы загрузки и тогда,
+     * когда в памяти только окно конца истории, и пересчитываются только
+     * для измененных и новых блоков.
+     */
+    template<class PRICE_TYPE = int32_t, class VOLUME_TYPE = uint64_t>
+    class HistorySync {
+    public:
+        static const size_t BLOCK_SIZE = 64;    /**< Количество баров в блоке */
+
+    private:
+        typedef FixedCandles<PRICE_TYPE, VOLUME_TYPE> candles_t;
+
+        std::vector<uint64_t> block_hashes;     /**< Хеши полных блоков истории, начиная с блока first_block */
+        size_t first_block = 0;                 /**< Абсолютный номер блока block_hashes[0] */
+
+        static inline void hash_value(uint64_t &hash, const uint64_t value) {
+            /* FNV-1a по 64-битным словам */
+            hash ^= value;
+            hash *= 0x100000001b3ULL;
+        }
+
+    public:
+
+        /** \brief Получить хеш баров с индексами от begin до end
+         */
+        static uint64_t hash_range(const candles_t &candles, const size_t begin, const size_t end) {
+            uint64_t hash = 0xcbf29ce484222325ULL;
+            const xtime::timestamp_t *timestamps = candles.timestamp_data();
+            const PRICE_TYPE *opens = candles.open_data();
+            const PRICE_TYPE *highs = candles.high_data();
+            const PRICE_TYPE *lows = candles.low_data();
+            const PRICE_TYPE *closes = candles.close_data();
+            const VOLUME_TYPE *volumes = candles.volume_data();
+            for(size_t i = begin; i < end; ++i) {
+                hash_value(hash, (uint64_t)timestamps[i]);
+                hash_value(hash, (uint64_t)(int64_t)opens[i]);
+                hash_value(hash, (uint64_t)(int64_t)highs[i]);
+                hash_value(hash, (uint64_t)(int64_t)lows[i]);
+                hash_value(hash, (uint64_t)(int64_t)closes[i]);
+                hash_value(hash, (uint64_t)volumes[i]);
+            }
+            return hash;
+        }
+
+    private:
+
+        /** \brief Выровнять хеши блоков по окну истории
+         *
+         * Блоки до начала окна отбрасываются. Хеши, которые не могут
+         * относиться к окну (окно началось раньше или история стала короче),
+         * сбрасываются
+         * \param candles Окно истории
+         * \param base Абсолютный номер бара candles[0]
+         */
+        void align_hashes(const candles_t &candles, const size_t base) {
+            const size_t window_block = (base + BLOCK_SIZE - 1) / BLOCK_SIZE;
+            const size_t end_block = (base + candles.size()) / BLOCK_SIZE;
+            if(block_hashes.empty() || first_block < window_block) {
+                const size_t skip = std::min(block_hashes.size(), window_block - std::min(window_block, first_block));
+                block_hashes.erase(block_hashes.begin(), block_hashes.begin() + skip);
+                if(block_hashes.empty()) first_block = window_block;
+                else first_block += skip;
+            }
+            if(first_block > window_block || first_block + block_hashes.size() > end_block) {
+                block_hashes.clear();
+                first_block = window_block;
+            }
+        }
+
+        /** \brief Обновить хеши блоков
+         * \param candles Окно истории
+         * \param base Абсолютный номер бара candles[0]
+         * \param from_index Индекс первого измененного бара в окне
+         */
+        void update_hashes(const candles_t &candles, const size_t base, const size_t from_index) {
+            const size_t changed_block = (base + from_index) / BLOCK_SIZE;
+            const size_t end_block = (base + candles.size()) / BLOCK_SIZE;
+            if(changed_block < first_block) block_hashes.clear();
+            else if(first_block + block_hashes.size() > changed_block) block_hashes.resize(changed_block - first_block);
+            for(size_t b = first_block + block_hashes.size(); b < end_block; ++b) {
+                block_hashes.push_back(hash_range(candles, b * BLOCK_SIZE - base, (b + 1) * BLOCK_SIZE - base));
+            }
+        }
+
+    public:
+
+        HistorySync() {};
+
+        /** \brief Сбросить хеши блоков
+         *
+         * Нужно вызвать, если история была изменена в обход этого класса
+         */
+        void reset() {
+            block_hashes.clear();
+            first_block = 0;
+        }
+
+        /** \brief Сверить историю с заново загруженными барами и применить изменения
+         *
+         * Бары из fresh, попадающие на уже сохраненный участок истории, сравниваются
+         * с ним и заменяют отличающиеся бары на месте. Если метки времени расходятся
+         * (бары вставлены или удалены), история заменяется начиная с первого расхождения.
+         * Бары новее последнего сохраненного добавляются в конец.
+         * \param candles История или окно ее конца
+         * \param fresh Заново загруженные бары с той же точностью, отсортированные по времени
+         * \param base Абсолютный номер бара candles[0], если в candles только конец истории
+         * \return Результат сверки, индексы в нем относятся к candles
+         */
+        SyncResult synchronize(candles_t &candles, const candles_t &fresh, const size_t base = 0) {
+            SyncResult result;
+            result.first_changed = candles.size();
+            if(fresh.empty()) return result;
+            /* хеши могли устареть, если история была перечитана с диска */
+            align_hashes(candles, base);
+            update_hashes(candles, base, (first_block + block_hashes.size()) * BLOCK_SIZE - base);
+
+            const size_t start = candles.lower_bound(fresh.front().timestamp);
+            const size_t overlap = std::min(candles.size() - start, fresh.size());
+            size_t i = start;
+            size_t j = 0;
+            while(j < overlap) {
+                /* целый блок сравниваем по хешу */
+                const size_t block = (base + i) / BLOCK_SIZE;
+                if((base + i) % BLOCK_SIZE == 0 && block >= first_block && (block - first_block) < block_hashes.size() && (j + BLOCK_SIZE) <= overlap) {
+                    if(block_hashes[block - first_block] == hash_range(fresh, j, j + BLOCK_SIZE)) {
+                        i += BLOCK_SIZE;
+                        j += BLOCK_SIZE;
+                        continue;
+                    }
+                }
+                if(candles.is_equal(i, fresh, j)) {
+                    ++i;
+                    ++j;
+                    continue;
+                }
+                if(candles[i].timestamp != fresh[j].timestamp) {
+                    /* бары вставлены или удалены, заменяем конец истории */
+                    result.is_rewritten = true;
+                    result.first_rewritten = i;
+                    candles.truncate(i);
+                    break;
+                }
+                candles.set(i, fresh[j]);
+                result.changed.push_back(i);
+                ++i;
+                ++j;
+            }
+
+            if(!result.is_rewritten && j == overlap && i < candles.size()) {
+                /* свежие бары закончились раньше истории, хвост истории не трогаем */
+            } else {
+                const size_t old_size = candles.size();
+                candles.append(fresh, j, fresh.size());
+                j = fresh.size();
+                if(!result.is_rewritten) result.added = candles.size() - old_size;
+            }
+
+            if(!result.changed.empty()) result.first_changed = result.changed.front();
+            else if(result.is_rewritten) result.first_changed = result.first_rewritten;
+            else result.first_changed = candles.size() - result.added;
+            result.is_changed = !result.changed.empty() || result.is_rewritten || result.added > 0;
+            if(result.is_changed) update_hashes(candles, base, result.first_changed);
+            return result;
+        }
+    };
+
+    typedef HistorySync<int32_t, uint64_t> CompactHistorySync;
+
+    /** \brief Окно баров, загруженное и сверенное в прошлом цикле
+     *
+     * Хранит хеш загруженного окна и последний бар истории после его сверки.
+     * Сверка окна с историей, в которую оно уже внесено, ничего не меняет,
+     * поэтому если следующее окно с той же меткой начала дает тот же хеш,
+     * чтение csv файла, сверку и запись можно пропустить. Последний бар
+     * позволяет выбрать начало окна без чтения файла. Кеш верен, пока историю
+     * меняет только загрузчик
+     */
+    template<class PRICE_TYPE = int32_t, class VOLUME_TYPE = uint64_t>
+    class HistoryWindowCache {
+    private:
+        typedef FixedCandles<PRICE_TYPE, VOLUME_TYPE> candles_t;
+
+        uint64_t hash = 0;
+        size_t size = 0;
+        xtime::timestamp_t timestamp_beg = 0;
+        xtime::timestamp_t last_timestamp = 0;
+        bool is_valid_flag = false;
+
+    public:
+
+        HistoryWindowCache() {};
+
+        /** \brief Запомнить окно после сверки
+         * \param fresh Загруженные бары
+         * \param user_timestamp_beg Метка времени начала запроса окна
+         * \param user_last_timestamp Метка времени последнего бара истории после сверки
+         */
+        void set(const candles_t &fresh, const xtime::timestamp_t user_timestamp_beg, const xtime::timestamp_t user_last_timestamp) {
+            hash = HistorySync<PRICE_TYPE, VOLUME_TYPE>::hash_range(fresh, 0, fresh.size());
+            size = fresh.size();
+            timestamp_beg = user_timestamp_beg;
+            last_timestamp = user_last_timestamp;
+            is_valid_flag = true;
+        }
+
+        /** \brief Проверить, совпадает ли окно с запомненным
+         * \param fresh Загруженные бары
+         * \param user_timestamp_beg Метка времени начала запроса окна
+         * \return Вернет true, если окно не изменилось
+         */
+        bool is_unchanged(const candles_t &fresh, const xtime::timestamp_t user_timestamp_beg) const {
+            return is_valid_flag &&
+                size == fresh.size() &&
+                timestamp_beg == user_timestamp_beg &&
+                hash == HistorySync<PRICE_TYPE, VOLUME_TYPE>::hash_range(fresh, 0, fresh.size());
+        }
+
+        void reset() {
+            is_valid_flag = false;
+        }
+
+        inline bool is_valid() const {
+            return is_valid_flag;
+        }
+
+        inline xtime::timestamp_t get_last_timestamp() const {
+            return last_timestamp;
+        }
+    };
+
+    typedef HistoryWindowCache<int32_t, uint64_t> CompactWindowCache;
+}
+
+#endif // MT4_SYNC_HPP_INCLUDED
@@ -0,0 +1,121 @@
+#ifndef MT4_SYNTHETIC_HPP_INCLUDED
+#define MT4_SYNTHETIC_HPP_INCLUDED
+
+#include "mt4-fixed-candles.hpp"
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+
+namespace mt4_tools {
+
+    /** \brief Способ расчета синтетического символа
+     */
+    enum class SyntheticModes {
+        OHLC,   /**< Все цены бара. Максимум и минимум оцениваются по крайним ценам составляющих */
+        CLOSE,  /**< Только цена закрытия, остальные цены бара равны ей */
+    };
+
+    /** \brief Возвести цену в степень составляющей
+     */
+    inline double apply_synthetic_power(const double value, const int32_t power) {
+        if(power == 1) return value;
+        if(power == -1) return 1.0 / value;
+        return std::pow(value, (double)power);
+    }
+
+    /** \brief Рассчитать бары синтетического символа по его составляющим
+     *
+     * Сначала метки времени составляющих сливаются в один проход: в результат
+     * попадают только метки, которые есть у всех составляющих. Затем каждая цена
+     * считается отдельным проходом по массивам столбцов как произведение цен
+     * составляющих в их степенях. Для отрицательной степени максимум бара
+     * получается из минимума составляющей и наоборот. Экстремумы составляющих
+     * не обязаны совпадать по времени, поэтому максимум и минимум - это оценка
+     * сверху и снизу. Объем равен 0.
+     * \param legs Бары составляющих
+     * \param powers Степени составляющих
+     * \param mode Способ расчета
+     * \param timestamp_beg Метка времени, с которой нужно рассчитать бары
+     * \param output Бары синтетического символа. Массив очищается перед расчетом
+     */
+    template<class PRICE_TYPE, class VOLUME_TYPE>
+    void compute_synthetic(
+            const std::vector<const FixedCandles<PRICE_TYPE, VOLUME_TYPE>*> &legs,
+            const std::vector<int32_t> &powers,
+            const SyntheticModes mode,
+            const xtime::timestamp_t timestamp_beg,
+            std::vector<xquotes_common::Candle> &output) {
+        output.clear();
+        const size_t legs_size = legs.size();
+        if(legs_size == 0 || powers.size() != legs_size) return;
+
+        /* выравниваем составляющие по меткам времени */
+        std::vector<size_t> pos(legs_size);
+        for(size_t k = 0; k < legs_size; ++k) {
+            pos[k] = legs[k]->lower_bound(timestamp_beg);
+        }
+        std::vector<std::vector<size_t>> indexes(legs_size);
+        std::vector<xtime::timestamp_t> timestamps;
+        while(true) {
+            bool is_end = false;
+            xtime::timestamp_t timestamp = 0;
+            for(size_t k = 0; k < legs_size; ++k) {
+                if(pos[k] >= legs[k]->size()) {
+                    is_end = true;
+                    break;
+                }
+                timestamp = std::max(timestamp, legs[k]->timestamp_data()[pos[k]]);
+            }
+            if(is_end) break;
+            bool is_aligned = true;
+            for(size_t k = 0; k < legs_size; ++k) {
+                const xtime::timestamp_t *leg_timestamps = legs[k]->timestamp_data();
+                const size_t leg_size = legs[k]->size();
+                while(pos[k] < leg_size && leg_timestamps[pos[k]] < timestamp) ++pos[k];
+                if(pos[k] >= leg_size || leg_timestamps[pos[k]] != timestamp) is_aligned = false;
+            }
+            if(!is_aligned) continue;
+            timestamps.push_back(timestamp);
+            for(size_t k = 0; k < legs_size; ++k) {
+                indexes[k].push_back(pos[k]++);
+            }
+        }
+
+        /* считаем цены по столбцам */
+        const size_t size = timestamps.size();
+        std::vector<double> opens(size, 1.0), highs(size, 1.0), lows(size, 1.0), closes(size, 1.0);
+        auto multiply = [&](std::vector<double> &column, const PRICE_TYPE *prices, const std::vector<size_t> &index, const double scale, const int32_t power) {
+            for(size_t n = 0; n < size; ++n) {
+                column[n] *= apply_synthetic_power((double)prices[index[n]] / scale, power);
+            }
+        };
+        for(size_t k = 0; k < legs_size; ++k) {
+            const FixedCandles<PRICE_TYPE, VOLUME_TYPE> &leg = *legs[k];
+            const double scale = std::pow(10.0, (double)leg.get_digits());
+            const int32_t power = powers[k];
+            multiply(closes, leg.close_data(), indexes[k], scale, power);
+            if(mode == SyntheticModes::CLOSE) continue;
+            multiply(opens, leg.open_data(), indexes[k], scale, power);
+            multiply(highs, power > 0 ? leg.high_data() : leg.low_data(), indexes[k], scale, power);
+            multiply(lows, power > 0 ? leg.low_data() : leg.high_data(), indexes[k], scale, power);
+        }
+
+        output.resize(size);
+        for(size_t n = 0; n < size; ++n) {
+            xquotes_common::Candle &candle = output[n];
+            candle.timestamp = timestamps[n];
+            candle.close = closes[n];
+            candle.volume = 0;
+            if(mode == SyntheticModes::CLOSE) {
+                candle.open = candle.high = candle.low = closes[n];
+            } else {
+                candle.open = opens[n];
+                candle.high = std::max(highs[n], std::max(opens[n], closes[n]));
+                candle.low = std::min(lows[n], std::min(opens[n], closes[n]));
+            }
+        }
+    }
+}
+
+#endif // MT4_SYNTHETIC_HPP_INCLUDED
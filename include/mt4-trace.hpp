@@ -0,0 +1,280 @@
+#ifndef MT4_TRACE_HPP_INCLUDED
+#define MT4_TRACE_HPP_INCLUDED
+
+#include <vector>
+#include <algorithm>
+#include <string>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <cstring>
+#include <cstdint>
+
+namespace mt4_tools {
+
+    /** \brief Запись интервалов работы загрузчика в формате Chrome trace event
+     *
+     * Каждый поток пишет интервалы в свой буфер без блокировок, блокировка
+     * нужна только при первой записи потока. Буфер завершившегося потока
+     * отдается следующему новому потоку. Файл открывается в chrome://tracing
+     * или https://ui.perfetto.dev. Пока запись выключена, интервал стоит
+     * одной проверки флага, время не замеряется.
+     * Методы write() и clear() вызываются между циклами, когда остальные
+     * потоки не пишут интервалы.
+     */
+    class TraceRecorder {
+    public:
+        static const size_t SYMBOL_SIZE = 24;
+
+        /** \brief Интервал
+         */
+        class Event {
+        public:
+            const char *name = nullptr;         /**< Имя этапа, строковая константа */
+            const char *category = nullptr;     /**< Категория этапа, строковая константа */
+            const char *value_name = nullptr;   /**< Имя числового параметра или nullptr */
+            int64_t value = 0;
+            int64_t ts = 0;                     /**< Начало в микросекундах от создания TraceRecorder */
+            int64_t dur = 0;                    /**< Длительность в микросекундах */
+            char symbol[SYMBOL_SIZE];           /**< Символ или пустая строка */
+
+            Event() {
+                symbol[0] = '\0';
+            };
+        };
+
+    private:
+
+        /** \brief Буфер интервалов одного потока
+         */
+        class ThreadBuffer {
+        public:
+            std::vector<Event> events;
+            uint32_t tid = 0;
+        };
+
+        /** \brief Буферы потоков, живут, пока жив TraceRecorder или поток с его буфером
+         */
+        class State {
+        public:
+            std::mutex mutex;
+            std::vector<std::unique_ptr<ThreadBuffer>> buffers;
+            std::vector<ThreadBuffer*> free_buffers;
+        };
+
+        /** \brief Буфер текущего потока, при завершении потока возвращается в State
+         */
+        class ThreadSlot {
+        public:
+            std::weak_ptr<State> state;
+            const State *owner = nullptr;
+            ThreadBuffer *buffer = nullptr;
+
+            ~ThreadSlot() {
+                std::shared_ptr<State> temp = state.lock();
+                if(!temp || buffer == nullptr) return;
+                std::lock_guard<std::mutex> lock(temp->mutex);
+                temp->free_buffers.push_back(buffer);
+            }
+        };
+
+        std::shared_ptr<State> state;
+        std::atomic<bool> is_enabled_flag;
+        std::chrono::steady_clock::time_point origin;
+
+        ThreadBuffer *get_buffer() {
+            static thread_local ThreadSlot slot;
+            if(slot.owner == state.get() && !slot.state.expired()) return slot.buffer;
+            std::lock_guard<std::mutex> lock(state->mutex);
+            ThreadBuffer *buffer = nullptr;
+            if(!state->free_buffers.empty()) {
+                buffer = state->free_buffers.back();
+                state->free_buffers.pop_back();
+            } else {
+                state->buffers.push_back(std::unique_ptr<ThreadBuffer>(new ThreadBuffer()));
+                buffer = state->buffers.back().get();
+                buffer->tid = (uint32_t)state->buffers.size();
+            }
+            slot.state = state;
+            slot.owner = state.get();
+            slot.buffer = buffer;
+            return buffer;
+        }
+
+        static void write_string(std::ofstream &file, const char *str) {
+            file << '"';
+            for(; *str != '\0'; ++str) {
+                if(*str == '"' || *str == '\\') file << '\\';
+                if((uint8_t)*str < 0x20) continue;
+                file << *str;
+            }
+            file << '"';
+        }
+
+    public:
+
+        TraceRecorder() :
+            state(std::make_shared<State>()),
+            is_enabled_flag(false),
+            origin(std::chrono::steady_clock::now()) {};
+
+        TraceRecorder(const TraceRecorder&) = delete;
+        TraceRecorder &operator=(const TraceRecorder&) = delete;
+
+        /** \brief Включить или выключить запись
+         */
+        inline void set_enabled(const bool is_enable) {
+            is_enabled_flag.store(is_enable, std::memory_order_relaxed);
+        }
+
+        inline bool is_enabled() const {
+            return is_enabled_flag.load(std::memory_order_relaxed);
+        }
+
+        /** \brief Перевести момент времени в микросекунды трассы
+         */
+        inline int64_t to_us(const std::chrono::steady_clock::time_point &time) const {
+            return std::chrono::duration_cast<std::chrono::microseconds>(time - origin).count();
+        }
+
+        /** \brief Добавить интервал
+         * \param name Имя этапа, строковая константа
+         * \param category Категория этапа, строковая константа
+         * \param start Начало интервала
+         * \param stop Конец интервала
+         * \param symbol Символ или nullptr
+         * \param value_name Имя числового параметра или nullptr
+         * \param value Значение числового параметра
+         */
+        void add(
+                const char *name,
+                const char *category,
+                const std::chrono::steady_clock::time_point &start,
+                const std::chrono::steady_clock::time_point &stop,
+                const char *symbol = nullptr,
+                const char *value_name = nullptr,
+                const int64_t value = 0) {
+            if(!is_enabled()) return;
+            ThreadBuffer *buffer = get_buffer();
+            buffer->events.push_back(Event());
+            Event &event = buffer->events.back();
+            event.name = name;
+            event.category = category;
+            event.value_name = value_name;
+            event.value = value;
+            event.ts = to_us(start);
+            event.dur = std::max<int64_t>(0, to_us(stop) - event.ts);
+            if(symbol != nullptr) {
+                std::strncpy(event.symbol, symbol, SYMBOL_SIZE - 1);
+                event.symbol[SYMBOL_SIZE - 1] = '\0';
+            }
+        }
+
+        /** \brief Получить количество записанных интервалов
+         */
+        size_t size() {
+            std::lock_guard<std::mutex> lock(state->mutex);
+            size_t total = 0;
+            for(size_t i = 0; i < state->buffers.size(); ++i) {
+                total += state->buffers[i]->events.size();
+            }
+            return total;
+        }
+
+        /** \brief Записать интервалы всех потоков в файл JSON
+         * \param file_name Имя файла
+         * \return Вернет true, если файл записан
+         */
+        bool write(const std::string &file_name) {
+            std::ofstream file(file_name, std::ios::binary | std::ios::trunc);
+            if(!file) return false;
+            std::lock_guard<std::mutex> lock(state->mutex);
+            file << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+            bool is_first = true;
+            for(size_t i = 0; i < state->buffers.size(); ++i) {
+                const ThreadBuffer &buffer = *state->buffers[i];
+                for(size_t n = 0; n < buffer.events.size(); ++n) {
+                    const Event &event = buffer.events[n];
+                    if(!is_first) file << ",";
+                    is_first = false;
+                    file << "\n{\"name\":";
+                    write_string(file, event.name);
+                    file << ",\"cat\":";
+                    write_string(file, event.category);
+                    file << ",\"ph\":\"X\",\"pid\":1,\"tid\":" << buffer.tid
+                        << ",\"ts\":" << event.ts
+                        << ",\"dur\":" << event.dur;
+                    if(event.symbol[0] != '\0' || event.value_name != nullptr) {
+                        file << ",\"args\":{";
+                        if(event.symbol[0] != '\0') {
+                            file << "\"symbol\":";
+                            write_string(file, event.symbol);
+                        }
+                        if(event.value_name != nullptr) {
+                            if(event.symbol[0] != '\0') file << ",";
+                            write_string(file, event.value_name);
+                            file << ":" << event.value;
+                        }
+                        file << "}";
+                    }
+                    file << "}";
+                }
+            }
+            file << "\n]}\n";
+            return (bool)file;
+        }
+
+        /** \brief Удалить записанные интервалы, память буферов сохраняется
+         */
+        void clear() {
+            std::lock_guard<std::mutex> lock(state->mutex);
+            for(size_t i = 0; i < state->buffers.size(); ++i) {
+                state->buffers[i]->events.clear();
+            }
+        }
+    };
+
+    /** \brief Интервал от создания до удаления объекта
+     */
+    class TraceSpan {
+    private:
+        TraceRecorder *recorder = nullptr;
+        const char *name = nullptr;
+        const char *category = nullptr;
+        const std::string *symbol = nullptr;
+        std::chrono::steady_clock::time_point start;
+
+    public:
+
+        /** \brief Начать интервал
+         * \param user_recorder Запись интервалов, nullptr или выключенная запись - интервал не пишется
+         * \param user_name Имя этапа, строковая константа
+         * \param user_category Категория этапа, строковая константа
+         * \param user_symbol Символ, строка должна жить до конца интервала
+         */
+        TraceSpan(
+                TraceRecorder *user_recorder,
+                const char *user_name,
+                const char *user_category,
+                const std::string *user_symbol = nullptr) {
+            if(user_recorder == nullptr || !user_recorder->is_enabled()) return;
+            recorder = user_recorder;
+            name = user_name;
+            category = user_category;
+            symbol = user_symbol;
+            start = std::chrono::steady_clock::now();
+        }
+
+        ~TraceSpan() {
+            if(recorder == nullptr) return;
+            recorder->add(name, category, start, std::chrono::steady_clock::now(), symbol != nullptr ? symbol->c_str() : nullptr);
+        }
+
+        TraceSpan(const TraceSpan&) = delete;
+        TraceSpan &operator=(const TraceSpan&) = delete;
+    };
+}
+
+#endif // MT4_TRACE_HPP_INCLUDED
@@ -0,0 +1,439 @@
+#ifndef MT4_WS_SERVER_HPP_INCLUDED
+#define MT4_WS_SERVER_HPP_INCLUDED
+
+#include "server_ws.hpp"
+#include "xquotes_common.hpp"
+#include <nlohmann/json.hpp>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <future>
+#include <deque>
+#include <map>
+#include <set>
+#include <vector>
+#include <string>
+#include <cstdio>
+#include <algorithm>
+
+namespace mt4_tools {
+
+    /** \brief WebSocket сервер для рассылки баров
+     *
+     * Протокол - текстовые сообщения JSON.
+     * Клиент отправляет {"cmd":"subscribe","symbol":"EURUSD","period":1440},
+     * {"cmd":"unsubscribe",...} или {"cmd":"list"}.
+     * После подписки сервер присылает снимок последних баров
+     * {"type":"snapshot","symbol":"EURUSD","period":1440,"digits":5,"candles":[[t,o,h,l,c,v],...]},
+     * а затем изменения, собранные за пачку символов, одним сообщением
+     * {"type":"update","data":[{"symbol":"EURUSD","period":1440,"candles":[[t,o,h,l,c,v],...]},...]}.
+     *
+     * У каждого клиента своя очередь отправки. Если клиент не успевает
+     * принимать данные и очередь превышает лимит, неотправленные изменения
+     * отбрасываются и заменяются свежими снимками его подписок.
+     */
+    class CandleWsServer {
+    public:
+        typedef SimpleWeb::SocketServer<SimpleWeb::WS> WsServer;
+
+        /** \brief Параметры сервера
+         */
+        class Config {
+        public:
+            std::string address;                /**< Адрес, пустой - все интерфейсы */
+            uint16_t port = 8090;
+            size_t snapshot_size = 100;         /**< Количество баров в снимке */
+            size_t max_queue_bytes = 1048576;   /**< Лимит очереди отправки клиента */
+
+            Config() {};
+        };
+
+    private:
+
+        /** \brief Поток баров символа
+         */
+        class Channel {
+        public:
+            std::string symbol;
+            uint32_t period = 0;
+            uint32_t digits = 0;
+            std::string candle_format;                      /**< Формат бара [t,o,h,l,c,v] для sprintf */
+            std::deque<xquotes_common::Candle> candles;     /**< Последние бары для снимка */
+            std::vector<xquotes_common::Candle> pending;    /**< Изменения, еще не разосланные клиентам */
+
+            Channel() {};
+        };
+
+        /** \brief Подключенный клиент
+         */
+        class Client {
+        public:
+            std::shared_ptr<WsServer::Connection> connection;
+            std::deque<std::string> queue;  /**< Сообщения, ожидающие отправки */
+            size_t queued_bytes = 0;        /**< Размер очереди вместе с отправляемым сообщением */
+            bool is_sending = false;
+            bool is_closed = false;
+            std::set<int> channels;         /**< Подписки */
+
+            Client() {};
+        };
+
+        WsServer server;
+        std::thread server_thread;
+        std::mutex clients_mutex;
+        std::vector<Channel> channels;
+        std::map<WsServer::Connection*, std::shared_ptr<Client>> clients;
+        Config config;
+        uint64_t overflows = 0;
+        bool is_started = false;
+
+        void add_candle_json(std::string &out, const Channel &channel, const xquotes_common::Candle &candle) const {
+            char buffer[256];
+            const int len = std::snprintf(buffer, sizeof(buffer), channel.candle_format.c_str(),
+                (long long)candle.timestamp, candle.open, candle.high, candle.low, candle.close, candle.volume);
+            if(len > 0) out.append(buffer, std::min<size_t>((size_t)len, sizeof(buffer) - 1));
+        }
+
+        std::string get_snapshot(const int channel_index) const {
+            const Channel &channel = channels[channel_index];
+            std::string out("{\"type\":\"snapshot\",\"symbol\":\"" + channel.symbol +
+                "\",\"period\":" + std::to_string(channel.period) +
+                ",\"digits\":" + std::to_string(channel.digits) +
+                ",\"candles\":[");
+            for(size_t i = 0; i < channel.candles.size(); ++i) {
+                if(i > 0) out += ',';
+                add_candle_json(out, channel, channel.candles[i]);
+            }
+            out += "]}";
+            return out;
+        }
+
+        /** \brief Поставить сообщение в очередь клиента
+         *
+         * Вызывается под clients_mutex
+         */
+        void enqueue(Client &client, const std::string &message, const bool is_update) {
+            if(client.is_closed) return;
+            if(is_update && (client.queued_bytes + message.size()) > config.max_queue_bytes) {
+                /* клиент не успевает, заменяем накопленные изменения снимками */
+                ++overflows;
+                for(size_t i = 0; i < client.queue.size(); ++i) {
+                    client.queued_bytes -= client.queue[i].size();
+                }
+                client.queue.clear();
+                for(auto it = client.channels.begin(); it != client.channels.end(); ++it) {
+                    const std::string snapshot = get_snapshot(*it);
+                    client.queued_bytes += snapshot.size();
+                    client.queue.push_back(snapshot);
+                }
+                return;
+            }
+            client.queued_bytes += message.size();
+            client.queue.push_back(message);
+        }
+
+        /** \brief Отправить следующее сообщение из очереди клиента
+         *
+         * Следующее сообщение отправляется только после завершения предыдущего,
+         * поэтому очередь отражает реальную скорость клиента
+         */
+        void send_next(const std::shared_ptr<Client> &client) {
+            std::shared_ptr<std::string> message;
+            {
+                std::lock_guard<std::mutex> lock(clients_mutex);
+                if(client->is_closed || client->is_sending || client->queue.empty()) return;
+                message = std::make_shared<std::string>();
+                message->swap(client->queue.front());
+                client->queue.pop_front();
+                client->is_sending = true;
+            }
+            const size_t size = message->size();
+            client->connection->send(*message, [this, client, size](const SimpleWeb::error_code &ec) {
+                {
+                    std::lock_guard<std::mutex> lock(clients_mutex);
+                    client->is_sending = false;
+                    client->queued_bytes -= size;
+                    if(ec) client->is_closed = true;
+                }
+                if(!ec) send_next(client);
+            });
+        }
+
+        void on_message(const std::shared_ptr<WsServer::Connection> &connection, const std::string &text) {
+            std::shared_ptr<Client> client;
+            {
+                std::lock_guard<std::mutex> lock(clients_mutex);
+                auto it = clients.find(connection.get());
+                if(it == clients.end()) return;
+                client = it->second;
+                std::string error;
+                try {
+                    const nlohmann::json j = nlohmann::json::parse(text);
+                    const std::string cmd = j.at("cmd").get<std::string>();
+                    if(cmd == "list") {
+                        std::string out("{\"type\":\"list\",\"channels\":[");
+                        for(size_t i = 0; i < channels.size(); ++i) {
+                            if(i > 0) out += ',';
+                            out += "{\"symbol\":\"" + channels[i].symbol + "\",\"period\":" + std::to_string(channels[i].period) + "}";
+                        }
+                        out += "]}";
+                        enqueue(*client, out, false);
+                    } else
+                    if(cmd == "subscribe" || cmd == "unsubscribe") {
+                        const int channel_index = find_channel(j.at("symbol").get<std::string>(), j.at("period").get<uint32_t>());
+                        if(channel_index < 0) {
+                            error = "unknown symbol";
+                        } else
+                        if(cmd == "subscribe") {
+                            client->channels.insert(channel_index);
+                            enqueue(*client, get_snapshot(channel_index), false);
+                        } else {
+                            client->channels.erase(channel_index);
+                        }
+                    } else {
+                        error = "unknown command";
+                    }
+                }
+                catch(...) {
+                    error = "invalid message";
+                }
+                if(error.size() != 0) enqueue(*client, "{\"type\":\"error\",\"message\":\"" + error + "\"}", false);
+            }
+            send_next(client);
+        }
+
+        void remove_client(const std::shared_ptr<WsServer::Connection> &connection) {
+            std::lock_guard<std::mutex> lock(clients_mutex);
+            auto it = clients.find(connection.get());
+            if(it == clients.end()) return;
+            it->second->is_closed = true;
+            clients.erase(it);
+        }
+
+        int find_channel(const std::string &symbol, const uint32_t period) const {
+            for(size_t i = 0; i < channels.size(); ++i) {
+                if(channels[i].period == period && channels[i].symbol == symbol) return (int)i;
+            }
+            return -1;
+        }
+
+        /** \brief Обновить бар в снимке канала
+         *
+         * Вызывается под clients_mutex
+         */
+        void apply_candle(Channel &channel, const xquotes_common::Candle &candle) {
+            std::deque<xquotes_common::Candle> &candles = channel.candles;
+            if(candles.empty() || candles.back().timestamp < candle.timestamp) {
+                candles.push_back(candle);
+                while(candles.size() > config.snapshot_size) candles.pop_front();
+                return;
+            }
+            /* исправление бара внутри снимка */
+            for(size_t i = candles.size(); i-- > 0;) {
+                if(candles[i].timestamp == candle.timestamp) {
+                    candles[i] = candle;
+                    return;
+                }
+                if(candles[i].timestamp < candle.timestamp) {
+                    candles.insert(candles.begin() + i + 1, candle);
+                    while(candles.size() > config.snapshot_size) candles.pop_front();
+                    return;
+                }
+            }
+        }
+
+    public:
+
+        CandleWsServer() {};
+
+        CandleWsServer(const CandleWsServer&) = delete;
+        CandleWsServer &operator=(const CandleWsServer&) = delete;
+
+        ~CandleWsServer() {
+            stop();
+        }
+
+        /** \brief Добавить поток баров символа
+         *
+         * Потоки добавляются до запуска сервера
+         * \param symbol Имя символа
+         * \param period Период в минутах
+         * \param digits Количество знаков после запятой
+         * \return Индекс потока
+         */
+        int add_channel(const std::string &symbol, const uint32_t period, const uint32_t digits) {
+            Channel channel;
+            channel.symbol = symbol;
+            channel.period = period;
+            channel.digits = digits;
+            const std::string price = "%." + std::to_string(digits) + "f";
+            channel.candle_format = "[%lld," + price + "," + price + "," + price + "," + price + ",%.0f]";
+            channels.push_back(channel);
+            return (int)channels.size() - 1;
+        }
+
+        /** \brief Запустить сервер в отдельном потоке
+         * \param user_config Параметры сервера
+         * \return Вернет true, если сервер начал принимать соединения
+         */
+        bool start(const Config &user_config) {
+            stop();
+            config = user_config;
+            server.config.port = config.port;
+            server.config.address = config.address;
+            WsServer::Endpoint &endpoint = server.endpoint["^/candles/?$"];
+            endpoint.on_open = [this](std::shared_ptr<WsServer::Connection> connection) {
+                std::shared_ptr<Client> client = std::make_shared<Client>();
+                client->connection = connection;
+                std::lock_guard<std::mutex> lock(clients_mutex);
+                clients[connection.get()] = client;
+            };
+            endpoint.on_message = [this](std::shared_ptr<WsServer::Connection> connection, std::shared_ptr<WsServer::InMessage> in_message) {
+                on_message(connection, in_message->string());
+            };
+            endpoint.on_close = [this](std::shared_ptr<WsServer::Connection> connection, int, const std::string &) {
+                remove_client(connection);
+            };
+            endpoint.on_error = [this](std::shared_ptr<WsServer::Connection> connection, const SimpleWeb::error_code &) {
+                remove_client(connection);
+            };
+
+            std::shared_ptr<std::promise<bool>> is_listen = std::make_shared<std::promise<bool>>();
+            std::future<bool> is_listen_future = is_listen->get_future();
+            server_thread = std::thread([this, is_listen]() {
+                bool is_set = false;
+                try {
+                    server.start([&](unsigned short) {
+                        is_set = true;
+                        is_listen->set_value(true);
+                    });
+                }
+                catch(...) {}
+                if(!is_set) is_listen->set_value(false);
+            });
+            is_started = is_listen_future.get();
+            if(!is_started) server_thread.join();
+            return is_started;
+        }
+
+        void stop() {
+            if(!server_thread.joinable()) return;
+            if(is_started) server.stop();
+            server_thread.join();
+            is_started = false;
+            std::lock_guard<std::mutex> lock(clients_mutex);
+            clients.clear();
+        }
+
+        inline bool is_running() const {
+            return is_started;
+        }
+
+        /** \brief Загрузить историю потока для снимков
+         *
+         * Подписчикам потока отправляется новый снимок
+         * \param channel_index Индекс потока
+         * \param candles История символа
+         */
+        template<class CANDLES_TYPE>
+        void set_history(const int channel_index, const CANDLES_TYPE &candles) {
+            if(channel_index < 0 || (size_t)channel_index >= channels.size()) return;
+            std::vector<std::shared_ptr<Client>> targets;
+            {
+                std::lock_guard<std::mutex> lock(clients_mutex);
+                Channel &channel = channels[channel_index];
+                channel.candles.clear();
+                channel.pending.clear();
+                const size_t first = candles.size() > config.snapshot_size ? candles.size() - config.snapshot_size : 0;
+                for(size_t i = first; i < candles.size(); ++i) {
+                    channel.candles.push_back(candles[i]);
+                }
+                std::string snapshot;
+                for(auto it = clients.begin(); it != clients.end(); ++it) {
+                    if(it->second->channels.count(channel_index) == 0) continue;
+                    if(snapshot.empty()) snapshot = get_snapshot(channel_index);
+                    enqueue(*it->second, snapshot, false);
+                    targets.push_back(it->second);
+                }
+            }
+            for(size_t i = 0; i < targets.size(); ++i) {
+                send_next(targets[i]);
+            }
+        }
+
+        /** \brief Добавить измененный или новый бар
+         *
+         * Изменения копятся до вызова flush
+         * \param channel_index Индекс потока
+         * \param candle Бар
+         */
+        void update(const int channel_index, const xquotes_common::Candle &candle) {
+            if(channel_index < 0 || (size_t)channel_index >= channels.size()) return;
+            std::lock_guard<std::mutex> lock(clients_mutex);
+            Channel &channel = channels[channel_index];
+            apply_candle(channel, candle);
+            /* несколько изменений одного бара за пачку отправляем один раз */
+            for(size_t i = channel.pending.size(); i-- > 0;) {
+                if(channel.pending[i].timestamp == candle.timestamp) {
+                    channel.pending[i] = candle;
+                    return;
+                }
+            }
+            channel.pending.push_back(candle);
+        }
+
+        /** \brief Разослать накопленные изменения
+         *
+         * Каждый клиент получает одно сообщение с изменениями всех своих подписок
+         */
+        void flush() {
+            std::vector<std::shared_ptr<Client>> targets;
+            {
+                std::lock_guard<std::mutex> lock(clients_mutex);
+                std::vector<std::string> parts(channels.size());
+                for(size_t c = 0; c < channels.size(); ++c) {
+                    Channel &channel = channels[c];
+                    if(channel.pending.empty()) continue;
+                    std::string &part = parts[c];
+                    part = "{\"symbol\":\"" + channel.symbol + "\",\"period\":" + std::to_string(channel.period) + ",\"candles\":[";
+                    for(size_t i = 0; i < channel.pending.size(); ++i) {
+                        if(i > 0) part += ',';
+                        add_candle_json(part, channel, channel.pending[i]);
+                    }
+                    part += "]}";
+                    channel.pending.clear();
+                }
+                for(auto it = clients.begin(); it != clients.end(); ++it) {
+                    Client &client = *it->second;
+                    std::string message;
+                    for(auto c = client.channels.begin(); c != client.channels.end(); ++c) {
+                        if(parts[*c].empty()) continue;
+                        message += message.empty() ? "{\"type\":\"update\",\"data\":[" : ",";
+                        message += parts[*c];
+                    }
+                    if(message.empty()) continue;
+                    message += "]}";
+                    enqueue(client, message, true);
+                    targets.push_back(it->second);
+                }
+            }
+            for(size_t i = 0; i < targets.size(); ++i) {
+                send_next(targets[i]);
+            }
+        }
+
+        /** \brief Получить количество переполнений очередей клиентов
+         */
+        inline uint64_t get_overflows() {
+            std::lock_guard<std::mutex> lock(clients_mutex);
+            return overflows;
+        }
+
+        inline size_t get_clients() {
+            std::lock_guard<std::mutex> lock(clients_mutex);
+            return clients.size();
+        }
+    };
+}
+
+#endif // MT4_WS_SERVER_HPP_INCLUDED
@@ -0,0 +1,226 @@
+#ifndef MT4_ZIP_HPP_INCLUDED
+#define MT4_ZIP_HPP_INCLUDED
+
+#include "zlib.h"
+#include <fstream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <cstring>
+#include <cstdint>
+#include <limits>
+
+namespace mt4_tools {
+
+    /** \brief Класс для чтения zip архива
+     *
+     * Поддерживаются методы сжатия stored и deflate, а также расширение ZIP64,
+     * которое нужно архивам с более чем 65535 файлами или размером больше 4 ГБ.
+     * Каждый объект держит свой поток файла, поэтому для чтения архива из
+     * нескольких потоков нужно открыть архив в каждом потоке отдельно.
+     */
+    class ZipArchive {
+    public:
+
+        /// Варианты состояния ошибок
+        enum ErrorType {
+            OK = 0,                     ///< Ошибки нет
+            FILE_CANNOT_OPENED = -1,    ///< Архив не удалось открыть
+            INVALID_ARCHIVE = -2,       ///< Структура архива повреждена
+            METHOD_NOT_SUPPORT = -3,    ///< Метод сжатия не поддерживается
+            DECOMPRESS_ERROR = -4,      ///< Ошибка распаковки
+        };
+
+        /** \brief Файл в архиве
+         */
+        class Entry {
+        public:
+            std::string name;
+            uint64_t compressed_size = 0;
+            uint64_t uncompressed_size = 0;
+            uint64_t local_header_offset = 0;
+            uint16_t method = 0;
+
+            Entry() {};
+        };
+
+    private:
+        std::ifstream file;
+        std::vector<Entry> entries;
+        std::vector<char> compressed;   /**< Буфер сжатых данных, переиспользуется между чтениями */
+
+        static inline uint16_t get_u16(const char *ptr) {
+            return (uint16_t)((uint8_t)ptr[0] | ((uint8_t)ptr[1] << 8));
+        }
+
+        static inline uint32_t get_u32(const char *ptr) {
+            return (uint32_t)get_u16(ptr) | ((uint32_t)get_u16(ptr + 2) << 16);
+        }
+
+        static inline uint64_t get_u64(const char *ptr) {
+            return (uint64_t)get_u32(ptr) | ((uint64_t)get_u32(ptr + 4) << 32);
+        }
+
+        bool read_at(const uint64_t offset, char *buffer, const size_t size) {
+            file.clear();
+            file.seekg((std::streamoff)offset, std::ios::beg);
+            file.read(buffer, size);
+            return (size_t)file.gcount() == size;
+        }
+
+        int read_central_directory() {
+            file.clear();
+            file.seekg(0, std::ios::end);
+            const uint64_t file_size = (uint64_t)file.tellg();
+            if(file_size < 22) return INVALID_ARCHIVE;
+
+            /* ищем запись End Of Central Directory с конца файла */
+            const size_t tail_size = (size_t)std::min<uint64_t>(file_size, 22 + 65535);
+            std::vector<char> tail(tail_size);
+            if(!read_at(file_size - tail_size, tail.data(), tail_size)) return INVALID_ARCHIVE;
+            size_t eocd = std::string::npos;
+            for(size_t i = tail_size - 22 + 1; i-- > 0;) {
+                if(get_u32(tail.data() + i) == 0x06054b50) {
+                    eocd = i;
+                    break;
+                }
+            }
+            if(eocd == std::string::npos) return INVALID_ARCHIVE;
+            uint64_t total_entries = get_u16(tail.data() + eocd + 10);
+            uint64_t cd_size = get_u32(tail.data() + eocd + 12);
+            uint64_t cd_offset = get_u32(tail.data() + eocd + 16);
+
+            /* ZIP64 End Of Central Directory Locator стоит перед EOCD */
+            const uint64_t eocd_offset = file_size - tail_size + eocd;
+            if(eocd_offset >= 20) {
+                char locator[20];
+                if(read_at(eocd_offset - 20, locator, 20) && get_u32(locator) == 0x07064b50) {
+                    const uint64_t zip64_offset = get_u64(locator + 8);
+                    char zip64_eocd[56];
+                    if(!read_at(zip64_offset, zip64_eocd, 56) || get_u32(zip64_eocd) != 0x06064b50) return INVALID_ARCHIVE;
+                    total_entries = get_u64(zip64_eocd + 32);
+                    cd_size = get_u64(zip64_eocd + 40);
+                    cd_offset = get_u64(zip64_eocd + 48);
+                }
+            }
+            if(cd_size > file_size || cd_offset > file_size - cd_size) return INVALID_ARCHIVE;
+
+            std::vector<char> cd((size_t)cd_size);
+            if(cd_size > 0 && !read_at(cd_offset, cd.data(), (size_t)cd_size)) return INVALID_ARCHIVE;
+            entries.clear();
+            /* количество записей не проверено, запись каталога занимает не меньше 46 байт */
+            entries.reserve((size_t)std::min<uint64_t>(total_entries, cd.size() / 46));
+            size_t ptr = 0;
+            for(uint64_t n = 0; n < total_entries; ++n) {
+                if(ptr + 46 > cd.size() || get_u32(cd.data() + ptr) != 0x02014b50) return INVALID_ARCHIVE;
+                const char *header = cd.data() + ptr;
+                Entry entry;
+                entry.method = get_u16(header + 10);
+                entry.compressed_size = get_u32(header + 20);
+                entry.uncompressed_size = get_u32(header + 24);
+                const size_t name_length = get_u16(header + 28);
+                const size_t extra_length = get_u16(header + 30);
+                const size_t comment_length = get_u16(header + 32);
+                entry.local_header_offset = get_u32(header + 42);
+                if(ptr + 46 + name_length + extra_length + comment_length > cd.size()) return INVALID_ARCHIVE;
+                entry.name.assign(header + 46, name_length);
+
+                /* поля ZIP64 идут в порядке: размер, сжатый размер, смещение */
+                const char *extra = header + 46 + name_length;
+                size_t extra_ptr = 0;
+                while(extra_ptr + 4 <= extra_length) {
+                    const uint16_t id = get_u16(extra + extra_ptr);
+                    const uint16_t size = get_u16(extra + extra_ptr + 2);
+                    if(id == 0x0001) {
+                        const char *field = extra + extra_ptr + 4;
+                        size_t field_ptr = 0;
+                        if(entry.uncompressed_size == 0xFFFFFFFF && field_ptr + 8 <= size) {
+                            entry.uncompressed_size = get_u64(field + field_ptr);
+                            field_ptr += 8;
+                        }
+                        if(entry.compressed_size == 0xFFFFFFFF && field_ptr + 8 <= size) {
+                            entry.compressed_size = get_u64(field + field_ptr);
+                            field_ptr += 8;
+                        }
+                        if(entry.local_header_offset == 0xFFFFFFFF && field_ptr + 8 <= size) {
+                            entry.local_header_offset = get_u64(field + field_ptr);
+                        }
+                    }
+                    extra_ptr += 4 + size;
+                }
+                ptr += 46 + name_length + extra_length + comment_length;
+                /* папки пропускаем */
+                if(!entry.name.empty() && entry.name.back() != '/') entries.push_back(entry);
+            }
+            return OK;
+        }
+
+    public:
+
+        ZipArchive() {};
+
+        /** \brief Открыть архив и прочитать список файлов
+         * \param file_name Имя файла архива
+         * \return Код ошибки
+         */
+        int open(const std::string &file_name) {
+            file.close();
+            file.clear();
+            file.open(file_name, std::ios::in | std::ios::binary);
+            if(!file.is_open()) return FILE_CANNOT_OPENED;
+            return read_central_directory();
+        }
+
+        inline const std::vector<Entry> &get_entries() const {
+            return entries;
+        }
+
+        /** \brief Распаковать файл из архива
+         * \param entry Файл архива
+         * \param output Содержимое файла. Память строки переиспользуется
+         * \return Код ошибки
+         */
+        int read(const Entry &entry, std::string &output) {
+            char local[30];
+            if(!read_at(entry.local_header_offset, local, 30) || get_u32(local) != 0x04034b50) return INVALID_ARCHIVE;
+            const uint64_t data_offset = entry.local_header_offset + 30 + get_u16(local + 26) + get_u16(local + 28);
+            output.resize((size_t)entry.uncompressed_size);
+            if(entry.method == 0) {
+                if(entry.uncompressed_size == 0) return OK;
+                if(!read_at(data_offset, &output[0], output.size())) return INVALID_ARCHIVE;
+                return OK;
+            }
+            if(entry.method != 8) return METHOD_NOT_SUPPORT;
+            compressed.resize((size_t)entry.compressed_size);
+            if(entry.compressed_size > 0 && !read_at(data_offset, compressed.data(), compressed.size())) return INVALID_ARCHIVE;
+
+            z_stream stream;
+            std::memset(&stream, 0, sizeof(stream));
+            /* отрицательный размер окна - сырой deflate без заголовка zlib */
+            if(inflateInit2(&stream, -MAX_WBITS) != Z_OK) return DECOMPRESS_ERROR;
+            /* avail_in и avail_out 32-битные, файлы ZIP64 больше 4 ГБ подаются частями */
+            const size_t max_chunk = std::numeric_limits<uInt>::max();
+            Bytef *in_base = (Bytef*)compressed.data();
+            /* zlib не принимает нулевой next_out даже для пустого файла */
+            Bytef empty_output = 0;
+            Bytef *out_base = output.empty() ? &empty_output : (Bytef*)&output[0];
+            stream.next_in = in_base;
+            stream.next_out = out_base;
+            int err = Z_OK;
+            while(err == Z_OK) {
+                const size_t in_done = (size_t)(stream.next_in - in_base);
+                const size_t out_done = (size_t)(stream.next_out - out_base);
+                if(stream.avail_in == 0) stream.avail_in = (uInt)std::min(max_chunk, compressed.size() - in_done);
+                if(stream.avail_out == 0) stream.avail_out = (uInt)std::min(max_chunk, output.size() - out_done);
+                /* Z_BUF_ERROR - данные кончились раньше конца потока или не хватило места */
+                err = inflate(&stream, Z_NO_FLUSH);
+            }
+            const size_t out_done = (size_t)(stream.next_out - out_base);
+            inflateEnd(&stream);
+            if(err != Z_STREAM_END || out_done != output.size()) return DECOMPRESS_ERROR;
+            return OK;
+        }
+    };
+}
+
+#endif // MT4_ZIP_HPP_INCLUDED
@@ -0,0 +1,27 @@
+#!/bin/sh
+# Проверка потокового разбора ответов: запускает tools/stooq-fixture.py
+# с разными размерами кусков и программу code-blocks/stream-check против него.
+# Запуск: tools/check-stream.sh путь/к/stream-check [порт]
+
+BIN="$1"
+PORT="${2:-18080}"
+DIR="$(cd "$(dirname "$0")" && pwd)"
+
+if [ -z "$BIN" ]; then
+    echo "usage: $0 path/to/stream-check [port]"
+    exit 2
+fi
+
+STATUS=0
+for MODE in "--chunk 777" "--chunk 1" "--chunk 13 --gzip"; do
+    python3 "$DIR/stooq-fixture.py" "$PORT" $MODE &
+    PID=$!
+    sleep 1
+    echo "fixture: $MODE"
+    if ! "$BIN" "http://127.0.0.1:$PORT"; then
+        STATUS=1
+    fi
+    kill "$PID"
+    wait "$PID" 2>/dev/null
+done
+exit $STATUS
@@ -0,0 +1,94 @@
+#!/usr/bin/env python3
+# -*- coding: utf-8 -*-
+"""Локальный сервер, отвечающий как stooq.com на запрос истории /q/d/l/
+
+Ответ отдается кусками Transfer-Encoding: chunked заданного размера, так что
+строки csv разрываются на границах кусков. Цены баров M5 и H1 зависят только
+от номера бара k, поэтому их проверяет code-blocks/stream-check:
+
+    Date,Time,Open,High,Low,Close,Volume
+    open = 1 + k / 100000, high = open + 0.00005, low = 0.99 + (k % 900) / 100000,
+    close = open + 0.00001, volume = k
+
+Бары M5 начинаются с 2020-08-28 00:00, их 576 (двое суток), баров H1 - 48.
+Дневной запрос возвращает 28 баров августа 2020 года.
+
+Запуск: stooq-fixture.py [port] [--chunk N] [--gzip]
+"""
+
+import gzip
+import http.server
+import sys
+import urllib.parse
+
+M5_BARS = 576
+H1_BARS = 48
+
+
+def get_lines(period):
+    if period in ('5', '60'):
+        step = int(period)
+        total = M5_BARS if period == '5' else H1_BARS
+        lines = ['Date,Time,Open,High,Low,Close,Volume']
+        for k in range(total):
+            minutes = k * step
+            day = 28 + minutes // 1440
+            hour = (minutes % 1440) // 60
+            minute = minutes % 60
+            lines.append('2020-08-%02d,%02d:%02d:00,1.%05d,1.%05d,0.%05d,1.%05d,%d' % (
+                day, hour, minute, k, k + 5, 99000 + k % 900, k + 1, k))
+        return lines
+    lines = ['Date,Open,High,Low,Close,Volume']
+    for day in range(1, 29):
+        lines.append('2020-08-%02d,1.1829,1.1913,1.1822,1.1904,%d' % (day, day))
+    return lines
+
+
+def make_handler(chunk_size, is_gzip):
+    class Handler(http.server.BaseHTTPRequestHandler):
+        protocol_version = 'HTTP/1.1'
+
+        def do_GET(self):
+            query = urllib.parse.parse_qs(urllib.parse.urlparse(self.path).query)
+            period = query.get('i', ['d'])[0]
+            body = ('\r\n'.join(get_lines(period)) + '\r\n').encode()
+            self.send_response(200)
+            self.send_header('Content-Type', 'text/csv')
+            self.send_header('Transfer-Encoding', 'chunked')
+            if is_gzip:
+                body = gzip.compress(body)
+                self.send_header('Content-Encoding', 'gzip')
+            self.end_headers()
+            for offset in range(0, len(body), chunk_size):
+                chunk = body[offset:offset + chunk_size]
+                self.wfile.write(b'%x\r\n' % len(chunk) + chunk + b'\r\n')
+                self.wfile.flush()
+            self.wfile.write(b'0\r\n\r\n')
+
+        def log_message(self, *args):
+            pass
+
+    return Handler
+
+
+def main():
+    port = 18080
+    chunk_size = 777
+    is_gzip = False
+    args = sys.argv[1:]
+    i = 0
+    while i < len(args):
+        if args[i] == '--chunk':
+            i += 1
+            chunk_size = int(args[i])
+        elif args[i] == '--gzip':
+            is_gzip = True
+        else:
+            port = int(args[i])
+        i += 1
+    server = http.server.HTTPServer(('127.0.0.1', port), make_handler(chunk_size, is_gzip))
+    server.serve_forever()
+
+
+if __name__ == '__main__':
+    main()